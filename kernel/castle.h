@@ -211,6 +211,7 @@ typedef uint32_t block_t;
 #define FREE_SPACE_START               (100)
 #define FREESPACE_OFFSET               (2 * C_CHK_SIZE)
 #define FREESPACE_SIZE                 (20 * C_CHK_SIZE)
+#define FREESPACE_CACHE_SCHKS          (64)  /* Superchunks read ahead from freespace ring */
 
 #define sup_ext_to_slave_id(_id)       ((_id) - SUP_EXT_ID)
 #define slave_id_to_sup_ext(_id)       ((_id) + SUP_EXT_ID)
@@ -983,6 +984,10 @@ struct castle_btree_type {
                                    dimensions set to -inf.                              */
     uint32_t (*key_hash)      (const void *key, c_btree_hash_enum_t type, uint32_t seed);
                               /**< Hash key using seed.                 */
+    uint64_t (*key_prefix)    (const void *key);
+                              /**< Optional. Order preserving key prefix:
+                                   prefix(a) < prefix(b) implies a < b.
+                                   Equal prefixes need full key_compare. */
     void     (*key_print)     (int level, const void *key);
                               /* Print the key with log level           */
     int      (*entry_get)     (struct castle_btree_node *node,
@@ -1069,6 +1074,7 @@ STATIC_BUG_ON(sizeof(struct castle_bbp_entry) != 70);
 #define CASTLE_CT_PARTIAL_TREE_BIT      5   /* CT tree is partial could be intree/outtree.      */
 #define CASTLE_CT_BACKUP_BARRIER_BIT    6   /* CT is the last tree backed-up. Everything after
                                                this, yet to be backed-up.                       */
+#define CASTLE_CT_KEY_RANGE_BIT         7   /* CT min_key and max_key are set.                  */
 
 #define CASTLE_CT_ON_DISK_FLAGS_MASK    ((1UL << CASTLE_CT_DYNAMIC_BIT)         |   \
                                          (1UL << CASTLE_CT_BLOOM_EXISTS_BIT)    |   \
@@ -1076,6 +1082,16 @@ STATIC_BUG_ON(sizeof(struct castle_bbp_entry) != 70);
 
 #define CT_DYNAMIC(_ct)         (test_bit(CASTLE_CT_DYNAMIC_BIT, &(_ct)->flags))
 #define CT_BLOOM_EXISTS(_ct)    (test_bit(CASTLE_CT_BLOOM_EXISTS_BIT, &(_ct)->flags))
+#define CT_KEY_RANGE_KNOWN(_ct) (test_bit(CASTLE_CT_KEY_RANGE_BIT, &(_ct)->flags))
+/**
+ * Are CT leaves immutable for as long as the CT is referenced (leaf hints usable).
+ */
+#define CT_LEAVES_IMMUTABLE(_ct)                                            \
+    (!TREE_GLOBAL((_ct)->seq) && !CT_DYNAMIC(_ct) &&                        \
+        !test_bit(CASTLE_CT_MERGE_OUTPUT_BIT, &((_ct)->flags)) &&           \
+        !test_bit(CASTLE_CT_PARTIAL_TREE_BIT, &((_ct)->flags)))
+
+#define CASTLE_CT_LEAF_HINTS    (8)         /**< Per-CT leaf hints for point reads.             */
 /**
  * Is CT queriable.
  */
@@ -1148,17 +1164,50 @@ struct castle_component_tree {
     atomic64_t          max_user_timestamp; /**< To terminate point gets early */
     atomic64_t          min_user_timestamp; /**< For tombstone discard */
 
+    void               *min_key;            /**< Smallest key in the tree, valid once
+                                                 CT_KEY_RANGE_KNOWN().                          */
+    void               *max_key;            /**< Largest key in the tree, as above.             */
+
+    c_ext_pos_t         leaf_hints[CASTLE_CT_LEAF_HINTS];
+                                            /**< Leaf last visited by point reads, per request
+                                                 cpu_index (mod CASTLE_CT_LEAF_HINTS).          */
+
     uint32_t            max_versions_per_key; /**< For a merge to correctly size the tv_resolver (see
                                                    trac #4749) */
 };
 extern struct castle_component_tree *castle_global_tree;
 
 struct castle_large_obj_entry {
-    c_ext_id_t          ext_id;
+    c_ext_pos_t         cep;            /**< Offset is 0, unless in a pool extent.          */
     uint64_t            length;
     struct list_head    list;
 };
 
+/**
+ * Extent shared by several large objects, @see castle_large_obj_alloc().
+ *
+ * Chunks are handed out first-fit, and refcounted individually (one reference per link to
+ * the object).  Chunks whose refcount dropped to zero are only reused once a checkpoint that
+ * no longer references them has completed.  The pool holds the only link to the extent.
+ */
+struct castle_lo_pool_ext {
+    c_ext_id_t          ext_id;
+    c_da_t              da_id;
+    struct castle_double_array *da;
+    c_chk_cnt_t         size;           /**< Extent size in chunks.                         */
+    c_chk_cnt_t         nr_used;        /**< Chunks with a non-zero refcount.               */
+    c_chk_cnt_t         nr_free;        /**< Chunks that can be handed out now.             */
+    int                 dead;           /**< Last chunk released, extent is being unlinked. */
+    spinlock_t          lock;           /**< Protects nr_used, dead, refs and the bitmaps.  */
+    uint32_t           *refs;           /**< Per chunk refcount.                            */
+    unsigned long      *pending;        /**< Released since the last checkpoint writeback.  */
+    unsigned long      *frozen;         /**< Released before the last checkpoint writeback,
+                                             reusable once that checkpoint completes.       */
+    struct list_head    hash_list;
+    struct list_head    da_list;        /**< Link to da->lo_pools, protected by
+                                             da->lo_pools_lock.                             */
+};
+
 struct castle_data_extent {
     c_ext_id_t          ext_id;
     atomic_t            ref_cnt;
@@ -1367,10 +1416,12 @@ struct castle_lolist_entry {
     /* offset:  0 */ c_ext_id_t  ext_id;
     /*          8 */ uint64_t    length;
     /*         16 */ tree_seq_t  ct_seq;
-    /*         24 */ uint8_t     _unused[8];
+    /*         24 */ uint32_t    pool_magic;    /**< LO_POOL_MAGIC for pooled objects.        */
+    /*         28 */ c_chk_t     pool_chk;      /**< First chunk of a pooled object.          */
     /*         32 */
 } PACKED;
 STATIC_BUG_ON(sizeof(struct castle_lolist_entry) != 32);
+#define LO_POOL_MAGIC     0x4c4f504c
 
 struct castle_dext_list_entry {
     /* align:   8 */
@@ -1763,24 +1814,25 @@ typedef struct castle_merged_iterator {
         void                        *iterator;
         struct castle_iterator_type *iterator_type;
         int                          cached;
+        int                          in_tree;       /**< Cached entry competes in the
+                                                         tournament tree.                   */
         struct {
             void                    *k;
+            uint64_t                 k_prefix;      /**< @see castle_btree_type.key_prefix  */
             c_ver_t                  v;
             c_val_tup_t              cvt;
             castle_user_timestamp_t  u_ts;
         } cached_entry;
         struct list_head             same_kv_head;
-        union {
-            struct rb_node           rb_node;       /**< Used to put the iterator onto rb tree
-                                                         rooted in the merged_iterator.rb_root
-                                                         (or temporarily when sorting same_kv
-                                                          list on local rb tree) */
-            struct list_head         same_kv_list;  /**< Used to add iterator to the list of
+        struct list_head             same_kv_list;  /**< Used to add iterator to the list of
                                                          iterators with the same (k,v), rooted
-                                                         at same_kv_head above. */
-        };
+                                                         at same_kv_head above. List is kept
+                                                         in recency (iterator) order.       */
     } *iterators;
-    struct rb_root                   rb_root;
+    int                             *tree;          /**< Tournament tree of component iterator
+                                                         indices. Node n (1 <= n < nr_iters)
+                                                         holds the winner of its subtree,
+                                                         nodes >= nr_iters are the leaves.  */
     castle_merged_iterator_each_skip each_skip;
     struct castle_da_merge          *merge;
     struct castle_double_array      *da;
@@ -1871,6 +1923,57 @@ struct castle {
     struct kobject kobj;
 };
 
+/**
+ * Classes of slave I/O, scheduled separately by the per-slave I/O scheduler.
+ */
+typedef enum {
+    CASTLE_IO_CLASS_USER = 0,           /**< Foreground reads (and misc I/O).                  */
+    CASTLE_IO_CLASS_FLUSH,              /**< Dirty c2b writeback, checkpoint flushes.          */
+    CASTLE_IO_CLASS_MERGE,              /**< Merge input reads and output writes.              */
+    CASTLE_IO_CLASS_REBUILD,            /**< Rebuild/remap reads and writes.                   */
+    CASTLE_IO_CLASSES,
+} c_io_class_t;
+
+/* Latency histogram buckets: <1ms, [1,2)ms, [2,4)ms, ..., >=1024ms. */
+#define CASTLE_IO_SCHED_LAT_BUCKETS     (12)
+
+/**
+ * Bio queued on (or dispatched by) the per-slave I/O scheduler.
+ */
+struct castle_io_sched_req {
+    struct list_head                list;
+    struct bio                     *bio;
+    int                             rw;
+    c_io_class_t                    io_class;
+    struct timespec                 queued;     /**< Time the bio was handed to the scheduler. */
+    unsigned long                   slow_until; /**< SLAVE_SLOW_ERR: jiffies to hold bio till. */
+};
+
+struct castle_io_sched_class {
+    struct list_head                queue;      /**< FIFO of castle_io_sched_req.               */
+    uint32_t                        queued;
+    uint32_t                        in_flight;
+    uint64_t                        vtime;      /**< Virtual time: bytes dispatched / weight.   */
+    uint64_t                        dispatched;
+    uint64_t                        lat_hist[CASTLE_IO_SCHED_LAT_BUCKETS];
+    uint32_t                        lat_recent[CASTLE_IO_SCHED_LAT_BUCKETS]; /**< Decaying
+                                                   histogram, for latency percentiles.      */
+    uint32_t                        nr_recent;
+    uint64_t                        lat_mark[CASTLE_IO_SCHED_LAT_BUCKETS]; /**< lat_hist at
+                                                   the last castle_io_sched_latency_pct_mark(). */
+};
+
+struct castle_io_sched {
+    spinlock_t                      lock;
+    uint32_t                        in_flight;  /**< Bios dispatched to the block layer.        */
+    uint64_t                        vtime;      /**< vtime of the last dispatched class.        */
+    uint32_t                        read_lat_us;/**< Moving average of read latency.            */
+    struct castle_io_sched_class    classes[CASTLE_IO_CLASSES];
+    struct work_struct              work;       /**< Dispatches bios queued behind in_flight.   */
+    struct list_head                slow;       /**< Reads held back by SLAVE_SLOW_ERR.         */
+    struct timer_list               slow_timer;
+};
+
 struct castle_slave {
     uint32_t                        id;
     uint32_t                        uuid; /* Copy of the uuid from the superblock
@@ -1887,6 +1990,11 @@ struct castle_slave {
     c_disk_chk_t                   *sup_ext_maps;
     struct mutex                    freespace_lock;
     castle_freespace_t              freespace;
+    c_chk_t                         freespace_cache[FREESPACE_CACHE_SCHKS];
+                                                        /**< Copy of the freespace ring entries
+                                                             from cons onwards.             */
+    uint32_t                        freespace_cache_nr; /**< Valid entries in freespace_cache. */
+    uint32_t                        freespace_cache_idx;/**< Next entry to hand out.        */
     c_chk_cnt_t                     prev_prod;
     c_chk_cnt_t                     frozen_prod;
     struct castle_slave_block_cnts  block_cnts;
@@ -1900,6 +2008,9 @@ struct castle_slave {
                                                              slave. */
     atomic_t                        free_chk_cnt;
     atomic_t                        io_in_flight;
+    atomic_t                        rebuild_io_in_flight; /**< Rebuild chunk I/Os remapping
+                                                               onto this slave.             */
+    struct castle_io_sched          io_sched;
     char                            bdev_name[BDEVNAME_SIZE];
     struct work_struct              work;
 };
@@ -2114,6 +2225,13 @@ struct castle_object_get {
                                   void *buffer,
                                   uint32_t buffer_length,
                                   int last);
+
+    /* Optional.  Pages to read a medium object into directly, bypassing the cache and
+       the reply callbacks.  Returning NULL falls back to reply_start/reply_continue. */
+    struct page **(*direct_pages)(struct castle_object_get *get,
+                                  uint64_t data_length);
+    void      (*direct_done)     (struct castle_object_get *get,
+                                  uint64_t data_length);
 };
 
 struct castle_object_pull {
@@ -2160,6 +2278,9 @@ struct castle_object_iterator
     struct castle_btree_type           *btree;
     void                               *start_key;
     void                               *end_key;
+    void                               *range_start;            /**< Keys to walk in the btree,
+                                                                     within the hypercube.      */
+    void                               *range_end;
     uint8_t                             flags;
 
     /* Rest */
@@ -2431,6 +2552,16 @@ struct castle_double_array {
     c_da_opts_t                 creation_opts;
     atomic64_t                  tombstone_discard_threshold_time_s;
 
+    /* Large object pool extents, @see castle_large_obj_alloc(). */
+    spinlock_t                  lo_pools_lock;      /**< Protects lo_pools and lo_pools_cursor. */
+    struct list_head            lo_pools;           /**< Pool extents of this DA.               */
+    struct castle_lo_pool_ext  *lo_pools_cursor;    /**< Pool extent last allocated from.       */
+
+    /* In-kernel merge policy (see castle_merge_policy.h). */
+    c_merge_id_t                policy_merge_id;    /**< Merge started/driven by the policy.    */
+    struct work_struct          policy_work;        /**< Runs the policy, @see
+                                                         castle_da_merge_policy_kick().         */
+
     struct {
         struct{
             atomic64_t partition_updates;
@@ -2446,6 +2577,10 @@ struct castle_double_array {
             atomic64_t ct_max_uts_negatives;
             atomic64_t ct_max_uts_false_positives;
         } user_timestamps;
+        struct{
+            atomic64_t mo_copied_bytes;     /**< Medium object bytes rewritten by merges.   */
+            atomic64_t mo_linked_bytes;     /**< Medium object bytes merges left in place.  */
+        } value_log;
     } stats;
 };
 
@@ -2570,6 +2705,10 @@ extern int castle_extents_process_ratelimit;
 
 extern int castle_rebuild_freespace_threshold;
 
+extern int castle_rebuild_slave_concurrency;
+
+extern int castle_rebuild_user_latency_ms;
+
 extern unsigned int castle_rda_lvl;
 
 extern const char *castle_error_strings[];
@@ -12,7 +12,9 @@
 #include <linux/list.h>
 #include <linux/vmalloc.h>
 #include <linux/delay.h>
+#include <linux/sort.h>
 #include <asm/pgtable.h>
+#include <asm/uaccess.h>
 
 #include "castle_public.h"
 #include "castle_defines.h"
@@ -57,6 +59,18 @@ static                LIST_HEAD(castle_back_conns); /**< List of all active cast
 int                             castle_back_inited = 0;
 atomic_t                        castle_req_seq_id = ATOMIC_INIT(0); /**< Unique ID for tracing */
 
+static unsigned int             castle_back_poll_us = 0;
+module_param(castle_back_poll_us, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_poll_us, "Max time ring consumers busy-poll for requests before sleeping (us, 0 = off)");
+
+static int                      castle_back_get_batching = 1;
+module_param(castle_back_get_batching, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_get_batching, "Issue gets queued on a request CPU together, in key order");
+
+static int                      castle_back_notify_coalesce = 0;
+module_param(castle_back_notify_coalesce, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_notify_coalesce, "Only wake userland for responses when the ring's rsp_event asks for it");
+
 struct castle_back_op;
 
 #define CASTLE_BACK_CONN_INITIALISED_BIT    (0)
@@ -66,28 +80,45 @@ struct castle_back_op;
 #define CASTLE_BACK_CONN_DEAD_BIT           (2)
 #define CASTLE_BACK_CONN_DEAD_FLAG          (1 << CASTLE_BACK_CONN_DEAD_BIT)
 
+/**
+ * Shared ring of a connection and the kernel thread consuming its requests.
+ *
+ * Responses to requests are always queued on the ring the request came from.
+ */
+struct castle_back_ring
+{
+    struct castle_back_conn *conn;
+    int                      idx;           /**< Index in conn->rings[]             */
+    castle_back_ring_t       back_ring;
+    struct task_struct      *work_thread;   /**< Consumer, bound to cpu             */
+    spinlock_t               response_lock; /**< Protects responses and free_ops    */
+    int                      cpu;           /**< CPU id for this ring               */
+    int                      cpu_index;     /**< CPU index for this ring            */
+    unsigned int             poll_us;       /**< Current busy-poll budget           */
+
+    /*
+     * in kernel state for each operation
+     * should be RING_SIZE(back_ring) of these
+     * and a free list to get new ones
+     */
+    struct castle_back_op   *ops;
+    struct list_head         free_ops;
+};
+
 struct castle_back_conn
 {
     unsigned long           flags;
 
-    /* details of the shared ring buffer */
-    unsigned long           rings_vstart;   /**< Where is the ring mapped in?       */
-    castle_back_ring_t      back_ring;
+    /* details of the shared ring buffers */
+    unsigned long           rings_vstart;   /**< Where are the rings mapped in?     */
+    struct castle_back_ring rings[CASTLE_RINGS_MAX];
+    int                     nr_rings;       /**< Rings in use, @see CASTLE_IOCTL_RINGS_SET */
+    struct mutex            rings_mutex;    /**< Serialises ring setup and mapping  */
     wait_queue_head_t       wait;
-    struct task_struct     *work_thread;
     struct list_head        list;           /**< Position on castle_back_conns list */
-    spinlock_t              response_lock;
+    spinlock_t              response_lock;  /**< Protects free_stateful_ops         */
     atomic_t                ref_count;
-    int                     cpu;            /**< CPU id for this conn               */
-    int                     cpu_index;      /**< CPU index for this conn            */
 
-    /*
-     * in kernel state for each operation
-     * should be RING_SIZE(back_ring) of these
-     * and a free list to get new ones
-     */
-    struct castle_back_op           *ops;
-    struct list_head                 free_ops;
     struct castle_back_stateful_op  *stateful_ops;
     struct list_head                 free_stateful_ops;
     struct timer_list                stateful_op_timeout_check_timer;
@@ -99,6 +130,8 @@ struct castle_back_conn
     /* details of the shared buffers */
     rwlock_t                         buffers_lock;  /**< Protects buffers_rb                */
     struct rb_root                   buffers_rb;    /**< RB tree for castle_back_buffers    */
+    struct castle_back_buffer      **fixed_buffers; /**< Registered buffers, each holds a ref */
+    uint32_t                         nr_fixed_buffers;
 };
 
 struct castle_back_buffer
@@ -110,6 +143,54 @@ struct castle_back_buffer
     void              *buffer;      /**< Pointer to buffer in kernel address space          */
 };
 
+/**
+ * One key of a CASTLE_RING_MULTI_GET or CASTLE_RING_MULTI_REPLACE.
+ */
+struct castle_back_multi_key
+{
+    struct castle_back_op           *op;
+    uint32_t                         idx;           /**< Position of the key in the request */
+    int                              cpu_index;     /**< CPU index the key hashes to        */
+    c_vl_bkey_t                     *key;
+    struct castle_iter_val          *val;           /**< Result slot (get) (KAS)            */
+    void                            *value;         /**< Value buffer (KAS)                 */
+    int                              tombstone;     /**< Remove rather than replace         */
+    uint32_t                         buffer_offset; /**< Bytes copied so far                */
+
+    union
+    {
+        struct castle_object_replace replace;
+        struct castle_object_get     get;
+    };
+};
+
+/**
+ * Keys of a multi op hashing to the same CPU, issued on that CPU in key order.
+ */
+struct castle_back_multi_cpu
+{
+    struct work_struct               work;
+    struct castle_back_op           *op;
+    int                              cpu_index;
+    uint32_t                         first;         /**< First key in multi->sorted[]       */
+    uint32_t                         nr;            /**< Number of keys                     */
+};
+
+struct castle_back_multi
+{
+    struct castle_back_multi_key    *keys;          /**< In request order                   */
+    struct castle_back_multi_key   **sorted;        /**< By cpu_index, then key             */
+    uint32_t                         nr_keys;
+    struct castle_back_multi_cpu    *cpus;
+    int                              nr_cpus;       /**< CPUs the keys hash to              */
+    void                            *buffer;        /**< Result/values buffer (KAS)         */
+    atomic_t                         outstanding;   /**< Keys in flight, +1 while queueing  */
+    atomic_t                         nr_done;       /**< Keys found/written                 */
+    spinlock_t                       lock;          /**< Protects buffer_used and err       */
+    uint32_t                         buffer_used;   /**< Bytes used in result buffer        */
+    int                              err;           /**< First error hit                    */
+};
+
 struct castle_back_op
 {
     struct list_head                 list;
@@ -119,6 +200,7 @@ struct castle_back_op
 
     castle_request_t                 req;           /**< Contains call_id etc.              */
     struct castle_back_conn         *conn;
+    struct castle_back_ring         *ring;          /**< Ring the request came from         */
     struct castle_back_buffer       *buf;
     struct castle_attachment        *attachment;
 
@@ -128,14 +210,37 @@ struct castle_back_op
     /* used for assembling a get and partial writes in puts */
     uint64_t value_length;
     uint32_t buffer_offset;
+    struct page **direct_pages;                     /**< Get buffer pages, for direct reads */
 
     union
     {
         struct castle_object_replace replace;
         struct castle_object_get     get;
+        struct castle_back_multi     multi;
     };
 };
 
+#define CASTLE_BACK_GET_BATCH_MAX   (64)    /**< Gets sorted and issued per batch round.     */
+
+/**
+ * Gets waiting to be issued on a request CPU.
+ *
+ * Gets that arrive while the batch work is already queued are issued together, in
+ * key order, so that they walk the CTs in the same order and reuse each other's
+ * leaves, @see castle_btree_leaf_hint_try().
+ */
+struct castle_back_get_batch
+{
+    spinlock_t              lock;           /**< Protects ops and queued                */
+    struct list_head        ops;
+    int                     queued;         /**< Is work queued                         */
+    struct work_struct      work;
+    int                     cpu;            /**< CPU to issue gets on                   */
+    struct castle_back_op  *sorted[CASTLE_BACK_GET_BATCH_MAX];
+};
+
+static struct castle_back_get_batch *castle_back_get_batches; /**< Per request cpu_index */
+
 struct castle_back_iterator
 {
     c_collection_id_t             collection_id;    /**< Collection ID.                     */
@@ -150,6 +255,31 @@ struct castle_back_iterator
     uint32_t                      buf_len;          /**< Bytes in buffer kv_list can fill.  */
     uint64_t                      nr_keys;          /**< Stats: number of keys.             */
     uint64_t                      nr_bytes;         /**< Stats: number of Bytes.            */
+
+    /* Streaming iterators, @see castle_request_iter_stream_start_t. */
+    struct castle_back_op        *fill_op;          /**< Fills buffers, NULL if not streaming */
+    void                         *stream_ptr;       /**< Start of the buffers (UAS).        */
+    uint32_t                      nr_buffers;
+    uint32_t                      buffer_size;
+    uint32_t                      fill_seq;         /**< Buffers filled.                    */
+    uint32_t                      reply_seq;        /**< Buffers returned to userland.      */
+    uint32_t                      nr_acks;          /**< Buffers handed back by userland.   */
+    int                           stream_done;      /**< Last buffer has been filled.       */
+    int                           stream_err;       /**< Error filling buffers.             */
+
+    /* Filtered iterators, @see castle_iter_filter_t. */
+    castle_iter_filter_t         *filter;           /**< Kernel copy, NULL if not filtering.*/
+    c_vl_bkey_t                  *filter_group;     /**< Last key returned, for max_values. */
+    uint32_t                      filter_group_values; /**< Values returned for the group.  */
+
+    /* Aggregating iterators, @see castle_request_aggregate_t. */
+    int                           aggregating;
+    uint32_t                      agg_group_dims;
+    int                           agg_pending;      /**< agg holds a group not yet returned.*/
+    c_vl_bkey_t                  *agg_key;          /**< First key of the current group.    */
+    castle_aggregate_t            agg;              /**< Current group.                     */
+    c_vl_bkey_t                  *agg_emit_key;     /**< Key of the last group returned.    */
+    castle_aggregate_t            agg_emit;         /**< Last group returned.               */
 };
 
 struct castle_back_stream_in
@@ -242,14 +372,17 @@ static inline void UnReservePages(void *buffer, unsigned long size)
         ClearPageReserved(vmalloc_to_page(buffer + (i * PAGE_SIZE)));
 }
 
-static inline int castle_vma_map(struct vm_area_struct *vma, void *buffer, unsigned long size)
+static inline int castle_vma_map(struct vm_area_struct *vma,
+                                 unsigned long vm_offset,
+                                 void *buffer,
+                                 unsigned long size)
 {
     int i, err, offset, pages = size >> PAGE_SHIFT;
 
     for (i=0; i<pages; i++)
     {
         offset = i << PAGE_SHIFT;
-        err = remap_pfn_range(vma, vma->vm_start + offset,
+        err = remap_pfn_range(vma, vma->vm_start + vm_offset + offset,
             vmalloc_to_pfn(buffer + offset),
             PAGE_SIZE, vma->vm_page_prot);
         if (err)
@@ -291,8 +424,13 @@ static USED void castle_back_print_page(char *buff, int length)
  * new ones into tree
  */
 
-#define castle_back_user_to_kernel(__buffer, __user_addr) \
-    (__buffer->buffer + ((unsigned long)__user_addr - __buffer->user_addr))
+/* CASTLE_FIXED_BUFFER() addresses keep the flag and the buffer index above bit 31. */
+STATIC_BUG_ON(sizeof(unsigned long) < sizeof(uint64_t));
+
+#define castle_back_user_to_kernel(__buffer, __user_addr)                                 \
+    (__buffer->buffer + (((unsigned long)(__user_addr) & CASTLE_FIXED_BUFFER_BIT) ?           \
+                         CASTLE_FIXED_BUFFER_OFFSET(__user_addr) :                            \
+                         ((unsigned long)(__user_addr) - __buffer->user_addr)))
 
 #define castle_back_kernel_to_user(__buffer, __kernel_addr) \
     (__buffer->user_addr + ((unsigned long)__kernel_addr - (unsigned long)__buffer->buffer))
@@ -340,6 +478,34 @@ static inline int __castle_back_buffer_exists(struct castle_back_conn *conn,
     return 0;
 }
 
+/**
+ * Look up a registered buffer by CASTLE_FIXED_BUFFER() index and offset.
+ *
+ * The table is installed once and only torn down with the conn, and holds a reference
+ * to each of its buffers, so no locking is needed.
+ *
+ * @also castle_back_buffers_register()
+ */
+static inline struct castle_back_buffer *castle_back_fixed_buffer_get(struct castle_back_conn *conn,
+                                                                      unsigned long user_addr,
+                                                                      uint32_t user_len)
+{
+    struct castle_back_buffer *buffer;
+    uint32_t idx = CASTLE_FIXED_BUFFER_IDX(user_addr);
+
+    if (idx >= conn->nr_fixed_buffers)
+        return NULL;
+    smp_rmb(); /* Pairs with smp_wmb() in castle_back_buffers_register(). */
+
+    buffer = conn->fixed_buffers[idx];
+    if ((uint64_t)CASTLE_FIXED_BUFFER_OFFSET(user_addr) + user_len > buffer->size)
+        return NULL;
+
+    atomic_inc(&buffer->ref_count);
+
+    return buffer;
+}
+
 /**
  * Look up buffer matching user_addr in conn's RB tree.
  *
@@ -365,6 +531,9 @@ static inline struct castle_back_buffer *castle_back_buffer_get(struct castle_ba
     struct rb_node *node;
     struct castle_back_buffer *buffer, *ret = NULL;
 
+    if (user_addr & CASTLE_FIXED_BUFFER_BIT)
+        return castle_back_fixed_buffer_get(conn, user_addr, user_len);
+
     read_lock(&conn->buffers_lock);
     node = conn->buffers_rb.rb_node;
     while (node)
@@ -954,7 +1123,8 @@ static int castle_back_reply(struct castle_back_op *op,
                              castle_resp_flags_t flags)
 {
     struct castle_back_conn *conn = op->conn;
-    castle_back_ring_t *back_ring = &conn->back_ring;
+    struct castle_back_ring *ring = op->ring;
+    castle_back_ring_t *back_ring = &ring->back_ring;
     castle_response_t resp;
     int notify;
 
@@ -969,7 +1139,7 @@ static int castle_back_reply(struct castle_back_op *op,
         "timestamp = %llu, flags=%u\n",
         op, op->req.call_id, err, token, length, user_timestamp, flags);
 
-    spin_lock(&conn->response_lock);
+    spin_lock(&ring->response_lock);
 
     memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &resp, sizeof(resp));
     back_ring->rsp_prod_pvt++;
@@ -977,14 +1147,18 @@ static int castle_back_reply(struct castle_back_op *op,
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(back_ring, notify);
 
     /* Put op at the back of the freelist. */
-    list_add_tail(&op->list, &conn->free_ops);
+    list_add_tail(&op->list, &ring->free_ops);
 
-    spin_unlock(&conn->response_lock);
+    spin_unlock(&ring->response_lock);
 
-    /* @TODO if (notify) ? */
-    debug(">>>notifying user\n");
-    set_bit(CASTLE_BACK_CONN_NOTIFY_BIT, &conn->flags);
-    wake_up(&conn->wait);
+    /* Userland sets rsp_event (RING_FINAL_CHECK_FOR_RESPONSES) before it sleeps, so
+     * responses pushed while it is still consuming don't need a wakeup. */
+    if (notify || !castle_back_notify_coalesce)
+    {
+        debug(">>>notifying user\n");
+        set_bit(CASTLE_BACK_CONN_NOTIFY_BIT, &conn->flags);
+        wake_up(&conn->wait);
+    }
 
     castle_back_conn_put(conn);
 
@@ -992,58 +1166,41 @@ static int castle_back_reply(struct castle_back_op *op,
 }
 
 /**
- * Copy userland key from user_key to key_out (size key_len).
+ * Copy key from a shared buffer to key_out (size key_len), validating the copy.
  *
- * @param user_key  Source key pointer (UAS)
- * @param key_len   Size of user_key
+ * @param kas_key   Source key pointer (KAS mapping of a shared buffer)
+ * @param key_len   Size of kas_key
  * @param key_out   Destination pointer (KAS)
  */
-static int castle_back_key_copy_get(struct castle_back_conn *conn,
-                                    c_vl_bkey_t *user_key,
-                                    uint32_t key_len,
-                                    c_vl_bkey_t **key_out)
+static int castle_back_key_kernel_copy(void *kas_key,
+                                       uint32_t key_len,
+                                       c_vl_bkey_t **key_out)
 {
-    struct castle_back_buffer *buf;
     c_vl_bkey_t *bkey;
     int i, err;
 
-    /*
-     * Get buffer with key in it and create a temporary copy
-     * of it, doing whole bunch of checks to make sure we have
-     * a valid key
-     */
-
     if (key_len < sizeof(c_vl_bkey_t) || key_len > VLBA_TREE_MAX_KEY_SIZE)
     {
         error("Bad key length %u\n", key_len);
-        err = -ENAMETOOLONG;
-        goto err0;
-    }
-
-    /* Work out the start (inclusive), and the end point (exclusive) of the key block
-       in user memory. */
-    buf = castle_back_buffer_get(conn, (unsigned long)user_key, key_len);
-    if (!buf)
-    {
-        error("Bad user pointer %p\n", user_key);
-        err = -EINVAL;
-        goto err0;
+        return -ENAMETOOLONG;
     }
 
-    bkey = castle_dup_or_copy(castle_back_user_to_kernel(buf, user_key), key_len, NULL, NULL);
+    bkey = castle_dup_or_copy(kas_key, key_len, NULL, NULL);
+    if (!bkey)
+        return -ENOMEM;
 
     if (key_len != (bkey->length + 4))
     {
         error("Buffer length(%u) doesn't match with key length(%u)\n", key_len, bkey->length+4);
         err = -EINVAL;
-        goto err1;
+        goto err;
     }
 
     if (*((uint64_t *)bkey->_unused) != 0)
     {
         error("Unused bits need to be set to 0\n");
         err = -EINVAL;
-        goto err1;
+        goto err;
     }
 
     /* Check if the key length is smaller than space needed for all dim_heads. */
@@ -1051,18 +1208,16 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn,
     {
         error("Too many dimensions %d\n", bkey->nr_dims);
         err = -EINVAL;
-        goto err1;
+        goto err;
     }
 
     if (bkey->nr_dims == 0)
     {
         error("Zero-dimensional key\n");
         err = -EINVAL;
-        goto err1;
+        goto err;
     }
 
-    debug("Original key pointer %p\n", user_key);
-
     /* Check if all the key dimensions or sane. */
     for (i=0; i < bkey->nr_dims; i++)
     {
@@ -1075,7 +1230,7 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn,
         {
             error("Found flags other than INFINITY %u\n", dim_flags);
             err = -EINVAL;
-            goto err1;
+            goto err;
         }
 
         /* Only one kind of infinity is possible. */
@@ -1084,7 +1239,7 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn,
         {
             error("Found both PLUS_INFINITY and MINUS_INFINITY for the same dimension.\n");
             err = -EINVAL;
-            goto err1;
+            goto err;
         }
 
         /* Length should be zero, if the dimension is infinity. */
@@ -1092,7 +1247,7 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn,
         {
             error("Found mis-match for INFINITY flags and dimension length.\n");
             err = -EINVAL;
-            goto err1;
+            goto err;
         }
 
         /* Dimension payload shouldn't cross key boundaries. */
@@ -1101,23 +1256,65 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn,
             error("Dimension payload going beyond the key boundaries [%p, %u] - [%p, %u]\n",
                   dim_data, dim_len, bkey, key_len);
             err = -EINVAL;
-            goto err1;
+            goto err;
         }
     }
 
     *key_out = bkey;
 
-    castle_back_buffer_put(conn, buf);
-
 #ifdef DEBUG
     vl_bkey_print(LOG_DEBUG, bkey);
 #endif
 
     return 0;
 
-err1: castle_free(bkey);
-      castle_back_buffer_put(conn, buf);
-err0: return err;
+err: castle_free(bkey);
+     return err;
+}
+
+/**
+ * Copy userland key from user_key to key_out (size key_len).
+ *
+ * @param user_key  Source key pointer (UAS)
+ * @param key_len   Size of user_key
+ * @param key_out   Destination pointer (KAS)
+ */
+static int castle_back_key_copy_get(struct castle_back_conn *conn,
+                                    c_vl_bkey_t *user_key,
+                                    uint32_t key_len,
+                                    c_vl_bkey_t **key_out)
+{
+    struct castle_back_buffer *buf;
+    int err;
+
+    /*
+     * Get buffer with key in it and create a temporary copy
+     * of it, doing whole bunch of checks to make sure we have
+     * a valid key
+     */
+
+    if (key_len < sizeof(c_vl_bkey_t) || key_len > VLBA_TREE_MAX_KEY_SIZE)
+    {
+        error("Bad key length %u\n", key_len);
+        return -ENAMETOOLONG;
+    }
+
+    /* Work out the start (inclusive), and the end point (exclusive) of the key block
+       in user memory. */
+    buf = castle_back_buffer_get(conn, (unsigned long)user_key, key_len);
+    if (!buf)
+    {
+        error("Bad user pointer %p\n", user_key);
+        return -EINVAL;
+    }
+
+    debug("Original key pointer %p\n", user_key);
+
+    err = castle_back_key_kernel_copy(castle_back_user_to_kernel(buf, user_key), key_len, key_out);
+
+    castle_back_buffer_put(conn, buf);
+
+    return err;
 }
 
 /**
@@ -1618,6 +1815,37 @@ err0: castle_free(op->key);
       castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
 }
 
+/**
+ * Reply to a successful get once all of the value has been copied out.
+ */
+static void castle_back_get_reply_finish(struct castle_back_op *op)
+{
+    struct castle_object_get *get = &op->get;
+    uint32_t get_value_len = op->req.get.value_len;
+    castle_user_timestamp_t u_ts = ULLONG_MAX;
+    castle_resp_flags_t resp_flags = CASTLE_RESPONSE_FLAG_NONE;
+
+    if (get->flags & CASTLE_RING_FLAG_RET_TIMESTAMP)
+        u_ts = get->cvt.user_timestamp;
+
+    if (CVT_TOMBSTONE(get->cvt))
+    {
+        /* if we got this far, it must be because the objects layer saw the flag: */
+        BUG_ON(!(get->flags & CASTLE_RING_FLAG_RET_TOMBSTONE));
+        resp_flags |= CASTLE_RESPONSE_FLAG_TOMBSTONE;
+    }
+
+    castle_back_buffer_put(op->conn, op->buf);
+
+    /* Update stats. */
+    atomic64_inc(&op->attachment->get.ios);
+    atomic64_add(get_value_len, &op->attachment->get.bytes);
+
+    castle_free(get->key);
+    castle_attachment_put(op->attachment);
+    castle_back_reply(op, 0, 0, op->value_length, u_ts, resp_flags);
+}
+
 int castle_back_get_reply_continue(struct castle_object_get *get,
                                    int err,
                                    void *buffer,
@@ -1652,34 +1880,7 @@ int castle_back_get_reply_continue(struct castle_object_get *get,
     last = last || (op->req.get.value_len == op->buffer_offset);
 
     if (last)
-    {
-        uint32_t get_value_len = op->req.get.value_len;
-        castle_user_timestamp_t u_ts = ULLONG_MAX;
-        castle_resp_flags_t resp_flags = CASTLE_RESPONSE_FLAG_NONE;
-
-        if (get->flags & CASTLE_RING_FLAG_RET_TIMESTAMP)
-            u_ts = get->cvt.user_timestamp;
-
-        if (CVT_TOMBSTONE(get->cvt))
-        {
-            /* if we got this far, it must be because the objects layer saw the flag: */
-            BUG_ON(!(get->flags & CASTLE_RING_FLAG_RET_TOMBSTONE));
-            resp_flags |= CASTLE_RESPONSE_FLAG_TOMBSTONE;
-        }
-
-        castle_back_buffer_put(op->conn, op->buf);
-
-        /* Update stats. */
-        if (!err)
-        {
-            atomic64_inc(&op->attachment->get.ios);
-            atomic64_add(get_value_len, &op->attachment->get.bytes);
-        }
-
-        castle_free(get->key);
-        castle_attachment_put(op->attachment);
-        castle_back_reply(op, err, 0, op->value_length, u_ts, resp_flags);
-    }
+        castle_back_get_reply_finish(op);
 
     return last;
 }
@@ -1695,6 +1896,13 @@ int castle_back_get_reply_start(struct castle_object_get *get,
 
     BUG_ON(buffer_length > data_length);
 
+    /* Direct read wasn't possible, the value is coming through the cache instead. */
+    if (op->direct_pages)
+    {
+        castle_free(op->direct_pages);
+        op->direct_pages = NULL;
+    }
+
     if (err)
     {
         err_prime = err;
@@ -1727,6 +1935,56 @@ err:
     return 0;
 }
 
+/**
+ * Hand out the pages of the get buffer for the objects layer to read the value into.
+ *
+ * Only done for CASTLE_RING_FLAG_NO_CACHE gets, when the value fits in full and starts
+ * on a page boundary.  Everything else is copied out of the cache.
+ */
+static struct page **castle_back_get_direct_pages(struct castle_object_get *get,
+                                                  uint64_t data_length)
+{
+    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
+    struct page **pages;
+    void *dest;
+    int i, nr_pages;
+
+    if (!(get->flags & CASTLE_RING_FLAG_NO_CACHE))
+        return NULL;
+
+    dest = castle_back_user_to_kernel(op->buf, op->req.get.value_ptr);
+    if (((unsigned long)dest & ~PAGE_MASK) ||
+        (op->req.get.value_len < ALIGN(data_length, PAGE_SIZE)))
+        return NULL;
+
+    nr_pages = (data_length - 1) / PAGE_SIZE + 1;
+    pages = castle_alloc(nr_pages * sizeof(struct page *));
+    if (!pages)
+        return NULL;
+    for (i = 0; i < nr_pages; i++)
+        pages[i] = vmalloc_to_page(dest + i * PAGE_SIZE);
+
+    op->direct_pages = pages;
+
+    return pages;
+}
+
+/**
+ * Value has been read into the get buffer by the objects layer.
+ */
+static void castle_back_get_direct_done(struct castle_object_get *get, uint64_t data_length)
+{
+    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
+
+    castle_free(op->direct_pages);
+    op->direct_pages = NULL;
+
+    op->value_length = data_length;
+    op->buffer_offset = data_length;
+
+    castle_back_get_reply_finish(op);
+}
+
 /**
  * Look for specified key,version in DA.
  *
@@ -1762,6 +2020,9 @@ static void castle_back_get(void *data)
 
     op->get.reply_start = castle_back_get_reply_start;
     op->get.reply_continue = castle_back_get_reply_continue;
+    op->get.direct_pages = castle_back_get_direct_pages;
+    op->get.direct_done = castle_back_get_direct_done;
+    op->direct_pages = NULL;
     op->get.key = op->key;
     op->get.flags = op->req.flags;
 
@@ -1786,23 +2047,633 @@ err0: castle_free(op->key);
       castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
 }
 
-/**** ITERATORS ****/
+/**
+ * Order ops by their (backend) key.
+ */
+static int castle_back_op_key_compare(const void *a, const void *b)
+{
+    const struct castle_back_op *op1 = *(struct castle_back_op **)a;
+    const struct castle_back_op *op2 = *(struct castle_back_op **)b;
 
-/*
- * CASTLE_BACK_ITER_START
- *      Initialises an iterator and immediately begins returning values.
- *      In the case where the total set of results returned by the iterator
- *      fits into the provided buffer the caller needs to issue no further
- *      ring operations.
+    return castle_object_btree_key_compare(op1->key, op2->key);
+}
+
+/**
+ * Issue up to CASTLE_BACK_GET_BATCH_MAX gets queued on a request CPU, in key order.
  *
- *      castle_back_iter_start()
- *          Gets, initialises and takes a stateful_op reference.  Enables
- *          expiry and decodes the relevant keys to be passed to the
- *          castle_objects function (castle_object_iter_init()) that
- *          initialises the underlying iterator structures.
+ * Requeues itself while more gets are waiting, so that a steady stream of gets doesn't
+ * hold up other work on castle_back_wq.
+ */
+static void castle_back_get_batch_do(void *data)
+{
+    struct castle_back_get_batch *batch = data;
+    int i, nr = 0, requeue;
+
+    spin_lock(&batch->lock);
+    while (!list_empty(&batch->ops) && nr < CASTLE_BACK_GET_BATCH_MAX)
+    {
+        batch->sorted[nr] = list_entry(batch->ops.next, struct castle_back_op, list);
+        list_del(&batch->sorted[nr++]->list);
+    }
+    spin_unlock(&batch->lock);
+
+    sort(batch->sorted, nr, sizeof(struct castle_back_op *),
+         castle_back_op_key_compare, NULL);
+
+    for (i = 0; i < nr; i++)
+        castle_back_get(batch->sorted[i]);
+
+    spin_lock(&batch->lock);
+    requeue = !list_empty(&batch->ops);
+    if (!requeue)
+        batch->queued = 0;
+    spin_unlock(&batch->lock);
+
+    if (requeue)
+        queue_work_on(batch->cpu, castle_back_wq, &batch->work);
+}
+
+/**
+ * Queue a get on its request CPU's batch.
+ */
+static void castle_back_get_batch_queue(struct castle_back_op *op)
+{
+    struct castle_back_get_batch *batch = &castle_back_get_batches[op->cpu_index];
+    int queue;
+
+    spin_lock(&batch->lock);
+    list_add_tail(&op->list, &batch->ops);
+    queue = !batch->queued;
+    batch->queued = 1;
+    spin_unlock(&batch->lock);
+
+    if (queue)
+        queue_work_on(batch->cpu, castle_back_wq, &batch->work);
+}
+
+/**** MULTI OPS ****/
+
+/*
+ * CASTLE_RING_MULTI_GET, CASTLE_RING_MULTI_REPLACE
+ *      Batches of independent point ops, for up to CASTLE_RING_MULTI_MAX_KEYS keys,
+ *      taking a single ring slot and returning a single response.
  *
- *          Fakes up a userland iter_next structure and calls directly into
- *          fastpath _castle_back_iter_next() (takes a stateful_op structure
+ *      Keys are sorted by the CPU (and hence T0) they hash to and then by key.  Each
+ *      CPU's keys are issued from a single work item on that CPU, in key order, so
+ *      that bloom filter probes and btree descents for neighbouring keys find the
+ *      same index and leaf c2bs hot in the cache.
+ */
+
+static void castle_back_multi_free(struct castle_back_op *op)
+{
+    struct castle_back_multi *multi = &op->multi;
+    uint32_t i;
+
+    if (multi->keys)
+        for (i = 0; i < multi->nr_keys; i++)
+            castle_check_free(multi->keys[i].key);
+    castle_check_free(multi->keys);
+    castle_check_free(multi->sorted);
+    castle_check_free(multi->cpus);
+}
+
+/**
+ * Order multi op keys by CPU index then key.  Duplicate keys keep request order.
+ */
+static int castle_back_multi_key_compare(const void *a, const void *b)
+{
+    const struct castle_back_multi_key *key1 = *(struct castle_back_multi_key **)a;
+    const struct castle_back_multi_key *key2 = *(struct castle_back_multi_key **)b;
+    int cmp;
+
+    if (key1->cpu_index != key2->cpu_index)
+        return key1->cpu_index < key2->cpu_index ? -1 : 1;
+
+    cmp = castle_object_btree_key_compare(key1->key, key2->key);
+    if (cmp)
+        return cmp;
+
+    return key1->idx < key2->idx ? -1 : 1;
+}
+
+/**
+ * Copy and validate the packed keys of a multi op, then sort and group them by CPU.
+ *
+ * @param   keys_ptr    Packed keys (UAS)
+ * @param   keys_len    Size of keys_ptr buffer
+ * @param   nr_keys     Number of keys in keys_ptr
+ *
+ * @also castle_back_multi_dispatch()
+ */
+static int castle_back_multi_init(struct castle_back_op *op,
+                                  void *keys_ptr,
+                                  uint32_t keys_len,
+                                  uint32_t nr_keys)
+{
+    struct castle_back_multi *multi = &op->multi;
+    struct castle_back_buffer *keys_buf;
+    uint32_t i, offset, key_len;
+    void *kas_keys;
+    int err;
+
+    memset(multi, 0, sizeof(struct castle_back_multi));
+
+    if (nr_keys == 0 || nr_keys > CASTLE_RING_MULTI_MAX_KEYS)
+    {
+        error("Bad number of keys %u\n", nr_keys);
+        return -EINVAL;
+    }
+
+    keys_buf = castle_back_buffer_get(op->conn, (unsigned long)keys_ptr, keys_len);
+    if (!keys_buf)
+    {
+        error("Couldn't get buffer for pointer=%p length=%u\n", keys_ptr, keys_len);
+        return -EINVAL;
+    }
+    kas_keys = castle_back_user_to_kernel(keys_buf, keys_ptr);
+
+    err = -ENOMEM;
+    multi->keys   = castle_zalloc(nr_keys * sizeof(struct castle_back_multi_key));
+    multi->sorted = castle_alloc(nr_keys * sizeof(struct castle_back_multi_key *));
+    multi->cpus   = castle_zalloc(castle_double_array_request_cpus()
+                                    * sizeof(struct castle_back_multi_cpu));
+    if (!multi->keys || !multi->sorted || !multi->cpus)
+        goto err;
+    multi->nr_keys = nr_keys;
+
+    for (i = 0, offset = 0; i < nr_keys; i++)
+    {
+        struct castle_back_multi_key *key = &multi->keys[i];
+
+        err = -EINVAL;
+        if (offset > keys_len || keys_len - offset < sizeof(c_vl_bkey_t))
+        {
+            error("Keys buffer too short for %u keys\n", nr_keys);
+            goto err;
+        }
+        key_len = ((c_vl_bkey_t *)(kas_keys + offset))->length;
+        if (key_len > keys_len - offset - 4)
+        {
+            error("Key %u crosses keys buffer boundary\n", i);
+            goto err;
+        }
+        key_len += 4;
+
+        if ((err = castle_back_key_kernel_copy(kas_keys + offset, key_len, &key->key)))
+            goto err;
+
+        key->op         = op;
+        key->idx        = i;
+        key->cpu_index  = castle_double_array_key_cpu_index(key->key);
+        multi->sorted[i] = key;
+
+        offset = ALIGN(offset + key_len, 8);
+    }
+    castle_back_buffer_put(op->conn, keys_buf);
+
+    sort(multi->sorted, nr_keys, sizeof(struct castle_back_multi_key *),
+         castle_back_multi_key_compare, NULL);
+
+    /* Split sorted keys into per-CPU runs. */
+    for (i = 0; i < nr_keys; i++)
+    {
+        struct castle_back_multi_cpu *cpu = &multi->cpus[multi->nr_cpus];
+
+        if (i > 0 && multi->sorted[i]->cpu_index != multi->sorted[i-1]->cpu_index)
+            cpu = &multi->cpus[++multi->nr_cpus];
+        if (cpu->nr == 0)
+        {
+            cpu->op        = op;
+            cpu->cpu_index = multi->sorted[i]->cpu_index;
+            cpu->first     = i;
+        }
+        cpu->nr++;
+    }
+    multi->nr_cpus++;
+
+    atomic_set(&multi->outstanding, nr_keys + 1);
+    atomic_set(&multi->nr_done, 0);
+    spin_lock_init(&multi->lock);
+
+    return 0;
+
+err:
+    castle_back_buffer_put(op->conn, keys_buf);
+    castle_back_multi_free(op);
+    return err;
+}
+
+/**
+ * Queue per-CPU key runs of a multi op on their CPUs.
+ */
+static void castle_back_multi_dispatch(struct castle_back_op *op, void (*fn)(void *))
+{
+    struct castle_back_multi *multi = &op->multi;
+    int i, nr_cpus = multi->nr_cpus;
+
+    for (i = 0; i < nr_cpus; i++)
+    {
+        struct castle_back_multi_cpu *cpu = &multi->cpus[i];
+
+        INIT_WORK(&cpu->work, fn, cpu);
+        queue_work_on(castle_double_array_request_cpu(cpu->cpu_index), castle_back_wq, &cpu->work);
+    }
+}
+
+static void castle_back_multi_err_set(struct castle_back_multi *multi, int err)
+{
+    spin_lock(&multi->lock);
+    if (!multi->err)
+        multi->err = err;
+    spin_unlock(&multi->lock);
+}
+
+/**
+ * Drop a reference to a multi op, replying to userland once all keys completed.
+ */
+static void castle_back_multi_put(struct castle_back_op *op)
+{
+    struct castle_back_multi *multi = &op->multi;
+    uint32_t nr_done;
+    uint64_t length;
+    int err;
+
+    if (!atomic_dec_and_test(&multi->outstanding))
+        return;
+
+    err     = multi->err;
+    nr_done = atomic_read(&multi->nr_done);
+
+    if (op->req.tag == CASTLE_RING_MULTI_GET)
+    {
+        length = multi->buffer_used;
+        atomic64_add(nr_done, &op->attachment->get.ios);
+        atomic64_add(length, &op->attachment->get.bytes);
+    }
+    else
+    {
+        length = nr_done;
+        atomic64_add(nr_done, &op->attachment->put.ios);
+    }
+
+    castle_back_buffer_put(op->conn, op->buf);
+    castle_back_multi_free(op);
+    castle_attachment_put(op->attachment);
+    castle_back_reply(op, err, 0, length, 0, CASTLE_RESPONSE_FLAG_NONE);
+}
+
+static int castle_back_multi_get_reply_continue(struct castle_object_get *get,
+                                                int err,
+                                                void *buffer,
+                                                uint32_t buffer_len,
+                                                int last)
+{
+    struct castle_back_multi_key *key = container_of(get, struct castle_back_multi_key, get);
+    struct castle_back_multi *multi = &key->op->multi;
+
+    if (err)
+    {
+        key->val->type = CASTLE_VALUE_TYPE_INVALID;
+        castle_back_multi_err_set(multi, err);
+        castle_back_multi_put(key->op);
+
+        return 1;
+    }
+
+    BUG_ON(key->buffer_offset + buffer_len > key->val->length);
+    memcpy(key->value + key->buffer_offset, buffer, buffer_len);
+    key->buffer_offset += buffer_len;
+
+    if (last)
+    {
+        atomic_inc(&multi->nr_done);
+        castle_back_multi_put(key->op);
+    }
+
+    return last;
+}
+
+static int castle_back_multi_get_reply_start(struct castle_object_get *get,
+                                             int err,
+                                             uint64_t data_length,
+                                             void *buffer,
+                                             uint32_t buffer_length)
+{
+    struct castle_back_multi_key *key = container_of(get, struct castle_back_multi_key, get);
+    struct castle_back_op *op = key->op;
+    struct castle_back_multi *multi = &op->multi;
+    struct castle_iter_val *val = key->val;
+    uint32_t offset = 0;
+    int fits;
+
+    if (err || !buffer)
+    {
+        /* Not found is reported through CASTLE_VALUE_TYPE_INVALID. */
+        if (err)
+            castle_back_multi_err_set(multi, err);
+        castle_back_multi_put(op);
+
+        /* Return value ignored if there was an error. */
+        return 0;
+    }
+
+    spin_lock(&multi->lock);
+    fits = (data_length <= op->req.multi_get.buffer_len - multi->buffer_used);
+    if (fits)
+    {
+        offset = multi->buffer_used;
+        multi->buffer_used += data_length;
+    }
+    spin_unlock(&multi->lock);
+
+    val->length = data_length;
+    if (!fits)
+    {
+        /* Let userland fetch it separately. */
+        val->type          = CASTLE_VALUE_TYPE_OUT_OF_LINE;
+        val->collection_id = op->req.multi_get.collection_id;
+        castle_back_multi_put(op);
+
+        return 1;
+    }
+
+    val->type = CVT_ON_DISK(get->cvt) ? CASTLE_VALUE_TYPE_INLINE
+                                      : castle_back_val_type_kernel_to_user(get->cvt);
+    val->val  = (uint8_t *)castle_back_kernel_to_user(op->buf, multi->buffer + offset);
+    key->value         = multi->buffer + offset;
+    key->buffer_offset = 0;
+
+    return castle_back_multi_get_reply_continue(get,
+                                                0,
+                                                buffer,
+                                                buffer_length,
+                                                buffer_length == data_length);
+}
+
+/**
+ * Issue gets for one CPU's keys, in key order.
+ */
+static void castle_back_multi_get_cpu_do(void *data)
+{
+    struct castle_back_multi_cpu *cpu = data;
+    struct castle_back_op *op = cpu->op;
+    struct castle_back_multi_key **sorted = op->multi.sorted;
+    uint32_t i, first = cpu->first, nr = cpu->nr;
+    int err;
+
+    /* The op (and cpu) may be gone as soon as the last get is issued. */
+    for (i = first; i < first + nr; i++)
+    {
+        struct castle_back_multi_key *key = sorted[i];
+
+        err = castle_object_get(&key->get, op->attachment, key->cpu_index);
+        if (err)
+            castle_back_multi_get_reply_start(&key->get, err, 0, NULL, 0);
+    }
+}
+
+/**
+ * Look up a batch of keys in a DA.
+ *
+ * @also castle_back_get()
+ * @also castle_back_multi_init()
+ */
+static void castle_back_multi_get(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    castle_request_multi_get_t *req = &op->req.multi_get;
+    uint32_t i;
+    int err;
+
+    op->attachment = castle_attachment_get(req->collection_id, READ);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", req->collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    op->buf = castle_back_buffer_get(conn, (unsigned long) req->buffer_ptr, req->buffer_len);
+    if (op->buf == NULL)
+    {
+        error("Couldn't get buffer for pointer=%p length=%u\n", req->buffer_ptr, req->buffer_len);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    if ((err = castle_back_multi_init(op, req->keys_ptr, req->keys_len, req->nr_keys)))
+        goto err2;
+
+    err = -EINVAL;
+    if ((uint64_t)req->nr_keys * sizeof(struct castle_iter_val) > req->buffer_len)
+    {
+        error("Buffer too small for %u results\n", req->nr_keys);
+        goto err3;
+    }
+
+    op->multi.buffer      = castle_back_user_to_kernel(op->buf, req->buffer_ptr);
+    op->multi.buffer_used = req->nr_keys * sizeof(struct castle_iter_val);
+
+    for (i = 0; i < req->nr_keys; i++)
+    {
+        struct castle_back_multi_key *key = &op->multi.keys[i];
+
+        key->val = (struct castle_iter_val *)op->multi.buffer + i;
+        key->val->type   = CASTLE_VALUE_TYPE_INVALID;
+        key->val->length = 0;
+
+        key->get.reply_start    = castle_back_multi_get_reply_start;
+        key->get.reply_continue = castle_back_multi_get_reply_continue;
+        key->get.key            = key->key;
+        /* Tombstones are reported as not found. */
+        key->get.flags          = op->req.flags & ~(CASTLE_RING_FLAG_RET_TOMBSTONE
+                                                    | CASTLE_RING_FLAG_RET_TIMESTAMP);
+    }
+
+    castle_back_multi_dispatch(op, castle_back_multi_get_cpu_do);
+    castle_back_multi_put(op);
+
+    return;
+
+err3: castle_back_multi_free(op);
+err2: castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
+}
+
+static void castle_back_multi_replace_complete(struct castle_object_replace *replace, int err)
+{
+    struct castle_back_multi_key *key = container_of(replace, struct castle_back_multi_key, replace);
+
+    /* Newer timestamped entry already in T0, @see castle_back_replace_complete(). */
+    if (err == -EEXIST)
+        err = 0;
+
+    if (err)
+        castle_back_multi_err_set(&key->op->multi, err);
+    else
+        atomic_inc(&key->op->multi.nr_done);
+
+    castle_back_multi_put(key->op);
+}
+
+static uint32_t castle_back_multi_replace_data_length_get(struct castle_object_replace *replace)
+{
+    return replace->value_len;
+}
+
+static void castle_back_multi_replace_data_copy(struct castle_object_replace *replace,
+                                                void *buffer, uint32_t buffer_length, int not_last)
+{
+    struct castle_back_multi_key *key = container_of(replace, struct castle_back_multi_key, replace);
+
+    BUG_ON(key->buffer_offset + buffer_length > replace->value_len);
+
+    memcpy(buffer, key->value + key->buffer_offset, buffer_length);
+
+    key->buffer_offset += buffer_length;
+}
+
+/**
+ * Issue replaces for one CPU's keys, in key order.
+ */
+static void castle_back_multi_replace_cpu_do(void *data)
+{
+    struct castle_back_multi_cpu *cpu = data;
+    struct castle_back_op *op = cpu->op;
+    struct castle_back_multi_key **sorted = op->multi.sorted;
+    uint32_t i, first = cpu->first, nr = cpu->nr;
+    int err;
+
+    /* The op (and cpu) may be gone as soon as the last replace is issued. */
+    for (i = first; i < first + nr; i++)
+    {
+        struct castle_back_multi_key *key = sorted[i];
+
+        err = castle_object_replace(&key->replace, op->attachment, key->cpu_index, key->tombstone);
+        if (err)
+            castle_back_multi_replace_complete(&key->replace, err);
+    }
+}
+
+/**
+ * Insert/remove a batch of keys in a DA.
+ *
+ * @also castle_back_replace()
+ * @also castle_back_multi_init()
+ */
+static void castle_back_multi_replace(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    castle_request_multi_replace_t *req = &op->req.multi_replace;
+    struct castle_iter_val *vals;
+    uint32_t i;
+    int err;
+
+    op->attachment = castle_attachment_get(req->collection_id, WRITE);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", req->collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    op->buf = castle_back_buffer_get(conn, (unsigned long) req->values_ptr, req->values_len);
+    if (op->buf == NULL)
+    {
+        error("Couldn't get buffer for pointer=%p length=%u\n", req->values_ptr, req->values_len);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    if ((err = castle_back_multi_init(op, req->keys_ptr, req->keys_len, req->nr_keys)))
+        goto err2;
+
+    err = -EINVAL;
+    if ((uint64_t)req->nr_keys * sizeof(struct castle_iter_val) > req->values_len)
+    {
+        error("Buffer too small for %u values\n", req->nr_keys);
+        goto err3;
+    }
+
+    op->multi.buffer = castle_back_user_to_kernel(op->buf, req->values_ptr);
+    vals = op->multi.buffer;
+
+    /* Validate all values before inserting anything.  Take a copy of the value
+       descriptors, userland may still be changing the shared buffer. */
+    for (i = 0; i < req->nr_keys; i++)
+    {
+        struct castle_back_multi_key *key = &op->multi.keys[i];
+        struct castle_iter_val val = vals[i];
+        unsigned long start = (unsigned long)req->values_ptr;
+
+        switch (val.type)
+        {
+            case CASTLE_VALUE_TYPE_INLINE:
+                if ((unsigned long)val.val < start
+                        || val.length > req->values_len
+                        || (unsigned long)val.val - start > req->values_len - val.length)
+                {
+                    error("Value %u at %p length %llu outside values buffer\n",
+                            i, val.val, val.length);
+                    goto err3;
+                }
+                key->value     = castle_back_user_to_kernel(op->buf, val.val);
+                key->tombstone = 0;
+                break;
+            case CASTLE_VALUE_TYPE_TOMBSTONE:
+                val.length     = 0;
+                key->tombstone = 1;
+                break;
+            default:
+                error("Unsupported value type %u for key %u\n", val.type, i);
+                goto err3;
+        }
+
+        key->buffer_offset = 0;
+        CVT_INVALID_INIT(key->replace.cvt);
+        key->replace.value_len          = val.length;
+        key->replace.replace_continue   = NULL;
+        key->replace.complete           = castle_back_multi_replace_complete;
+        key->replace.data_length_get    = key->tombstone ? NULL
+                                            : castle_back_multi_replace_data_length_get;
+        key->replace.data_copy          = key->tombstone ? NULL
+                                            : castle_back_multi_replace_data_copy;
+        key->replace.counter_type       = CASTLE_OBJECT_NOT_COUNTER;
+        key->replace.has_user_timestamp = 0;
+        key->replace.key                = key->key;
+    }
+
+    castle_back_multi_dispatch(op, castle_back_multi_replace_cpu_do);
+    castle_back_multi_put(op);
+
+    return;
+
+err3: castle_back_multi_free(op);
+err2: castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
+}
+
+/**** ITERATORS ****/
+
+/*
+ * CASTLE_BACK_ITER_START
+ *      Initialises an iterator and immediately begins returning values.
+ *      In the case where the total set of results returned by the iterator
+ *      fits into the provided buffer the caller needs to issue no further
+ *      ring operations.
+ *
+ *      castle_back_iter_start()
+ *          Gets, initialises and takes a stateful_op reference.  Enables
+ *          expiry and decodes the relevant keys to be passed to the
+ *          castle_objects function (castle_object_iter_init()) that
+ *          initialises the underlying iterator structures.
+ *
+ *          Fakes up a userland iter_next structure and calls directly into
+ *          fastpath _castle_back_iter_next() (takes a stateful_op structure
  *          instead of searching based on provided iter_next token).
  *
  *          Overflows into CASTLE_BACK_ITER_NEXT
@@ -1876,34 +2747,301 @@ err0: castle_free(op->key);
  *          to consume.  Calls castle_back_stateful_op_finish_all() to finish
  *          all outstanding ops on the stateful_op queue.
  *
- *          Finally calls castle_back_iter_clean() to free any remaining
- *          back iterator state and puts the stateful_op.
+ *          Finally calls castle_back_iter_clean() to free any remaining
+ *          back iterator state and puts the stateful_op.
+ *
+ * In case of early termination, e.g. by userland closing the ring, we call
+ * into castle_back_release() which calls each stateful_op's->expire().  For
+ * iterators the expire function is castle_back_iter_expire() which does a
+ * similar job to __castle_back_iter_finish() (terminating any queued ops
+ * on the stateful_op op queue).  However, in the case that there is a
+ * running op (stateful_op->curr_op) we set
+ * stateful_op->cancel_on_op_complete indicating that as soon as the running
+ * op is completed, it should not terminate.  For this reason it is essential
+ * to always call castle_back_iter_reply() (which checks the cancel bit)
+ * instead of castle_back_reply() directly.
+ */
+
+static void __castle_back_iter_next(void *data);
+DEFINE_WQ_TRACE_FN(__castle_back_iter_next, struct castle_back_stateful_op);
+
+static void _castle_back_iter_next(struct castle_back_op *op,
+                                   struct castle_back_stateful_op *stateful_op,
+                                   int fastpath);
+static void __castle_back_iter_finish(void *data);
+DEFINE_WQ_TRACE_FN(__castle_back_iter_finish, struct castle_back_stateful_op);
+
+static void _castle_back_iter_finish(struct castle_back_op *op,
+                                     struct castle_back_stateful_op *stateful_op,
+                                     int fastpath);
+static void castle_back_iter_cleanup(struct castle_back_stateful_op *stateful_op);
+static void castle_back_iter_stream_fini(struct castle_back_stateful_op *stateful_op);
+
+/**
+ * Check a byte string lies within [off, off + len) of a filter of filter_len bytes.
+ */
+static inline int castle_back_iter_filter_bytes_ok(uint32_t off, uint32_t len, uint32_t filter_len)
+{
+    return off <= filter_len && len <= filter_len - off;
+}
+
+/**
+ * Copy and validate an iterator filter from userland.
+ */
+static int castle_back_iter_filter_get(struct castle_back_stateful_op *stateful_op,
+                                       castle_iter_filter_t *filter_ptr,
+                                       uint32_t filter_len)
+{
+    struct castle_back_buffer *buf;
+    castle_iter_filter_t *filter;
+    uint32_t i;
+
+    if (filter_len < sizeof(castle_iter_filter_t)
+            || filter_len > CASTLE_ITER_FILTER_MAX_SIZE)
+    {
+        error("Bad iterator filter length %u\n", filter_len);
+        return -EINVAL;
+    }
+
+    buf = castle_back_buffer_get(stateful_op->conn, (unsigned long)filter_ptr, filter_len);
+    if (!buf)
+    {
+        error("Bad user pointer %p\n", filter_ptr);
+        return -EINVAL;
+    }
+    filter = castle_alloc(filter_len);
+    if (!filter)
+    {
+        castle_back_buffer_put(stateful_op->conn, buf);
+        return -ENOMEM;
+    }
+    memcpy(filter, castle_back_user_to_kernel(buf, filter_ptr), filter_len);
+    castle_back_buffer_put(stateful_op->conn, buf);
+
+    if (filter->nr_dims > CASTLE_ITER_FILTER_MAX_DIMS
+            || sizeof(castle_iter_filter_t)
+                + filter->nr_dims * sizeof(castle_iter_filter_dim_t) > filter_len
+            || !castle_back_iter_filter_bytes_ok(filter->value_prefix_off,
+                                                 filter->value_prefix_len,
+                                                 filter_len)
+            || filter->ts_min > filter->ts_max)
+        goto err;
+    for (i = 0; i < filter->nr_dims; i++)
+        if (!castle_back_iter_filter_bytes_ok(filter->dims[i].min_off,
+                                              filter->dims[i].min_len,
+                                              filter_len)
+                || !castle_back_iter_filter_bytes_ok(filter->dims[i].max_off,
+                                                     filter->dims[i].max_len,
+                                                     filter_len))
+            goto err;
+
+    if ((filter->ts_min || filter->ts_max != ULLONG_MAX) &&
+        !castle_attachment_user_timestamping_check(stateful_op->attachment))
+    {
+        error("User requested timestamp filter on a non-timestamped collection, id=0x%x\n",
+              stateful_op->iterator.collection_id);
+        goto err;
+    }
+
+    stateful_op->iterator.filter = filter;
+
+    return 0;
+
+err:
+    error("Invalid iterator filter\n");
+    castle_free(filter);
+
+    return -EINVAL;
+}
+
+static void castle_back_iter_filter_fini(struct castle_back_stateful_op *stateful_op)
+{
+    castle_check_free(stateful_op->iterator.filter);
+    castle_check_free(stateful_op->iterator.filter_group);
+}
+
+/**
+ * Compare a key dimension against a filter bound, as key dimensions are ordered.
+ */
+static int castle_back_iter_filter_dim_compare(const char *dim, uint32_t dim_len,
+                                               const char *bound, uint32_t bound_len)
+{
+    int cmp = memcmp(dim, bound, min(dim_len, bound_len));
+
+    if (cmp)
+        return cmp;
+    return (int)dim_len - (int)bound_len;
+}
+
+/**
+ * Whether two keys have the same first nr_dims dimensions.
+ */
+static int castle_back_key_dims_equal(c_vl_bkey_t *key1, c_vl_bkey_t *key2, uint32_t nr_dims)
+{
+    uint32_t i;
+
+    if (key1->nr_dims < nr_dims || key2->nr_dims < nr_dims)
+        return 0;
+    for (i = 0; i < nr_dims; i++)
+        if (castle_back_iter_filter_dim_compare(castle_object_btree_key_dim_get(key1, i),
+                                                castle_object_btree_key_dim_length(key1, i),
+                                                castle_object_btree_key_dim_get(key2, i),
+                                                castle_object_btree_key_dim_length(key2, i)))
+            return 0;
+
+    return 1;
+}
+
+/**
+ * Evaluate an iterator's filter on a key-value pair.
+ *
+ * @return  1   Return the pair to userland
+ * @return  0   Skip it
+ */
+static int castle_back_iter_filter_match(struct castle_back_stateful_op *stateful_op,
+                                         c_vl_bkey_t *key,
+                                         c_val_tup_t *val)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    castle_iter_filter_t *filter = iter->filter;
+    char *filter_data = (char *)filter;
+    uint32_t i;
+
+    if (val->user_timestamp < filter->ts_min || val->user_timestamp > filter->ts_max)
+        return 0;
+
+    if (filter->value_prefix_len)
+    {
+        if (!CVT_INLINE(*val) || val->length < filter->value_prefix_len)
+            return 0;
+        if (memcmp(CVT_INLINE_VAL_PTR(*val),
+                   filter_data + filter->value_prefix_off,
+                   filter->value_prefix_len))
+            return 0;
+    }
+
+    for (i = 0; i < filter->nr_dims; i++)
+    {
+        castle_iter_filter_dim_t *pred = &filter->dims[i];
+        uint32_t dim_len;
+        char *dim;
+
+        if (pred->dim >= key->nr_dims)
+            return 0;
+        dim     = castle_object_btree_key_dim_get(key, pred->dim);
+        dim_len = castle_object_btree_key_dim_length(key, pred->dim);
+        if (pred->min_len && castle_back_iter_filter_dim_compare(dim, dim_len,
+                                    filter_data + pred->min_off, pred->min_len) < 0)
+            return 0;
+        if (pred->max_len && castle_back_iter_filter_dim_compare(dim, dim_len,
+                                    filter_data + pred->max_off, pred->max_len) > 0)
+            return 0;
+    }
+
+    if (!filter->max_values)
+        return 1;
+
+    /* Pairs come in key order, so a group's pairs are adjacent. */
+    if (iter->filter_group)
+    {
+        if (castle_back_key_dims_equal(key, iter->filter_group, filter->prefix_dims))
+        {
+            if (iter->filter_group_values >= filter->max_values)
+                return 0;
+            iter->filter_group_values++;
+
+            return 1;
+        }
+        castle_free(iter->filter_group);
+    }
+
+    /* First pair of a new group. */
+    iter->filter_group = castle_dup_or_copy(key, key->length + 4, NULL, NULL);
+    iter->filter_group_values = 1;
+
+    return 1;
+}
+
+static void castle_back_aggregate_add(castle_aggregate_t *agg, c_val_tup_t *val)
+{
+    int64_t counter;
+
+    agg->nr_keys++;
+    if (!CVT_ANY_COUNTER(*val))
+        return;
+
+    counter = *(int64_t *)CVT_INLINE_VAL_PTR(*val);
+    if (agg->nr_counters++ == 0)
+        agg->min = agg->max = counter;
+    else if (counter < agg->min)
+        agg->min = counter;
+    else if (counter > agg->max)
+        agg->max = counter;
+    agg->sum += counter;
+}
+
+/**
+ * Add a key-value pair to an aggregating iterator's current group.
+ *
+ * @param   key     Key iterated, or NULL at the end of the range
+ * @param   val     Value iterated
+ * @param   agg_val Set to the aggregate if a group is complete
  *
- * In case of early termination, e.g. by userland closing the ring, we call
- * into castle_back_release() which calls each stateful_op's->expire().  For
- * iterators the expire function is castle_back_iter_expire() which does a
- * similar job to __castle_back_iter_finish() (terminating any queued ops
- * on the stateful_op op queue).  However, in the case that there is a
- * running op (stateful_op->curr_op) we set
- * stateful_op->cancel_on_op_complete indicating that as soon as the running
- * op is completed, it should not terminate.  For this reason it is essential
- * to always call castle_back_iter_reply() (which checks the cancel bit)
- * instead of castle_back_reply() directly.
+ * @return  Key of the group now complete, to be returned to userland with agg_val
+ * @return  NULL if there is no complete group
  */
+static c_vl_bkey_t *castle_back_aggregate(struct castle_back_stateful_op *stateful_op,
+                                          c_vl_bkey_t *key,
+                                          c_val_tup_t *val,
+                                          c_val_tup_t *agg_val)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
 
-static void __castle_back_iter_next(void *data);
-DEFINE_WQ_TRACE_FN(__castle_back_iter_next, struct castle_back_stateful_op);
+    if (iter->agg_pending && key
+            && castle_back_key_dims_equal(key, iter->agg_key, iter->agg_group_dims))
+    {
+        castle_back_aggregate_add(&iter->agg, val);
 
-static void _castle_back_iter_next(struct castle_back_op *op,
-                                   struct castle_back_stateful_op *stateful_op,
-                                   int fastpath);
-static void __castle_back_iter_finish(void *data);
-DEFINE_WQ_TRACE_FN(__castle_back_iter_finish, struct castle_back_stateful_op);
+        return NULL;
+    }
 
-static void _castle_back_iter_finish(struct castle_back_op *op,
-                                     struct castle_back_stateful_op *stateful_op,
-                                     int fastpath);
-static void castle_back_iter_cleanup(struct castle_back_stateful_op *stateful_op);
+    /* The current group (if any) is complete, make it the one being returned. */
+    castle_check_free(iter->agg_emit_key);
+    if (iter->agg_pending)
+    {
+        iter->agg_emit_key = iter->agg_key;
+        iter->agg_emit     = iter->agg;
+        iter->agg_key      = NULL;
+        iter->agg_pending  = 0;
+    }
+
+    /* Start the next group. */
+    if (key)
+    {
+        iter->agg_key = castle_dup_or_copy(key, key->length + 4, NULL, NULL);
+        if (iter->agg_key)
+        {
+            memset(&iter->agg, 0, sizeof(castle_aggregate_t));
+            castle_back_aggregate_add(&iter->agg, val);
+            iter->agg_pending = 1;
+        }
+    }
+
+    if (!iter->agg_emit_key)
+        return NULL;
+
+    memset(agg_val, 0, sizeof(c_val_tup_t));
+    CVT_INLINE_INIT(*agg_val, sizeof(castle_aggregate_t), (uint8_t *)&iter->agg_emit);
+
+    return iter->agg_emit_key;
+}
+
+static void castle_back_aggregate_fini(struct castle_back_stateful_op *stateful_op)
+{
+    castle_check_free(stateful_op->iterator.agg_key);
+    castle_check_free(stateful_op->iterator.agg_emit_key);
+    stateful_op->iterator.agg_pending = 0;
+}
 
 static void castle_back_iter_expire(struct castle_back_stateful_op *stateful_op)
 {
@@ -1919,6 +3057,62 @@ static void castle_back_iter_expire(struct castle_back_stateful_op *stateful_op)
     castle_back_iter_cleanup(stateful_op); /* drops stateful_op->lock */
 }
 
+/**
+ * Whether the op at the head of a streaming iterator's queue can be handled now.
+ */
+static int castle_back_iter_stream_ready(struct castle_back_stateful_op *stateful_op)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    struct castle_back_op *op;
+
+    BUG_ON(!spin_is_locked(&stateful_op->lock));
+
+    if (list_empty(&stateful_op->op_queue))
+        return 0;
+
+    op = list_first_entry(&stateful_op->op_queue, struct castle_back_op, list);
+
+    return (op->req.tag == CASTLE_RING_ITER_FINISH)
+        || (iter->fill_seq != iter->reply_seq)
+        ||  iter->stream_err;
+}
+
+/**
+ * Start filling the next free buffer of a streaming iterator, if there is one.
+ *
+ * NOTE: Drops stateful_op->lock.
+ */
+static void castle_back_iter_stream_fill(struct castle_back_stateful_op *stateful_op)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    struct castle_back_op *fill_op = iter->fill_op;
+    uint32_t in_use;
+
+    BUG_ON(!spin_is_locked(&stateful_op->lock));
+    BUG_ON(stateful_op->curr_op);
+
+    /* Buffers filled and not yet handed back by userland. */
+    in_use = iter->fill_seq - min(iter->nr_acks, iter->reply_seq);
+
+    if (!iter->stream_done && !iter->stream_err && in_use < iter->nr_buffers)
+    {
+        castle_back_stateful_op_disable_expire(stateful_op);
+        fill_op->req.iter_next.buffer_ptr = (char *)iter->stream_ptr
+            + (iter->fill_seq % iter->nr_buffers) * iter->buffer_size;
+        fill_op->req.iter_next.buffer_len = iter->buffer_size;
+        stateful_op->curr_op = fill_op;
+        spin_unlock(&stateful_op->lock);
+        BUG_ON(!queue_work_on(stateful_op->cpu, castle_back_wq, &stateful_op->work[0]));
+
+        return;
+    }
+
+    /* All buffers full (or the scan is over), wait for userland. */
+    if (list_empty(&stateful_op->op_queue))
+        castle_back_stateful_op_enable_expire(stateful_op);
+    spin_unlock(&stateful_op->lock);
+}
+
 /**
  * Execute the next stateful_op op, if available.
  *
@@ -1929,6 +3123,14 @@ static void castle_back_iter_call_queued(struct castle_back_stateful_op *statefu
 {
     BUG_ON(!spin_is_locked(&stateful_op->lock));
 
+    /* Streaming iterators only take an ITER_NEXT once there is a buffer to return. */
+    if (stateful_op->iterator.fill_op && !stateful_op->curr_op &&
+            !castle_back_iter_stream_ready(stateful_op))
+    {
+        castle_back_iter_stream_fill(stateful_op); // drops stateful_op->lock
+        return;
+    }
+
     if (castle_back_stateful_op_prod(stateful_op))
     {
         switch (stateful_op->curr_op->req.tag)
@@ -1993,6 +3195,76 @@ static void castle_back_iter_reply(struct castle_back_stateful_op *stateful_op,
     castle_back_iter_call_queued(stateful_op); // drops stateful_op->lock
 }
 
+/**
+ * A streaming iterator's fill op has finished filling a buffer.
+ *
+ * @param   err     Error filling the buffer
+ * @param   done    Iterator has no more results
+ */
+static void castle_back_iter_stream_filled(struct castle_back_stateful_op *stateful_op,
+                                           int err,
+                                           int done)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+
+    spin_lock(&stateful_op->lock);
+
+    BUG_ON(stateful_op->curr_op != iter->fill_op);
+    stateful_op->curr_op = NULL;
+    if (err)
+        iter->stream_err = err;
+    else
+    {
+        iter->fill_seq++;
+        iter->stream_done = done;
+    }
+
+    /* drops the lock if return non-zero */
+    if (castle_back_stateful_op_completed_op(stateful_op))
+        return;
+
+    castle_back_iter_call_queued(stateful_op); // drops stateful_op->lock
+}
+
+/**
+ * Return the next filled buffer of a streaming iterator to userland.
+ *
+ * op is the current op, an ITER_NEXT (or the ITER_START it was faked from).
+ */
+static void castle_back_iter_stream_reply(struct castle_back_stateful_op *stateful_op,
+                                          struct castle_back_op *op)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    int last, err = 0;
+
+    spin_lock(&stateful_op->lock);
+    if (iter->fill_seq != iter->reply_seq)
+    {
+        last = iter->stream_done && (iter->fill_seq == iter->reply_seq + 1);
+        iter->reply_seq++;
+    }
+    else
+    {
+        BUG_ON(!iter->stream_err);
+        last = 0;
+        err = iter->stream_err;
+    }
+
+    if (last)
+    {
+        /* That was the last buffer, end the iterator as __castle_back_iter_next() does. */
+        op->req.tag = CASTLE_RING_ITER_FINISH;
+        op->req.iter_finish.token = stateful_op->token;
+        spin_unlock(&stateful_op->lock);
+        _castle_back_iter_finish(op, stateful_op, 1 /*fastpath*/);
+
+        return;
+    }
+    spin_unlock(&stateful_op->lock);
+
+    castle_back_iter_reply(stateful_op, op, err);
+}
+
 /**
  * Complete initialisation of stateful op range query.
  *
@@ -2054,6 +3326,9 @@ void _castle_back_iter_start(void *private, int err)
     return;
 
 err:
+    castle_back_iter_stream_fini(stateful_op);
+    castle_back_iter_filter_fini(stateful_op);
+    castle_back_aggregate_fini(stateful_op);
     castle_attachment_put(attachment);
     /* See castle_back_iter_start() comment for why we reset curr_op. */
     spin_lock(&stateful_op->lock);
@@ -2063,6 +3338,73 @@ err:
     castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
 }
 
+/**
+ * Set up the buffers and fill op of a streaming iterator.
+ *
+ * @also castle_request_iter_stream_start_t
+ */
+static int castle_back_iter_stream_init(struct castle_back_stateful_op *stateful_op,
+                                        struct castle_back_op *op)
+{
+    castle_request_iter_stream_start_t *req = &op->req.iter_stream_start;
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    struct castle_back_op *fill_op;
+
+    if (req->nr_buffers == 0
+            || req->nr_buffers > CASTLE_ITER_STREAM_MAX_BUFFERS
+            || req->start.buffer_len / req->nr_buffers < PAGE_SIZE)
+    {
+        error("Can't split %u bytes into %u iterator buffers\n",
+                req->start.buffer_len, req->nr_buffers);
+        return -ENOBUFS;
+    }
+
+    /* The fill op stands in for a ring op while the kernel fills buffers on its own. */
+    fill_op = castle_zalloc(sizeof(struct castle_back_op));
+    if (!fill_op)
+        return -ENOMEM;
+
+    fill_op->buf = castle_back_buffer_get(op->conn,
+                                          (unsigned long)req->start.buffer_ptr,
+                                          req->start.buffer_len);
+    if (!fill_op->buf)
+    {
+        error("Couldn't get buffer for pointer=%p length=%u\n",
+                req->start.buffer_ptr, req->start.buffer_len);
+        castle_free(fill_op);
+        return -EINVAL;
+    }
+    fill_op->conn               = op->conn;
+    fill_op->ring               = op->ring;
+    fill_op->req.tag            = CASTLE_RING_ITER_NEXT;
+    fill_op->req.flags          = op->req.flags;
+    fill_op->req.iter_next.token = stateful_op->token;
+
+    iter->fill_op     = fill_op;
+    iter->stream_ptr  = req->start.buffer_ptr;
+    iter->nr_buffers  = req->nr_buffers;
+    iter->buffer_size = (req->start.buffer_len / req->nr_buffers) & ~7U;
+    iter->fill_seq    = 0;
+    iter->reply_seq   = 0;
+    iter->nr_acks     = 0;
+    iter->stream_done = 0;
+    iter->stream_err  = 0;
+
+    return 0;
+}
+
+static void castle_back_iter_stream_fini(struct castle_back_stateful_op *stateful_op)
+{
+    struct castle_back_op *fill_op = stateful_op->iterator.fill_op;
+
+    if (!fill_op)
+        return;
+
+    castle_back_buffer_put(fill_op->conn, fill_op->buf);
+    castle_free(fill_op);
+    stateful_op->iterator.fill_op = NULL;
+}
+
 /**
  * Begin stateful op iterating for values in specified key,version range in DA.
  *
@@ -2078,6 +3420,8 @@ static void castle_back_iter_start(void *data)
     struct castle_attachment *attachment;
     c_vl_bkey_t *start_key;
     c_vl_bkey_t *end_key;
+    c_vl_bkey_t *range_start = NULL;
+    c_vl_bkey_t *range_end = NULL;
     int err;
 
     stateful_debug("conn=%p op=%p\n", conn, op);
@@ -2147,8 +3491,59 @@ static void castle_back_iter_start(void *data)
     stateful_op->iterator.end_key = end_key;
     stateful_op->iterator.nr_keys = 0;
     stateful_op->iterator.nr_bytes = 0;
+    stateful_op->iterator.fill_op = NULL;
+    stateful_op->iterator.filter = NULL;
+    stateful_op->iterator.filter_group = NULL;
+    stateful_op->iterator.aggregating = 0;
+    stateful_op->iterator.agg_pending = 0;
+    stateful_op->iterator.agg_key = NULL;
+    stateful_op->iterator.agg_emit_key = NULL;
     stateful_op->attachment = attachment;
 
+    /* Range keys are only needed until castle_object_iter_init() has packed them. */
+    if (op->req.tag == CASTLE_RING_ITER_RANGE_START)
+    {
+        castle_request_iter_range_start_t *req = &op->req.iter_range_start;
+
+        if (req->range_start_ptr
+                && (err = castle_back_key_copy_get(conn, req->range_start_ptr,
+                                                   req->range_start_len, &range_start)))
+            goto err4;
+        if (req->range_end_ptr
+                && (err = castle_back_key_copy_get(conn, req->range_end_ptr,
+                                                   req->range_end_len, &range_end)))
+            goto err4;
+    }
+
+    if (op->req.tag == CASTLE_RING_ITER_STREAM_START)
+    {
+        err = castle_back_iter_stream_init(stateful_op, op);
+        if (err)
+            goto err4;
+    }
+
+    if (op->req.tag == CASTLE_RING_ITER_FILTER_START)
+    {
+        err = castle_back_iter_filter_get(stateful_op,
+                                          op->req.iter_filter_start.filter_ptr,
+                                          op->req.iter_filter_start.filter_len);
+        if (err)
+            goto err4;
+    }
+
+    if (op->req.tag == CASTLE_RING_AGGREGATE)
+    {
+        if (op->req.aggregate.filter_ptr
+                && (err = castle_back_iter_filter_get(stateful_op,
+                                                      op->req.aggregate.filter_ptr,
+                                                      op->req.aggregate.filter_len)))
+            goto err4;
+        stateful_op->iterator.aggregating    = 1;
+        stateful_op->iterator.agg_group_dims = op->req.aggregate.group_dims;
+        /* Aggregates are returned as values. */
+        stateful_op->flags &= ~CASTLE_RING_FLAG_ITER_NO_VALUES;
+    }
+
     CASTLE_INIT_WORK_AND_TRACE(&stateful_op->work[0], __castle_back_iter_next, stateful_op);
     CASTLE_INIT_WORK_AND_TRACE(&stateful_op->work[1], __castle_back_iter_finish, stateful_op);
 
@@ -2161,6 +3556,8 @@ static void castle_back_iter_start(void *data)
     err = castle_object_iter_init(attachment,
                                   start_key,
                                   end_key,
+                                  range_start,
+                                  range_end,
                                   &stateful_op->iterator.iterator,
                                   stateful_op->seq_id,
                                   stateful_op->flags,
@@ -2168,6 +3565,8 @@ static void castle_back_iter_start(void *data)
                                   stateful_op /*private*/);
     if (err)
         goto err4;
+    castle_check_free(range_start);
+    castle_check_free(range_end);
 
     /* castle_object_iter_init() has gone asynchronous, iter_start will be
      * continued via callback handler, _castle_back_iter_start(). */
@@ -2178,15 +3577,139 @@ static void castle_back_iter_start(void *data)
 
     return;
 
-err4: stateful_op->curr_op = NULL; /* revert the abuse performed above */
-      castle_free(end_key);
+err4: stateful_op->curr_op = NULL; /* revert the abuse performed above */
+      castle_back_iter_stream_fini(stateful_op);
+      castle_back_iter_filter_fini(stateful_op);
+      castle_back_aggregate_fini(stateful_op);
+      castle_check_free(range_start);
+      castle_check_free(range_end);
+      castle_free(end_key);
+err3: castle_free(start_key);
+err2: castle_attachment_put(attachment);
+      stateful_op->attachment = NULL;
+err1: /* No one could have added another op to queue as we haven't returns token yet */
+      spin_lock(&stateful_op->lock);
+      castle_back_put_stateful_op(conn, stateful_op);
+err0: castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
+}
+
+/**
+ * Split a range query into sub-ranges for parallel iteration.
+ *
+ * Replies with the number of split keys, which are returned in the buffer as a
+ * castle_key_value_list with NULL values.
+ *
+ * @also castle_request_iter_split_t
+ * @also castle_object_iter_split()
+ */
+static void castle_back_iter_split(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    castle_request_iter_split_t *req = &op->req.iter_split;
+    struct castle_key_value_list *kv_list, *kv_list_tail = NULL;
+    c_vl_bkey_t **split_keys;
+    c_vl_bkey_t *start_key;
+    c_vl_bkey_t *end_key;
+    uint32_t buf_used, cur_len;
+    int i, nr_keys = 0, nr_split = 0, err;
+
+    if (req->nr_ranges == 0 || req->nr_ranges > CASTLE_ITER_SPLIT_MAX_RANGES)
+    {
+        error("Can't split a range query into %u ranges\n", req->nr_ranges);
+        err = -EINVAL;
+        goto err0;
+    }
+
+    op->attachment = castle_attachment_get(req->start.collection_id, READ);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", req->start.collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    op->buf = castle_back_buffer_get(conn,
+                                     (unsigned long) req->start.buffer_ptr,
+                                     req->start.buffer_len);
+    if (op->buf == NULL)
+    {
+        error("Couldn't get buffer for pointer=%p length=%u\n",
+                req->start.buffer_ptr, req->start.buffer_len);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    err = castle_back_key_copy_get(conn, req->start.start_key_ptr,
+        req->start.start_key_len, &start_key);
+    if (err)
+        goto err2;
+
+    err = castle_back_key_copy_get(conn, req->start.end_key_ptr,
+        req->start.end_key_len, &end_key);
+    if (err)
+        goto err3;
+
+    split_keys = castle_alloc(req->nr_ranges * sizeof(c_vl_bkey_t *));
+    if (!split_keys)
+    {
+        err = -ENOMEM;
+        goto err4;
+    }
+
+    nr_split = castle_object_iter_split(op->attachment, start_key, end_key,
+                                        req->nr_ranges, split_keys);
+    if (nr_split < 0)
+    {
+        err = nr_split;
+        nr_split = 0;
+        goto err5;
+    }
+    /* Keys to free, nr_split is only the reply count from here on. */
+    nr_keys = nr_split;
+
+    /* Lay the keys out as an iterator would. */
+    kv_list  = castle_back_user_to_kernel(op->buf, req->start.buffer_ptr);
+    buf_used = 0;
+    for (i = 0; i < nr_split; i++)
+    {
+        cur_len = sizeof(struct castle_key_value_list);
+        if (buf_used + cur_len >= req->start.buffer_len)
+            break;
+        kv_list->key = (c_vl_bkey_t *)castle_back_kernel_to_user(op->buf,
+                (unsigned long)kv_list + cur_len);
+        kv_list->val = NULL;
+        kv_list->user_timestamp = ULLONG_MAX;
+        cur_len += castle_back_key_kernel_to_user(split_keys[i],
+                                                  (char *)kv_list + cur_len,
+                                                  req->start.buffer_len - buf_used - cur_len);
+        if (cur_len == sizeof(struct castle_key_value_list))
+            break;
+
+        kv_list->next = (struct castle_key_value_list *)
+            castle_back_kernel_to_user(op->buf, ((unsigned long)kv_list + cur_len));
+        kv_list_tail = kv_list;
+        kv_list = (struct castle_key_value_list *)((char *)kv_list + cur_len);
+        buf_used += cur_len;
+    }
+    if (i < nr_split)
+    {
+        error("Buffer of %u bytes too small for %d split keys\n",
+                req->start.buffer_len, nr_split);
+        err = -ENOBUFS;
+        nr_split = 0;
+    }
+    else if (kv_list_tail)
+        kv_list_tail->next = NULL;
+
+err5: for (i = 0; i < nr_keys; i++)
+          castle_free(split_keys[i]);
+      castle_free(split_keys);
+err4: castle_free(end_key);
 err3: castle_free(start_key);
-err2: castle_attachment_put(attachment);
-      stateful_op->attachment = NULL;
-err1: /* No one could have added another op to queue as we haven't returns token yet */
-      spin_lock(&stateful_op->lock);
-      castle_back_put_stateful_op(conn, stateful_op);
-err0: castle_back_reply(op, err, 0, 0, 0, CASTLE_RESPONSE_FLAG_NONE);
+err2: castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, nr_split, 0, CASTLE_RESPONSE_FLAG_NONE);
 }
 
 /**
@@ -2305,6 +3828,7 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
     struct castle_key_value_list *kv_list_cur;
     struct castle_back_conn *conn;
     struct castle_back_op *op;
+    c_val_tup_t agg_val;
     uint32_t cur_len;
     uint32_t buf_len, buf_used;
 
@@ -2321,6 +3845,28 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
     if (err)
         goto err0;
 
+    if (stateful_op->iterator.aggregating)
+    {
+        c_vl_bkey_t *group_key;
+
+        if (key && CVT_TOMBSTONE(*val))
+            return 1;
+        if (key && stateful_op->iterator.filter
+                && !castle_back_iter_filter_match(stateful_op, key, val))
+            return 1;
+
+        /* Groups are returned once their last pair has been seen.  At the end
+         * of the range, returning 1 gets us called again with a NULL key. */
+        group_key = castle_back_aggregate(stateful_op, key, val, &agg_val);
+        if (group_key)
+        {
+            key = group_key;
+            val = &agg_val;
+        }
+        else if (key)
+            return 1;
+    }
+
     /* kv_list_cur will be the next empty entry in the key-value list. */
     kv_list_cur = stateful_op->iterator.kv_list_next;
 
@@ -2331,6 +3877,13 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
          * iterator has terminated with no more values to return. */
         stateful_op->iterator.kv_list_tail->next = NULL;
 
+        /* Streaming iterators finish when userland gets this buffer. */
+        if (op == stateful_op->iterator.fill_op)
+        {
+            castle_back_iter_stream_filled(stateful_op, 0, 1 /*done*/);
+            return 0;
+        }
+
         /* Iterator has finished.  Fake up an iter_finish request and pass it
          * to castle_back_iter_finish() to end the iterator.
          * See also: libcastle.hg:castle_iter_finish_prepare() */
@@ -2352,6 +3905,10 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
         !(stateful_op->flags & CASTLE_RING_FLAG_RET_TOMBSTONE) ) /* didn't ask for them back */
         return 1; /* skip, and tell caller to continue iterating */
 
+    if (stateful_op->iterator.filter && !stateful_op->iterator.aggregating
+            && !castle_back_iter_filter_match(stateful_op, key, val))
+        return 1; /* filtered out, continue iterating */
+
     /* The iterator has returned a key.  Try and add it to the list. */
     buf_len  = stateful_op->iterator.buf_len;
     buf_used = stateful_op->iterator.kv_list_size;
@@ -2393,8 +3950,13 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
 
         stateful_debug("op=%p "stateful_op_fmt_str" key=%p err=%d cur_len=0\n",
                 op, stateful_op2str(stateful_op), key, err);
-        castle_back_buffer_put(conn, op->buf);
-        castle_back_iter_reply(stateful_op, op, 0);
+        if (op == stateful_op->iterator.fill_op)
+            castle_back_iter_stream_filled(stateful_op, 0, 0 /*done*/);
+        else
+        {
+            castle_back_buffer_put(conn, op->buf);
+            castle_back_iter_reply(stateful_op, op, 0);
+        }
 
         return 0;
     }
@@ -2415,8 +3977,13 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
     return 1;
 
 err0:
-    castle_back_buffer_put(conn, op->buf);
-    castle_back_iter_reply(stateful_op, op, err);
+    if (op == stateful_op->iterator.fill_op)
+        castle_back_iter_stream_filled(stateful_op, err, 0 /*done*/);
+    else
+    {
+        castle_back_buffer_put(conn, op->buf);
+        castle_back_iter_reply(stateful_op, op, err);
+    }
 
     return 0;
 }
@@ -2447,6 +4014,13 @@ static void __castle_back_iter_next(void *data)
     stateful_debug("op=%p "stateful_op_fmt_str" iterator=%p iterator.saved_key=%p\n",
             op, stateful_op2str(stateful_op), iterator, stateful_op->iterator.saved_key);
 
+    /* Userland ops on streaming iterators just collect a buffer that's been filled. */
+    if (stateful_op->iterator.fill_op && op != stateful_op->iterator.fill_op)
+    {
+        castle_back_iter_stream_reply(stateful_op, op);
+        return;
+    }
+
     stateful_op->iterator.buf_len      = op->req.iter_next.buffer_len;
     stateful_op->iterator.kv_list_size = 0;
     stateful_op->iterator.kv_list_tail = castle_back_user_to_kernel(op->buf,
@@ -2505,6 +4079,11 @@ static void __castle_back_iter_next(void *data)
     return;
 
 err:
+    if (op == stateful_op->iterator.fill_op)
+    {
+        castle_back_iter_stream_filled(stateful_op, err, 0 /*done*/);
+        return;
+    }
     castle_back_buffer_put(conn, op->buf);
     castle_back_iter_reply(stateful_op, op, err);
 }
@@ -2527,6 +4106,13 @@ static void _castle_back_iter_next(struct castle_back_op *op,
 {
     int err;
 
+    /* Streaming iterators fill their own buffers, @see castle_back_iter_stream_fill(). */
+    if (stateful_op->iterator.fill_op)
+    {
+        op->buf = NULL;
+        goto queue;
+    }
+
     if (op->req.iter_next.buffer_len < PAGE_SIZE)
     {
         error("castle_back_iter_next buffer_len smaller than a page\n");
@@ -2546,6 +4132,7 @@ static void _castle_back_iter_next(struct castle_back_op *op,
         goto err;
     }
 
+queue:
     spin_lock(&stateful_op->lock);
 
     if (fastpath)
@@ -2553,6 +4140,9 @@ static void _castle_back_iter_next(struct castle_back_op *op,
         BUG_ON(!stateful_op->curr_op);
         stateful_op->curr_op = NULL;
     }
+    else if (stateful_op->iterator.fill_op)
+        /* Userland hands back the buffer from the previous reply. */
+        stateful_op->iterator.nr_acks++;
 
     /* Put this op on the queue for the iterator */
     stateful_debug("op=%p "stateful_op_fmt_str" fastpath=%d\n",
@@ -2628,6 +4218,9 @@ static void castle_back_iter_cleanup(struct castle_back_stateful_op *stateful_op
         CVT_INLINE_FREE(stateful_op->iterator.saved_val);
     }
 
+    castle_back_iter_stream_fini(stateful_op);
+    castle_back_iter_filter_fini(stateful_op);
+    castle_back_aggregate_fini(stateful_op);
     castle_free(stateful_op->iterator.start_key);
     castle_free(stateful_op->iterator.end_key);
     attachment = stateful_op->attachment;
@@ -3875,8 +5468,11 @@ unsigned int castle_back_poll(struct file *file, poll_table *wait)
 
     if (conn->flags & CASTLE_BACK_CONN_NOTIFY_FLAG)
     {
+        int i;
+
         clear_bit(CASTLE_BACK_CONN_NOTIFY_BIT, &conn->flags);
-        RING_PUSH_RESPONSES(&conn->back_ring);
+        for (i = 0; i < conn->nr_rings; i++)
+            RING_PUSH_RESPONSES(&conn->rings[i].back_ring);
 
         return POLLIN | POLLRDNORM;
     }
@@ -3889,16 +5485,16 @@ unsigned int castle_back_poll(struct file *file, poll_table *wait)
 /**
  * Get cpu_index for a given stateful op.
  */
-static int castle_back_stateful_op_cpu_index_get(struct castle_back_conn *conn,
+static int castle_back_stateful_op_cpu_index_get(struct castle_back_ring *ring,
                                                  castle_interface_token_t token,
                                                  uint32_t tag)
 {
     struct castle_back_stateful_op *stateful_op;
 
-    stateful_op = castle_back_find_stateful_op(conn, token, tag);
+    stateful_op = castle_back_find_stateful_op(ring->conn, token, tag);
     if (!stateful_op)
-        /* Error later, queue on current conn CPU for now. */
-        return conn->cpu_index;
+        /* Error later, queue on current ring CPU for now. */
+        return ring->cpu_index;
     else
         return stateful_op->cpu_index;
 }
@@ -3909,8 +5505,9 @@ static int castle_back_stateful_op_cpu_index_get(struct castle_back_conn *conn,
  * - Hash okey and select appropriate CPU to queue request onto
  * - Stateful ops maintain CPU affinity
  */
-static void castle_back_request_process(struct castle_back_conn *conn, struct castle_back_op *op)
+static void castle_back_request_process(struct castle_back_ring *ring, struct castle_back_op *op)
 {
+    struct castle_back_conn *conn = ring->conn;
     int err;
     uint64_t val_len = 0;
     int8_t   counter_add_flag = -1;
@@ -3922,7 +5519,7 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
     /* Required in case castle_back_key_copy_get() fails to return a key.
      * It won't matter that the op ends up on the wrong CPU because it will
      * return before hitting the DA. */
-    op->cpu_index = conn->cpu_index;
+    op->cpu_index = ring->cpu_index;
 
     CVT_INVALID_INIT(op->replace.cvt);
     switch (op->req.tag)
@@ -3933,19 +5530,19 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
          * correct CPU (op->cpu) and CT (op->cpu_index). */
 
         case CASTLE_RING_STREAM_IN_START: /* iterator, round-robin CPU selection */
-            op->cpu_index = conn->cpu_index;
+            op->cpu_index = ring->cpu_index;
             INIT_WORK(&op->work, castle_back_stream_in_start, op);
             break;
 
         case CASTLE_RING_STREAM_IN_NEXT:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.stream_in_next.token,
                                                                   CASTLE_RING_STREAM_IN_START);
             INIT_WORK(&op->work, castle_back_stream_in_next, op);
             break;
 
         case CASTLE_RING_STREAM_IN_FINISH:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.stream_in_finish.token,
                                                                   CASTLE_RING_STREAM_IN_START);
             INIT_WORK(&op->work, castle_back_stream_in_finish, op);
@@ -4012,6 +5609,21 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
             INIT_WORK(&op->work, castle_back_get, op);
             break;
 
+        /* Multi ops
+         *
+         * Keys hash to different CPUs, castle_back_multi_dispatch() queues
+         * each CPU's keys there.  Parsing happens on the ring CPU. */
+
+        case CASTLE_RING_MULTI_GET:
+            op->cpu_index = ring->cpu_index;
+            INIT_WORK(&op->work, castle_back_multi_get, op);
+            break;
+
+        case CASTLE_RING_MULTI_REPLACE:
+            op->cpu_index = ring->cpu_index;
+            INIT_WORK(&op->work, castle_back_multi_replace, op);
+            break;
+
         /* Stateful op initialisers
          *
          * Initialise CPU affinity but are broken down into two categories:
@@ -4045,37 +5657,46 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
             break;
 
         case CASTLE_RING_ITER_START: /* iterator, round-robin CPU selection */
-            op->cpu_index = conn->cpu_index;
+        case CASTLE_RING_ITER_STREAM_START:
+        case CASTLE_RING_ITER_RANGE_START:
+        case CASTLE_RING_ITER_FILTER_START:
+        case CASTLE_RING_AGGREGATE:
+            op->cpu_index = ring->cpu_index;
             INIT_WORK(&op->work, castle_back_iter_start, op);
             break;
 
+        case CASTLE_RING_ITER_SPLIT:
+            op->cpu_index = ring->cpu_index;
+            INIT_WORK(&op->work, castle_back_iter_split, op);
+            break;
+
         /* Stateful op continuations
          *
          * Maintain existing CPU affinity. */
 
         case CASTLE_RING_ITER_NEXT:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.iter_next.token,
                                                                   CASTLE_RING_ITER_START);
             INIT_WORK(&op->work, castle_back_iter_next, op);
             break;
 
         case CASTLE_RING_ITER_FINISH:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.iter_finish.token,
                                                                   CASTLE_RING_ITER_START);
             INIT_WORK(&op->work, castle_back_iter_finish, op);
             break;
 
         case CASTLE_RING_PUT_CHUNK:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.put_chunk.token,
                                                                   CASTLE_RING_BIG_PUT);
             INIT_WORK(&op->work, castle_back_put_chunk, op);
             break;
 
         case CASTLE_RING_GET_CHUNK:
-            op->cpu_index = castle_back_stateful_op_cpu_index_get(conn,
+            op->cpu_index = castle_back_stateful_op_cpu_index_get(ring,
                                                                   op->req.get_chunk.token,
                                                                   CASTLE_RING_BIG_GET);
             INIT_WORK(&op->work, castle_back_get_chunk, op);
@@ -4093,12 +5714,14 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
 
     /* Get CPU and queue work. */
     op->cpu = castle_double_array_request_cpu(op->cpu_index);
-    queue_work_on(op->cpu, castle_back_wq, &op->work);
+    if (op->req.tag == CASTLE_RING_GET && castle_back_get_batching)
+        castle_back_get_batch_queue(op);
+    else
+        queue_work_on(op->cpu, castle_back_wq, &op->work);
 
-    /* Bump conn cpu_index/cpu for next op (might be used by stateful ops). */
-    if (++conn->cpu_index >= castle_double_array_request_cpus())
-        conn->cpu_index = 0;
-    conn->cpu = castle_double_array_request_cpu(conn->cpu_index);
+    /* Bump ring cpu_index for next op (might be used by stateful ops). */
+    if (++ring->cpu_index >= castle_double_array_request_cpus())
+        ring->cpu_index = 0;
 
     return;
 
@@ -4107,12 +5730,49 @@ err:
 }
 
 /**
- * This is called once per connection and lives for as long as the connection is alive.
+ * Busy-poll the ring for new requests, for up to ring->poll_us microseconds.
+ *
+ * Saves the sleep/wakeup round trip (and the userland POKE_RING ioctl, as req_event
+ * isn't moved while polling) when requests arrive back to back.  The budget adapts to
+ * the request rate: it is restored to castle_back_poll_us whenever polling finds a
+ * request, halved whenever it expires without one, and doubled on every wakeup.  Rings
+ * that are mostly idle therefore go back to sleeping almost straight away.
+ *
+ * @return 1 if there are requests to consume (or the thread should stop)
+ */
+static int castle_back_ring_poll(struct castle_back_ring *ring)
+{
+    castle_back_ring_t *back_ring = &ring->back_ring;
+    unsigned int spun;
+
+    if (ring->poll_us > castle_back_poll_us)
+        ring->poll_us = castle_back_poll_us;
+
+    for (spun = 0; spun < ring->poll_us; spun++)
+    {
+        if (RING_HAS_UNCONSUMED_REQUESTS(back_ring) || kthread_should_stop())
+        {
+            ring->poll_us = castle_back_poll_us;
+            return 1;
+        }
+        if (need_resched())
+            break;
+        udelay(1);
+    }
+
+    ring->poll_us /= 2;
+
+    return 0;
+}
+
+/**
+ * This is called once per ring and lives for as long as the connection is alive.
  */
 static int castle_back_work_do(void *data)
 {
-    struct castle_back_conn *conn = data;
-    castle_back_ring_t *back_ring = &conn->back_ring;
+    struct castle_back_ring *ring = data;
+    struct castle_back_conn *conn = ring->conn;
+    castle_back_ring_t *back_ring = &ring->back_ring;
     int should_stop, more, items = 0;
     RING_IDX cons, rp;
     struct castle_back_op *op;
@@ -4135,11 +5795,11 @@ static int castle_back_work_do(void *data)
                 back_ring->req_cons = rp;
                 break;
             }
-            spin_lock(&conn->response_lock);
-            BUG_ON(list_empty(&conn->free_ops));
-            op = list_entry(conn->free_ops.next, struct castle_back_op, list);
+            spin_lock(&ring->response_lock);
+            BUG_ON(list_empty(&ring->free_ops));
+            op = list_entry(ring->free_ops.next, struct castle_back_op, list);
             list_del(&op->list);
-            spin_unlock(&conn->response_lock);
+            spin_unlock(&ring->response_lock);
 
             op->buf = NULL;
             memcpy(&op->req, RING_GET_REQUEST(back_ring, cons), sizeof(castle_request_t));
@@ -4149,10 +5809,13 @@ static int castle_back_work_do(void *data)
             /* this is put in castle_back_reply */
             castle_back_conn_get(conn);
 
-            castle_back_request_process(conn, op);
+            castle_back_request_process(ring, op);
             items++;
         }
 
+        if (castle_back_ring_poll(ring))
+            continue;
+
         /* this ensures that if we get an ioctl in between checking the ring
          * for more and calling schedule, we don't sleep and miss it
          */
@@ -4169,9 +5832,10 @@ static int castle_back_work_do(void *data)
         preempt_enable();
         if (!more)
         {
-            trace_CASTLE_BACK_WORK_DO(conn, items);
+            trace_CASTLE_BACK_WORK_DO(conn, ring->idx, items);
             items = 0;
             schedule();
+            ring->poll_us = min(max(ring->poll_us * 2, 1U), castle_back_poll_us);
         }
     }
 
@@ -4180,9 +5844,207 @@ static int castle_back_work_do(void *data)
     return 0;
 }
 
+/**
+ * Allocate and initialise conn->rings[idx], with its consumer thread bound to the
+ * request CPU for cpu_index.
+ *
+ * The thread is started by the first CASTLE_IOCTL_POKE_RING*.
+ *
+ * @also castle_back_ring_fini()
+ */
+static int castle_back_ring_init(struct castle_back_conn *conn, int idx, int cpu_index)
+{
+    struct castle_back_ring *ring = &conn->rings[idx];
+    castle_sring_t *sring;
+    int i, err;
+
+    ring->conn      = conn;
+    ring->idx       = idx;
+    ring->cpu_index = cpu_index;
+    ring->cpu       = castle_double_array_request_cpu(cpu_index);
+    ring->poll_us   = castle_back_poll_us;
+    spin_lock_init(&ring->response_lock);
+
+    /* Structure is mapped in userspace, vmalloc() for page alignment. */
+    sring = (castle_sring_t *)castle_vmalloc(CASTLE_RING_SIZE);
+    if (sring == NULL)
+    {
+        error("castle_back: failed to vmalloc shared ring\n");
+        err = -ENOMEM;
+        goto err0;
+    }
+
+    ReservePages(sring, CASTLE_RING_SIZE);
+
+    SHARED_RING_INIT(sring);
+    BACK_RING_INIT(&ring->back_ring, sring, CASTLE_RING_SIZE);
+
+    /* init the ops pool */
+    ring->ops = castle_vmalloc(sizeof(struct castle_back_op) * RING_SIZE(&ring->back_ring));
+    if (ring->ops == NULL)
+    {
+        error("castle_back: failed to vmalloc mirror buffer for ops\n");
+        err = -ENOMEM;
+        goto err1;
+    }
+
+    INIT_LIST_HEAD(&ring->free_ops);
+
+    for (i=0; i<RING_SIZE(&ring->back_ring); i++)
+    {
+        ring->ops[i].conn = conn;
+        ring->ops[i].ring = ring;
+        list_add(&ring->ops[i].list, &ring->free_ops);
+    }
+
+    /* Don't increase the reference count here, since the conn holds a reference
+     * count and won't release it until kthread_stop has returned. */
+    ring->work_thread = kthread_create(castle_back_work_do, ring, "castle_client%d", idx);
+    if (IS_ERR(ring->work_thread))
+    {
+        error("Could not create work thread\n");
+        err = PTR_ERR(ring->work_thread);
+        goto err2;
+    }
+    kthread_bind(ring->work_thread, ring->cpu);
+
+    return 0;
+
+err2:
+    castle_vfree(ring->ops);
+err1:
+    UnReservePages(sring, CASTLE_RING_SIZE);
+    castle_vfree(sring);
+err0:
+    return err;
+}
+
+/**
+ * Free a ring's shared ring and ops.  Its thread must have been stopped.
+ */
+static void castle_back_ring_fini(struct castle_back_ring *ring)
+{
+    UnReservePages(ring->back_ring.sring, CASTLE_RING_SIZE);
+    castle_vfree(ring->back_ring.sring);
+    castle_vfree(ring->ops);
+}
+
+/**
+ * Switch a connection to nr_rings shared rings.
+ *
+ * Must be called before the rings get mapped.  Each ring gets a consumer thread bound
+ * to the next request CPU, starting from the CPU of ring 0.
+ */
+static int castle_back_rings_set(struct castle_back_conn *conn, unsigned long nr_rings)
+{
+    int i, err = 0;
+
+    if (nr_rings < 1 || nr_rings > CASTLE_RINGS_MAX)
+        return -EINVAL;
+
+    mutex_lock(&conn->rings_mutex);
+
+    if (test_bit(CASTLE_BACK_CONN_INITIALISED_BIT, &conn->flags) || conn->nr_rings != 1)
+    {
+        err = -EBUSY;
+        goto out;
+    }
+
+    for (i = 1; i < nr_rings; i++)
+    {
+        err = castle_back_ring_init(conn, i, (conn->rings[0].cpu_index + i)
+                                                % castle_double_array_request_cpus());
+        if (err)
+        {
+            while (--i > 0)
+            {
+                kthread_stop(conn->rings[i].work_thread);
+                castle_back_ring_fini(&conn->rings[i]);
+            }
+            goto out;
+        }
+    }
+
+    /* Rings must be initialised before they can be poked. */
+    wmb();
+    conn->nr_rings = nr_rings;
+
+out:
+    mutex_unlock(&conn->rings_mutex);
+
+    return err;
+}
+
+/**
+ * Install the connection's table of registered buffers, @see CASTLE_FIXED_BUFFER().
+ *
+ * @param arg   Userland castle_buffers_register_t pointer
+ *
+ * @also castle_back_fixed_buffer_get()
+ */
+static int castle_back_buffers_register(struct castle_back_conn *conn, unsigned long arg)
+{
+    castle_buffers_register_t reg;
+    struct castle_back_buffer **table;
+    unsigned long addr;
+    uint32_t i;
+    int err = 0;
+
+    if (copy_from_user(&reg, (void __user *)arg, sizeof(reg)))
+        return -EFAULT;
+    if (reg.nr_buffers == 0 || reg.nr_buffers > CASTLE_FIXED_BUFFERS_MAX)
+        return -EINVAL;
+
+    table = castle_zalloc(reg.nr_buffers * sizeof(struct castle_back_buffer *));
+    if (!table)
+        return -ENOMEM;
+
+    mutex_lock(&conn->rings_mutex);
+
+    if (conn->nr_fixed_buffers)
+    {
+        err = -EBUSY;
+        goto out;
+    }
+
+    for (i = 0; i < reg.nr_buffers; i++)
+    {
+        if (get_user(addr, (unsigned long __user *)(reg.buffers + i)))
+        {
+            err = -EFAULT;
+            goto out;
+        }
+        /* Takes the reference the table holds. */
+        table[i] = castle_back_buffer_get(conn, addr, 0 /*user_len*/);
+        if (!table[i] || table[i]->user_addr != addr)
+        {
+            error("castle_back: no shared buffer starts at %lx\n", addr);
+            err = -EINVAL;
+            goto out;
+        }
+    }
+
+    conn->fixed_buffers = table;
+    smp_wmb();
+    conn->nr_fixed_buffers = reg.nr_buffers;
+    table = NULL;
+
+out:
+    mutex_unlock(&conn->rings_mutex);
+    if (table)
+    {
+        for (i = 0; i < reg.nr_buffers && table[i]; i++)
+            castle_back_buffer_put(conn, table[i]);
+        castle_free(table);
+    }
+
+    return err;
+}
+
 long castle_back_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct castle_back_conn *conn = file->private_data;
+    int i;
 
     if (conn == NULL)
     {
@@ -4195,9 +6057,22 @@ long castle_back_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned lo
     switch (cmd)
     {
         case CASTLE_IOCTL_POKE_RING:
-            castle_wake_up_task(conn->work_thread, 1 /*inhibit_cs*/);
+            for (i = 0; i < conn->nr_rings; i++)
+                castle_wake_up_task(conn->rings[i].work_thread, 1 /*inhibit_cs*/);
+            break;
+
+        case CASTLE_IOCTL_POKE_RING_N:
+            if (arg >= conn->nr_rings)
+                return -EINVAL;
+            castle_wake_up_task(conn->rings[arg].work_thread, 1 /*inhibit_cs*/);
             break;
 
+        case CASTLE_IOCTL_RINGS_SET:
+            return castle_back_rings_set(conn, arg);
+
+        case CASTLE_IOCTL_BUFFERS_REGISTER:
+            return castle_back_buffers_register(conn, arg);
+
         default:
             return -ENOIOCTLCMD;
     }
@@ -4214,7 +6089,6 @@ long castle_back_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned lo
  */
 int castle_back_open(struct inode *inode, struct file *file)
 {
-    castle_sring_t *sring;
     struct castle_back_conn *conn;
     int i, err = 0;
     static atomic_t castle_next_conn_cpu_index = ATOMIC_INIT(0);
@@ -4237,47 +6111,23 @@ int castle_back_open(struct inode *inode, struct file *file)
     }
 
     conn->flags = 0;
-    conn->cpu_index = castle_atomic_inc_cycle(castle_double_array_request_cpus(),
-                                              &castle_next_conn_cpu_index);
-    conn->cpu = castle_double_array_request_cpu(conn->cpu_index);
     atomic_set(&conn->ref_count, 1);
 
     init_waitqueue_head(&conn->wait);
     spin_lock_init(&conn->response_lock);
     rwlock_init(&conn->buffers_lock);
     spin_lock_init(&conn->restart_timer_lock);
+    mutex_init(&conn->rings_mutex);
     conn->buffers_rb = RB_ROOT;
+    conn->fixed_buffers = NULL;
+    conn->nr_fixed_buffers = 0;
 
-    /* Structure is mapped in userspace, vmalloc() for page alignment. */
-    sring = (castle_sring_t *)castle_vmalloc(CASTLE_RING_SIZE);
-    if (sring == NULL)
-    {
-        error("castle_back: failed to vmalloc shared ring\n");
-        err = -ENOMEM;
+    /* Start with a single ring, @see castle_back_rings_set(). */
+    conn->nr_rings = 1;
+    err = castle_back_ring_init(conn, 0, castle_atomic_inc_cycle(castle_double_array_request_cpus(),
+                                                                 &castle_next_conn_cpu_index));
+    if (err)
         goto err1;
-    }
-
-    ReservePages(sring, CASTLE_RING_SIZE);
-
-    SHARED_RING_INIT(sring);
-    BACK_RING_INIT(&conn->back_ring, sring, CASTLE_RING_SIZE);
-
-    /* init the ops pool */
-    conn->ops = castle_vmalloc(sizeof(struct castle_back_op) * RING_SIZE(&conn->back_ring));
-    if (conn->ops == NULL)
-    {
-        error("castle_back: failed to vmalloc mirror buffer for ops\n");
-        err = -ENOMEM;
-        goto err2;
-    }
-
-    INIT_LIST_HEAD(&conn->free_ops);
-
-    for (i=0; i<RING_SIZE(&conn->back_ring); i++)
-    {
-        conn->ops[i].conn = conn;
-        list_add(&conn->ops[i].list, &conn->free_ops);
-    }
 
     /* init the stateful ops pool */
     conn->stateful_ops = castle_vmalloc(sizeof(struct castle_back_stateful_op) * MAX_STATEFUL_OPS);
@@ -4303,15 +6153,6 @@ int castle_back_open(struct inode *inode, struct file *file)
 
     file->private_data = conn;
 
-    /* Don't increase the reference count here, since we hold a reference count
-     * and won't release it until kthread_stop has returned. */
-    conn->work_thread = kthread_create(castle_back_work_do, conn, "castle_client");
-    if (!conn->work_thread)
-    {
-        error("Could not create work thread\n");
-        goto err4;
-    }
-
     INIT_WORK(&conn->timeout_check_work, _castle_back_stateful_op_timeout_check, conn);
     conn->timeout_check_wq = create_workqueue("castle_back_timeout");
 
@@ -4327,13 +6168,9 @@ int castle_back_open(struct inode *inode, struct file *file)
 
     return 0;
 
-err4:
-    castle_vfree(conn->stateful_ops);
 err3:
-    castle_vfree(conn->ops);
-err2:
-    UnReservePages(conn->back_ring.sring, CASTLE_RING_SIZE);
-    castle_vfree(sring);
+    kthread_stop(conn->rings[0].work_thread);
+    castle_back_ring_fini(&conn->rings[0]);
 err1:
     castle_free(conn);
 err0:
@@ -4371,11 +6208,15 @@ static void castle_back_cleanup_conn(struct castle_back_conn *conn)
 
     debug("castle_back_cleanup_conn for conn = %p cleaned up and freeing\n", conn);
 
-    UnReservePages(conn->back_ring.sring, CASTLE_RING_SIZE);
-    castle_vfree(conn->back_ring.sring);
-    castle_vfree(conn->ops);
+    for (i = 0; i < conn->nr_rings; i++)
+        castle_back_ring_fini(&conn->rings[i]);
     castle_vfree(conn->stateful_ops);
 
+    /* Drop the registered buffers table's references. */
+    for (i = 0; i < conn->nr_fixed_buffers; i++)
+        castle_back_buffer_put(conn, conn->fixed_buffers[i]);
+    castle_check_free(conn->fixed_buffers);
+
     spin_lock(&conns_lock);
     list_del(&conn->list);
     spin_unlock(&conns_lock);
@@ -4415,7 +6256,8 @@ int castle_back_release(struct inode *inode, struct file *file)
 
     set_bit(CASTLE_BACK_CONN_DEAD_BIT, &conn->flags);
     file->private_data = NULL;
-    kthread_stop(conn->work_thread);
+    for (i = 0; i < conn->nr_rings; i++)
+        kthread_stop(conn->rings[i].work_thread);
     wake_up(&conn->wait);
 
     stateful_ops = conn->stateful_ops;
@@ -4522,7 +6364,7 @@ static int castle_buffer_map(struct castle_back_conn *conn, struct vm_area_struc
 
     vma->vm_flags |= VM_DONTCOPY;
 
-    err = castle_vma_map(vma, buffer->buffer, size);
+    err = castle_vma_map(vma, 0 /*vm_offset*/, buffer->buffer, size);
     if (err)
     {
         error("castle_back: mapping failed!\n");
@@ -4548,22 +6390,31 @@ err1:
     return err;
 }
 
+/**
+ * Map all of the connection's rings, ring i at offset i * CASTLE_RING_SIZE.
+ *
+ * Called with conn->rings_mutex held.
+ */
 static int castle_ring_map(struct castle_back_conn *conn, struct vm_area_struct *vma)
 {
     unsigned long size;
-    int err;
+    int i, err = 0;
+
+    BUG_ON(!mutex_is_locked(&conn->rings_mutex));
 
     size = vma->vm_end - vma->vm_start;
-    if (size != CASTLE_RING_SIZE)
+    if (size != conn->nr_rings * CASTLE_RING_SIZE)
     {
         error("castle_back: you _must_ map exactly %d bytes (you asked for %ld)!\n",
-            CASTLE_RING_SIZE, size);
-        return -EINVAL;
+            conn->nr_rings * CASTLE_RING_SIZE, size);
+        err = -EINVAL;
+        goto out;
     }
     else if (vma->vm_start % PAGE_SIZE)
     {
         error("castle_back: you tried to map at addr %ld, not page aligned!\n", vma->vm_start);
-        return -EINVAL;
+        err = -EINVAL;
+        goto out;
     }
 
     vma->vm_flags |= VM_RESERVED;
@@ -4572,16 +6423,21 @@ static int castle_ring_map(struct castle_back_conn *conn, struct vm_area_struct
 
     conn->rings_vstart = vma->vm_start;
 
-    err = castle_vma_map(vma, conn->back_ring.sring, CASTLE_RING_SIZE);
-    if (err)
+    for (i = 0; i < conn->nr_rings; i++)
     {
-        error("castle_back: mapping failed!\n");
-        return err;
+        err = castle_vma_map(vma, i * CASTLE_RING_SIZE,
+                             conn->rings[i].back_ring.sring, CASTLE_RING_SIZE);
+        if (err)
+        {
+            error("castle_back: mapping failed!\n");
+            goto out;
+        }
     }
 
     vma->vm_flags |= VM_DONTCOPY;
 
-    return 0;
+out:
+    return err;
 }
 
 int castle_back_mmap(struct file *file, struct vm_area_struct *vma)
@@ -4596,17 +6452,20 @@ int castle_back_mmap(struct file *file, struct vm_area_struct *vma)
 
     debug("castle_back_mmap mm->mmap_sem.activity=%d\n", vma->vm_mm->mmap_sem.activity);
 
-    if(!test_and_set_bit(CASTLE_BACK_CONN_INITIALISED_BIT, &conn->flags))
+    /* The first mmap() maps the rings, serialised against castle_back_rings_set(). */
+    mutex_lock(&conn->rings_mutex);
+    if(!test_bit(CASTLE_BACK_CONN_INITIALISED_BIT, &conn->flags))
     {
         err = castle_ring_map(conn, vma);
+        if (!err)
+            set_bit(CASTLE_BACK_CONN_INITIALISED_BIT, &conn->flags);
+        mutex_unlock(&conn->rings_mutex);
         if (err)
-        {
-            clear_bit(CASTLE_BACK_CONN_INITIALISED_BIT, &conn->flags);
             goto err_out;
-        }
     }
     else
     {
+        mutex_unlock(&conn->rings_mutex);
         err = castle_buffer_map(conn, vma);
         if (err)
             goto err_out;
@@ -4620,7 +6479,7 @@ err_out:
 
 int castle_back_init(void)
 {
-    int err;
+    int i, err;
 
     debug("castle_back initing...");
 
@@ -4632,6 +6491,24 @@ int castle_back_init(void)
         goto err1;
     }
 
+    castle_back_get_batches = castle_zalloc(castle_double_array_request_cpus()
+                                                * sizeof(struct castle_back_get_batch));
+    if (!castle_back_get_batches)
+    {
+        error(KERN_ALERT "Error: Could not alloc get batches\n");
+        err = -ENOMEM;
+        goto err2;
+    }
+    for (i = 0; i < castle_double_array_request_cpus(); i++)
+    {
+        struct castle_back_get_batch *batch = &castle_back_get_batches[i];
+
+        spin_lock_init(&batch->lock);
+        INIT_LIST_HEAD(&batch->ops);
+        batch->cpu = castle_double_array_request_cpu(i);
+        INIT_WORK(&batch->work, castle_back_get_batch_do, batch);
+    }
+
     init_waitqueue_head(&conn_close_wait);
     spin_lock_init(&conns_lock);
     atomic_set(&castle_back_conn_count, 0);
@@ -4642,7 +6519,8 @@ int castle_back_init(void)
 
     return 0;
 
-    destroy_workqueue(castle_back_wq); /* unreachable */
+err2:
+    destroy_workqueue(castle_back_wq);
 err1:
     return err;
 }
@@ -4655,6 +6533,7 @@ void castle_back_fini(void)
     BUG_ON(!list_empty(&castle_back_conns));
 
     destroy_workqueue(castle_back_wq);
+    castle_free(castle_back_get_batches);
 
     debug("done!\n");
 }
@@ -31,6 +31,10 @@
 
 #define __XOR(a, b) (((a) && !(b)) || (!(a) && (b)))
 
+static int castle_btree_leaf_hints = 1;
+module_param(castle_btree_leaf_hints, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_btree_leaf_hints, "Resolve point reads from the last leaf visited, if it holds the key");
+
 static DECLARE_WAIT_QUEUE_HEAD(castle_btree_iters_wq);
 static atomic_t castle_btree_iters_cnt = ATOMIC_INIT(0);
 
@@ -1160,6 +1164,10 @@ static void castle_btree_read_process(c_bvec_t *c_bvec)
     /* If we found the LUB, either complete the tree walk (if we are looking at a leaf). */
     if (BTREE_NODE_IS_LEAF(node))
     {
+        if (CT_LEAVES_IMMUTABLE(c_bvec->tree))
+            c_bvec->tree->leaf_hints[c_bvec->cpu_index % CASTLE_CT_LEAF_HINTS] =
+                c_bvec->btree_node->cep;
+
         BUG_ON(!CVT_LEAF_VAL(lub_cvt));
         if (CVT_ON_DISK(lub_cvt))
             debug(" Is a leaf, found (k,v)=(%p, 0x%x), cep="cep_fmt_str_nl,
@@ -1418,6 +1426,68 @@ static void __castle_btree_submit(c_bvec_t *c_bvec,
     }
 }
 
+/**
+ * Try to process a read from the leaf last visited on its CT, skipping the descent.
+ *
+ * Gets issued in key order (CASTLE_RING_MULTI_GET, batched CASTLE_RING_GETs) mostly
+ * land in the same leaf as the previous get from the same request CPU.  If the key
+ * sorts strictly between the first and the last key in the hinted leaf, all its
+ * entries (in any version) must be in that leaf, and searching it gives the same
+ * answer as a full descent.
+ *
+ * Must be called with the CT locked, @see castle_btree_root_get().
+ *
+ * @return 1 if the read was processed from the hinted leaf
+ */
+static int castle_btree_leaf_hint_try(c_bvec_t *c_bvec)
+{
+    struct castle_component_tree *ct = c_bvec->tree;
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_btree_node *node;
+    void *first_key, *last_key;
+    c_ext_pos_t cep;
+    c2_block_t *c2b;
+
+    if (!castle_btree_leaf_hints || !CT_LEAVES_IMMUTABLE(ct))
+        return 0;
+
+    cep = ct->leaf_hints[c_bvec->cpu_index % CASTLE_CT_LEAF_HINTS];
+    if (cep.ext_id != ct->tree_ext_free.ext_id)
+        return 0;
+
+    c2b = castle_cache_block_get(cep, ct->node_sizes[0], USER);
+    if (!c2b_uptodate(c2b))
+    {
+        put_c2b(c2b);
+        return 0;
+    }
+    read_lock_node(c2b);
+
+    node = c2b_bnode(c2b);
+    if (node->magic != BTREE_NODE_MAGIC || !BTREE_NODE_IS_LEAF(node) || node->used < 2)
+        goto miss;
+    btree->entry_get(node, 0, &first_key, NULL, NULL);
+    btree->entry_get(node, node->used - 1, &last_key, NULL, NULL);
+    if (btree->key_compare(first_key, c_bvec->key) >= 0
+            || btree->key_compare(c_bvec->key, last_key) >= 0)
+        goto miss;
+
+    /* Continue as if the leaf had been reached by descending from the root. */
+    c_bvec->btree_depth = c_bvec->btree_levels;
+    clear_bit(CBV_C2B_WRITE_LOCKED, &c_bvec->flags);
+    castle_btree_c2b_forget(c_bvec); /* drops the CT lock */
+    castle_btree_c2b_remember(c_bvec, c2b);
+    castle_btree_process(c_bvec);
+
+    return 1;
+
+miss:
+    read_unlock_node(c2b);
+    put_c2b(c2b);
+
+    return 0;
+}
+
 /**
  * Submit request to btree (workqueue function).
  *
@@ -1447,6 +1517,8 @@ static void _castle_btree_submit(c_bvec_t *c_bvec)
     c_bvec->btree_levels = atomic_read(&ct->tree_depth);
     BUG_ON(EXT_POS_INVAL(root_cep));
     castle_debug_bvec_update(c_bvec, C_BVEC_VERSION_FOUND);
+    if ((c_bvec_data_dir(c_bvec) == READ) && castle_btree_leaf_hint_try(c_bvec))
+        return;
     __castle_btree_submit(c_bvec, root_cep, btree->max_key);
 }
 DEFINE_WQ_TRACE_FN(_castle_btree_submit, c_bvec_t);
@@ -160,6 +160,15 @@ inline static uint32_t castle_slim_key_hash(const void *key,
     return castle_norm_key_hash(key, type, seed);
 }
 
+/**
+ * Compute an order-preserving prefix of a slim tree key.
+ * @see castle_norm_key_prefix
+ */
+inline static uint64_t castle_slim_key_prefix(const void *key)
+{
+    return castle_norm_key_prefix(key);
+}
+
 /**
  * Print a slim tree key.
  * @see castle_norm_key_print
@@ -1212,6 +1221,7 @@ struct castle_btree_type castle_slim_tree = {
     .nr_dims       = castle_slim_key_nr_dims,
     .key_strip     = castle_slim_key_strip,
     .key_hash      = castle_slim_key_hash,
+    .key_prefix    = castle_slim_key_prefix,
     .key_print     = castle_slim_key_print,
     .entry_get     = castle_slim_entry_get,
     .entry_add     = castle_slim_entry_add,
@@ -25,6 +25,7 @@
 #include "castle_time.h"
 #include "castle_rebuild.h"
 #include "castle_mstore.h"
+#include "castle_io_sched.h"
 #include "castle_systemtap.h"
 
 #ifndef DEBUG
@@ -60,6 +61,8 @@ enum c2b_state_bits {
     C2B_eio,                /**< Block failed to write to slave(s)                              */
     C2B_evictlist,          /**< Block is on castle_cache_block_evictlist.                      */
     C2B_clock,              /**< Block on castle_cache_block_clock (protected by _clock_lock).  */
+    C2B_no_hedge,           /**< Block must not be read with hedged reads.                      */
+    C2B_writeback_odd,      /**< Block written back in an odd writeback epoch.                  */
     C2B_num_state_bits,     /**< Number of allocated c2b state bits (must be last).             */
 };
 STATIC_BUG_ON(C2B_num_state_bits >= C2B_STATE_BITS_BITS); /* Can use 0..C2B_STATE_BITS_BITS-1   */
@@ -158,6 +161,9 @@ C2B_FNS(evictlist, evictlist)
 C2B_TAS_FNS(evictlist, evictlist)
 C2B_FNS(clock, clock)
 C2B_TAS_FNS(clock, clock)
+C2B_FNS(no_hedge, no_hedge)
+C2B_FNS(writeback_odd, writeback_odd)
+C2B_TAS_FNS(writeback_odd, writeback_odd)
 
 /* c2p encapsulates multiple memory pages (in order to reduce overheads).
    NOTE: In order for this to work, c2bs must necessarily be allocated in
@@ -333,6 +339,18 @@ static unsigned int            castle_checkpoint_ratelimit;
 module_param(castle_checkpoint_ratelimit, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_checkpoint_ratelimit, "Checkpoint ratelimit in KB/s");
 
+static int                     castle_cache_hedged_reads = 0;
+module_param(castle_cache_hedged_reads, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_cache_hedged_reads, "Reissue slow user reads to another replica");
+
+static int                     castle_cache_hedge_percentile = 95;
+module_param(castle_cache_hedge_percentile, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_cache_hedge_percentile, "Slave read latency percentile after which reads are hedged");
+
+static int                     castle_cache_hedge_max_pages = 64;
+module_param(castle_cache_hedge_max_pages, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_cache_hedge_max_pages, "Largest read (in pages) that is hedged");
+
 
 static c2_block_t             *castle_cache_blks = NULL;
 static c2_page_t              *castle_cache_pgs  = NULL;
@@ -448,11 +466,20 @@ DEFINE_PER_CPU(struct mutex, castle_cache_vmap_lock);
 struct task_struct            *castle_cache_flush_thread;
 static DECLARE_WAIT_QUEUE_HEAD(castle_cache_flush_wq);
 static atomic_t                castle_cache_flush_seq;
+static DEFINE_SPINLOCK(castle_cache_block_writebacks_lock);
+static int                     castle_cache_block_writeback_epoch;  /**< Advanced by checkpoint,
+                                                      protected by _writebacks_lock.        */
+static atomic_t                castle_cache_block_writebacks[2] = {ATOMIC(0), ATOMIC(0)};
+                                                   /**< In-flight castle_cache_block_writeback()
+                                                        IOs, by epoch parity.               */
 
 struct task_struct            *castle_cache_evict_thread;
 
 static atomic_t                castle_cache_read_stats = ATOMIC_INIT(0); /**< Pgs read from disk  */
 static atomic_t                castle_cache_write_stats = ATOMIC_INIT(0);/**< Pgs written to disk */
+static atomic_t                castle_cache_hedge_stats = ATOMIC_INIT(0);/**< Hedged reads issued */
+static atomic_t                castle_cache_hedge_won_stats = ATOMIC_INIT(0); /**< Hedged reads
+                                                      that completed first.                 */
 
 struct timer_list              castle_cache_stats_timer;
 
@@ -467,6 +494,13 @@ struct                  task_struct  *checkpoint_thread;
  * Prototypes.
  */
 static void c2_pref_c2b_destroy(c2_block_t *c2b);
+static inline void castle_cache_page_hash_idx(c_ext_pos_t cep, int *hash_idx_p, int *lock_idx_p);
+static c2_page_t* castle_cache_page_hash_find(c_ext_pos_t cep);
+struct castle_io_array;
+static int c_io_hedged_read_submit(c2_block_t *c2b,
+                                   c_disk_chk_t *chunks,
+                                   int k_factor,
+                                   struct castle_io_array *array);
 
 /**********************************************************************************************
  * Core cache.
@@ -486,13 +520,15 @@ void castle_cache_stats_print(int verbose)
     atomic_sub(writes, &castle_cache_write_stats);
 
     if (verbose)
-        castle_printk(LOG_PERF, "castle_cache_stats_timer_tick: D=%d(%d%%) C=%d F=%d R=%d W=%d\n",
+        castle_printk(LOG_PERF, "castle_cache_stats_timer_tick: D=%d(%d%%) C=%d F=%d R=%d W=%d H=%d/%d\n",
             atomic_read(&castle_cache_dirty_pgs),
             100 * atomic_read(&castle_cache_dirty_pgs) / castle_cache_size,
             atomic_read(&castle_cache_clean_pgs),
             castle_cache_page_freelist_size * PAGES_PER_C2P,
             reads,
-            writes);
+            writes,
+            atomic_read(&castle_cache_hedge_won_stats),
+            atomic_read(&castle_cache_hedge_stats));
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_CLEAN_PGS_ID,
                        atomic_read(&castle_cache_clean_pgs), 0);
@@ -1500,10 +1536,13 @@ struct bio_info {
     int                 rw;
     struct bio          *bio;
     c2_block_t          *c2b;
+    struct castle_cache_direct_read *dread;   /**< Set for castle_cache_direct_read() bios. */
     uint32_t            nr_pages;
     struct block_device *bdev;
     struct completion   completion;
     int                 err;
+    struct castle_io_sched_req sched_req;   /**< Set for bios submitted through the slave's
+                                                 I/O scheduler.                             */
 };
 
 /**
@@ -1533,6 +1572,8 @@ static void c2b_remaining_io_sub(int rw, int nr_pages, c2_block_t *c2b, int asyn
              * I/O error via !uptodate or dirty flags.
              */
             debug("c2b %p had bio error(s) - returning error\n", c2b);
+            if (c2b_no_hedge(c2b))
+                clear_c2b_no_hedge(c2b);
             clear_c2b_in_flight(c2b);
             c2b->end_io(c2b, 1 /*did_io*/);
         }
@@ -1541,13 +1582,84 @@ static void c2b_remaining_io_sub(int rw, int nr_pages, c2_block_t *c2b, int asyn
 
     /* All bios succeeded for this c2b. On reads, update the c2b, on writes clean it. */
     if(rw == READ)
+    {
+        /* A read resubmitted after failed hedged reads, later reads may hedge again. */
+        if (c2b_no_hedge(c2b))
+            clear_c2b_no_hedge(c2b);
         update_c2b(c2b);
+    }
     else
         clean_c2b(c2b);
     clear_c2b_in_flight(c2b);
     c2b->end_io(c2b, async /*did_io*/);
 }
 
+/**
+ * Drop an in-flight I/O reference on a slave, queueing the bdev release if the slave
+ * went out-of-service and this was its last outstanding I/O.
+ */
+static void castle_slave_io_put(struct castle_slave *io_slave)
+{
+    /*
+     * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
+     * of CASTLE_SLAVE_OOS_BIT is important.
+     * Decrement io_in_flight. If the slave is marked out-of-service, then check if
+     * io_in_flight is zero. If it is, then we know that it cannot now be incremented
+     * in submit_c2b_io because it is only incremented there if the out-of-service flag
+     * is not set. It is therefore safe to queue the device for release.
+     */
+    atomic_dec(&io_slave->io_in_flight);
+
+    /* If slave is out-of-service, and no I/O is outstanding, then queue up bdev release. */
+    if (test_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags) &&
+        (atomic_read(&io_slave->io_in_flight) == 0))
+    {
+        CASTLE_INIT_WORK(&io_slave->work, castle_release_oos_slave);
+        queue_work(castle_wq, &io_slave->work);
+    }
+}
+
+/**
+ * Take a slave out of service after an I/O error, and trigger a rebuild.
+ *
+ * May be called in interrupt context.
+ */
+static void castle_slave_io_error(struct castle_slave *io_slave)
+{
+    struct castle_slave *slave;
+    struct list_head *lh;
+
+    if (!test_and_set_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags))
+    {
+        /*
+         * This is the first time a bio for this slave has failed. If removing this slave
+         * from service would leave us with less than the minimum number of live slaves,
+         * then BUG out. Otherwise, mark the slave as out-of-service and trigger a rebuild.
+         * Note: We only look at non-SSD slaves here, as SSD slaves can be remapped to
+         * non-SSD slaves.
+         */
+        if (!(io_slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
+        {
+            int nr_live_slaves=0;
+
+            rcu_read_lock();
+            list_for_each_rcu(lh, &castle_slaves.slaves)
+            {
+                slave = list_entry(lh, struct castle_slave, list);
+                if (!test_bit(CASTLE_SLAVE_EVACUATE_BIT, &slave->flags) &&
+                    !test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags) &&
+                    !(slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
+                    nr_live_slaves++;
+            }
+            rcu_read_unlock();
+            BUG_ON(nr_live_slaves < MIN_LIVE_SLAVES);
+        }
+        castle_printk(LOG_WARN, "Disabling slave 0x%x [%s], due to IO errors.\n",
+                io_slave->uuid, io_slave->bdev_name);
+        castle_extents_rebuild_wake();
+    }
+}
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
 static int c2b_multi_io_end(struct bio *bio, unsigned int completed, int err)
 #else
@@ -1555,9 +1667,8 @@ static void c2b_multi_io_end(struct bio *bio, int err)
 #endif
 {
     struct bio_info     *bio_info = bio->bi_private;
-    struct castle_slave *slave, *io_slave;
+    struct castle_slave *io_slave;
     c2_block_t          *c2b = bio_info->c2b;
-    struct list_head    *lh;
 #ifdef CASTLE_DEBUG
     unsigned long flags;
 
@@ -1597,35 +1708,7 @@ static void c2b_multi_io_end(struct bio *bio, int err)
     if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
     {
         /* I/O has failed for this bio, or testing has injected fault. */
-        if (!test_and_set_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags))
-        {
-            /*
-             * This is the first time a bio for this slave has failed. If removing this slave
-             * from service would leave us with less than the minimum number of live slaves,
-             * then BUG out. Otherwise, mark the slave as out-of-service and trigger a rebuild.
-             * Note: We only look at non-SSD slaves here, as SSD slaves can be remapped to
-             * non-SSD slaves.
-             */
-            if (!(io_slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
-            {
-                int nr_live_slaves=0;
-
-                rcu_read_lock();
-                list_for_each_rcu(lh, &castle_slaves.slaves)
-                {
-                    slave = list_entry(lh, struct castle_slave, list);
-                    if (!test_bit(CASTLE_SLAVE_EVACUATE_BIT, &slave->flags) &&
-                        !test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags) &&
-                        !(slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
-                        nr_live_slaves++;
-                }
-                rcu_read_unlock();
-                BUG_ON(nr_live_slaves < MIN_LIVE_SLAVES);
-            }
-            castle_printk(LOG_WARN, "Disabling slave 0x%x [%s], due to IO errors.\n",
-                    io_slave->uuid, io_slave->bdev_name);
-            castle_extents_rebuild_wake();
-        }
+        castle_slave_io_error(io_slave);
 
         /* We may need to re-submit I/O for the c2b. Mark this c2b as 'bio_error' */
         set_c2b_bio_error(((struct bio_info *)bio->bi_private)->c2b);
@@ -1636,26 +1719,11 @@ static void c2b_multi_io_end(struct bio *bio, int err)
 #ifdef CASTLE_DEBUG
     local_irq_restore(flags);
 #endif
+    castle_io_sched_end(&io_slave->io_sched, &bio_info->sched_req);
     castle_free(bio_info);
     bio_put(bio);
 
-    /*
-     * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
-     * of CASTLE_SLAVE_OOS_BIT is important.
-     * Decrement io_in_flight. If the slave is marked out-of-service, then check if
-     * io_in_flight is zero. If it is, then we know that it cannot now be incremented
-     * in submit_c2b_io because it is only incremented there if the out-of-service flag
-     * is not set. It is therefore safe to queue the device for release.
-     */
-    atomic_dec(&io_slave->io_in_flight);
-
-    /* If slave is out-of-service, and no I/O is outstanding, then queue up bdev release. */
-    if (test_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags) &&
-        (atomic_read(&io_slave->io_in_flight) == 0))
-    {
-        CASTLE_INIT_WORK(&io_slave->work, castle_release_oos_slave);
-        queue_work(castle_wq, &io_slave->work);
-    }
+    castle_slave_io_put(io_slave);
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
     return 0;
@@ -1688,6 +1756,9 @@ int chk_valid(c_disk_chk_t chk)
 #endif
 
 #define MAX_BIO_PAGES        128
+#define MAX_IO_ARRAY_PAGES   (4 * BLKS_PER_CHK) /**< Max pages per io_array: physically
+                                                     adjacent chunks are submitted together,
+                                                     split into bios by submit_c2b_io().  */
 
 /**
  * Handle completion for submit_direct_io bios
@@ -1794,6 +1865,20 @@ int submit_direct_io(int                    rw,
     return ret;
 }
 
+/**
+ * Work out which slave I/O scheduler class c2b I/O belongs to.
+ */
+static c_io_class_t c2b_io_class(int rw, c2_block_t *c2b)
+{
+    if (c2b_remap(c2b))
+        return CASTLE_IO_CLASS_REBUILD;
+    if (c2b_partition(c2b, MERGE_IN))
+        return CASTLE_IO_CLASS_MERGE;
+    if (rw == WRITE)
+        return CASTLE_IO_CLASS_FLUSH;
+    return CASTLE_IO_CLASS_USER;
+}
+
 /**
  * Allocate bio for pages & hand-off to Linux block layer.
  *
@@ -1817,6 +1902,7 @@ int submit_c2b_io(int           rw,
     struct bio_info *bio_info;
     int i, j, batch;
     c_ext_type_t ext_type;
+    c_io_class_t io_class;
 
 #ifdef CASTLE_DEBUG
     /* Check that we are submitting IO to the right ceps. */
@@ -1856,7 +1942,8 @@ int submit_c2b_io(int           rw,
     sector = ((sector_t)disk_chk.offset << (C_CHK_SHIFT - 9)) +
               (BLK_IN_CHK(cep.offset) << (C_BLK_SHIFT - 9));
 
-    BUG_ON(nr_pages > MAX_BIO_PAGES);
+    BUG_ON(nr_pages > MAX_IO_ARRAY_PAGES);
+    io_class = c2b_io_class(rw, c2b);
     j = 0;
     while (nr_pages > 0)
     {
@@ -1912,60 +1999,58 @@ int submit_c2b_io(int           rw,
         j += batch;
         nr_pages -= batch;
 
-        bio_get(bio);
-        /* Hand off to Linux block layer. Deal with barrier writes correctly. */
+        /* Hand off to the slave I/O scheduler. Deal with barrier writes correctly. */
         if(unlikely(c2b_barrier(c2b) &&
                     nr_pages <= 0 &&
                     test_bit(CASTLE_SLAVE_ORDERED_SUPP_BIT, &cs->flags)))
         {
             BUG_ON(rw != WRITE);
             /* Set the barrier flag, but only if that the last bio. */
-            submit_bio(WRITE_BARRIER, bio);
+            castle_io_sched_submit(&cs->io_sched, &bio_info->sched_req, bio, WRITE_BARRIER,
+                                   io_class);
         }
         else
-            submit_bio(rw, bio);
-        if(bio_flagged(bio, BIO_EOPNOTSUPP))
-        {
-            castle_printk(LOG_ERROR, "BIO flagged not supported.\n");
-            WARN_ON(1);
-        }
-        bio_put(bio);
+            castle_io_sched_submit(&cs->io_sched, &bio_info->sched_req, bio, rw, io_class);
     }
     return EXIT_SUCCESS;
 }
 
 typedef struct castle_io_array {
-    struct page *io_pages[MAX_BIO_PAGES];
+    struct page *io_pages[MAX_IO_ARRAY_PAGES];
     c_ext_pos_t start_cep;
-    c_chk_t chunk;
+    c_chk_t chunk;          /**< Last logical chunk the array spans.                          */
+    c_chk_cnt_t nr_chunks;  /**< Number of (physically adjacent) logical chunks spanned.      */
     int next_idx;
 } c_io_array_t;
 
 /**
  * Select the next slave to read from.
  *
+ * @param prefetch  Whether the read is a prefetch
  * @param chunks    The chunk for which a slave is to be selected
  * @param k_factor  k_factor for the chunk
  * @param idx       Returns the index in the chunk for the slave to use
  *
  * @return          ENOENT if no slave found, EXIT_SUCCESS if found
  */
-static int c_io_next_slave_get(c2_block_t *c2b, c_disk_chk_t *chunks, int k_factor, int *idx)
+static int c_io_next_slave_get(int prefetch, c_disk_chk_t *chunks, int k_factor, int *idx)
 {
     struct castle_slave *slave;
-    int i, do_second, disk_idx, min_outstanding_ios, tmp;
+    int i, do_second, disk_idx;
+    uint64_t min_cost, cost;
 
     /*
-     * Read scheduler: select the one with minimum in-flight IOs
+     * Read scheduler: select the one with the smallest expected wait, i.e. in-flight IOs
+     * weighted by the recent read latency of the slave.
      *
      * At the moment, when prefetching,
      * 1. Avoid using the first copy, which may be stored on SSDs (don't waste SSD bandwidth).
      * 2. Always go to the same hd-copy in order to exploit sequentiality of prefetches.
      */
-    do_second = c2b_prefetch(c2b);
+    do_second = prefetch;
     /* Loop around, searching for disks in service. */
     disk_idx = -1;
-    min_outstanding_ios = 0; /* keep the compiler happy */
+    min_cost = 0; /* keep the compiler happy */
     for(i=0; i<k_factor; i++)
     {
         slave = castle_slave_find_by_uuid(chunks[i].slave_id);
@@ -1975,19 +2060,19 @@ static int c_io_next_slave_get(c2_block_t *c2b, c_disk_chk_t *chunks, int k_fact
             if(disk_idx == -1)
             {
                 disk_idx = i;
-                min_outstanding_ios = atomic_read(&slave->io_in_flight);
+                min_cost = castle_io_sched_read_cost(slave);
             }
             else if(do_second && disk_idx != -1) {
                 disk_idx = i;
-                min_outstanding_ios = 0; /* fix on this second disk */
+                min_cost = 0; /* fix on this second disk */
             }
             else
             {
-                tmp = atomic_read(&slave->io_in_flight);
-                if(tmp < min_outstanding_ios)
+                cost = castle_io_sched_read_cost(slave);
+                if(cost < min_cost)
                 {
                     disk_idx = i;
-                    min_outstanding_ios = tmp;
+                    min_cost = cost;
                 }
             }
         }
@@ -2038,16 +2123,27 @@ static int c_io_array_submit(int rw,
         k_factor,
         (rw == READ) ? "read" : "write");
 
-    BUG_ON((nr_pages <= 0) || (nr_pages > MAX_BIO_PAGES));
+    BUG_ON((nr_pages <= 0) || (nr_pages > MAX_IO_ARRAY_PAGES));
 
     if (rw == READ) /* Read from one slave only */
     {
         /* Accounting */
         atomic_add(nr_pages, &castle_cache_read_stats);
 
+        /* Small user reads may be hedged across replicas, to cut tail latency. */
+        if (castle_cache_hedged_reads &&
+                (k_factor > 1) &&
+                (nr_pages <= castle_cache_hedge_max_pages) &&
+                !SUPER_EXTENT(ext_id) &&
+                !c2b_no_hedge(c2b) &&
+                !c2b_prefetch(c2b) &&
+                (c2b_io_class(READ, c2b) == CASTLE_IO_CLASS_USER) &&
+                (c_io_hedged_read_submit(c2b, chunks, k_factor, array) == EXIT_SUCCESS))
+            return EXIT_SUCCESS;
+
 retry:
         /* Call the slave scheduler to find the next slave to read from */
-        ret = c_io_next_slave_get(c2b, chunks, k_factor, &read_idx);
+        ret = c_io_next_slave_get(c2b_prefetch(c2b), chunks, k_factor, &read_idx);
         /*
          * If there is a read failure here (no live slaves found) then we return error.
          * Callers must check for read failure. For non-superblock extents this will be fatal.
@@ -2129,13 +2225,566 @@ retry:
     return EXIT_SUCCESS;
 }
 
+/**
+ * State of an uncached read, @see castle_cache_direct_read().
+ */
+struct castle_cache_direct_read {
+    atomic_t                    remaining;  /**< Outstanding bios, plus submitter's ref.    */
+    int                         err;
+    castle_cache_direct_end_io_t end_io;
+    void                       *private;
+};
+
+static void castle_cache_direct_read_put(struct castle_cache_direct_read *dread)
+{
+    if (!atomic_dec_and_test(&dread->remaining))
+        return;
+
+    dread->end_io(dread->private, dread->err);
+    castle_free(dread);
+}
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+static int castle_cache_direct_read_end(struct bio *bio, unsigned int completed, int err)
+#else
+static void castle_cache_direct_read_end(struct bio *bio, int err)
+#endif
+{
+    struct bio_info                 *bio_info = bio->bi_private;
+    struct castle_cache_direct_read *dread = bio_info->dread;
+    struct castle_slave             *io_slave;
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+    if (bio->bi_size)
+        return 1;
+#endif
+    io_slave = castle_slave_find_by_bdev(bio_info->bdev);
+    BUG_ON(!io_slave);
+
+    /* Same as for cached reads, the caller may not retry the read on this slave. */
+    if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+    {
+        castle_slave_io_error(io_slave);
+        dread->err = -EIO;
+    }
+
+    castle_io_sched_end(&io_slave->io_sched, &bio_info->sched_req);
+    castle_free(bio_info);
+    bio_put(bio);
+    castle_slave_io_put(io_slave);
+    castle_cache_direct_read_put(dread);
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+    return 0;
+#endif
+}
+
+/**
+ * Submit bios reading nr_pages from a single slave chunk, starting at cep.
+ *
+ * @return  -EAGAIN if the slave is out-of-service, nothing was submitted
+ */
+static int castle_cache_direct_read_submit(struct castle_cache_direct_read *dread,
+                                           struct castle_slave *cs,
+                                           c_disk_chk_t disk_chk,
+                                           c_ext_pos_t cep,
+                                           struct page **pages,
+                                           int nr_pages)
+{
+    struct bio_info *bio_info;
+    struct bio *bio;
+    sector_t sector;
+    int i, j, batch;
+
+    sector = ((sector_t)disk_chk.offset << (C_CHK_SHIFT - 9)) +
+              (BLK_IN_CHK(cep.offset) << (C_BLK_SHIFT - 9));
+
+    /* Same io_in_flight protocol as submit_c2b_io(). */
+    atomic_inc(&cs->io_in_flight);
+    if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+    {
+        castle_slave_io_put(cs);
+        return -EAGAIN;
+    }
+
+    j = 0;
+    while (nr_pages > 0)
+    {
+        /* Every bio holds an io_in_flight ref, the first one is taken above. */
+        if (j > 0)
+            atomic_inc(&cs->io_in_flight);
+        batch = min(nr_pages, bio_get_nr_vecs(cs->bdev));
+        bio = bio_alloc(GFP_KERNEL, batch);
+        bio_info = castle_alloc(sizeof(struct bio_info));
+        BUG_ON(!bio || !bio_info);
+
+        bio_info->rw       = READ;
+        bio_info->bio      = bio;
+        bio_info->c2b      = NULL;
+        bio_info->dread    = dread;
+        bio_info->nr_pages = batch;
+        bio_info->bdev     = cs->bdev;
+        for (i=0; i < batch; i++)
+        {
+            bio->bi_io_vec[i].bv_page   = pages[i + j];
+            bio->bi_io_vec[i].bv_len    = PAGE_SIZE;
+            bio->bi_io_vec[i].bv_offset = 0;
+        }
+        bio->bi_sector  = sector + (sector_t)(j * 8);
+        bio->bi_bdev    = cs->bdev;
+        bio->bi_vcnt    = batch;
+        bio->bi_idx     = 0;
+        bio->bi_size    = batch * C_BLK_SIZE;
+        bio->bi_end_io  = castle_cache_direct_read_end;
+        bio->bi_private = bio_info;
+
+        j += batch;
+        nr_pages -= batch;
+
+        atomic_inc(&dread->remaining);
+        castle_io_sched_submit(&cs->io_sched, &bio_info->sched_req, bio, READ,
+                               CASTLE_IO_CLASS_USER);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * One replica read of a hedged read, into its own bounce pages.
+ */
+struct c_io_hedge_copy {
+    struct c_io_hedge          *hedge;
+    struct page               **pages;
+};
+
+/**
+ * Hedged c2b read, @see c_io_hedged_read_submit().
+ *
+ * Both replica reads go to bounce pages, so that the losing read can't overwrite the c2b
+ * after its I/O has been completed.  The winner's pages are copied into the c2b.
+ */
+typedef struct c_io_hedge {
+    spinlock_t                  lock;
+    atomic_t                    ref_cnt;    /**< Issued copies, plus the timer while it is
+                                                 pending or its work is queued.             */
+    c2_block_t                 *c2b;
+    c_ext_pos_t                 cep;
+    int                         nr_pages;
+    struct page               **c2b_pages;
+    c_disk_chk_t               *chunks;
+    int                         k_factor;
+    int                         primary;    /**< Index in chunks of the first replica read. */
+    int                         issued;     /**< Copies issued.                             */
+    int                         finished;   /**< Copies completed (successfully or not).    */
+    int                         closed;     /**< No more copies will be issued.             */
+    int                         resolved;   /**< c2b I/O has been completed.                */
+    struct timer_list           timer;
+    struct work_struct          work;
+    struct c_io_hedge_copy      copies[2];
+} c_io_hedge_t;
+
+static void c_io_hedge_put(c_io_hedge_t *hedge)
+{
+    int i, j;
+
+    if (!atomic_dec_and_test(&hedge->ref_cnt))
+        return;
+
+    for (i=0; i<2; i++)
+        for (j=0; j<hedge->nr_pages; j++)
+            if (hedge->copies[i].pages[j])
+                __free_page(hedge->copies[i].pages[j]);
+    castle_free(hedge);
+}
+
+static int c_io_hedge_pages_alloc(c_io_hedge_t *hedge, struct page **pages)
+{
+    int i;
+
+    for (i=0; i<hedge->nr_pages; i++)
+        if (!(pages[i] = alloc_page(GFP_KERNEL)))
+            return -ENOMEM;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Completes the c2b I/O with the first copy read successfully, or with an error once
+ * all copies failed.
+ *
+ * May be called in interrupt context.
+ */
+static void c_io_hedge_copy_end(void *private, int err)
+{
+    struct c_io_hedge_copy *copy = private;
+    c_io_hedge_t *hedge = copy->hedge;
+    unsigned long flags;
+    int won = 0, failed = 0, cancelled = 0, i;
+
+    spin_lock_irqsave(&hedge->lock, flags);
+    hedge->finished++;
+    if (!hedge->resolved)
+    {
+        if (!err)
+            won = hedge->resolved = 1;
+        else if (hedge->closed && (hedge->finished == hedge->issued))
+            failed = hedge->resolved = 1;
+        /* Nothing left for the timer to do, don't keep the bounce pages until it fires. */
+        if (hedge->resolved)
+            cancelled = del_timer(&hedge->timer);
+    }
+    spin_unlock_irqrestore(&hedge->lock, flags);
+    if (cancelled)
+        c_io_hedge_put(hedge);
+
+    /* The first read failed, don't wait for the timer to read the other replica. */
+    if (err && !hedge->closed && del_timer(&hedge->timer))
+        queue_work(castle_wq, &hedge->work);
+
+    if (won)
+    {
+        for (i=0; i<hedge->nr_pages; i++)
+            memcpy(page_address(hedge->c2b_pages[i]), page_address(copy->pages[i]), PAGE_SIZE);
+        if (copy != &hedge->copies[0])
+            atomic_inc(&castle_cache_hedge_won_stats);
+    }
+    if (failed)
+    {
+        /* Resubmit without hedging, failed slaves have been taken out of service. */
+        set_c2b_no_hedge(hedge->c2b);
+        set_c2b_bio_error(hedge->c2b);
+    }
+    if (won || failed)
+        c2b_remaining_io_sub(READ, hedge->nr_pages, hedge->c2b, 1 /*async*/);
+
+    c_io_hedge_put(hedge);
+}
+
+/**
+ * Select the best live replica, other than the primary, to hedge a read to.
+ *
+ * @return  -ENOENT if there is none
+ */
+static int c_io_hedge_slave_get(c_io_hedge_t *hedge, struct castle_slave **cs_p)
+{
+    struct castle_slave *cs;
+    uint64_t cost, min_cost = 0;
+    int i, idx = -1;
+
+    for (i=0; i<hedge->k_factor; i++)
+    {
+        if ((i == hedge->primary) ||
+                (hedge->chunks[i].slave_id == hedge->chunks[hedge->primary].slave_id))
+            continue;
+        cs = castle_slave_find_by_uuid(hedge->chunks[i].slave_id);
+        BUG_ON(!cs);
+        if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+            continue;
+        cost = castle_io_sched_read_cost(cs);
+        if ((idx < 0) || (cost < min_cost))
+        {
+            idx      = i;
+            min_cost = cost;
+            *cs_p    = cs;
+        }
+    }
+
+    return idx < 0 ? -ENOENT : idx;
+}
+
+/**
+ * Reads the second replica, once the first read took longer than expected (or failed).
+ */
+static void c_io_hedge_work(struct work_struct *work)
+{
+    c_io_hedge_t *hedge = container_of(work, c_io_hedge_t, work);
+    struct c_io_hedge_copy *copy = &hedge->copies[1];
+    struct castle_cache_direct_read *dread;
+    struct castle_slave *cs = NULL;
+    int idx, failed = 0;
+
+    spin_lock_irq(&hedge->lock);
+    idx = hedge->resolved ? -ENOENT : c_io_hedge_slave_get(hedge, &cs);
+    if (idx >= 0)
+    {
+        hedge->issued++;
+        atomic_inc(&hedge->ref_cnt);
+    }
+    hedge->closed = 1;
+    /* Nothing more will be read, and the primary has already failed. */
+    if ((idx < 0) && !hedge->resolved && (hedge->finished == hedge->issued))
+        failed = hedge->resolved = 1;
+    spin_unlock_irq(&hedge->lock);
+
+    if (failed)
+    {
+        set_c2b_no_hedge(hedge->c2b);
+        set_c2b_bio_error(hedge->c2b);
+        c2b_remaining_io_sub(READ, hedge->nr_pages, hedge->c2b, 1 /*async*/);
+    }
+    if (idx < 0)
+        goto out;
+
+    atomic_inc(&castle_cache_hedge_stats);
+    dread = castle_alloc(sizeof(struct castle_cache_direct_read));
+    if (!dread || c_io_hedge_pages_alloc(hedge, copy->pages))
+    {
+        if (dread)
+            castle_free(dread);
+        c_io_hedge_copy_end(copy, -ENOMEM);
+        goto out;
+    }
+    atomic_set(&dread->remaining, 1);
+    dread->err     = 0;
+    dread->end_io  = c_io_hedge_copy_end;
+    dread->private = copy;
+    if (castle_cache_direct_read_submit(dread, cs, hedge->chunks[idx], hedge->cep,
+                                        copy->pages, hedge->nr_pages))
+        dread->err = -EAGAIN;
+    castle_cache_direct_read_put(dread);
+
+out:
+    /* Drop the timer's reference. */
+    c_io_hedge_put(hedge);
+}
+
+static void c_io_hedge_timer_fire(unsigned long data)
+{
+    c_io_hedge_t *hedge = (c_io_hedge_t *)data;
+
+    queue_work(castle_wq, &hedge->work);
+}
+
+/**
+ * Read c2b pages from one replica, and from a second one if the first doesn't complete
+ * within the recent castle_cache_hedge_percentile read latency of its slave.  Whichever
+ * read completes first completes the c2b I/O.
+ *
+ * @return  EXIT_SUCCESS if the I/O was submitted, error if the caller should read the
+ *          c2b the normal way instead
+ */
+static int c_io_hedged_read_submit(c2_block_t *c2b,
+                                   c_disk_chk_t *chunks,
+                                   int k_factor,
+                                   c_io_array_t *array)
+{
+    struct castle_cache_direct_read *dread;
+    struct castle_slave *cs, *alt;
+    c_io_hedge_t *hedge;
+    unsigned long flags;
+    uint32_t delay_ms;
+    int nr_pages = array->next_idx, armed;
+
+    hedge = castle_zalloc(sizeof(c_io_hedge_t) + k_factor * sizeof(c_disk_chk_t)
+                              + 3 * nr_pages * sizeof(struct page *));
+    if (!hedge)
+        return -ENOMEM;
+    spin_lock_init(&hedge->lock);
+    atomic_set(&hedge->ref_cnt, 2);
+    hedge->c2b               = c2b;
+    hedge->cep               = array->start_cep;
+    hedge->nr_pages          = nr_pages;
+    hedge->k_factor          = k_factor;
+    hedge->chunks            = (c_disk_chk_t *)(hedge + 1);
+    hedge->c2b_pages         = (struct page **)(hedge->chunks + k_factor);
+    hedge->copies[0].hedge   = hedge;
+    hedge->copies[0].pages   = hedge->c2b_pages + nr_pages;
+    hedge->copies[1].hedge   = hedge;
+    hedge->copies[1].pages   = hedge->c2b_pages + 2 * nr_pages;
+    memcpy(hedge->chunks, chunks, k_factor * sizeof(c_disk_chk_t));
+    memcpy(hedge->c2b_pages, array->io_pages, nr_pages * sizeof(struct page *));
+    setup_timer(&hedge->timer, c_io_hedge_timer_fire, (unsigned long)hedge);
+    CASTLE_INIT_WORK(&hedge->work, c_io_hedge_work);
+
+    /* Only hedge if there is another replica to go to. */
+    if (c_io_next_slave_get(0 /*prefetch*/, chunks, k_factor, &hedge->primary) ||
+            (c_io_hedge_slave_get(hedge, &alt) < 0) ||
+            c_io_hedge_pages_alloc(hedge, hedge->copies[0].pages) ||
+            !(dread = castle_alloc(sizeof(struct castle_cache_direct_read))))
+        goto err_out;
+    atomic_set(&dread->remaining, 1);
+    dread->err     = 0;
+    dread->end_io  = c_io_hedge_copy_end;
+    dread->private = &hedge->copies[0];
+
+    cs = castle_slave_find_by_uuid(chunks[hedge->primary].slave_id);
+    BUG_ON(!cs);
+    if (castle_cache_direct_read_submit(dread, cs, chunks[hedge->primary], hedge->cep,
+                                        hedge->copies[0].pages, nr_pages))
+    {
+        castle_free(dread);
+        goto err_out;
+    }
+    hedge->issued = 1;
+    atomic_add(nr_pages, &castle_cache_read_stats);
+    atomic_add(nr_pages, &c2b->remaining);
+
+    /* Without latency history for the slave, hedge after a jiffy. */
+    delay_ms = castle_io_sched_latency_pct(&cs->io_sched, CASTLE_IO_CLASS_USER,
+                                           castle_cache_hedge_percentile);
+    /* Arm the timer under the lock, so that a read that has already won can't miss it. */
+    spin_lock_irqsave(&hedge->lock, flags);
+    armed = !hedge->resolved;
+    if (armed)
+        mod_timer(&hedge->timer, jiffies + msecs_to_jiffies(delay_ms) + 1);
+    spin_unlock_irqrestore(&hedge->lock, flags);
+    if (!armed)
+        c_io_hedge_put(hedge);
+
+    /* Drop the submitter's reference, the read may now complete. */
+    castle_cache_direct_read_put(dread);
+
+    return EXIT_SUCCESS;
+
+err_out:
+    atomic_set(&hedge->ref_cnt, 1);
+    c_io_hedge_put(hedge);
+    return -EAGAIN;
+}
+
+/**
+ * Read extent pages straight into caller supplied pages, bypassing the cache.
+ *
+ * Nothing is read if any page of the range is present in the cache, as it may be newer
+ * than what is on disk.  Callers are expected to fall back to a cached read in that case
+ * (and on error).
+ *
+ * @param cep       Page aligned start of the range
+ * @param pages     Pages to read into
+ * @param nr_pages  Number of pages to read
+ * @param end_io    Called once, possibly in interrupt context, when all I/O completed
+ * @param private   Passed to end_io
+ *
+ * @return  0       end_io will be called
+ * @return  -EEXIST Part of the range is cached, no I/O was issued
+ * @return  <0      Other error, no I/O was issued
+ */
+int castle_cache_direct_read(c_ext_pos_t cep,
+                             struct page **pages,
+                             int nr_pages,
+                             castle_cache_direct_end_io_t end_io,
+                             void *private)
+{
+    struct castle_cache_direct_read *dread;
+    uint32_t k_factor = castle_extent_kfactor_get(cep.ext_id);
+    c_disk_chk_t chunks[k_factor*2];
+    struct castle_slave *cs;
+    c_ext_pos_t page_cep;
+    spinlock_t *lock;
+    int i, lock_idx, idx, iochunks, batch, ret = 0;
+
+    BUG_ON(cep.offset % PAGE_SIZE);
+    if (nr_pages <= 0 || k_factor == 0)
+        return -EINVAL;
+
+    /* Refuse to bypass pages that are in the cache. */
+    page_cep = cep;
+    for (i=0; i < nr_pages; i++, page_cep.offset += PAGE_SIZE)
+    {
+        c2_page_t *c2p;
+
+        castle_cache_page_hash_idx(page_cep, NULL, &lock_idx);
+        lock = castle_cache_page_hash_locks + lock_idx;
+        spin_lock_irq(lock);
+        c2p = castle_cache_page_hash_find(page_cep);
+        spin_unlock_irq(lock);
+        if (c2p)
+            return -EEXIST;
+    }
+
+    dread = castle_alloc(sizeof(struct castle_cache_direct_read));
+    if (!dread)
+        return -ENOMEM;
+    atomic_set(&dread->remaining, 1);
+    dread->err     = 0;
+    dread->end_io  = end_io;
+    dread->private = private;
+
+    while (nr_pages > 0)
+    {
+        batch = min(nr_pages, (int)(BLKS_PER_CHK - BLK_IN_CHK(cep.offset)));
+        iochunks = castle_extent_map_get(cep.ext_id, CHUNK(cep.offset), chunks,
+                                         READ, cep.offset);
+        if (iochunks == 0)
+        {
+            ret = -EINVAL;
+            break;
+        }
+        BUG_ON(iochunks > k_factor*2);
+
+        do {
+            ret = c_io_next_slave_get(0 /*prefetch*/, chunks, iochunks, &idx);
+            if (ret)
+                break;
+            cs = castle_slave_find_by_uuid(chunks[idx].slave_id);
+            BUG_ON(!cs);
+            ret = castle_cache_direct_read_submit(dread, cs, chunks[idx], cep, pages, batch);
+        } while (ret == -EAGAIN);
+        if (ret)
+            break;
+
+        atomic_add(batch, &castle_cache_read_stats);
+        cep.offset += batch * PAGE_SIZE;
+        pages      += batch;
+        nr_pages   -= batch;
+    }
+
+    /* Nothing went out, let the caller handle the error synchronously. */
+    if (ret && atomic_read(&dread->remaining) == 1)
+    {
+        castle_free(dread);
+        return ret;
+    }
+    if (ret)
+        dread->err = ret;
+    castle_cache_direct_read_put(dread);
+
+    return 0;
+}
+
 static inline void c_io_array_init(c_io_array_t *array)
 {
     array->start_cep = INVAL_EXT_POS;
     array->chunk = INVAL_CHK;
+    array->nr_chunks = 0;
     array->next_idx = 0;
 }
 
+/**
+ * Extend I/O array to the next logical chunk, if its disk chunks directly follow the
+ * disk chunks of all the logical chunks already in the array.
+ *
+ * @param array         I/O array, with pages up to the end of array->chunk
+ * @param chunks        Disk chunks of the first logical chunk in the array
+ * @param nr_chunks     Number of disk chunks in chunks
+ * @param next_chunks   Disk chunks of the following logical chunk
+ * @param nr_next       Number of disk chunks in next_chunks
+ *
+ * @return 1 if the array was extended, 0 otherwise
+ */
+static inline int c_io_array_chunk_extend(c_io_array_t *array,
+                                          c_disk_chk_t *chunks,
+                                          int nr_chunks,
+                                          c_disk_chk_t *next_chunks,
+                                          int nr_next)
+{
+    int i;
+
+    if ((array->next_idx == 0) || (nr_chunks != nr_next))
+        return 0;
+    if ((array->nr_chunks + 1) * BLKS_PER_CHK > MAX_IO_ARRAY_PAGES)
+        return 0;
+    for (i=0; i<nr_chunks; i++)
+        if ((next_chunks[i].slave_id != chunks[i].slave_id) ||
+            (next_chunks[i].offset != chunks[i].offset + array->nr_chunks))
+            return 0;
+
+    array->chunk++;
+    array->nr_chunks++;
+
+    return 1;
+}
+
 /**
  * Add page to I/O array.
  */
@@ -2146,8 +2795,8 @@ static inline int c_io_array_page_add(c_io_array_t *array,
 {
     c_ext_pos_t cur_cep;
 
-    /* We cannot accept any more pages, if we already have MAX_BIO_PAGES. */
-    if(array->next_idx >= MAX_BIO_PAGES)
+    /* We cannot accept any more pages, if we already have MAX_IO_ARRAY_PAGES. */
+    if(array->next_idx >= MAX_IO_ARRAY_PAGES)
         return -1;
     /* If it is an established array, reject pages for different chunks, or non-sequential ceps. */
     if(array->next_idx > 0)
@@ -2164,6 +2813,7 @@ static inline int c_io_array_page_add(c_io_array_t *array,
     {
         array->start_cep = cep;
         array->chunk = logical_chunk;
+        array->nr_chunks = 1;
         cur_cep = cep;
     }
     /* Add the page, increment the index. */
@@ -2173,6 +2823,39 @@ static inline int c_io_array_page_add(c_io_array_t *array,
     return EXIT_SUCCESS;
 }
 
+/**
+ * Submit I/O array, if it holds any pages, and reinitialise it.
+ *
+ * @param submitted_c2ps        [out]   Incremented by the number of c2ps submitted (may be NULL)
+ * @param array_submitted_c2ps  [both]  Number of c2ps in the array, reset once submitted
+ *
+ * @return See c_io_array_submit()
+ */
+static int c_io_array_dispatch(int rw,
+                               c2_block_t *c2b,
+                               c_disk_chk_t *chunks,
+                               int k_factor,
+                               c_io_array_t *array,
+                               c_ext_id_t ext_id,
+                               int *submitted_c2ps,
+                               int *array_submitted_c2ps)
+{
+    int ret;
+
+    if (array->next_idx == 0)
+        return EXIT_SUCCESS;
+
+    /* Could fail to submit the IO, possibly due to a slave going out-of-service. */
+    if ((ret = c_io_array_submit(rw, c2b, chunks, k_factor, array, ext_id)))
+        return ret;
+    if (submitted_c2ps)
+        *submitted_c2ps += *array_submitted_c2ps;
+    *array_submitted_c2ps = 0;
+    c_io_array_init(array);
+
+    return EXIT_SUCCESS;
+}
+
 extern atomic_t wi_in_flight;
 
 /**
@@ -2309,7 +2992,8 @@ out:
  *
  * Iterates over passed c2b's c2ps (ignoring those that are clean/uptodate for WRITEs/READs)
  * Populates array of pages from c2ps
- * Dispatches array once it reaches a chunk boundary
+ * Dispatches array once it reaches a chunk boundary, unless the next logical chunk is
+ * physically adjacent on disk (e.g. run-length allocated extents)
  * Continues until whole c2b has been dispatched
  *
  * @param   rw              [in]    READ or WRITE c2b
@@ -2331,6 +3015,8 @@ int _submit_c2b_rda(int rw, c2_block_t *c2b, int *submitted_c2ps)
     c_ext_id_t    ext_id = c2b->cep.ext_id;
     uint32_t      k_factor = castle_extent_kfactor_get(ext_id);
     c_disk_chk_t  chunks[k_factor*2]; /* May need to handle I/O to shadow map chunks as well. */
+    c_disk_chk_t  cur_chunks[k_factor*2]; /* Map for cur_chk, if io_array spans several chunks. */
+    int           cur_iochunks = 0;
     int           chunk;
     int           array_submitted_c2ps; /* Number of c2ps in current io_array.  */
 
@@ -2374,48 +3060,28 @@ int _submit_c2b_rda(int rw, c2_block_t *c2b, int *submitted_c2ps)
         if(skip_c2p)
             goto next_page; // continue
 
-        /* If we are not skipping, add the page to io array. */
-        if(c_io_array_page_add(io_array, cur_cep, cur_chk, page) != EXIT_SUCCESS)
-        {
-            /* Failed to add this page to the array (see return code for reason).
-             * Dispatch the current array, initialise a new one and
-             * attempt to add the page to the new array.
-             *
-             * We've got physical chunks for last_chk (logical chunk), this should
-             * match with the logical chunk stored in io_array. */
-            BUG_ON(io_array->chunk != last_chk);
-            /* Submit the array. */
-            ret = c_io_array_submit(rw, c2b, chunks, iochunks, io_array, ext_id);
-            if (ret)
-                /*
-                 * Could not submit the IO, possibly due to a slave going out-of-service. Drop
-                 * our reference and return early.
-                 */
-                goto out;
-            if (submitted_c2ps)
-                *submitted_c2ps += array_submitted_c2ps;
-            array_submitted_c2ps = 0;
-
-            /* Reinit the array, and re-try adding the current page. This should not
-               fail any more. */
-            c_io_array_init(io_array);
-            BUG_ON(c_io_array_page_add(io_array, cur_cep, cur_chk, page));
-        }
-
-        /* Increment the number of c2ps we are going to do I/O on. */
-        array_submitted_c2ps++;
-
         /* Update chunk map when we move to a new chunk. */
         if(cur_chk != last_chk)
         {
             debug("Asking extent manager for "cep_fmt_str_nl,
                     cep2str(cur_cep));
-            iochunks = castle_extent_map_get(cur_cep.ext_id,
-                                        CHUNK(cur_cep.offset),
-                                        chunks,
-                                        rw, cur_cep.offset);
-            BUG_ON((iochunks != 0) && (iochunks > k_factor*2));
-            if (iochunks == 0)
+            cur_iochunks = castle_extent_map_get(cur_cep.ext_id,
+                                                 CHUNK(cur_cep.offset),
+                                                 cur_chunks,
+                                                 rw, cur_cep.offset);
+            BUG_ON((cur_iochunks != 0) && (cur_iochunks > k_factor*2));
+
+            /* Keep on filling the current array if the new chunk is physically adjacent
+             * to the chunks in it, otherwise dispatch it. */
+            if ((cur_iochunks == 0) ||
+                !c_io_array_chunk_extend(io_array, chunks, iochunks, cur_chunks, cur_iochunks))
+            {
+                if ((ret = c_io_array_dispatch(rw, c2b, chunks, iochunks, io_array, ext_id,
+                                               submitted_c2ps, &array_submitted_c2ps)))
+                    goto out;
+            }
+
+            if (cur_iochunks == 0)
                 /* Complete the IO by dropping our reference, return early. */
                 goto out;
 
@@ -2425,16 +3091,40 @@ int _submit_c2b_rda(int rw, c2_block_t *c2b, int *submitted_c2ps)
              */
             if (c2b_remap(c2b))
             {
-                for (chunk=0; chunk<iochunks; chunk++)
+                for (chunk=0; chunk<cur_iochunks; chunk++)
                 {
-                    if (!test_bit(CASTLE_SLAVE_OOS_BIT, &chunks[chunk].slave_id))
+                    if (!test_bit(CASTLE_SLAVE_OOS_BIT, &cur_chunks[chunk].slave_id))
                     rebuild_write_chunks++;
                 }
             }
 
-            debug("chunks[0]="disk_chk_fmt_nl, disk_chk2str(chunks[0]));
+            debug("chunks[0]="disk_chk_fmt_nl, disk_chk2str(cur_chunks[0]));
             last_chk = cur_chk;
         }
+
+        /* If we are not skipping, add the page to io array. */
+        if(c_io_array_page_add(io_array, cur_cep, cur_chk, page) != EXIT_SUCCESS)
+        {
+            /* Failed to add this page to the array (see return code for reason).
+             * Dispatch the current array, initialise a new one and
+             * attempt to add the page to the new array. */
+            if ((ret = c_io_array_dispatch(rw, c2b, chunks, iochunks, io_array, ext_id,
+                                           submitted_c2ps, &array_submitted_c2ps)))
+                goto out;
+
+            /* Re-try adding the current page. This should not fail any more. */
+            BUG_ON(c_io_array_page_add(io_array, cur_cep, cur_chk, page));
+        }
+
+        /* New array, it is mapped by the current chunk's disk chunks. */
+        if (io_array->next_idx == 1)
+        {
+            memcpy(chunks, cur_chunks, cur_iochunks * sizeof(c_disk_chk_t));
+            iochunks = cur_iochunks;
+        }
+
+        /* Increment the number of c2ps we are going to do I/O on. */
+        array_submitted_c2ps++;
     }
 next_page:
     c2b_for_each_page_end(page, c2p, cur_cep, c2b);
@@ -4886,8 +5576,8 @@ static int c2_pref_window_advance(c2_pref_window_t *window,
     pages += window->pref_pages;
     BUG_ON(pages % BLKS_PER_CHK);
 
-    /* No more pages need to be prefetched. */
-    if (!pages)
+    /* No more pages need to be prefetched (static window may have been shrunk). */
+    if (pages <= 0)
         goto dont_advance;
 
     /* Pages doesn't meet advance threshold. */
@@ -4961,6 +5651,7 @@ dont_advance:
  * @param cep       Requested offset within extent
  * @param advise    Hints for the prefetcher
  * @param part_id   Cache partition to allocate from
+ * @param chunks    Static window size in chunks (C2_ADV_STATIC only, 0 for default)
  *
  * @return ENOMEM: Failed to allocate a new prefetch window.
  * @return See c2_pref_window_advance().
@@ -4970,7 +5661,8 @@ dont_advance:
  */
 static int castle_cache_prefetch_advise(c_ext_pos_t cep,
                                         c2_advise_t advise,
-                                        c2_partition_id_t part_id)
+                                        c2_partition_id_t part_id,
+                                        int chunks)
 {
     c2_pref_window_t *window;
 
@@ -5001,8 +5693,10 @@ static int castle_cache_prefetch_advise(c_ext_pos_t cep,
     BUG_ON(c2_pref_window_compare(window, cep));
 
     /* Update window advice to match prefetch advice.  Do this once we know we
-     * aren't racing so we don't pollute other bystanding windows.  Currently a no-op (no
-     * relevant advice to update). */
+     * aren't racing so we don't pollute other bystanding windows.  Static windows may
+     * be resized by the consumer, e.g. to stop prefetching past the end of an object. */
+    if ((advise & C2_ADV_STATIC) && !(window->state & PREF_WINDOW_ADAPTIVE) && chunks > 0)
+        window->pref_pages = chunks * BLKS_PER_CHK;
 
     /* Advance the window if necessary. */
     return c2_pref_window_advance(window, cep, advise, part_id);
@@ -5014,7 +5708,8 @@ static int castle_cache_prefetch_advise(c_ext_pos_t cep,
  * @param cep       Extent/offset to operate on/from
  * @param advise    Advice for the cache
  * @param part_id   Cache partition to allocate from
- * @param chunks    Chunks to pin from cep (for !(advise & C2_ADV_EXTENT))
+ * @param chunks    Chunks to pin from cep (for !(advise & C2_ADV_EXTENT)), or the
+ *                  prefetch window size (for C2_ADV_PREFETCH|C2_ADV_STATIC)
  *
  * - If operating on an extent (advise & C2_ADV_EXTENT) manipulate cep and
  *   chunks to span the whole extent.
@@ -5033,7 +5728,7 @@ int castle_cache_advise(c_ext_pos_t cep, c2_advise_t advise, c2_partition_id_t p
 
     /* Prefetching is handled via a _prefetch_advise() call. */
     if ((advise & C2_ADV_PREFETCH) && !(advise & C2_ADV_EXTENT))
-        return castle_cache_prefetch_advise(cep, advise, part_id);
+        return castle_cache_prefetch_advise(cep, advise, part_id, chunks);
 
     /* Pinning, etc. is handled via _prefetch_pin() call. */
     if (advise & C2_ADV_EXTENT)
@@ -5172,6 +5867,96 @@ static void castle_cache_extent_flush_endio(c2_block_t *c2b, int did_io)
     wake_up(&castle_cache_flush_wq);
 }
 
+/**
+ * Drop an in-flight castle_cache_block_writeback() IO, waking checkpoint.
+ *
+ * @param epoch Parity of the writeback epoch the IO was counted in
+ */
+static void castle_cache_block_writeback_put(int epoch)
+{
+    BUG_ON(atomic_dec_return(&castle_cache_block_writebacks[epoch]) < 0);
+    atomic_inc(&castle_cache_flush_seq);
+    wake_up(&castle_cache_flush_wq);
+}
+
+/**
+ * IO completion callback for castle_cache_block_writeback().
+ *
+ * - Drop the flushing bit, read lock and reference taken on behalf of the caller
+ * - Demote the c2b, it was written back because it is not expected to be reused
+ * - Release the extent reference held for the duration of the IO
+ */
+static void castle_cache_block_writeback_endio(c2_block_t *c2b, int did_io)
+{
+    c_ext_mask_id_t mask_id = (c_ext_mask_id_t)(unsigned long)c2b->private;
+    int epoch = test_clear_c2b_writeback_odd(c2b);
+
+    BUG_ON(!c2b_flushing(c2b));
+    clear_c2b_flushing(c2b);
+    read_unlock_c2b(c2b);
+    put_c2b_and_demote(c2b);
+    castle_extent_put_all(mask_id);
+
+    castle_cache_block_writeback_put(epoch);
+}
+
+/**
+ * Write a dirty c2b out immediately, rather than waiting for the flush thread.
+ *
+ * For bulk data that is written once and unlikely to be read back soon (e.g. large
+ * object values).  The IO is issued straight away in whatever unit the c2b spans and
+ * the c2b is demoted on completion, so it is reclaimed ahead of other clean blocks.
+ *
+ * @param c2b   Dirty c2b, write locked by the caller
+ *
+ * NOTE: Consumes the caller's write lock and c2b reference.
+ *
+ * @also castle_periodic_checkpoint() waits for outstanding writebacks
+ */
+void castle_cache_block_writeback(c2_block_t *c2b)
+{
+    c_ext_mask_id_t mask_id;
+    int epoch;
+
+    BUG_ON(!c2b_write_locked(c2b));
+    BUG_ON(!c2b_dirty(c2b));
+
+    downgrade_write_c2b(c2b);
+
+    /* Count the IO before marking the c2b flushing, so that a checkpoint extent flush
+     * that skips it is guaranteed to wait for it. */
+    spin_lock(&castle_cache_block_writebacks_lock);
+    epoch = castle_cache_block_writeback_epoch & 1;
+    atomic_inc(&castle_cache_block_writebacks[epoch]);
+    spin_unlock(&castle_cache_block_writebacks_lock);
+
+    /* Someone else is already writing this c2b out (e.g. it's being flushed for checkpoint).
+     * The c2b stays dirty and will be written out again by the flush thread. */
+    if (test_set_c2b_flushing(c2b))
+        goto out;
+
+    /* Hold the extent for the duration of the IO. */
+    mask_id = castle_extent_all_masks_get(c2b->cep.ext_id);
+    if (MASK_ID_INVAL(mask_id))
+    {
+        clear_c2b_flushing(c2b);
+        goto out;
+    }
+
+    if (epoch)
+        set_c2b_writeback_odd(c2b);
+    c2b->end_io  = castle_cache_block_writeback_endio;
+    c2b->private = (void *)(unsigned long)mask_id;
+    BUG_ON(submit_c2b(WRITE, c2b));
+
+    return;
+
+out:
+    castle_cache_block_writeback_put(epoch);
+    read_unlock_c2b(c2b);
+    put_c2b_and_demote(c2b);
+}
+
 static void castle_cache_flush_endio(c2_block_t *c2b, int did_io);
 
 /**
@@ -6091,6 +6876,7 @@ int castle_checkpoint_version_inc(void)
     /* Done with previous checkpoint. Update freespace counters now. Safe to
      * reuse them now. */
     castle_freespace_post_checkpoint();
+    castle_large_obj_pools_post_checkpoint();
 
     /* Goto next version. */
     fs_sb = castle_fs_superblocks_get();
@@ -6362,7 +7148,7 @@ static int castle_periodic_checkpoint(void *unused)
     struct castle_fs_superblock         *fs_sb;
     struct castle_extents_superblock    *castle_extents_sb;
 
-    int      ret, i;
+    int      ret, i, epoch;
     struct   list_head flush_list;
 
     do {
@@ -6441,6 +7227,14 @@ static int castle_periodic_checkpoint(void *unused)
                                          castle_checkpoint_ratelimit,
                                          CASTLE_MIN_CHECKPOINT_RATELIMIT));
 
+        /* Extent flush skips c2bs already being written back, wait for those.  Start a
+           new writeback epoch, so that writebacks issued from now on aren't waited for. */
+        spin_lock(&castle_cache_block_writebacks_lock);
+        epoch = castle_cache_block_writeback_epoch++ & 1;
+        spin_unlock(&castle_cache_block_writebacks_lock);
+        wait_event(castle_cache_flush_wq,
+                   atomic_read(&castle_cache_block_writebacks[epoch]) == 0);
+
         FAULT(CHECKPOINT_FAULT);
 
         /* Writeback superblocks. */
@@ -221,6 +221,7 @@ int  castle_cache_advise      (c_ext_pos_t cep, c2_advise_t advise, c2_partition
 int  castle_cache_advise_clear(c_ext_pos_t cep, c2_advise_t advise, int chunks);
 void castle_cache_prefetch_pin(c_ext_pos_t cep, c2_advise_t advise, c2_partition_id_t partition, int chunks);
 void castle_cache_extent_flush(c_ext_id_t ext_id, uint64_t start, uint64_t size, unsigned int ratelimit);
+void castle_cache_block_writeback(c2_block_t *c2b);
 void castle_cache_extent_evict(c_ext_dirtytree_t *dirtytree, c_chk_cnt_t start, c_chk_cnt_t count);
 void castle_cache_prefetches_wait(void);
 
@@ -241,6 +242,9 @@ int         submit_c2b_rda            (int rw, c2_block_t *c2b);
 int         submit_c2b_remap_rda      (c2_block_t *c2b, c_disk_chk_t *remap_chunks, int nr_remaps);
 int         submit_direct_io          (int rw, struct block_device *bdev, sector_t sector,
                                        struct page **iopages, int nr_pages);
+typedef void (*castle_cache_direct_end_io_t)(void *private, int err);
+int         castle_cache_direct_read  (c_ext_pos_t cep, struct page **pages, int nr_pages,
+                                       castle_cache_direct_end_io_t end_io, void *private);
 
 int         c2b_has_clean_pages       (c2_block_t *c2b);
 
@@ -1168,10 +1168,9 @@ int castle_control_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 }
             }
 
+            /* Clears data_exts once the merge takes them over. */
             ioctl.merge_start.ret = castle_merge_start(merge_cfg, &ioctl.merge_start.merge_id, -1);
 
-            /* In case of SUCCESS don't free data_exts. */
-            merge_cfg->data_exts = NULL;
 err_out:
             castle_check_free(merge_cfg->data_exts);
             castle_check_free(merge_cfg->arrays);
@@ -20,7 +20,9 @@
 #include "castle_events.h"
 #include "castle_mstore.h"
 #include "castle_ctrl_prog.h"
+#include "castle_merge_policy.h"
 #include "castle_systemtap.h"
+#include "castle_unit_tests.h"
 
 //#define DEBUG
 #ifndef DEBUG
@@ -69,9 +71,11 @@
 #define CASTLE_DA_HASH_SIZE             (1000)
 #define CASTLE_CT_HASH_SIZE             (4000)
 #define CASTLE_DATA_EXTS_HASH_SIZE      (1000)
+#define CASTLE_LO_POOLS_HASH_SIZE       (100)
 static struct list_head        *castle_da_hash       = NULL;
 static struct list_head        *castle_ct_hash       = NULL;
 static struct list_head        *castle_data_exts_hash= NULL;
+static struct list_head        *castle_lo_pools_hash = NULL;
        c_da_t                   castle_next_da_id    = 1;
 static atomic64_t               castle_next_tree_seq = ATOMIC64(0);
 static atomic64_t               castle_next_tree_data_age = ATOMIC64(0);
@@ -106,6 +110,39 @@ static int                      castle_use_ssd_leaf_nodes = 0;
 module_param(castle_use_ssd_leaf_nodes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_use_ssd_leaf_nodes, "Use SSDs for btree leaf nodes");
 
+/* Maximum number of medium object copies a merge may have in flight on the
+ * castle_da_mo workqueue.  Set to 0 to copy synchronously on the merge thread. */
+static int                      castle_merge_mo_copy_depth = 32;
+
+module_param(castle_merge_mo_copy_depth, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_mo_copy_depth, "Max in-flight asynchronous medium object copies per merge (0 = synchronous)");
+
+/* Minimum number of entries in an RWCT before its modlist iter sort is spread across
+ * the request CPUs.  Smaller trees are sorted on the merge thread. */
+static int                      castle_modlist_sort_parallel_min = 65536;
+
+module_param(castle_modlist_sort_parallel_min, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_modlist_sort_parallel_min, "Min RWCT entries for a parallel modlist iter sort");
+
+/* Live data percentage below which in-kernel merges of a CASTLE_DA_OPTS_VALUE_LOG DA drain
+ * (garbage collect) a data extent.  Extents above it are linked to the output tree as is. */
+static int                      castle_value_log_gc_pct = 50;
+
+module_param(castle_value_log_gc_pct, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_value_log_gc_pct, "Live data % below which value log DA merges drain a data extent");
+
+/* Large objects of up to castle_lo_pool_max_chunks chunks are packed into shared extents of
+ * castle_lo_pool_ext_chunks chunks.  Bigger objects get an extent each.  0 disables pooling. */
+static int                      castle_lo_pool_max_chunks = 64;
+
+module_param(castle_lo_pool_max_chunks, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_lo_pool_max_chunks, "Max size (in chunks) of large objects packed into shared extents");
+
+static int                      castle_lo_pool_ext_chunks = 512;
+
+module_param(castle_lo_pool_ext_chunks, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_lo_pool_ext_chunks, "Size (in chunks) of shared large object extents");
+
 /**********************************************************************************************/
 /* Notes about the locking on doubling arrays & component trees.
    Each doubling array has a spinlock which protects the lists of component trees rooted in
@@ -129,6 +166,7 @@ MODULE_PARM_DESC(castle_use_ssd_leaf_nodes, "Use SSDs for btree leaf nodes");
 DEFINE_HASH_TBL(castle_da, castle_da_hash, CASTLE_DA_HASH_SIZE, struct castle_double_array, hash_list, c_da_t, id);
 DEFINE_HASH_TBL(castle_ct, castle_ct_hash, CASTLE_CT_HASH_SIZE, struct castle_component_tree, hash_list, tree_seq_t, seq);
 DEFINE_HASH_TBL(castle_data_exts, castle_data_exts_hash, CASTLE_DATA_EXTS_HASH_SIZE, struct castle_data_extent, hash_list, c_ext_id_t, ext_id);
+DEFINE_HASH_TBL(castle_lo_pools, castle_lo_pools_hash, CASTLE_LO_POOLS_HASH_SIZE, struct castle_lo_pool_ext, hash_list, c_ext_id_t, ext_id);
 
 atomic_t castle_zombie_da_count = ATOMIC(0);
 
@@ -203,7 +241,7 @@ static int castle_da_all_rwcts_create(struct castle_double_array *da,
 void castle_da_next_ct_read(c_bvec_t *c_bvec);
 
 struct workqueue_struct *castle_da_wqs[NR_CASTLE_DA_WQS];
-char *castle_da_wqs_names[NR_CASTLE_DA_WQS] = {"castle_da0"};
+char *castle_da_wqs_names[NR_CASTLE_DA_WQS] = {"castle_da0", "castle_da_mo", "castle_da_sort"};
 
 static int castle_da_merge_check(struct castle_da_merge *merge, void *da);
 static void castle_ct_stats_commit(struct castle_component_tree *ct);
@@ -212,8 +250,17 @@ static signed int castle_tree_ext_index_lookup(struct castle_component_tree *ct,
                                                struct castle_da_merge *merge);
 static void castle_data_ext_size_get(c_ext_id_t ext_id, uint64_t *nr_bytes,
                                      uint64_t *nr_drain_bytes, uint64_t *nr_entries);
+static int castle_large_obj_link_count_get(c_ext_pos_t cep);
 static int castle_merge_thread_create(c_thread_id_t *thread_id, struct castle_double_array *da);
 static int castle_merge_thread_attach(c_merge_id_t merge_id, c_thread_id_t thread_id);
+static c_work_size_t castle_da_merge_policy_work_bytes(void);
+static void castle_da_merge_policy_work(struct work_struct *work);
+static void castle_da_merge_policy_kick(struct castle_double_array *da);
+static int castle_da_merge_policy_start(struct castle_double_array *da, void *unused);
+static inline int castle_ct_key_range_overlaps(struct castle_component_tree *ct,
+                                               struct castle_btree_type *btree,
+                                               void *start_key,
+                                               void *end_key);
 static void castle_da_lfs_all_rwcts_callback(void *data);
 static int castle_immut_tree_nodes_complete(struct castle_immut_tree_construct *tree_constr);
 static void castle_immut_tree_constr_dealloc(struct castle_immut_tree_construct *tree_constr);
@@ -943,10 +990,12 @@ typedef struct castle_modlist_iterator {
     uint8_t enum_advanced;          /**< Set if enumerator has advanced to a new node             */
     int err;
     uint32_t nr_nodes;              /**< Number of nodes in the buffer                            */
+    int budget;                     /**< Bytes taken from castle_ct_modlist_iter_byte_budget      */
     void *node_buffer;              /**< Buffer to store all the nodes                            */
     uint32_t nr_items;              /**< Number of items in the buffer                            */
     uint32_t next_item;             /**< Next item to return in iterator                          */
     struct item_idx {
+        uint64_t prefix;            /**< Entry key prefix (@see castle_btree_type.key_prefix)     */
         uint32_t node;              /**< Which btree node                                         */
         uint32_t node_offset;       /**< Offset within btree node                                 */
     } *src_entry_idx;               /**< 1 of 2 arrays of entry pointers (used for sort)          */
@@ -956,6 +1005,8 @@ typedef struct castle_modlist_iterator {
         uint32_t end;
     } *ranges;
     uint32_t nr_ranges;             /**< Number of elements in node_ranges                        */
+    atomic_t sorts_inflight;        /**< Parallel radix sort work items still running             */
+    wait_queue_head_t sorts_wq;     /**< Woken when sorts_inflight drops to 0                     */
 } c_modlist_iter_t;
 
 struct mutex    castle_da_level1_merge_init;            /**< For level 1 merges serialise entry to
@@ -968,8 +1019,6 @@ atomic_t        castle_ct_modlist_iter_byte_budget;     /**< Byte budget remaini
  */
 static void castle_ct_modlist_iter_free(c_modlist_iter_t *iter)
 {
-    int buffer_size;
-
     if(iter->enumerator)
     {
         castle_ct_immut_iter.cancel(iter->enumerator);
@@ -981,8 +1030,8 @@ static void castle_ct_modlist_iter_free(c_modlist_iter_t *iter)
     castle_check_free(iter->ranges);
 
     /* Replenish the budget - no need to serialise. */
-    buffer_size = iter->nr_nodes * iter->leaf_node_size * C_BLK_SIZE;
-    atomic_add(buffer_size, &castle_ct_modlist_iter_byte_budget);
+    atomic_add(iter->budget, &castle_ct_modlist_iter_byte_budget);
+    iter->budget = 0;
 }
 
 /**
@@ -1078,10 +1127,7 @@ static inline void castle_ct_modlist_iter_merge_index_fill(c_modlist_iter_t *ite
     uint32_t i;
 
     for (i = 0; i < count; i++, src++, dst++)
-    {
-        iter->dst_entry_idx[dst].node        = iter->src_entry_idx[src].node;
-        iter->dst_entry_idx[dst].node_offset = iter->src_entry_idx[src].node_offset;
-    }
+        iter->dst_entry_idx[dst] = iter->src_entry_idx[src];
 }
 
 /**
@@ -1242,6 +1288,7 @@ static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
 
         /* Insert entry into node. */
         btree->entry_add(node, node_offset, key, version, cvt);
+        iter->dst_entry_idx[item_idx].prefix      = btree->key_prefix ? btree->key_prefix(key) : 0;
         iter->dst_entry_idx[item_idx].node        = node_idx-1;
         iter->dst_entry_idx[item_idx].node_offset = node_offset;
         node_offset++;
@@ -1282,11 +1329,14 @@ static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
  *   be k,<-v sorted
  * - nr_ranges: number of ranges in src_entry_idx[]
  *
+ * Used for btree types without key prefixes, @see castle_ct_modlist_iter_sort().
+ *
  * Mergesort implementation as follows:
  *
- * castle_ct_modlist_iter_fill() fills iter->entry_buffer with leaf-nodes from
- * the source btree.  For each entry that gets inserted into the buffer a
- * pointer to that entry goes into dst_entry_idx[].  Individual source btree
+ * castle_ct_modlist_iter_fill() (called first by castle_ct_modlist_iter_sort())
+ * fills iter->entry_buffer with leaf-nodes from the source btree.  For each
+ * entry that gets inserted into the buffer a pointer to that entry goes into
+ * dst_entry_idx[].  Individual source btree
  * nodes are k,<-v sorted so we define ranges of entries on top of
  * dst_entry_idx[].  Each range encompasses the entries from a single source
  * btree node.  iter->nr_ranges contains the number of active ranges in
@@ -1319,10 +1369,8 @@ static void castle_ct_modlist_iter_mergesort(c_modlist_iter_t *iter)
     uint32_t src_range, dst_range;
     void *tmp_entry_idx;
 
-    /* Populate internal entry buffer and initialise dst_entry_idx[] and the
-     * initial node ranges for sorting. */
-    castle_ct_modlist_iter_fill(iter);
-
+    /* castle_ct_modlist_iter_fill() has populated the internal entry buffer and
+     * initialised dst_entry_idx[] and the initial node ranges for sorting. */
     /* Repeatedly merge ranges of entry pointers until we have a single
      * all-encompassing smallest->largest sorted range we can use to return
      * entries when the iterator .has_next(), .next() functions are called. */
@@ -1393,6 +1441,383 @@ static void castle_ct_modlist_iter_mergesort(c_modlist_iter_t *iter)
     iter->dst_entry_idx = NULL;
 }
 
+#define CASTLE_MODLIST_SORT_SMALL   32          /**< Buckets this small are insertion sorted.   */
+#define CASTLE_MODLIST_SORT_STACK   (8 * 256)   /**< Max pending buckets per radix sort.        */
+
+/**
+ * Bucket of entries [start, end) still to be radix sorted on the key prefix byte at bit
+ * offset shift.  A negative shift means the prefix bytes are exhausted.
+ */
+struct modlist_sort_bucket {
+    uint32_t start;
+    uint32_t end;
+    int      shift;
+};
+
+/**
+ * Radix sort state.  One per thread sorting (part of) a modlist iterator.
+ *
+ * @also castle_ct_modlist_iter_radix_sort()
+ */
+struct castle_modlist_sorter {
+    c_modlist_iter_t           *iter;
+    struct work_struct          work;           /**< For parallel sorts on castle_da_sort.    */
+    uint32_t                    start;          /**< First entry of the range to sort.        */
+    uint32_t                    end;            /**< Entry following the range to sort.       */
+    int                         shift;          /**< Prefix byte to start sorting on.         */
+    uint32_t                    counts[256];    /**< Per-byte counts/offsets for a partition. */
+    struct modlist_sort_bucket  stack[CASTLE_MODLIST_SORT_STACK];
+};
+
+/**
+ * Compare two modlist entries in k,<-v order.
+ *
+ * Key prefixes decide the order if they differ.  Otherwise the keys are fetched from
+ * node_buffer and compared in full, along with the versions.
+ */
+static int castle_ct_modlist_iter_entry_compare(c_modlist_iter_t *iter,
+                                                struct item_idx *e1,
+                                                struct item_idx *e2)
+{
+    struct castle_btree_node *node;
+    void *k1, *k2;
+    c_ver_t v1, v2;
+
+    if (e1->prefix != e2->prefix)
+        return e1->prefix < e2->prefix ? -1 : 1;
+
+    node = castle_ct_modlist_iter_buffer_get(iter, e1->node);
+    iter->btree->entry_get(node, e1->node_offset, &k1, &v1, NULL);
+    node = castle_ct_modlist_iter_buffer_get(iter, e2->node);
+    iter->btree->entry_get(node, e2->node_offset, &k2, &v2, NULL);
+
+    return castle_kv_compare(iter->btree, k1, v1, k2, v2);
+}
+
+/**
+ * Insertion sort entries [start, end) of idx[].
+ */
+static void castle_ct_modlist_iter_insertion_sort(c_modlist_iter_t *iter,
+                                                  struct item_idx *idx,
+                                                  uint32_t start,
+                                                  uint32_t end)
+{
+    struct item_idx entry;
+    uint32_t i, j;
+
+    for (i = start + 1; i < end; i++)
+    {
+        entry = idx[i];
+        for (j = i; j > start; j--)
+        {
+            if (castle_ct_modlist_iter_entry_compare(iter, &entry, &idx[j-1]) >= 0)
+                break;
+            idx[j] = idx[j-1];
+        }
+        idx[j] = entry;
+    }
+}
+
+/**
+ * Comparison sort entries [start, end) of idx[], using tmp[] as scratch space.
+ *
+ * Used for buckets whose key prefixes are exhausted, e.g. many versions of a key or keys
+ * sharing a long common prefix.  Insertion sorted runs are merged bottom-up, alternating
+ * between idx[] and tmp[].
+ */
+static void castle_ct_modlist_iter_compare_sort(c_modlist_iter_t *iter,
+                                                struct item_idx *idx,
+                                                struct item_idx *tmp,
+                                                uint32_t start,
+                                                uint32_t end)
+{
+    struct item_idx *src = idx, *dst = tmp, *swap;
+    uint32_t width, lo, mid, hi, i, j, k;
+
+    for (lo = start; lo < end; lo += CASTLE_MODLIST_SORT_SMALL)
+        castle_ct_modlist_iter_insertion_sort(iter, idx, lo,
+                                              min(lo + CASTLE_MODLIST_SORT_SMALL, end));
+
+    for (width = CASTLE_MODLIST_SORT_SMALL; width < end - start; width *= 2)
+    {
+        for (lo = start; lo < end; lo += 2 * width)
+        {
+            might_resched();
+
+            mid = min(lo + width, end);
+            hi  = min(lo + 2 * width, end);
+            for (i = lo, j = mid, k = lo; k < hi; k++)
+            {
+                if (j >= hi
+                        || (i < mid
+                            && castle_ct_modlist_iter_entry_compare(iter, &src[i], &src[j]) <= 0))
+                    dst[k] = src[i++];
+                else
+                    dst[k] = src[j++];
+            }
+        }
+
+        swap = src;
+        src  = dst;
+        dst  = swap;
+    }
+
+    if (src != idx)
+        memcpy(&idx[start], &src[start], (end - start) * sizeof(struct item_idx));
+}
+
+/**
+ * Partition entries [start, end) of idx[] on the key prefix byte at bit offset shift.
+ *
+ * Entries are counted per byte value and scattered (stably) via tmp[] back into idx[].
+ * The scatter is skipped if all entries share the same byte.
+ *
+ * On return sorter->counts[b] is the end offset of the bucket for byte value b; the
+ * bucket starts at counts[b-1] (or start, for b == 0).
+ */
+static void castle_ct_modlist_iter_radix_partition(struct castle_modlist_sorter *sorter,
+                                                   struct item_idx *idx,
+                                                   struct item_idx *tmp,
+                                                   uint32_t start,
+                                                   uint32_t end,
+                                                   int shift)
+{
+    uint32_t *counts = sorter->counts;
+    uint32_t i, pos, count;
+    int b, first;
+
+    memset(counts, 0, sizeof(sorter->counts));
+    for (i = start; i < end; i++)
+        counts[(idx[i].prefix >> shift) & 0xff]++;
+
+    first = (idx[start].prefix >> shift) & 0xff;
+    if (counts[first] == end - start)
+    {
+        /* Single bucket, nothing to move. */
+        for (b = 0; b < 256; b++)
+            counts[b] = b < first ? start : end;
+
+        return;
+    }
+
+    /* Convert counts to bucket start offsets. */
+    for (b = 0, pos = start; b < 256; b++)
+    {
+        count     = counts[b];
+        counts[b] = pos;
+        pos      += count;
+    }
+
+    /* Scatter.  This leaves counts[b] pointing at the end of bucket b. */
+    for (i = start; i < end; i++)
+        tmp[counts[(idx[i].prefix >> shift) & 0xff]++] = idx[i];
+    memcpy(&idx[start], &tmp[start], (end - start) * sizeof(struct item_idx));
+}
+
+/**
+ * MSD radix sort entries [start, end) of idx[] into k,<-v order.
+ *
+ * Buckets are partitioned on successive key prefix bytes, starting with the byte at bit
+ * offset shift.  Small buckets are insertion sorted and buckets whose prefix bytes are
+ * exhausted are comparison sorted, which also orders the versions of each key.  Pending
+ * buckets are kept on sorter->stack rather than recursing.
+ *
+ * @also castle_ct_modlist_iter_sort()
+ */
+static void castle_ct_modlist_iter_radix_sort(struct castle_modlist_sorter *sorter,
+                                              struct item_idx *idx,
+                                              struct item_idx *tmp,
+                                              uint32_t start,
+                                              uint32_t end,
+                                              int shift)
+{
+    c_modlist_iter_t *iter = sorter->iter;
+    uint32_t bucket_start;
+    int depth, b;
+
+    depth = 0;
+    sorter->stack[depth].start = start;
+    sorter->stack[depth].end   = end;
+    sorter->stack[depth].shift = shift;
+    depth++;
+
+    while (depth > 0)
+    {
+        depth--;
+        start = sorter->stack[depth].start;
+        end   = sorter->stack[depth].end;
+        shift = sorter->stack[depth].shift;
+
+        might_resched();
+
+        if (end - start <= CASTLE_MODLIST_SORT_SMALL)
+        {
+            castle_ct_modlist_iter_insertion_sort(iter, idx, start, end);
+            continue;
+        }
+
+        if (shift < 0)
+        {
+            castle_ct_modlist_iter_compare_sort(iter, idx, tmp, start, end);
+            continue;
+        }
+
+        castle_ct_modlist_iter_radix_partition(sorter, idx, tmp, start, end, shift);
+
+        /* Queue up all buckets with more than one entry for the next prefix byte. */
+        for (b = 0, bucket_start = start; b < 256; bucket_start = sorter->counts[b++])
+        {
+            if (sorter->counts[b] - bucket_start < 2)
+                continue;
+
+            BUG_ON(depth >= CASTLE_MODLIST_SORT_STACK);
+            sorter->stack[depth].start = bucket_start;
+            sorter->stack[depth].end   = sorter->counts[b];
+            sorter->stack[depth].shift = shift - 8;
+            depth++;
+        }
+    }
+}
+
+/**
+ * Radix sort a range of modlist entries on a castle_da_sort workqueue.
+ */
+static void castle_ct_modlist_iter_radix_sort_work(struct work_struct *work)
+{
+    struct castle_modlist_sorter *sorter = container_of(work, struct castle_modlist_sorter, work);
+    c_modlist_iter_t *iter = sorter->iter;
+
+    castle_ct_modlist_iter_radix_sort(sorter,
+                                      iter->dst_entry_idx,
+                                      iter->src_entry_idx,
+                                      sorter->start,
+                                      sorter->end,
+                                      sorter->shift);
+
+    if (atomic_dec_and_test(&iter->sorts_inflight))
+        wake_up(&iter->sorts_wq);
+}
+
+/**
+ * Radix sort the entries of a filled modlist iterator on their key prefixes.
+ *
+ * - Find the most significant key prefix byte that differs between entries
+ * - RWCTs with fewer than castle_modlist_sort_parallel_min entries are sorted on the
+ *   calling thread
+ * - Otherwise partition all entries on that byte, then split the buckets into
+ *   contiguous ranges of similar size and sort each range on a request CPU
+ *
+ * Entries are sorted within dst_entry_idx[] (as populated by castle_ct_modlist_iter_fill())
+ * using src_entry_idx[] as scratch space, then the indexes are swapped so src_entry_idx[]
+ * holds the result and dst_entry_idx[] is freed, as after castle_ct_modlist_iter_mergesort().
+ *
+ * @return 0        Entries sorted
+ * @return -ENOMEM  Could not allocate sort state, entries left unsorted
+ *
+ * @also castle_ct_modlist_iter_radix_sort()
+ */
+static int castle_ct_modlist_iter_radix_sort_all(c_modlist_iter_t *iter)
+{
+    struct castle_modlist_sorter *sorters;
+    struct item_idx *idx = iter->dst_entry_idx;
+    uint32_t i, start, target, nr_items = iter->nr_items;
+    uint64_t diff = 0;
+    int nr_sorters, nr_queued, shift, b, s;
+
+    /* Skip leading prefix bytes common to all entries. */
+    for (i = 1; i < nr_items; i++)
+        diff |= idx[i].prefix ^ idx[0].prefix;
+    shift = 56;
+    while (shift >= 0 && !((diff >> shift) & 0xff))
+        shift -= 8;
+
+    nr_sorters = 1;
+    if (nr_items >= castle_modlist_sort_parallel_min && shift >= 0)
+        nr_sorters = castle_double_array_request_cpus();
+
+    sorters = castle_alloc(nr_sorters * sizeof(struct castle_modlist_sorter));
+    if (!sorters)
+        return -ENOMEM;
+    for (s = 0; s < nr_sorters; s++)
+        sorters[s].iter = iter;
+
+    if (nr_sorters == 1)
+    {
+        if (nr_items)
+            castle_ct_modlist_iter_radix_sort(&sorters[0], idx, iter->src_entry_idx,
+                                              0, nr_items, shift);
+        goto out;
+    }
+
+    /* Partition on the first differing byte, then hand out whole buckets so that each
+     * sorter gets roughly nr_items/nr_sorters entries.  Sorters re-partition their range
+     * on the same byte, which keeps the buckets in place. */
+    castle_ct_modlist_iter_radix_partition(&sorters[0], idx, iter->src_entry_idx,
+                                           0, nr_items, shift);
+    for (b = 0, s = 0, start = 0; b < 256 && s < nr_sorters; b++)
+    {
+        target = (uint32_t)((uint64_t)nr_items * (s + 1) / nr_sorters);
+        if (sorters[0].counts[b] < target)
+            continue;
+
+        sorters[s].start = start;
+        sorters[s].end   = sorters[0].counts[b];
+        sorters[s].shift = shift;
+        start = sorters[0].counts[b];
+        s++;
+    }
+    BUG_ON(start != nr_items);
+
+    nr_queued = 0;
+    for (i = 0; i < s; i++)
+        if (sorters[i].end - sorters[i].start > 1)
+            nr_queued++;
+
+    init_waitqueue_head(&iter->sorts_wq);
+    atomic_set(&iter->sorts_inflight, nr_queued);
+    for (i = 0; i < s; i++)
+    {
+        if (sorters[i].end - sorters[i].start < 2)
+            continue;
+
+        CASTLE_INIT_WORK(&sorters[i].work, castle_ct_modlist_iter_radix_sort_work);
+        BUG_ON(!queue_work_on(request_cpus.cpus[i],
+                              castle_da_wqs[CASTLE_DA_SORT_WQ],
+                              &sorters[i].work));
+    }
+    wait_event(iter->sorts_wq, atomic_read(&iter->sorts_inflight) == 0);
+
+out:
+    castle_free(sorters);
+
+    /* Sorted entries are in dst_entry_idx[]. */
+    castle_free(iter->src_entry_idx);
+    iter->src_entry_idx = iter->dst_entry_idx;
+    iter->dst_entry_idx = NULL;
+
+    return 0;
+}
+
+/**
+ * Sort the underlying component tree into smallest->largest k,<-v order.
+ *
+ * - Populate node_buffer and dst_entry_idx[] via castle_ct_modlist_iter_fill()
+ * - Radix sort on key prefixes if the btree type provides them
+ * - Otherwise (or if radix sort state could not be allocated) mergesort
+ *
+ * @also castle_ct_modlist_iter_radix_sort_all()
+ * @also castle_ct_modlist_iter_mergesort()
+ */
+static void castle_ct_modlist_iter_sort(c_modlist_iter_t *iter)
+{
+    castle_ct_modlist_iter_fill(iter);
+
+    if (iter->btree->key_prefix && !castle_ct_modlist_iter_radix_sort_all(iter))
+        return;
+
+    castle_ct_modlist_iter_mergesort(iter);
+}
+
 struct castle_iterator_type castle_ct_modlist_iter = {
     .register_cb = NULL,
     .prep_next   = (castle_iterator_prep_next_t)    castle_ct_modlist_iter_prep_next,
@@ -1404,45 +1829,50 @@ struct castle_iterator_type castle_ct_modlist_iter = {
 /**
  * Initialise modlist btree iterator.
  *
- * See castle_ct_modlist_iter_mergesort() for full implementation details.
+ * See castle_ct_modlist_iter_sort() for full implementation details.
  *
  * - Initialise members
  * - Consume bytes from the global modlist iter byte budget
  * - Allocate memory for node_buffer, src_ and dst_entry_idx[] and ranges
  * - Initialise immutable iterator (for sort)
- * - Kick off mergesort
+ * - Kick off sort
  *
  * NOTE: Caller must hold castle_da_level1_merge_init mutex.
  *
- * @also castle_ct_modlist_iter_mergesort()
+ * @also castle_ct_modlist_iter_sort()
  */
 static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
 {
     struct castle_component_tree *ct = iter->tree;
-    int buffer_size;
+    int buffer_size, budget;
 
     BUG_ON(!mutex_is_locked(&castle_da_level1_merge_init));
     BUG_ON(atomic64_read(&ct->item_count) == 0);
     BUG_ON(!ct); /* component tree must be provided */
 
     iter->err = 0;
+    iter->budget = 0;
     iter->btree = castle_btree_type_get(ct->btree_type);
     iter->leaf_node_size = ct->node_sizes[0];
     iter->async_iter.end_io = NULL;
     iter->async_iter.iter_type = &castle_ct_modlist_iter;
 
     /* To prevent sudden kernel memory ballooning we impose a modlist byte
-     * budget for all DAs.  Size the node buffer based on leaf nodes only. */
+     * budget for all DAs.  Size the node buffer based on leaf nodes only.
+     * Both entry indexes count towards the budget too, with key prefixes
+     * they take a significant fraction of the node buffer size. */
     buffer_size = atomic64_read(&ct->tree_ext_free.used);
     iter->nr_nodes = buffer_size / (iter->leaf_node_size * C_BLK_SIZE);
-    if (atomic_sub_return(buffer_size, &castle_ct_modlist_iter_byte_budget) < 0)
+    budget = buffer_size + 2 * atomic64_read(&ct->item_count) * sizeof(struct item_idx);
+    if (atomic_sub_return(budget, &castle_ct_modlist_iter_byte_budget) < 0)
     {
         castle_printk(LOG_INFO,
                 "Couldn't allocate enough bytes for _modlist_iter_init from bytes budget.\n");
-        atomic_add(buffer_size, &castle_ct_modlist_iter_byte_budget);
+        atomic_add(budget, &castle_ct_modlist_iter_byte_budget);
         iter->err = -ENOMEM;
         return;
     }
+    iter->budget = budget;
 
     /* Allocate immutable iterator.
      * For iterating over source entries during sort. */
@@ -1469,7 +1899,7 @@ static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
     castle_ct_immut_iter_init(iter->enumerator, castle_ct_modlist_iter_next_node, iter, NULL, 0);
 
     /* Finally, sort the data so we can return sorted entries to the caller. */
-    castle_ct_modlist_iter_mergesort(iter);
+    castle_ct_modlist_iter_sort(iter);
 
     /* Good state before we accept requests. */
     iter->err = 0;
@@ -1477,152 +1907,168 @@ static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
 }
 
 /**
- * Insert a component iterator (with cached (k,v)) into the RB-tree.
+ * Compare cached (k,v) entries of two component iterators.
  *
- * In case of duplicate (k,v) tuples maintain only store the most recent iterator in the tree.
- * All other iterators in the list rooted at that newest iterator.same_kv_head.
+ * Cached key prefixes are compared first, falling back to the full (k,v) comparison
+ * only if the prefixes are equal (or if btree type doesn't provide prefixes).
  *
- * Each_skip callback will be used to notify the client about older CVTs with matching (k,v).
- * But only if they are non-counter types.
+ * @also castle_kv_compare()
+ */
+static inline int castle_ct_merged_iter_kv_compare(c_merged_iter_t *iter,
+                                                   struct component_iterator *c1,
+                                                   struct component_iterator *c2)
+{
+    if (c1->cached_entry.k_prefix != c2->cached_entry.k_prefix)
+        return c1->cached_entry.k_prefix < c2->cached_entry.k_prefix ? -1 : 1;
+
+    return castle_kv_compare(iter->btree,
+                             c1->cached_entry.k, c1->cached_entry.v,
+                             c2->cached_entry.k, c2->cached_entry.v);
+}
+
+/**
+ * Play a single match of the tournament between component iterators idx1 and idx2.
  *
- * @param iter [in]         Merged iterator that the RB tree belongs to
- * @param comp_iter [in]    Component iterator that the new kv pair belongs to
+ * Iterators which aren't in the tree always lose. Equal (k,v) pairs are won by the
+ * more recent iterator (component iterator pointers determine the recency order).
  *
- * @also _each_skip() callbacks
+ * @return Index of the winning component iterator
  */
-static void castle_ct_merged_iter_rbtree_insert(c_merged_iter_t *iter,
-                                                struct component_iterator *comp_iter)
+static inline int castle_ct_merged_iter_match(c_merged_iter_t *iter, int idx1, int idx2)
 {
-    struct rb_root *root = &iter->rb_root;
-    struct rb_node **p = &root->rb_node;
-    struct rb_node *parent = NULL;
-    struct rb_node *node = &comp_iter->rb_node;
-    int nr_cmps = 0;
+    struct component_iterator *c1 = iter->iterators + idx1;
+    struct component_iterator *c2 = iter->iterators + idx2;
+    int kv_cmp;
 
-    /* Init the same_kv_head when the iterator is getting added to the tree.
-       This guarantees that its going to be read for use, when we detect (k,v) collision(s). */
-    INIT_LIST_HEAD(&comp_iter->same_kv_head);
+    if (!c1->in_tree)
+        return idx2;
+    if (!c2->in_tree)
+        return idx1;
 
-    /* Go until end of the tree. */
-    while (*p)
-    {
-        struct component_iterator *c_iter, *dup_iter = NULL, *new_iter = NULL;
-        int kv_cmp;
+    kv_cmp = castle_ct_merged_iter_kv_compare(iter, c1, c2);
+    if (kv_cmp == 0)
+        return c1 < c2 ? idx1 : idx2;
 
-        parent = *p;
-        c_iter = rb_entry(parent, struct component_iterator, rb_node);
+    return kv_cmp < 0 ? idx1 : idx2;
+}
 
-        BUG_ON(!c_iter->cached);
-        BUG_ON(c_iter == comp_iter);
+/**
+ * Returns the winner of tournament tree node n.
+ */
+static inline int castle_ct_merged_iter_tree_node_get(c_merged_iter_t *iter, int n)
+{
+    /* Leaves aren't stored, they map directly onto component iterator indices. */
+    if (n >= iter->nr_iters)
+        return n - iter->nr_iters;
 
-        /* Compare the entry in RB Tree with new entry. */
-        kv_cmp = castle_kv_compare(iter->btree,
-                                   comp_iter->cached_entry.k,
-                                   comp_iter->cached_entry.v,
-                                   c_iter->cached_entry.k,
-                                   c_iter->cached_entry.v);
-        nr_cmps++;
+    return iter->tree[n];
+}
 
-        /* New (key,version) is smaller than key in tree.  Traverse left. */
-        if (kv_cmp < 0)
-            p = &(*p)->rb_left;
-        /* New (key,version) is bigger than key in tree.  Traverse right. */
-        else if (kv_cmp > 0)
-            p = &(*p)->rb_right;
-        else
-        {
-            /* Both (key,version) pairs are equal. Here is how we deal with those:
-             *
-             * 1. Put the newest iterator (i.e. from the latest tree) in the rb_tree.
-             *    Older iterators with same (k,v) will _not_ be accessible in the tree directly.
-             * 2. Construct a list of iterators which cache same (k,v), rooted at the newest
-             *    component iterator.same_kv_head. This list may contain both counter and
-             *    non-counter CVTs.
-             * 3. Call each_skip (if registered) for all iterators, except of the newest
-             *    one (i.e. from the latest tree).
-             *
-             * Component iterators are threaded onto a list headed by the newset iterator
-             * (same_kv list). This list is later used to construct response for
-             * counters. Otherwise its thrown away.
-             *
-             * Component iterator pointers are used to determine the recency order.
-             */
-            if(c_iter > comp_iter)
-            {
-                /* The current iterator is more recent than the one in the tree.
-                   (Re-)splice the same_kv list onto current iterator head. */
-                list_splice_init(&c_iter->same_kv_head, &comp_iter->same_kv_head);
-                /* Replace the rb node. */
-                rb_replace_node(&c_iter->rb_node, &comp_iter->rb_node, root);
-                /* Add the older iterator onto same_kv list. */
-                list_add(&c_iter->same_kv_list, &comp_iter->same_kv_head);
-
-                /* Save which iterator is newer and older. */
-                dup_iter = c_iter;
-                new_iter = comp_iter;
-
-            } else
-            {
-                /* The current iterator is less recent that the one in the tree.
-                   Add the current iterator to the same_kv list (rooted at the most
-                   recent iterator). */
-                list_add(&comp_iter->same_kv_list, &c_iter->same_kv_head);
-
-                /* Save which iterator is newer and older. */
-                dup_iter = comp_iter;
-                new_iter = c_iter;
-            }
+/**
+ * Replays all matches on the path from component iterator idx to the root of the
+ * tournament tree. Needs to be called whenever the iterator enters or leaves the tree.
+ */
+static void castle_ct_merged_iter_tree_update(c_merged_iter_t *iter, int idx)
+{
+    int n;
 
-            /* The rb_tree and same_kv list have all been updated, return now. */
-            return;
-        }
-    }
+    for (n = (iter->nr_iters + idx) >> 1; n > 0; n >>= 1)
+        iter->tree[n] = castle_ct_merged_iter_match(iter,
+                                                    castle_ct_merged_iter_tree_node_get(iter, 2*n),
+                                                    castle_ct_merged_iter_tree_node_get(iter, 2*n+1));
+}
+
+/**
+ * Initialises all internal nodes of the tournament tree.
+ */
+static void castle_ct_merged_iter_tree_build(c_merged_iter_t *iter)
+{
+    int n;
+
+    for (n = iter->nr_iters - 1; n > 0; n--)
+        iter->tree[n] = castle_ct_merged_iter_match(iter,
+                                                    castle_ct_merged_iter_tree_node_get(iter, 2*n),
+                                                    castle_ct_merged_iter_tree_node_get(iter, 2*n+1));
+}
+
+/**
+ * Insert a component iterator (with cached (k,v)) into the tournament tree.
+ *
+ * @param iter [in]         Merged iterator that the tree belongs to
+ * @param comp_iter [in]    Component iterator that the new kv pair belongs to
+ */
+static void castle_ct_merged_iter_tree_insert(c_merged_iter_t *iter,
+                                              struct component_iterator *comp_iter)
+{
+    BUG_ON(!comp_iter->cached);
+    BUG_ON(comp_iter->in_tree);
 
-    /* Link the node to tree. */
-    rb_link_node(node, parent, p);
-    /* Set color and in turn balance the tree. */
-    rb_insert_color(node, root);
+    comp_iter->cached_entry.k_prefix = iter->btree->key_prefix ?
+                                       iter->btree->key_prefix(comp_iter->cached_entry.k) : 0;
+    comp_iter->in_tree = 1;
+    castle_ct_merged_iter_tree_update(iter, comp_iter - iter->iterators);
 }
 
-static inline struct component_iterator* castle_ct_merged_iter_rbtree_min_get(
-                                                                      c_merged_iter_t *iter)
+/**
+ * Returns the component iterator which provided the smallest (k,v), without
+ * removing it from the tree.
+ */
+static inline struct component_iterator* castle_ct_merged_iter_tree_min_get(c_merged_iter_t *iter)
 {
-    struct rb_root *root = &iter->rb_root;
-    struct rb_node *min;
+    struct component_iterator *comp_iter;
 
-    /* Get the first element in the sorted order(minimum). */
-    min = rb_first(root);
-    if(!min)
+    if (iter->nr_iters == 0)
         return NULL;
 
-    /* Return the iterator. */
-    return rb_entry(min, struct component_iterator, rb_node);
+    comp_iter = iter->iterators + castle_ct_merged_iter_tree_node_get(iter, 1);
+
+    return comp_iter->in_tree ? comp_iter : NULL;
 }
 
 /**
- * Removes the iterator specified from the rbtree.
+ * Removes the component iterator specified from the tournament tree.
  */
-static inline void castle_ct_merged_iter_rbtree_del(c_merged_iter_t *iter,
-                                                    struct component_iterator *comp_iter)
+static inline void castle_ct_merged_iter_tree_del(c_merged_iter_t *iter,
+                                                  struct component_iterator *comp_iter)
 {
-    /* Erase the element from tree. */
-    rb_erase(&comp_iter->rb_node, &iter->rb_root);
+    BUG_ON(!comp_iter->in_tree);
+    comp_iter->in_tree = 0;
+    castle_ct_merged_iter_tree_update(iter, comp_iter - iter->iterators);
 }
 
 /**
  * Determines and removes+returns the component iterator which provided the smallest
- * key.
+ * (k,v), together with all other iterators caching the same (k,v).
+ *
+ * The returned iterator is the most recent one. Older iterators with the same (k,v)
+ * are threaded onto the list rooted at its same_kv_head, in recency order. This list
+ * may contain both counter and non-counter CVTs, and it is later used to construct
+ * response for counters (and timestamped values). Each_skip callback will be used to
+ * notify the client about older CVTs.
+ *
+ * @also castle_ct_merged_iter_consume()
  */
-static struct component_iterator* castle_ct_merge_iter_rbtree_min_del(c_merged_iter_t *iter)
+static struct component_iterator* castle_ct_merged_iter_tree_min_del(c_merged_iter_t *iter)
 {
-    struct component_iterator *comp_iter;
+    struct component_iterator *comp_iter, *dup_iter;
 
     /* Get the smallest iter from the tree. */
-    comp_iter = castle_ct_merged_iter_rbtree_min_get(iter);
+    comp_iter = castle_ct_merged_iter_tree_min_get(iter);
     BUG_ON(!comp_iter);
+    BUG_ON(!comp_iter->cached);
+    castle_ct_merged_iter_tree_del(iter, comp_iter);
+    INIT_LIST_HEAD(&comp_iter->same_kv_head);
 
-    /* Delete from the rbtree. */
-    castle_ct_merged_iter_rbtree_del(iter, comp_iter);
+    /* Equal (k,v) pairs are won by the more recent iterator, therefore duplicates will
+       come out of the tree oldest last. */
+    while ((dup_iter = castle_ct_merged_iter_tree_min_get(iter)) &&
+           (castle_ct_merged_iter_kv_compare(iter, dup_iter, comp_iter) == 0))
+    {
+        BUG_ON(!dup_iter->cached);
+        BUG_ON(dup_iter < comp_iter);
+        castle_ct_merged_iter_tree_del(iter, dup_iter);
+        list_add_tail(&dup_iter->same_kv_list, &comp_iter->same_kv_head);
+    }
 
     /* Return the iterator. */
     return comp_iter;
@@ -1708,11 +2154,8 @@ static int castle_ct_merged_iter_prep_next(c_merged_iter_t *iter)
                 comp_iter->cached = 1;
                 iter->src_items_completed++;
                 debug_iter("%s:%p:%d - cached\n", __FUNCTION__, iter, i);
-                /* Insert the kv pair into RB tree. */
-                /* It is possible that. this call could delete kv pairs of the component
-                 * iterators (which is fine, as we go through that component iterator anyway)
-                 * coming after this or it could delete the current kv pair itself. */
-                castle_ct_merged_iter_rbtree_insert(iter, comp_iter);
+                /* Insert the kv pair into the tournament tree. */
+                castle_ct_merged_iter_tree_insert(iter, comp_iter);
             }
             else
             {
@@ -1840,61 +2283,17 @@ drain_cached:
     iter->cached = 0;
 }
 
-/**
- * Sort a list of iterators (with same kv) according to iter order, which is
- * implicitly ct seq order.
- */
-static void castle_ct_merged_iter_same_kv_iters_sort(struct list_head *same_kv_head,
-                                                     struct rb_root *rb_root_p)
-{
-    struct list_head *l, *t;
-    struct rb_node **p, *parent;
-
-    /* The same_kv list isn't sorted. Insert sort it. */
-    *rb_root_p = RB_ROOT;
-    list_for_each_safe(l, t, same_kv_head)
-    {
-        struct component_iterator *current_iter;
-
-        /* Work ot the iterator structure pointer, and delete list entry. */
-        current_iter = list_entry(l, struct component_iterator, same_kv_list);
-        list_del(l);
-
-        /* Insert into rb tree. */
-        parent = NULL;
-        p = &rb_root_p->rb_node;
-        while(*p)
-        {
-            struct component_iterator *tree_iter;
-
-            parent = *p;
-            tree_iter = rb_entry(parent, struct component_iterator, rb_node);
-
-            BUG_ON(!CVT_LEAF_VAL(tree_iter->cached_entry.cvt));
-
-            /* We never expect to see the same iterator twice. */
-            BUG_ON(tree_iter == current_iter);
-            if(tree_iter > current_iter)
-                p = &(*p)->rb_left;
-            else
-                p = &(*p)->rb_right;
-        }
-        rb_link_node(&current_iter->rb_node, parent, p);
-        rb_insert_color(&current_iter->rb_node, rb_root_p);
-    }
-}
-
 /**
  * Accumulates and returns counter (wrapped into a cvt) from the component iterator
  * specified and older iterators present in the same_kv list.
  *
- * The function uses O(n*log(n)) sort on same_kv list.
+ * The same_kv list is kept in recency order, so it is walked directly.
  */
 static c_val_tup_t castle_ct_merged_iter_counter_reduce(struct component_iterator *iter)
 {
     c_val_tup_t accumulator;
-    struct rb_root rb_root;
-    struct rb_node *rb_entry;
+    struct component_iterator *other_iter;
+    struct list_head *l;
 
     /* We expecting for the list head of the same_kv list to be a counter (at least). */
     BUG_ON(!CVT_ANY_COUNTER(iter->cached_entry.cvt));
@@ -1908,23 +2307,15 @@ static c_val_tup_t castle_ct_merged_iter_counter_reduce(struct component_iterato
     if(castle_counter_simple_reduce(&accumulator, iter->cached_entry.cvt))
         return accumulator;
 
-    /* If the list same_kv list is empty, return too. */
-    if(list_empty(&iter->same_kv_head))
-        return accumulator;
-
-    /* The same_kv list isn't sorted. Insert sort it. */
-    castle_ct_merged_iter_same_kv_iters_sort(&iter->same_kv_head, &rb_root);
-
     /* Now accumulate the results one iterator at the time. */
-    rb_entry = rb_first(&rb_root);
-    /* There was a check for empty same_kv list, so there should be something in the tree. */
-    BUG_ON(!rb_entry);
-    do {
-        iter = rb_entry(rb_entry, struct component_iterator, rb_node);
+    list_for_each(l, &iter->same_kv_head)
+    {
+        other_iter = list_entry(l, struct component_iterator, same_kv_list);
+        BUG_ON(!CVT_LEAF_VAL(other_iter->cached_entry.cvt));
         /* Continue iterating until a terminating cvt (e.g. a counter set) is found. */
-        if(castle_counter_simple_reduce(&accumulator, iter->cached_entry.cvt))
+        if(castle_counter_simple_reduce(&accumulator, other_iter->cached_entry.cvt))
             return accumulator;
-    } while((rb_entry = rb_next(&iter->rb_node)));
+    }
 
     /* Never reached a terminating cvt, assume implicit set 0. */
     return accumulator;
@@ -2003,8 +2394,8 @@ static void castle_ct_merged_iter_next(c_merged_iter_t *iter,
     /* Iterator shouldn't be running(waiting for prep_next to complete) now. */
     BUG_ON(iter->iter_running);
 
-    /* Get the smallest kv pair from RB tree. */
-    comp_iter = castle_ct_merge_iter_rbtree_min_del(iter);
+    /* Get the smallest kv pair from the tournament tree. */
+    comp_iter = castle_ct_merged_iter_tree_min_del(iter);
     BUG_ON(!comp_iter);
     debug("Smallest entry is from iterator: %p.\n", comp_iter);
 
@@ -2051,15 +2442,13 @@ static void castle_ct_merged_iter_skip(c_merged_iter_t *iter,
             comp_iter->iterator_type->skip(comp_iter->iterator, key);
     }
 
-    /* Go through the rbtree, and extract all the keys smaller than the key we
+    /* Go through the tournament tree, and extract all the keys smaller than the key we
        are skipping to. */
-    while((comp_iter = castle_ct_merged_iter_rbtree_min_get(iter)) &&
+    while((comp_iter = castle_ct_merged_iter_tree_min_get(iter)) &&
           (iter->btree->key_compare(comp_iter->cached_entry.k, key) < 0))
     {
-        /* Since the iterator is in the rb_tree, it must be cached. */
-        BUG_ON(!comp_iter->cached);
-        /* Delete from the rbtree. */
-        castle_ct_merged_iter_rbtree_del(iter, comp_iter);
+        /* Delete from the tree, together with iterators caching the same (k,v). */
+        comp_iter = castle_ct_merged_iter_tree_min_del(iter);
         /* Consume (clear cached flags & skip) from all component iterators
            on the same_kv list. */
         castle_ct_merged_iter_consume(iter, comp_iter, 1 /* skip. */, key);
@@ -2075,6 +2464,7 @@ static void castle_ct_merged_iter_cancel(c_merged_iter_t *iter)
     /* Iterator shouldn't be running(waiting for prep_next to complete) now. */
     BUG_ON(iter->iter_running);
 
+    castle_check_free(iter->tree);
     castle_check_free(iter->iterators);
 }
 
@@ -2110,7 +2500,7 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
     iter->async_iter.end_io    = NULL;
     iter->async_iter.iter_type = &castle_ct_merged_iter;
     iter->iter_running         = 0;
-    iter->rb_root              = RB_ROOT;
+    iter->tree                 = NULL;
     iter->iterators            = castle_alloc(iter->nr_iters * sizeof(struct component_iterator));
     if (iter->nr_iters && !iter->iterators)
     {
@@ -2118,6 +2508,19 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
         iter->err = -ENOMEM;
         return;
     }
+    /* Internal nodes of the tournament tree: 1 .. nr_iters-1. Node 0 is unused. */
+    if (iter->nr_iters)
+    {
+        iter->tree = castle_alloc(iter->nr_iters * sizeof(int));
+        if (!iter->tree)
+        {
+            castle_printk(LOG_WARN, "Failed to allocate memory for merged iterator.\n");
+            castle_free(iter->iterators);
+            iter->iterators = NULL;
+            iter->err = -ENOMEM;
+            return;
+        }
+    }
     iter->each_skip = each_skip;
     iter->da        = da;
     /* Memory allocated for the iterators array, init the state.
@@ -2131,13 +2534,209 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
         comp_iter->iterator      = iterators[i];
         comp_iter->iterator_type = iterator_types[i];
         comp_iter->cached        = 0;
+        comp_iter->in_tree       = 0;
         comp_iter->completed     = 0;
+        INIT_LIST_HEAD(&comp_iter->same_kv_head);
 
         if (comp_iter->iterator_type->register_cb)
             comp_iter->iterator_type->register_cb(comp_iter->iterator,
                                                   castle_ct_merged_iter_end_io,
                                                   (void *)iter);
     }
+    castle_ct_merged_iter_tree_build(iter);
+}
+
+/**
+ * In-memory iterator over an array of keys, used by the merged iterator unit tests.
+ */
+typedef struct castle_ct_array_iterator {
+    c_async_iterator_t          async_iter;
+    struct castle_btree_type   *btree;
+    void                      **keys;
+    int                         nr_keys;
+    int                         next_idx;
+} c_ct_array_iter_t;
+
+static int castle_ct_array_iter_prep_next(c_ct_array_iter_t *iter)
+{
+    return 1;
+}
+
+static int castle_ct_array_iter_has_next(c_ct_array_iter_t *iter)
+{
+    return iter->next_idx < iter->nr_keys;
+}
+
+static void castle_ct_array_iter_next(c_ct_array_iter_t *iter,
+                                      void **key_p,
+                                      c_ver_t *version_p,
+                                      c_val_tup_t *cvt_p)
+{
+    BUG_ON(!castle_ct_array_iter_has_next(iter));
+
+    *key_p     = iter->keys[iter->next_idx++];
+    *version_p = 0;
+    CVT_TOMBSTONE_INIT(*cvt_p);
+}
+
+static void castle_ct_array_iter_skip(c_ct_array_iter_t *iter, void *key)
+{
+    while (castle_ct_array_iter_has_next(iter) &&
+           iter->btree->key_compare(iter->keys[iter->next_idx], key) < 0)
+        iter->next_idx++;
+}
+
+static struct castle_iterator_type castle_ct_array_iter = {
+    .register_cb = NULL,
+    .prep_next   = (castle_iterator_prep_next_t)  castle_ct_array_iter_prep_next,
+    .has_next    = (castle_iterator_has_next_t)   castle_ct_array_iter_has_next,
+    .next        = (castle_iterator_next_t)       castle_ct_array_iter_next,
+    .skip        = (castle_iterator_skip_t)       castle_ct_array_iter_skip,
+    .cancel      = NULL,
+};
+
+/**
+ * Allocates a single dimensional key of the btree type, holding big-endian value v.
+ */
+static void* castle_ct_merged_iter_test_key_alloc(struct castle_btree_type *btree, uint64_t v)
+{
+    char buf[castle_object_btree_key_header_size(1) + sizeof(uint64_t)];
+    c_vl_bkey_t *vl_key = (c_vl_bkey_t *)buf;
+    __be64 be_v = cpu_to_be64(v);
+
+    memset(buf, 0, sizeof(buf));
+    vl_key->length      = sizeof(buf) - 4;
+    vl_key->nr_dims     = 1;
+    vl_key->dim_head[0] = KEY_DIMENSION_HEADER(castle_object_btree_key_header_size(1), 0);
+    memcpy(buf + castle_object_btree_key_header_size(1), &be_v, sizeof(be_v));
+
+    return btree->key_pack(vl_key, NULL, NULL);
+}
+
+#define MERGED_ITER_TEST_KEYS       (16384)     /**< Distinct keys, across all iterators.    */
+#define MERGED_ITER_TEST_DUP_FREQ   (16)        /**< Every n-th key is in all iterators.     */
+
+/**
+ * Merges nr_iters array iterators, checks that the output is sorted and free of
+ * duplicates, and reports the time taken per returned entry.
+ *
+ * Iterator i holds keys k such that k % nr_iters == i, and all iterators hold keys
+ * which are multiples of MERGED_ITER_TEST_DUP_FREQ (exercising same_kv handling).
+ */
+static int castle_ct_merged_iter_unit_test(int nr_iters)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(SLIM_TREE_TYPE);
+    struct castle_iterator_type **iter_types = NULL;
+    struct castle_double_array *da = NULL;
+    c_ct_array_iter_t *array_iters = NULL;
+    struct timespec start, end;
+    c_merged_iter_t miter;
+    void **iters = NULL, **keys = NULL;
+    void *key, *prev_key = NULL;
+    c_ver_t version;
+    c_val_tup_t cvt;
+    int i, k, max_keys, nr_entries = 0, ret = -ENOMEM;
+
+    max_keys = MERGED_ITER_TEST_KEYS / nr_iters + MERGED_ITER_TEST_KEYS / MERGED_ITER_TEST_DUP_FREQ + 1;
+
+    if (!(da = castle_zalloc(sizeof(struct castle_double_array))))
+        goto out;
+    da->creation_opts = CASTLE_DA_OPTS_NO_USER_TIMESTAMPING;
+    if (!(keys = castle_zalloc(MERGED_ITER_TEST_KEYS * sizeof(void *))))
+        goto out;
+    if (!(array_iters = castle_zalloc(nr_iters * sizeof(c_ct_array_iter_t))))
+        goto out;
+    if (!(iters = castle_alloc(nr_iters * sizeof(void *))))
+        goto out;
+    if (!(iter_types = castle_alloc(nr_iters * sizeof(struct castle_iterator_type *))))
+        goto out;
+
+    for (i=0; i<nr_iters; i++)
+    {
+        array_iters[i].async_iter.iter_type = &castle_ct_array_iter;
+        array_iters[i].btree = btree;
+        if (!(array_iters[i].keys = castle_alloc(max_keys * sizeof(void *))))
+            goto out;
+        iters[i]      = &array_iters[i];
+        iter_types[i] = &castle_ct_array_iter;
+    }
+
+    for (k=0; k<MERGED_ITER_TEST_KEYS; k++)
+    {
+        if (!(keys[k] = castle_ct_merged_iter_test_key_alloc(btree, k)))
+            goto out;
+        for (i=0; i<nr_iters; i++)
+            if ((k % MERGED_ITER_TEST_DUP_FREQ == 0) || (k % nr_iters == i))
+                array_iters[i].keys[array_iters[i].nr_keys++] = keys[k];
+    }
+
+    miter.nr_iters = nr_iters;
+    miter.btree    = btree;
+    castle_ct_merged_iter_init(&miter, iters, iter_types, NULL, da);
+    if ((ret = miter.err))
+        goto out;
+
+    getnstimeofday(&start);
+    while (castle_iterator_has_next_sync(&castle_ct_merged_iter, &miter))
+    {
+        castle_ct_merged_iter_next(&miter, &key, &version, &cvt);
+        if (prev_key && btree->key_compare(prev_key, key) >= 0)
+        {
+            castle_printk(LOG_ERROR, "%s::merged iterator returned out of order key.\n",
+                    __FUNCTION__);
+            ret = -EINVAL;
+            break;
+        }
+        prev_key = key;
+        nr_entries++;
+    }
+    getnstimeofday(&end);
+    castle_ct_merged_iter_cancel(&miter);
+
+    if (!ret && nr_entries != MERGED_ITER_TEST_KEYS)
+    {
+        castle_printk(LOG_ERROR, "%s::merged iterator returned %d entries, expected %d.\n",
+                __FUNCTION__, nr_entries, MERGED_ITER_TEST_KEYS);
+        ret = -EINVAL;
+    }
+
+    if (!ret)
+        castle_printk(LOG_INIT, "%s::%d iterators, %d entries, %lluns per entry.\n",
+                __FUNCTION__, nr_iters, nr_entries,
+                (timespec_to_ns(&end) - timespec_to_ns(&start)) / nr_entries);
+
+out:
+    if (keys)
+        for (k=0; k<MERGED_ITER_TEST_KEYS; k++)
+            castle_check_free(keys[k]);
+    if (array_iters)
+        for (i=0; i<nr_iters; i++)
+            castle_check_free(array_iters[i].keys);
+    castle_check_free(iter_types);
+    castle_check_free(iters);
+    castle_check_free(array_iters);
+    castle_check_free(keys);
+    castle_check_free(da);
+
+    return ret;
+}
+
+int castle_da_merged_iter_unit_tests_do(void)
+{
+    int test_seq_id = 0;
+    int err = 0;
+
+    test_seq_id++; if (0 != (err = castle_ct_merged_iter_unit_test(2)) ) goto fail;
+    test_seq_id++; if (0 != (err = castle_ct_merged_iter_unit_test(8)) ) goto fail;
+    test_seq_id++; if (0 != (err = castle_ct_merged_iter_unit_test(32)) ) goto fail;
+
+    BUG_ON(err);
+    castle_printk(LOG_INIT, "%s::%d tests passed.\n", __FUNCTION__, test_seq_id);
+    return 0;
+fail:
+    castle_printk(LOG_ERROR, "%s::test %d failed with return code %d.\n",
+            __FUNCTION__, test_seq_id, err);
+    return err;
 }
 
 
@@ -2485,6 +3084,10 @@ static inline int castle_da_rq_iter_ct_relevant(struct castle_da_cts_proxy_ct *p
          * partition key - it can't have any relevant results. */
         return 0;
 
+    if (!castle_ct_key_range_overlaps(proxy_ct->ct, btree, start_key, end_key))
+        /* Skip this tree if its keys all fall outside of the range. */
+        return 0;
+
     if (!CT_BLOOM_EXISTS(proxy_ct->ct))
         /* Query all trees that do not have bloom filters. */
         return 1;
@@ -2685,25 +3288,148 @@ void castle_da_rq_iter_init(c_da_rq_iter_t *iter,
     if (castle_da_rq_iter_relevant_cts_get(iter, start_key, end_key) != 0)
         goto alloc_fail2;
 
-    /* The remainder of the iterator initialisation is done asynchronously.
-     * See _castle_da_rq_iter_init() for more details. */
+    /* The remainder of the iterator initialisation is done asynchronously.
+     * See _castle_da_rq_iter_init() for more details. */
+
+    return;
+
+alloc_fail2:
+    if (iter->cts_proxy)
+    {
+        castle_da_cts_proxy_put(iter->cts_proxy);
+        iter->cts_proxy = NULL;
+    }
+alloc_fail:
+    iter->err = -ENOMEM;
+
+    /* If we set-up backup, destroy the state. */
+    if (flags & CASTLE_RING_FLAG_INC_BACKUP)
+        castle_da_incremental_backup_finish(da, iter->err);
+backup_fail:
+    init_cb(private);
+}
+
+/**
+ * Pick keys splitting a range query into roughly equal sub-ranges.
+ *
+ * @param   da_id       DA to split the range query for
+ * @param   start_key   Range query start key (packed)
+ * @param   end_key     Range query end key (packed)
+ * @param   nr_ranges   Number of sub-ranges wanted
+ * @param   split_keys  Array of (nr_ranges - 1) entries to return split keys in
+ *
+ * Keys are taken from the root node of the largest immutable CT in the DA.  These
+ * are the separators for the subtrees underneath the root, so the sub-ranges they
+ * delimit cover similar numbers of leaf nodes of (at least) that tree.  Split keys
+ * are returned in ascending order, each strictly between start_key and end_key.
+ * Sub-range i covers the keys after split_keys[i-1], up to and including
+ * split_keys[i].  Caller frees the keys with btree->key_dealloc().
+ *
+ * Reads the root node synchronously, so may sleep.
+ *
+ * @return  Number of split keys returned, 0 if the range can't be split
+ * @return  -ENOMEM on allocation failure
+ */
+int castle_da_rq_iter_split_keys_get(c_da_t da_id,
+                                     void *start_key,
+                                     void *end_key,
+                                     int nr_ranges,
+                                     void **split_keys)
+{
+    struct castle_component_tree *ct = NULL;
+    struct castle_da_cts_proxy *proxy;
+    struct castle_double_array *da;
+    struct castle_btree_type *btree;
+    struct castle_btree_node *node;
+    void **keys = NULL, *key;
+    int i, nr_keys, nr_split = 0;
+    c2_block_t *c2b;
+
+    if (nr_ranges < 2)
+        return 0;
+
+    da = castle_da_hash_get(da_id);
+    BUG_ON(!da);
+    btree = castle_btree_type_get(da->btree_type);
+
+    proxy = castle_da_cts_proxy_get(da);
+    if (!proxy)
+        return -ENOMEM;
+
+    /* Find the largest immutable tree.  T0s are still changing and trees with
+     * redirection partitions are mid-merge, neither have a stable root. */
+    for (i = 0; i < proxy->nr_cts; i++)
+    {
+        struct castle_component_tree *cand = proxy->cts[i].ct;
+
+        if (CT_DYNAMIC(cand) || proxy->cts[i].state != NO_REDIR
+                || EXT_POS_INVAL(cand->root_node))
+            continue;
+        if (!ct || atomic64_read(&cand->item_count) > atomic64_read(&ct->item_count))
+            ct = cand;
+    }
+    if (!ct || atomic_read(&ct->tree_depth) < 1)
+        goto out;
 
-    return;
+    c2b = castle_cache_block_get(ct->root_node,
+                                 ct->node_sizes[atomic_read(&ct->tree_depth) - 1],
+                                 USER);
+    if (castle_cache_block_sync_read(c2b))
+    {
+        put_c2b(c2b);
+        goto out;
+    }
+    read_lock_c2b(c2b);
+    node = c2b_bnode(c2b);
+    BUG_ON(node->magic != BTREE_NODE_MAGIC);
+    if (!node->used)
+        goto out_unlock;
 
-alloc_fail2:
-    if (iter->cts_proxy)
+    /* Collect the distinct keys strictly inside the range.  Entries for the same
+     * key in different versions are adjacent. */
+    keys = castle_alloc(node->used * sizeof(void *));
+    if (!keys)
     {
-        castle_da_cts_proxy_put(iter->cts_proxy);
-        iter->cts_proxy = NULL;
+        nr_split = -ENOMEM;
+        goto out_unlock;
+    }
+    for (i = 0, nr_keys = 0; i < node->used; i++)
+    {
+        btree->entry_get(node, i, &key, NULL, NULL);
+        if (btree->key_compare(key, start_key) <= 0)
+            continue;
+        if (btree->key_compare(key, end_key) >= 0)
+            break;
+        if (nr_keys && btree->key_compare(key, keys[nr_keys - 1]) == 0)
+            continue;
+        keys[nr_keys++] = key;
     }
-alloc_fail:
-    iter->err = -ENOMEM;
 
-    /* If we set-up backup, destroy the state. */
-    if (flags & CASTLE_RING_FLAG_INC_BACKUP)
-        castle_da_incremental_backup_finish(da, iter->err);
-backup_fail:
-    init_cb(private);
+    /* Space the split keys evenly through the candidates. */
+    if (nr_ranges > nr_keys + 1)
+        nr_ranges = nr_keys + 1;
+    for (i = 1; i < nr_ranges; i++)
+    {
+        key = keys[(i * nr_keys) / nr_ranges];
+        split_keys[nr_split] = btree->key_copy(key, NULL, NULL);
+        if (!split_keys[nr_split])
+        {
+            while (nr_split--)
+                btree->key_dealloc(split_keys[nr_split]);
+            nr_split = -ENOMEM;
+            goto out_unlock;
+        }
+        nr_split++;
+    }
+
+out_unlock:
+    read_unlock_c2b(c2b);
+    put_c2b(c2b);
+    castle_check_free(keys);
+out:
+    castle_da_cts_proxy_put(proxy);
+
+    return nr_split;
 }
 
 struct castle_iterator_type castle_da_rq_iter = {
@@ -3073,9 +3799,9 @@ static int castle_da_iterators_create(struct castle_da_merge *merge)
                             &(curr_comp->cached_entry.k),
                             &(curr_comp->cached_entry.v),
                             &(curr_comp->cached_entry.cvt));
-                    /* Restore the rbtree */
+                    /* Restore the tournament tree */
                     /* Assume we should never serialise on a deleted kv pair */
-                    castle_ct_merged_iter_rbtree_insert(merge->merged_iter, curr_comp);
+                    castle_ct_merged_iter_tree_insert(merge->merged_iter, curr_comp);
                 } /* replenished cache */
             } /* restored curr_c2b */
             else
@@ -4032,13 +4758,158 @@ static int castle_da_merge_extent_grow(c_ext_free_t     *ext_free,
     return 0;
 }
 
+/**
+ * Copy total_blocks of medium object data from old_cep to new_cep.
+ *
+ * Reads are done in (up to) chunk-sized units, aligned to chunk boundaries where
+ * the object is large enough to make it worthwhile.
+ */
+static void castle_da_medium_obj_blocks_copy(c_ext_pos_t old_cep,
+                                             c_ext_pos_t new_cep,
+                                             int total_blocks)
+{
+    int blocks;
+    c2_block_t *s_c2b, *c_c2b;
+
+    while (total_blocks > 0)
+    {
+        int chk_off, pgs_to_end;
+
+        /* Chunk-align blocks if total_blocks is large enough to make it worthwhile. */
+        chk_off = CHUNK_OFFSET(old_cep.offset);
+        if (chk_off)
+            pgs_to_end = (C_CHK_SIZE - chk_off) >> PAGE_SHIFT;
+
+        /* Be careful about subtraction, if it goes negative, and is compared to
+           BLKS_PER_CHK the test is likely not to work correctly. */
+        if (chk_off && (total_blocks >= 2*BLKS_PER_CHK + pgs_to_end))
+            /* Align for a minimum of 2 full blocks (1 can be inefficient) */
+            blocks = pgs_to_end;
+        else if (total_blocks > BLKS_PER_CHK)
+            blocks = BLKS_PER_CHK;
+        else
+            blocks = total_blocks;
+        total_blocks -= blocks;
+
+        s_c2b = castle_cache_block_get(old_cep, blocks, MERGE_IN);
+        c_c2b = castle_cache_block_get(new_cep, blocks, MERGE_OUT);
+        castle_cache_advise(s_c2b->cep, C2_ADV_PREFETCH, MERGE_IN, 0);
+        BUG_ON(castle_cache_block_sync_read(s_c2b));
+        read_lock_c2b(s_c2b);
+        write_lock_c2b(c_c2b);
+        update_c2b(c_c2b);
+        memcpy(c2b_buffer(c_c2b), c2b_buffer(s_c2b), blocks * PAGE_SIZE);
+        dirty_c2b(c_c2b);
+        write_unlock_c2b(c_c2b);
+        read_unlock_c2b(s_c2b);
+        put_c2b(c_c2b);
+        put_c2b_and_demote(s_c2b);
+        old_cep.offset += blocks * PAGE_SIZE;
+        new_cep.offset += blocks * PAGE_SIZE;
+    }
+}
+
+/**
+ * Medium object copy queued on the castle_da_mo workqueue.
+ *
+ * @also castle_da_medium_obj_copy()
+ */
+struct castle_da_mo_copy {
+    struct castle_da_merge     *merge;
+    c_ext_pos_t                 old_cep;        /**< Object in input tree data extent.      */
+    c_ext_pos_t                 new_cep;        /**< Space allocated in output data extent. */
+    int                         nr_blocks;
+    struct work_struct          work;
+};
+
+static void castle_da_medium_obj_copy_work(struct work_struct *work)
+{
+    struct castle_da_mo_copy *copy = container_of(work, struct castle_da_mo_copy, work);
+    struct castle_da_merge *merge = copy->merge;
+
+    castle_da_medium_obj_blocks_copy(copy->old_cep, copy->new_cep, copy->nr_blocks);
+    castle_free(copy);
+
+    /* Decrement and wakeup under the lock: once the waiter sees the count drop it may
+       free the merge, so merge must not be touched after the lock is released. */
+    spin_lock(&merge->mo_copies_lock);
+    if (--merge->mo_copies_inflight < castle_merge_mo_copy_depth)
+        wake_up(&merge->mo_copies_wq);
+    spin_unlock(&merge->mo_copies_lock);
+}
+
+/**
+ * Checks whether fewer than limit medium object copies are in flight for the merge.
+ */
+static int castle_da_medium_obj_copies_below(struct castle_da_merge *merge, int limit)
+{
+    int below;
+
+    spin_lock(&merge->mo_copies_lock);
+    below = (merge->mo_copies_inflight < limit);
+    spin_unlock(&merge->mo_copies_lock);
+
+    return below;
+}
+
+/**
+ * Wait for all outstanding medium object copies of the merge to complete.
+ *
+ * Must be called before anything that exposes the output tree data extent: partition
+ * redirection (readers), serialisation (checkpoint) and the end of each merge unit
+ * (merge completion, T0 unhardpin).
+ */
+static void castle_da_medium_obj_copies_wait(struct castle_da_merge *merge)
+{
+    wait_event(merge->mo_copies_wq, castle_da_medium_obj_copies_below(merge, 1));
+}
+
+/**
+ * Queue copy of a medium object to one of the request CPUs.
+ *
+ * Blocks while castle_merge_mo_copy_depth copies are already in flight.
+ *
+ * @return 0        Copy has been queued
+ * @return -ENOMEM  Failed to allocate copy structure, caller should copy synchronously
+ */
+static int castle_da_medium_obj_copy_queue(struct castle_da_merge *merge,
+                                           c_ext_pos_t old_cep,
+                                           c_ext_pos_t new_cep,
+                                           int nr_blocks)
+{
+    struct castle_da_mo_copy *copy;
+    int cpu;
+
+    copy = castle_alloc(sizeof(struct castle_da_mo_copy));
+    if (!copy)
+        return -ENOMEM;
+
+    copy->merge     = merge;
+    copy->old_cep   = old_cep;
+    copy->new_cep   = new_cep;
+    copy->nr_blocks = nr_blocks;
+    CASTLE_INIT_WORK(&copy->work, castle_da_medium_obj_copy_work);
+
+    wait_event(merge->mo_copies_wq,
+               castle_da_medium_obj_copies_below(merge, castle_merge_mo_copy_depth));
+    spin_lock(&merge->mo_copies_lock);
+    merge->mo_copies_inflight++;
+    spin_unlock(&merge->mo_copies_lock);
+
+    /* Spread copies across request CPUs, away from the merge thread. */
+    merge->mo_copy_cpu_idx = (merge->mo_copy_cpu_idx + 1) % castle_double_array_request_cpus();
+    cpu = request_cpus.cpus[merge->mo_copy_cpu_idx];
+    BUG_ON(!queue_work_on(cpu, castle_da_wqs[CASTLE_DA_MO_COPY_WQ], &copy->work));
+
+    return 0;
+}
+
 static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
                                              c_val_tup_t old_cvt)
 {
     c_ext_pos_t old_cep, new_cep;
     c_val_tup_t new_cvt;
-    int total_blocks, blocks, i;
-    c2_block_t *s_c2b, *c_c2b;
+    int total_blocks, i;
     c_byte_off_t ext_space_needed;
 
     old_cep = old_cvt.cep;
@@ -4065,7 +4936,11 @@ static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
 
     /* Don't copy if data extent is marked not to merge. */
     if (castle_data_ext_should_drain(old_cvt.cep.ext_id, merge) == -1)
+    {
+        atomic64_add(NR_BLOCKS(old_cvt.length) * C_BLK_SIZE,
+                     &merge->da->stats.value_log.mo_linked_bytes);
         return old_cvt;
+    }
 
     /* Should have a valid data extent. */
     BUG_ON(EXT_ID_INVAL(merge->out_tree_constr->tree->data_ext_free.ext_id));
@@ -4085,51 +4960,21 @@ static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
     new_cvt = old_cvt;
     new_cvt.cep = new_cep;
 
-    /* Do the actual copy. */
+    /* Do the actual copy.  Destination space is already allocated, so the data can be
+       copied asynchronously while the merge thread carries on adding entries. */
     debug("Copying "cep_fmt_str" to "cep_fmt_str_nl,
             cep2str(old_cep), cep2str(new_cep));
 
-    while (total_blocks > 0)
-    {
-        int chk_off, pgs_to_end;
-
-        /* Chunk-align blocks if total_blocks is large enough to make it worthwhile. */
-        chk_off = CHUNK_OFFSET(old_cep.offset);
-        if (chk_off)
-            pgs_to_end = (C_CHK_SIZE - chk_off) >> PAGE_SHIFT;
-
-        /* Be careful about subtraction, if it goes negative, and is compared to
-           BLKS_PER_CHK the test is likely not to work correctly. */
-        if (chk_off && (total_blocks >= 2*BLKS_PER_CHK + pgs_to_end))
-            /* Align for a minimum of 2 full blocks (1 can be inefficient) */
-            blocks = pgs_to_end;
-        else if (total_blocks > BLKS_PER_CHK)
-            blocks = BLKS_PER_CHK;
-        else
-            blocks = total_blocks;
-        total_blocks -= blocks;
-
-        s_c2b = castle_cache_block_get(old_cep, blocks, MERGE_IN);
-        c_c2b = castle_cache_block_get(new_cep, blocks, MERGE_OUT);
-        castle_cache_advise(s_c2b->cep, C2_ADV_PREFETCH, MERGE_IN, 0);
-        BUG_ON(castle_cache_block_sync_read(s_c2b));
-        read_lock_c2b(s_c2b);
-        write_lock_c2b(c_c2b);
-        update_c2b(c_c2b);
-        memcpy(c2b_buffer(c_c2b), c2b_buffer(s_c2b), blocks * PAGE_SIZE);
-        dirty_c2b(c_c2b);
-        write_unlock_c2b(c_c2b);
-        read_unlock_c2b(s_c2b);
-        put_c2b(c_c2b);
-        put_c2b_and_demote(s_c2b);
-        old_cep.offset += blocks * PAGE_SIZE;
-        new_cep.offset += blocks * PAGE_SIZE;
-    }
+    if (castle_merge_mo_copy_depth <= 0
+            || castle_da_medium_obj_copy_queue(merge, old_cep, new_cep, total_blocks))
+        castle_da_medium_obj_blocks_copy(old_cep, new_cep, total_blocks);
 
     /* Update stats for Data extent stats. */
     castle_data_extent_update(new_cvt.cep.ext_id, NR_BLOCKS(new_cvt.length) * C_BLK_SIZE, 1);
     castle_data_extent_update(old_cvt.cep.ext_id, NR_BLOCKS(old_cvt.length) * C_BLK_SIZE, 0);
     merge->nr_bytes += NR_BLOCKS(old_cvt.length) * C_BLK_SIZE;
+    atomic64_add(NR_BLOCKS(old_cvt.length) * C_BLK_SIZE,
+                 &merge->da->stats.value_log.mo_copied_bytes);
 
     debug("Finished copy, i=%d\n", i);
 
@@ -4653,6 +5498,9 @@ static void castle_da_merge_node_complete_cb(struct castle_immut_tree_construct
      * key to next node. */
     merge->out_tree_constr->btree->entry_get(node, node->used - 1, &key, NULL, NULL);
 
+    /* Readers may be redirected to the output tree, its medium objects must be in place. */
+    castle_da_medium_obj_copies_wait(merge);
+
     castle_da_merge_new_partition_update(merge, node_c2b, key);
 }
 
@@ -4928,6 +5776,22 @@ static void castle_da_merge_sysfs_cleanup(struct castle_da_merge *merge, int err
         castle_sysfs_ct_del(ct);
 }
 
+/**
+ * Free the cached key range of a CT, @see castle_ct_key_range_set().
+ */
+static void castle_ct_key_range_free(struct castle_component_tree *ct)
+{
+    struct castle_btree_type *btree;
+
+    if (!CT_KEY_RANGE_KNOWN(ct))
+        return;
+
+    btree = castle_btree_type_get(ct->btree_type);
+    btree->key_dealloc(ct->min_key);
+    btree->key_dealloc(ct->max_key);
+    clear_bit(CASTLE_CT_KEY_RANGE_BIT, &ct->flags);
+}
+
 void castle_ct_dealloc(struct castle_component_tree *ct)
 {
     struct list_head *lh, *t;
@@ -4946,9 +5810,116 @@ void castle_ct_dealloc(struct castle_component_tree *ct)
 
     list_del(&ct->hash_list);
     castle_check_free(ct->data_exts);
+    castle_ct_key_range_free(ct);
     castle_free(ct);
 }
 
+/**
+ * Read the smallest and largest keys of an immutable CT.
+ *
+ * Leaf nodes of immutable trees are laid out in key order in the tree extent, so
+ * the range comes from the first entry of the first leaf and the last entry of the
+ * last leaf.
+ *
+ * Doesn't need the transaction lock, but the caller must keep the tree extent from
+ * being shrunk underneath, either by holding the lock or a reference to the extent
+ * taken while the CT wasn't being merged.
+ *
+ * @return 0        Keys copied into keys[0] (min) and keys[1] (max)
+ * @return -ENOENT  CT is dynamic or has no entries
+ * @return -ENOMEM  Failed to allocate key copies
+ */
+static int castle_ct_key_range_read(struct castle_component_tree *ct, void *keys[2])
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    uint16_t node_size = ct->node_sizes[0];
+    struct castle_btree_node *node;
+    c_byte_off_t used;
+    c_ext_pos_t cep;
+    c2_block_t *c2b;
+    void *key;
+    int i;
+
+    keys[0] = keys[1] = NULL;
+
+    used = atomic64_read(&ct->tree_ext_free.used);
+    if (CT_DYNAMIC(ct) || !atomic64_read(&ct->item_count) || !used)
+        return -ENOENT;
+
+    for (i = 0; i < 2; i++)
+    {
+        cep.ext_id = ct->tree_ext_free.ext_id;
+        cep.offset = i ? used - (c_byte_off_t)node_size * C_BLK_SIZE : 0;
+
+        c2b = castle_cache_block_get(cep, node_size, MERGE_IN);
+        BUG_ON(castle_cache_block_sync_read(c2b));
+        read_lock_c2b(c2b);
+        node = c2b_bnode(c2b);
+        BUG_ON(node->magic != BTREE_NODE_MAGIC);
+        BUG_ON(!BTREE_NODE_IS_LEAF(node) || !node->used);
+        btree->entry_get(node, i ? node->used - 1 : 0, &key, NULL, NULL);
+        keys[i] = btree->key_copy(key, NULL, NULL);
+        read_unlock_c2b(c2b);
+        put_c2b(c2b);
+
+        if (!keys[i])
+            goto err_out;
+    }
+
+    return 0;
+
+err_out:
+    if (keys[0])
+        btree->key_dealloc(keys[0]);
+
+    return -ENOMEM;
+}
+
+/**
+ * Cache key range read by castle_ct_key_range_read() in the CT.
+ *
+ * Once set, readers may skip the CT for keys outside of the range, @see
+ * CT_KEY_RANGE_KNOWN().  Keys are freed if the range got set in the meantime.
+ * Serialised by the transaction lock.
+ */
+static void castle_ct_key_range_set(struct castle_component_tree *ct, void *keys[2])
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+
+    BUG_ON(!CASTLE_IN_TRANSACTION);
+
+    if (CT_KEY_RANGE_KNOWN(ct))
+    {
+        btree->key_dealloc(keys[0]);
+        btree->key_dealloc(keys[1]);
+        return;
+    }
+
+    ct->min_key = keys[0];
+    ct->max_key = keys[1];
+    /* Publish the keys before the flag, readers don't take locks. */
+    smp_wmb();
+    set_bit(CASTLE_CT_KEY_RANGE_BIT, &ct->flags);
+}
+
+/**
+ * Can CT contain keys in [start_key, end_key].
+ *
+ * @return 1 if it can, or the key range of the CT isn't known
+ */
+static inline int castle_ct_key_range_overlaps(struct castle_component_tree *ct,
+                                               struct castle_btree_type *btree,
+                                               void *start_key,
+                                               void *end_key)
+{
+    if (!CT_KEY_RANGE_KNOWN(ct))
+        return 1;
+    smp_rmb();
+
+    return btree->key_compare(end_key, ct->min_key) >= 0
+        && btree->key_compare(start_key, ct->max_key) <= 0;
+}
+
 static void castle_da_merge_cts_release(struct castle_da_merge *merge, int err)
 {
     int i;
@@ -5009,7 +5980,7 @@ static void castle_da_merge_trees_cleanup(struct castle_da_merge *merge, int err
         {
             struct castle_large_obj_entry *lo = list_entry(lh, struct castle_large_obj_entry, list);
 
-            castle_extent_unlink(lo->ext_id);
+            castle_large_obj_unlink(lo->cep, lo->length);
         }
     }
 
@@ -5608,15 +6579,15 @@ static int castle_da_entry_do(struct castle_da_merge *merge,
         cvt = castle_da_medium_obj_copy(merge, cvt);
     else if (CVT_LARGE_OBJECT(cvt))
     {
-        atomic64_add(castle_extent_size_get(cvt.cep.ext_id), &out_tree->large_ext_chk_cnt);
+        atomic64_add((cvt.length - 1) / C_CHK_SIZE + 1, &out_tree->large_ext_chk_cnt);
         /* No need to add Large Objects under lock as merge is done in sequence. No concurrency
          * issues on the tree. With merge serialisation, checkpoint thread uses the list on
          * the output tree, which is only spliced in da_merge_marshall (under serdes lock) and
          * da_merge_package (which explicitly takes serdes lock).*/
         /* Adding LO to a temp list, wait for merge_serialise to splice when appropriate, or
            da_merge_package to do final splice. */
-        castle_ct_large_obj_add(cvt.cep.ext_id, cvt.length, &merge->new_large_objs, NULL);
-        BUG_ON(castle_extent_link(cvt.cep.ext_id) < 0);
+        castle_ct_large_obj_add(cvt.cep, cvt.length, &merge->new_large_objs, NULL);
+        BUG_ON(castle_large_obj_link(cvt.cep, cvt.length) < 0);
         debug("%s::large object ("cep_fmt_str") for da %d level %d.\n",
             __FUNCTION__, cep2str(cvt.cep), da->id, merge->level);
     }
@@ -5847,6 +6818,9 @@ static int castle_da_merge_unit_do(struct castle_da_merge *merge,
            castle_da_merge_unit_with_resolver_do(merge, max_nr_bytes) :
            castle_da_merge_unit_without_resolver_do(merge, max_nr_bytes);
 
+    /* Complete all medium object copies issued by this unit. */
+    castle_da_medium_obj_copies_wait(merge);
+
     if(hardpin)
     {
         /* Unhard-pin T1s in the cache. Do this before we deallocate the merge and extents. */
@@ -5867,7 +6841,90 @@ int check_dext_list(c_ext_id_t ext_id, c_ext_id_t *list, uint32_t size)
         if (list[i] == ext_id)
             return 1;
 
-    return 0;
+    return 0;
+}
+
+/**
+ * Should an in-kernel merge garbage collect (drain) a value log data extent.
+ *
+ * Bytes of medium objects that were overwritten, deleted or copied out by earlier merges
+ * are accounted as drained bytes, @see castle_data_extent_update().
+ *
+ * @return 1 if the live data in the extent dropped below castle_value_log_gc_pct
+ */
+static int castle_data_ext_gc_needed(c_ext_id_t ext_id)
+{
+    uint64_t nr_bytes, nr_drain_bytes, nr_entries;
+
+    castle_data_ext_size_get(ext_id, &nr_bytes, &nr_drain_bytes, &nr_entries);
+
+    /* Nothing live left, draining frees the extent. */
+    if (!nr_entries || !nr_bytes)
+        return 1;
+
+    return ((nr_bytes - nr_drain_bytes) * 100 < (uint64_t)castle_value_log_gc_pct * nr_bytes);
+}
+
+/**
+ * Build the list of data extents an in-kernel merge of in_trees should drain.
+ *
+ * All data extents are drained, unless the DA was created with CASTLE_DA_OPTS_VALUE_LOG.
+ * Medium objects of value log DAs stay in their data extents, which merges link to the
+ * output tree, until the extent is picked for garbage collection by
+ * castle_data_ext_gc_needed().
+ *
+ * @param   da          [in]    Doubling array
+ * @param   in_trees    [in]    Trees to be merged
+ * @param   nr_trees    [in]    Number of trees to be merged
+ * @param   data_exts   [out]   List of extents to drain, NULL if empty
+ *
+ * @return  Number of extents on the list, -ENOMEM on allocation failure
+ */
+static int castle_da_merge_drain_exts_get(struct castle_double_array *da,
+                                          struct castle_component_tree **in_trees,
+                                          int nr_trees,
+                                          c_ext_id_t **data_exts)
+{
+    int value_log = !!(da->creation_opts & CASTLE_DA_OPTS_VALUE_LOG);
+    int i, j, nr_data_exts, k;
+
+    *data_exts = NULL;
+
+    nr_data_exts = 0;
+    for (i=0; i<nr_trees; i++)
+        nr_data_exts += in_trees[i]->nr_data_exts;
+    if (nr_data_exts == 0)
+        return 0;
+
+    *data_exts = castle_zalloc(nr_data_exts * sizeof(c_ext_id_t));
+    if (!*data_exts)
+        return -ENOMEM;
+
+    k = 0;
+    for (i=0; i<nr_trees; i++)
+        for (j=0; j<in_trees[i]->nr_data_exts; j++)
+        {
+            c_ext_id_t ext_id = in_trees[i]->data_exts[j];
+
+            if (value_log && !castle_data_ext_gc_needed(ext_id))
+                continue;
+            if (check_dext_list(ext_id, *data_exts, k))
+                continue;
+
+            (*data_exts)[k++] = ext_id;
+        }
+
+    if (value_log)
+        debug_dexts("%s: DA=%d draining %d of %d data extents\n",
+                __FUNCTION__, da->id, k, nr_data_exts);
+
+    if (k == 0)
+    {
+        castle_free(*data_exts);
+        *data_exts = NULL;
+    }
+
+    return k;
 }
 
 /**
@@ -6304,6 +7361,11 @@ static struct castle_da_merge* castle_da_merge_alloc(int
 
     merge->skipped_count                = 0;
 
+    spin_lock_init(&merge->mo_copies_lock);
+    merge->mo_copies_inflight = 0;
+    init_waitqueue_head(&merge->mo_copies_wq);
+    merge->mo_copy_cpu_idx              = 0;
+
     merge->redirection_partition.node_c2b     = NULL;
     merge->redirection_partition.key          = NULL;
 
@@ -6643,6 +7705,9 @@ static void castle_da_merge_serialise(struct castle_da_merge *merge, int using_t
 
         if( is_new_key ) /* -- T2a -- */
         {
+            /* Serialised output tree must not reference medium objects still being copied. */
+            castle_da_medium_obj_copies_wait(merge);
+
             /* Here we need transaction lock because we want to guarantee synchronization btwn
             merge serdes state, version stats, ct stats etc, and also to protect the merge
             mstore package checkpointable structure. */
@@ -6845,7 +7910,7 @@ static void castle_da_merge_marshall(struct castle_da_merge *merge,
         {
             struct castle_large_obj_entry *lo =
                 list_entry(lh, struct castle_large_obj_entry, list);
-            int lo_ref_cnt = castle_extent_link_count_get(lo->ext_id);
+            int lo_ref_cnt = castle_large_obj_link_count_get(lo->cep);
             /* we expect the input cct and output cct to both have reference to the LO ext */
             BUG_ON(lo_ref_cnt < 2);
             lo_count++;
@@ -7039,7 +8104,7 @@ static void castle_da_merge_struct_deser(struct castle_da_merge *merge,
     {
         struct castle_large_obj_entry *lo =
             list_entry(lh, struct castle_large_obj_entry, list);
-        BUG_ON(castle_extent_link(lo->ext_id) < 0);
+        BUG_ON(castle_large_obj_link(lo->cep, lo->length) < 0);
     }
     mutex_unlock(&des_tree->lo_mutex);
 
@@ -7224,6 +8289,8 @@ static int castle_da_merge_do(struct castle_da_merge *merge, uint64_t nr_bytes)
 {
     struct castle_double_array *da = merge->da;
     int level = merge->level;
+    void *keys[2];
+    int keys_read;
     int ret;
 
     /* Check for FS stop and merge abort due to DA deletion. */
@@ -7262,6 +8329,18 @@ static int castle_da_merge_do(struct castle_da_merge *merge, uint64_t nr_bytes)
         return ret;
     }
 
+    /* Read the output tree key range before taking the transaction lock, the end
+       leaves are still likely to be in the cache.  The leaf under construction is
+       write locked by the merge, drop it for the duration of the read.  Leaf
+       entries don't change when the tree gets completed. */
+    keys_read = 0;
+    if (ret == EXIT_SUCCESS)
+    {
+        castle_merge_sleep_prepare(merge);
+        keys_read = !castle_ct_key_range_read(merge->out_tree_constr->tree, keys);
+        castle_merge_sleep_return(merge);
+    }
+
     /* If merge is terminating due to successful completion, or an error
        do the remaining work under transaction lock in order not to race with checkpoint. */
     CASTLE_TRANSACTION_BEGIN;
@@ -7274,6 +8353,10 @@ static int castle_da_merge_do(struct castle_da_merge *merge, uint64_t nr_bytes)
         /* Finish packaging the output tree. */
         castle_immut_tree_complete(merge->out_tree_constr);
 
+        /* Let reads skip the output tree for keys outside of its range. */
+        if (keys_read)
+            castle_ct_key_range_set(merge->out_tree_constr->tree, keys);
+
         /* update list of large objects */
         /* in transaction, so won't race against checkpoint - safe to proceed without locks */
         list_splice_init(&merge->new_large_objs, &merge->out_tree_constr->tree->large_objs);
@@ -7333,7 +8416,7 @@ static int castle_da_l1_merge_trigger(struct castle_double_array *da, int nr_tre
  */
 static int castle_da_l1_merge_run(void *da_p)
 {
-    int i, j, k, ignore, ret, nr_trees = 1, level = 1;
+    int i, ignore, ret, nr_trees = 1, level = 1;
     struct castle_double_array *da = (struct castle_double_array *)da_p;
     struct castle_component_tree *in_trees[nr_trees];
     struct castle_da_merge *merge = NULL;
@@ -7364,17 +8447,9 @@ static int castle_da_l1_merge_run(void *da_p)
         if(ret == -EAGAIN)
             continue;
 
-        nr_data_exts = 0;
         for (i=0; i<nr_trees; i++)
-        {
             BUG_ON(!MERGE_ID_INVAL(in_trees[i]->merge_id));
-            nr_data_exts += in_trees[i]->nr_data_exts;
-        }
 
-        data_exts = castle_zalloc(nr_data_exts * sizeof(c_ext_id_t));
-        BUG_ON(!data_exts);
-
-        k = 0;
         for (i = 0; i < nr_trees; i++)
         {
             /* Truncate extents so during merge we don't over-prefetch. */
@@ -7390,11 +8465,10 @@ static int castle_da_l1_merge_run(void *da_p)
                                    USED_CHUNK(atomic64_read(&in_trees[i]->tree_ext_free.used)));
             castle_extent_truncate(in_trees[i]->data_ext_free.ext_id,
                                    USED_CHUNK(atomic64_read(&in_trees[i]->data_ext_free.used)));
-
-            for (j = 0; j < in_trees[i]->nr_data_exts; j++)
-                data_exts[k++] = in_trees[i]->data_exts[j];
         }
-        BUG_ON(k != nr_data_exts);
+
+        nr_data_exts = castle_da_merge_drain_exts_get(da, in_trees, nr_trees, &data_exts);
+        BUG_ON(nr_data_exts < 0);
 
         merge = castle_da_merge_alloc(nr_trees, level, da, INVAL_MERGE_ID, in_trees,
                                       nr_data_exts, data_exts);
@@ -7459,6 +8533,9 @@ static int castle_da_l1_merge_run(void *da_p)
 
         castle_trace_da_merge(TRACE_END, TRACE_DA_MERGE_ID, da->id, level, 0, 0);
 
+        /* New array above level 1, let the merge policy have a look. */
+        castle_da_merge_policy_kick(da);
+
     } while(1);
 
     debug_merges("Merge thread exiting.\n");
@@ -7958,6 +9035,15 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id, c_da_opts_t opt
     /* set up creation-time DA options */
     da->creation_opts = opts;
 
+    /* Large object pools. */
+    spin_lock_init(&da->lo_pools_lock);
+    INIT_LIST_HEAD(&da->lo_pools);
+    da->lo_pools_cursor = NULL;
+
+    /* In-kernel merge policy. */
+    da->policy_merge_id = INVAL_MERGE_ID;
+    CASTLE_INIT_WORK(&da->policy_work, castle_da_merge_policy_work);
+
     /* Set default tombstone discard realtime threshold */
     atomic64_set(&da->tombstone_discard_threshold_time_s,
             CASTLE_TOMBSTONE_DISCARD_TD_DEFAULT);
@@ -7970,6 +9056,8 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id, c_da_opts_t opt
     atomic64_set(&da->stats.user_timestamps.merge_discards, 0);
     atomic64_set(&da->stats.user_timestamps.ct_max_uts_negatives, 0);
     atomic64_set(&da->stats.user_timestamps.ct_max_uts_false_positives, 0);
+    atomic64_set(&da->stats.value_log.mo_copied_bytes, 0);
+    atomic64_set(&da->stats.value_log.mo_linked_bytes, 0);
 
     castle_printk(LOG_USERINFO, "Allocated DA=%d successfully with creation opts 0x%llx.\n",
             da_id, opts);
@@ -8024,102 +9112,497 @@ struct castle_component_tree* castle_component_tree_get(tree_seq_t seq)
  * @param   head    List head to add ct after (or NULL)
  * @param   in_init Set if we are adding a just demarshalled CT from disk
  *
- * WARNING: Caller must hold da->lock
+ * WARNING: Caller must hold da->lock
+ */
+static void castle_component_tree_add(struct castle_double_array *da,
+                                      struct castle_component_tree *ct,
+                                      struct list_head *head)
+{
+    struct castle_component_tree *cmp_ct;
+
+    BUG_ON(da != ct->da);
+    BUG_ON(ct->level >= MAX_DA_LEVEL);
+    BUG_ON(read_can_lock(&da->lock));
+    BUG_ON(!CASTLE_IN_TRANSACTION);
+
+    /* CTs are sorted by decreasing seq number (newer trees towards the front
+     * of the list) to guarantee newest values are returned during gets.
+     *
+     * Levels 0,1 are a special case as their seq numbers are 'prefixed' with
+     * the cpu_index.  This means an older CT would appear before a newer CT if
+     * it had a greater cpu_index prefixed.
+     *
+     * At level 0 this is valid because inserts are disjoint (they go to a
+     * specific CT based on the key->cpu_index hash).
+     * At level 1 this is valid because CTs from a given cpu_index are still in
+     * order, and for the same reasons it is valid at level 0.
+     *
+     * Skip ordering checks during init (we sort the tree afterwards). */
+    if (!head)
+    {
+        struct list_head *l;
+
+        list_for_each(l, &da->levels[ct->level].trees)
+        {
+            cmp_ct = list_entry(l, struct castle_component_tree, da_list);
+            if (castle_da_ct_compare(ct, cmp_ct) > 0)
+                break; /* list_for_each() */
+            head = l;
+        }
+
+        if (!head)  head = &da->levels[ct->level].trees;
+    }
+
+    /* CT seq should be < head->next seq (skip if head is the last elephant) */
+    if (!list_is_last(head, &da->levels[ct->level].trees))
+    {
+        cmp_ct = list_entry(head->next, struct castle_component_tree, da_list);
+        BUG_ON(castle_da_ct_compare(ct, cmp_ct) <= 0);
+    }
+
+    list_add(&ct->da_list, head);
+    da->levels[ct->level].nr_trees++;
+    da->nr_trees++;
+
+    if (ct->level > da->top_level)
+    {
+        da->top_level = ct->level;
+        castle_printk(LOG_INFO, "DA: %d growing one level to %d\n", da->id, ct->level);
+    }
+}
+
+/**
+ * Unlink ct from da->level[ct->level].trees list.
+ */
+static void castle_component_tree_del(struct castle_double_array *da,
+                                      struct castle_component_tree *ct)
+{
+    BUG_ON(da != ct->da);
+    BUG_ON(read_can_lock(&da->lock));
+    BUG_ON(!CASTLE_IN_TRANSACTION);
+
+    list_del(&ct->da_list);
+    ct->da_list.next = NULL;
+    ct->da_list.prev = NULL;
+    da->levels[ct->level].nr_trees--;
+    da->nr_trees--;
+}
+
+/**
+ * Promote ct to next level.
+ *
+ * @param   da      Doubling array to promote ct in
+ * @param   level   CT to promote
+ * @param   in_init Set if we are adding a just demarshalled CT from disk
+ */
+static void castle_component_tree_promote(struct castle_double_array *da,
+                                          struct castle_component_tree *ct)
+{
+    castle_component_tree_del(da, ct);
+    ct->level++;
+
+    /* If promoting to level-1 assign it a data age. */
+    if (ct->level == 1)
+        ct->data_age = atomic64_inc_return(&castle_next_tree_data_age);
+
+    castle_ct_stats_commit(ct);
+
+    castle_component_tree_add(da, ct, NULL /* append */);
+}
+
+/**********************************************************************************************/
+/* Large object pools. */
+
+static void castle_lo_pool_ext_free(struct castle_lo_pool_ext *pool)
+{
+    castle_check_free(pool->frozen);
+    castle_check_free(pool->pending);
+    castle_check_free(pool->refs);
+    castle_free(pool);
+}
+
+static struct castle_lo_pool_ext* castle_lo_pool_ext_alloc(c_ext_id_t                  ext_id,
+                                                           struct castle_double_array *da,
+                                                           c_chk_cnt_t                 size)
+{
+    struct castle_lo_pool_ext *pool;
+
+    pool = castle_zalloc(sizeof(struct castle_lo_pool_ext));
+    if (!pool)
+        return NULL;
+
+    pool->refs    = castle_zalloc(size * sizeof(uint32_t));
+    pool->pending = castle_zalloc(BITS_TO_LONGS(size) * sizeof(unsigned long));
+    pool->frozen  = castle_zalloc(BITS_TO_LONGS(size) * sizeof(unsigned long));
+    if (!pool->refs || !pool->pending || !pool->frozen)
+    {
+        castle_lo_pool_ext_free(pool);
+        return NULL;
+    }
+
+    pool->ext_id  = ext_id;
+    pool->da_id   = da->id;
+    pool->da      = da;
+    pool->size    = size;
+    pool->nr_used = 0;
+    pool->nr_free = size;
+    pool->dead    = 0;
+    spin_lock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->da_list);
+
+    return pool;
+}
+
+/**
+ * Make a pool extent available to castle_da_lo_pool_alloc(), and allocate from it next.
+ */
+static void castle_da_lo_pool_add(struct castle_lo_pool_ext *pool)
+{
+    struct castle_double_array *da = pool->da;
+    unsigned long flags;
+
+    spin_lock_irqsave(&da->lo_pools_lock, flags);
+    list_add(&pool->da_list, &da->lo_pools);
+    da->lo_pools_cursor = pool;
+    spin_unlock_irqrestore(&da->lo_pools_lock, flags);
+}
+
+static void castle_da_lo_pool_del(struct castle_lo_pool_ext *pool)
+{
+    struct castle_double_array *da = pool->da;
+    unsigned long flags;
+
+    spin_lock_irqsave(&da->lo_pools_lock, flags);
+    list_del(&pool->da_list);
+    if (da->lo_pools_cursor == pool)
+        da->lo_pools_cursor = NULL;
+    spin_unlock_irqrestore(&da->lo_pools_lock, flags);
+}
+
+/**
+ * Find nr_chunks consecutive reusable chunks in a pool extent and reference them.
+ *
+ * @return First chunk of the range, -1 if there is no big enough free range
+ */
+static int castle_lo_pool_ext_range_get(struct castle_lo_pool_ext *pool, c_chk_cnt_t nr_chunks)
+{
+    c_chk_cnt_t chk, run;
+    unsigned long flags;
+    int first = -1;
+
+    spin_lock_irqsave(&pool->lock, flags);
+    if (pool->dead || (pool->nr_free < nr_chunks))
+        goto out;
+
+    for (chk=0, run=0; chk<pool->size; chk++)
+    {
+        if (pool->refs[chk] || test_bit(chk, pool->pending) || test_bit(chk, pool->frozen))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == nr_chunks)
+        {
+            first = chk + 1 - nr_chunks;
+            break;
+        }
+    }
+    if (first < 0)
+        goto out;
+
+    for (chk=first; chk<first+nr_chunks; chk++)
+        pool->refs[chk] = 1;
+    pool->nr_used += nr_chunks;
+    pool->nr_free -= nr_chunks;
+
+out:
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return first;
+}
+
+/**
+ * Drop a reference on a chunk range of a pool extent.
+ *
+ * Released chunks become reusable after the next checkpoint.  The extent is unlinked once no
+ * chunk is referenced any more.
+ */
+static void castle_lo_pool_ext_range_put(struct castle_lo_pool_ext *pool,
+                                         c_chk_t first,
+                                         c_chk_cnt_t nr_chunks)
+{
+    unsigned long flags;
+    c_chk_t chk;
+    int dead;
+
+    BUG_ON(first + nr_chunks > pool->size);
+
+    spin_lock_irqsave(&pool->lock, flags);
+    for (chk=first; chk<first+nr_chunks; chk++)
+    {
+        BUG_ON(pool->refs[chk] == 0);
+        if (--pool->refs[chk] == 0)
+        {
+            set_bit(chk, pool->pending);
+            pool->nr_used--;
+        }
+    }
+    dead = pool->dead = (pool->nr_used == 0);
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    if (!dead)
+        return;
+
+    debug("%s::releasing large object pool extent %llu\n", __FUNCTION__, pool->ext_id);
+    /* The extent layer keeps the extent around until it is no longer on disk checkpoints. */
+    castle_da_lo_pool_del(pool);
+    castle_lo_pools_hash_remove(pool);
+    castle_extent_unlink(pool->ext_id);
+    castle_lo_pool_ext_free(pool);
+}
+
+/**
+ * Allocate nr_chunks from one of the DA's pool extents.
+ *
+ * The pool extent last allocated from is tried first.  Others are only searched for a free
+ * range if their free chunk count is big enough.  Holding lo_pools_lock keeps pools from
+ * being freed, @see castle_lo_pool_ext_range_put().
+ *
+ * @return 0 on success, -ENOSPC if no pool extent has a big enough free range
+ */
+static int castle_da_lo_pool_alloc(struct castle_double_array *da,
+                                   c_chk_cnt_t nr_chunks,
+                                   c_ext_pos_t *cep)
+{
+    struct castle_lo_pool_ext *pool = NULL, *cursor;
+    struct list_head *l;
+    unsigned long flags;
+    int first = -1;
+
+    spin_lock_irqsave(&da->lo_pools_lock, flags);
+    cursor = da->lo_pools_cursor;
+    if (cursor && ((first = castle_lo_pool_ext_range_get(cursor, nr_chunks)) >= 0))
+        pool = cursor;
+    else
+    {
+        list_for_each(l, &da->lo_pools)
+        {
+            pool = list_entry(l, struct castle_lo_pool_ext, da_list);
+
+            /* Unlocked read of nr_free, range_get() rechecks it. */
+            if ((pool == cursor) || (pool->nr_free < nr_chunks))
+                continue;
+            if ((first = castle_lo_pool_ext_range_get(pool, nr_chunks)) >= 0)
+                break;
+        }
+    }
+    if (first >= 0)
+    {
+        da->lo_pools_cursor = pool;
+        cep->ext_id = pool->ext_id;
+        cep->offset = (c_byte_off_t)first * C_CHK_SIZE;
+    }
+    spin_unlock_irqrestore(&da->lo_pools_lock, flags);
+
+    return (first >= 0) ? 0 : -ENOSPC;
+}
+
+/**
+ * Allocate space for a large object of given length.
+ *
+ * Objects of up to castle_lo_pool_max_chunks chunks are packed into pool extents shared with
+ * other large objects of the same DA, bigger objects get an extent each.  Either way, the
+ * caller owns one link to the object, @see castle_large_obj_unlink().
+ *
+ * @return 0 on success, -ENOSPC otherwise
+ */
+int castle_large_obj_alloc(struct castle_double_array *da, uint64_t length, c_ext_pos_t *cep)
+{
+    c_chk_cnt_t nr_chunks = (length - 1) / C_CHK_SIZE + 1;
+    int max_chunks = castle_lo_pool_max_chunks, pool_size = castle_lo_pool_ext_chunks;
+    struct castle_lo_pool_ext *pool;
+    c_ext_id_t ext_id;
+
+    if ((max_chunks <= 0) || (nr_chunks > max_chunks) || (pool_size <= (int)nr_chunks))
+        goto own_extent;
+
+    if (castle_da_lo_pool_alloc(da, nr_chunks, cep) == 0)
+        return 0;
+
+    /* No room in existing pool extents, start a new one.  Concurrent allocators may each
+       start one, the spare room gets used by later objects. */
+    ext_id = castle_extent_alloc(castle_get_rda_lvl(),
+                                 da->id,
+                                 EXT_T_LARGE_OBJECT,
+                                 pool_size, 0,  /* Not in transaction. */
+                                 NULL, NULL);
+    if (EXT_ID_INVAL(ext_id))
+        goto own_extent;
+
+    pool = castle_lo_pool_ext_alloc(ext_id, da, pool_size);
+    if (!pool)
+    {
+        castle_extent_free(ext_id);
+        goto own_extent;
+    }
+    BUG_ON(castle_lo_pool_ext_range_get(pool, nr_chunks) != 0);
+    castle_lo_pools_hash_add(pool);
+    castle_da_lo_pool_add(pool);
+    debug("%s::new large object pool extent %llu for da %d\n", __FUNCTION__, ext_id, da->id);
+
+    cep->ext_id = ext_id;
+    cep->offset = 0;
+
+    return 0;
+
+own_extent:
+    memset(cep, 0, sizeof(c_ext_pos_t));
+    cep->ext_id = castle_extent_alloc(castle_get_rda_lvl(),
+                                      da->id,
+                                      EXT_T_LARGE_OBJECT,
+                                      nr_chunks, 0,  /* Not in transaction. */
+                                      NULL, NULL);
+
+    return EXT_ID_INVAL(cep->ext_id) ? -ENOSPC : 0;
+}
+
+/**
+ * Take an additional link to a large object.
+ */
+int castle_large_obj_link(c_ext_pos_t cep, uint64_t length)
+{
+    struct castle_lo_pool_ext *pool = castle_lo_pools_hash_get(cep.ext_id);
+    c_chk_cnt_t nr_chunks = (length - 1) / C_CHK_SIZE + 1;
+    unsigned long flags;
+    c_chk_t chk;
+
+    if (!pool)
+        return castle_extent_link(cep.ext_id);
+
+    spin_lock_irqsave(&pool->lock, flags);
+    for (chk=CHUNK(cep.offset); chk<CHUNK(cep.offset)+nr_chunks; chk++)
+    {
+        /* Shouldn't link to a released object. */
+        BUG_ON(pool->refs[chk] == 0);
+        pool->refs[chk]++;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return 0;
+}
+
+/**
+ * Drop a link to a large object.  Dropping the last link frees the space.
+ */
+void castle_large_obj_unlink(c_ext_pos_t cep, uint64_t length)
+{
+    struct castle_lo_pool_ext *pool = castle_lo_pools_hash_get(cep.ext_id);
+
+    if (!pool)
+    {
+        castle_extent_unlink(cep.ext_id);
+        return;
+    }
+
+    castle_lo_pool_ext_range_put(pool, CHUNK(cep.offset), (length - 1) / C_CHK_SIZE + 1);
+}
+
+/**
+ * Number of links to a large object.
+ */
+static int castle_large_obj_link_count_get(c_ext_pos_t cep)
+{
+    struct castle_lo_pool_ext *pool = castle_lo_pools_hash_get(cep.ext_id);
+
+    if (!pool)
+        return castle_extent_link_count_get(cep.ext_id);
+
+    return pool->refs[CHUNK(cep.offset)];
+}
+
+/**
+ * Re-create pool extent state for a pooled large object read from the mstore.
+ *
+ * Like extent link counts, chunk refcounts restart from 1 no matter how many trees refer to
+ * the object.  Merge deserialisation re-takes links for its output tree.
  */
-static void castle_component_tree_add(struct castle_double_array *da,
-                                      struct castle_component_tree *ct,
-                                      struct list_head *head)
+static int castle_large_obj_pool_restore(struct castle_lolist_entry *mstore_entry,
+                                         struct castle_double_array *da)
 {
-    struct castle_component_tree *cmp_ct;
-
-    BUG_ON(da != ct->da);
-    BUG_ON(ct->level >= MAX_DA_LEVEL);
-    BUG_ON(read_can_lock(&da->lock));
-    BUG_ON(!CASTLE_IN_TRANSACTION);
+    c_chk_cnt_t nr_chunks = (mstore_entry->length - 1) / C_CHK_SIZE + 1;
+    struct castle_lo_pool_ext *pool;
+    c_chk_t chk;
 
-    /* CTs are sorted by decreasing seq number (newer trees towards the front
-     * of the list) to guarantee newest values are returned during gets.
-     *
-     * Levels 0,1 are a special case as their seq numbers are 'prefixed' with
-     * the cpu_index.  This means an older CT would appear before a newer CT if
-     * it had a greater cpu_index prefixed.
-     *
-     * At level 0 this is valid because inserts are disjoint (they go to a
-     * specific CT based on the key->cpu_index hash).
-     * At level 1 this is valid because CTs from a given cpu_index are still in
-     * order, and for the same reasons it is valid at level 0.
-     *
-     * Skip ordering checks during init (we sort the tree afterwards). */
-    if (!head)
+    pool = castle_lo_pools_hash_get(mstore_entry->ext_id);
+    if (!pool)
     {
-        struct list_head *l;
+        pool = castle_lo_pool_ext_alloc(mstore_entry->ext_id,
+                                        da,
+                                        castle_extent_size_get(mstore_entry->ext_id));
+        if (!pool)
+            return -ENOMEM;
+        castle_lo_pools_hash_add(pool);
+        castle_da_lo_pool_add(pool);
+    }
+    BUG_ON(pool->da_id != da->id);
+    BUG_ON(mstore_entry->pool_chk + nr_chunks > pool->size);
 
-        list_for_each(l, &da->levels[ct->level].trees)
+    for (chk=mstore_entry->pool_chk; chk<mstore_entry->pool_chk+nr_chunks; chk++)
+        if (pool->refs[chk] == 0)
         {
-            cmp_ct = list_entry(l, struct castle_component_tree, da_list);
-            if (castle_da_ct_compare(ct, cmp_ct) > 0)
-                break; /* list_for_each() */
-            head = l;
+            pool->refs[chk] = 1;
+            pool->nr_used++;
+            pool->nr_free--;
         }
 
-        if (!head)  head = &da->levels[ct->level].trees;
-    }
-
-    /* CT seq should be < head->next seq (skip if head is the last elephant) */
-    if (!list_is_last(head, &da->levels[ct->level].trees))
-    {
-        cmp_ct = list_entry(head->next, struct castle_component_tree, da_list);
-        BUG_ON(castle_da_ct_compare(ct, cmp_ct) <= 0);
-    }
+    return 0;
+}
 
-    list_add(&ct->da_list, head);
-    da->levels[ct->level].nr_trees++;
-    da->nr_trees++;
+static int castle_lo_pool_freeze(struct castle_lo_pool_ext *pool, void *unused)
+{
+    unsigned long flags;
+    int i;
 
-    if (ct->level > da->top_level)
+    spin_lock_irqsave(&pool->lock, flags);
+    for (i=0; i<BITS_TO_LONGS(pool->size); i++)
     {
-        da->top_level = ct->level;
-        castle_printk(LOG_INFO, "DA: %d growing one level to %d\n", da->id, ct->level);
+        pool->frozen[i] |= pool->pending[i];
+        pool->pending[i] = 0;
     }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return 0;
 }
 
-/**
- * Unlink ct from da->level[ct->level].trees list.
- */
-static void castle_component_tree_del(struct castle_double_array *da,
-                                      struct castle_component_tree *ct)
+static int castle_lo_pool_thaw(struct castle_lo_pool_ext *pool, void *unused)
 {
-    BUG_ON(da != ct->da);
-    BUG_ON(read_can_lock(&da->lock));
-    BUG_ON(!CASTLE_IN_TRANSACTION);
+    unsigned long flags;
 
-    list_del(&ct->da_list);
-    ct->da_list.next = NULL;
-    ct->da_list.prev = NULL;
-    da->levels[ct->level].nr_trees--;
-    da->nr_trees--;
+    spin_lock_irqsave(&pool->lock, flags);
+    pool->nr_free += bitmap_weight(pool->frozen, pool->size);
+    memset(pool->frozen, 0, BITS_TO_LONGS(pool->size) * sizeof(unsigned long));
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return 0;
 }
 
 /**
- * Promote ct to next level.
+ * Make pool chunks released before the last checkpoint writeback reusable.  The checkpoint
+ * no longer references them, and has been completed.
  *
- * @param   da      Doubling array to promote ct in
- * @param   level   CT to promote
- * @param   in_init Set if we are adding a just demarshalled CT from disk
+ * @also castle_double_arrays_writeback()
  */
-static void castle_component_tree_promote(struct castle_double_array *da,
-                                          struct castle_component_tree *ct)
+void castle_large_obj_pools_post_checkpoint(void)
 {
-    castle_component_tree_del(da, ct);
-    ct->level++;
-
-    /* If promoting to level-1 assign it a data age. */
-    if (ct->level == 1)
-        ct->data_age = atomic64_inc_return(&castle_next_tree_data_age);
+    castle_lo_pools_hash_iterate(castle_lo_pool_thaw, NULL);
+}
 
-    castle_ct_stats_commit(ct);
+static int castle_lo_pool_remove(struct castle_lo_pool_ext *pool, void *unused)
+{
+    __castle_lo_pools_hash_remove(pool);
+    castle_lo_pool_ext_free(pool);
 
-    castle_component_tree_add(da, ct, NULL /* append */);
+    return 0;
 }
 
 static void castle_ct_large_obj_writeback(struct castle_large_obj_entry *lo,
@@ -8128,9 +9611,15 @@ static void castle_ct_large_obj_writeback(struct castle_large_obj_entry *lo,
 {
     struct castle_lolist_entry mstore_entry;
 
-    mstore_entry.ext_id = lo->ext_id;
+    memset(&mstore_entry, 0, sizeof(struct castle_lolist_entry));
+    mstore_entry.ext_id = lo->cep.ext_id;
     mstore_entry.length = lo->length;
     mstore_entry.ct_seq = ct->seq;
+    if (castle_lo_pools_hash_get(lo->cep.ext_id))
+    {
+        mstore_entry.pool_magic = LO_POOL_MAGIC;
+        mstore_entry.pool_chk   = CHUNK(lo->cep.offset);
+    }
 
     castle_mstore_entry_insert(store,
                                &mstore_entry,
@@ -8144,8 +9633,8 @@ static void __castle_ct_large_obj_remove(struct list_head *lh)
     /* Remove LO from list. */
     list_del(&lo->list);
 
-    /* Unlink LO extent from this CT. If it from merge, the output CT could hold a link to it. */
-    castle_extent_unlink(lo->ext_id);
+    /* Unlink LO from this CT. If it from merge, the output CT could hold a link to it. */
+    castle_large_obj_unlink(lo->cep, lo->length);
 
     /* Free memory. */
     castle_free(lo);
@@ -8156,7 +9645,7 @@ static void __castle_ct_large_obj_remove(struct list_head *lh)
  * this gets called for only LO replaces.
  * Also this remove blocks new LO insertions as it is holding the mutex. Instead it might be a
  * good idea to not maintain LO list for T0. (that would make T0 persistence hard) */
-int castle_ct_large_obj_remove(c_ext_id_t           ext_id,
+int castle_ct_large_obj_remove(c_ext_pos_t          cep,
                                struct list_head    *lo_list_head,
                                struct mutex        *mutex)
 {
@@ -8171,7 +9660,7 @@ int castle_ct_large_obj_remove(c_ext_id_t           ext_id,
     {
         struct castle_large_obj_entry *lo = list_entry(lh, struct castle_large_obj_entry, list);
 
-        if (lo->ext_id == ext_id)
+        if (EXT_POS_EQUAL(lo->cep, cep))
         {
             /* Remove LO from list. */
             __castle_ct_large_obj_remove(lh);
@@ -8193,21 +9682,21 @@ static void castle_ct_large_objs_remove(struct list_head *lo_list_head)
         __castle_ct_large_obj_remove(lh);
 }
 
-int castle_ct_large_obj_add(c_ext_id_t              ext_id,
+int castle_ct_large_obj_add(c_ext_pos_t             cep,
                             uint64_t                length,
                             struct list_head       *head,
                             struct mutex           *mutex)
 {
     struct castle_large_obj_entry *lo;
 
-    if (EXT_ID_INVAL(ext_id))
+    if (EXT_ID_INVAL(cep.ext_id))
         return -EINVAL;
 
     lo = castle_alloc(sizeof(struct castle_large_obj_entry));
     if (!lo)
         return -ENOMEM;
 
-    lo->ext_id = ext_id;
+    lo->cep    = cep;
     lo->length = length;
 
     if (mutex) mutex_lock(mutex);
@@ -8691,6 +10180,8 @@ void castle_ct_put(struct castle_component_tree *ct, int rw)
     if (CT_BLOOM_EXISTS(ct))
         castle_bloom_destroy(&ct->bloom);
 
+    castle_ct_key_range_free(ct);
+
     /* Poison ct (note this will be repoisoned by kfree on kernel debug build. */
     memset(ct, 0xde, sizeof(struct castle_component_tree));
     castle_free(ct);
@@ -9040,6 +10531,12 @@ static void castle_data_exts_hash_destroy(void)
     castle_free(castle_data_exts_hash);
 }
 
+static void castle_lo_pools_hash_destroy(void)
+{
+    __castle_lo_pools_hash_iterate(castle_lo_pool_remove, NULL);
+    castle_free(castle_lo_pools_hash);
+}
+
 struct castle_da_writeback_mstores {
     struct castle_mstore *da_store;
     struct castle_mstore *tree_store;
@@ -9192,11 +10689,11 @@ static void __castle_da_merge_writeback(struct castle_da_merge *merge,
         {
             struct castle_large_obj_entry *lo =
                 list_entry(lh, struct castle_large_obj_entry, list);
-            int lo_ref_cnt = castle_extent_link_count_get(lo->ext_id);
+            int lo_ref_cnt = castle_large_obj_link_count_get(lo->cep);
             /* input ct and/or output ct will have ref */
             BUG_ON(lo_ref_cnt < 1);
-            debug("%s::writeback lo at ext %d\n", __FUNCTION__,
-                    lo->ext_id);
+            debug("%s::writeback lo at "cep_fmt_str_nl, __FUNCTION__,
+                    cep2str(lo->cep));
             castle_ct_large_obj_writeback(lo, ct, mstores->lo_store);
         }
         mutex_unlock(&ct->lo_mutex);
@@ -9378,6 +10875,9 @@ void castle_double_arrays_writeback(void)
         goto out;
     }
 
+    /* Chunks released from large object pools so far aren't referenced by this checkpoint. */
+    castle_lo_pools_hash_iterate(castle_lo_pool_freeze, NULL);
+
     __castle_da_hash_iterate(castle_da_writeback, &mstores);
 
     /* Writeback all the merges. */
@@ -9554,6 +11054,7 @@ int castle_double_array_start(void)
     /* Check all DAs to see whether any merges need to be done. */
     castle_da_hash_iterate(castle_da_merge_start, NULL);
     castle_da_hash_iterate(castle_da_merge_restart, NULL);
+    castle_da_hash_iterate(castle_da_merge_policy_start, NULL);
 
     return 0;
 }
@@ -9945,6 +11446,7 @@ int castle_double_array_read(void)
     struct castle_mstore_iter *iterator = NULL;
     struct castle_double_array *da;
     size_t mstore_dentry_size, mstore_loentry_size;
+    c_ext_pos_t lo_cep;
     int ret = 0;
     debug("%s::start.\n", __FUNCTION__);
 
@@ -10031,7 +11533,15 @@ int castle_double_array_read(void)
                     mstore_loentry.ext_id, mstore_loentry.ct_seq);
             BUG();
         }
-        if (castle_ct_large_obj_add(mstore_loentry.ext_id,
+        lo_cep.ext_id = mstore_loentry.ext_id;
+        lo_cep.offset = 0;
+        if (mstore_loentry.pool_magic == LO_POOL_MAGIC)
+        {
+            lo_cep.offset = (c_byte_off_t)mstore_loentry.pool_chk * C_CHK_SIZE;
+            if (castle_large_obj_pool_restore(&mstore_loentry, ct->da))
+                goto error_out;
+        }
+        if (castle_ct_large_obj_add(lo_cep,
                                     mstore_loentry.length,
                                     &ct->large_objs, NULL))
         {
@@ -11103,6 +12613,13 @@ static struct castle_component_tree* castle_da_cts_proxy_ct_next(struct castle_d
     {
         proxy_ct = &proxy->cts[i];
 
+        if (!castle_ct_key_range_overlaps(proxy_ct->ct,
+                                          castle_btree_type_get(proxy->btree_type),
+                                          key,
+                                          key))
+            /* Key falls outside of the CT, no need to query its bloom filter. */
+            continue;
+
         if (proxy_ct->pk)
         {
             /* CT has a partition key. */
@@ -11800,8 +13317,9 @@ int castle_double_array_init(void)
     }
 
     /* Initialise modlist iter mergesort buffer based on cache size.
-     * As a minimum we need to be able to merge two full T0s. */
-    min_budget = 2 * MAX_DYNAMIC_TREE_SIZE * C_CHK_SIZE;            /* Two full T0s. */
+     * As a minimum we need to be able to merge two full T0s.  Allow as much
+     * again for their entry indexes. */
+    min_budget = 4 * MAX_DYNAMIC_TREE_SIZE * C_CHK_SIZE;            /* Two full T0s. */
     budget     = (castle_cache_size_get() * PAGE_SIZE) / 10;        /* 10% of cache. */
     if (budget < min_budget)
         budget = min_budget;
@@ -11840,16 +13358,23 @@ int castle_double_array_init(void)
     if(!castle_data_exts_hash)
         goto err5;
 
+    castle_lo_pools_hash = castle_lo_pools_hash_alloc();
+    if(!castle_lo_pools_hash)
+        goto err6;
+
     castle_da_hash_init();
     castle_ct_hash_init();
     castle_merge_threads_hash_init();
     castle_merges_hash_init();
     castle_data_exts_hash_init();
+    castle_lo_pools_hash_init();
 
     castle_da_cts_proxy_timer_fire(1);
 
     return 0;
 
+err6:
+    castle_free(castle_data_exts_hash);
 err5:
     castle_free(castle_merges_hash);
 err4:
@@ -11901,6 +13426,7 @@ void castle_double_array_fini(void)
     castle_da_hash_destroy();
     castle_ct_hash_destroy();
     castle_data_exts_hash_destroy();
+    castle_lo_pools_hash_destroy();
 
     castle_free(request_cpus.cpus);
 
@@ -12245,6 +13771,13 @@ static int castle_merge_run(void *_data)
         /* Check if merge completed successfully. */
         if (!ret)
         {
+            /* Arrays have changed, let the merge policy pick the next merge. */
+            CASTLE_TRANSACTION_BEGIN;
+            if (merge_thread->merge_id == da->policy_merge_id)
+                da->policy_merge_id = INVAL_MERGE_ID;
+            CASTLE_TRANSACTION_END;
+            castle_da_merge_policy_kick(da);
+
             if (castle_ct_hash_get(out_tree_seq))
                 castle_events_merge_work_finished(merge_thread->da->id,
                                                   merge_thread->merge_id,
@@ -12268,6 +13801,18 @@ static int castle_merge_run(void *_data)
                                               merge_thread->work_id,
                                               merge->nr_bytes - prev_nr_bytes,
                                               MERGE_NOT_COMPLETED);
+
+            /* Merges driven by the in-kernel merge policy queue their own next unit.
+               policy_merge_id and work ids are protected by the transaction lock. */
+            CASTLE_TRANSACTION_BEGIN;
+            if ((ret == EAGAIN)
+                    && (merge_thread->merge_id == da->policy_merge_id)
+                    && !castle_ctrl_prog_present())
+            {
+                merge_thread->work_id       = castle_merge_max_work_id++;
+                merge_thread->cur_work_size = castle_da_merge_policy_work_bytes();
+            }
+            CASTLE_TRANSACTION_END;
         }
 
     } while(1);
@@ -12520,6 +14065,8 @@ int castle_merge_start(c_merge_cfg_t *merge_cfg, c_merge_id_t *merge_id, int lev
         goto err_out;
     }
     castle_check_free(in_trees);
+    /* Merge owns the data extents list now, it gets freed with the merge. */
+    merge_cfg->data_exts = NULL;
 
     ret = castle_da_merge_init(merge, NULL);
     if (ret < 0)
@@ -12669,6 +14216,298 @@ err_out:
     return ret;
 }
 
+/**
+ * In-kernel merge policy.
+ *
+ * DAs created with a CASTLE_DA_OPTS_MERGE_POLICY_* option merge their arrays above level 1
+ * without a control program.  The policy runs whenever those arrays change (level 1 merge
+ * or policy merge completion, and FS start) and starts at most one merge per DA through
+ * castle_merge_start().  Policy merges then feed themselves work units from
+ * castle_merge_run().  Nothing is done while a control program is present.
+ */
+
+/**
+ * Work unit size for merges driven by the merge policy.
+ */
+static c_work_size_t castle_da_merge_policy_work_bytes(void)
+{
+    return (c_work_size_t)max(castle_merge_policy_work_size, 1) << 20;
+}
+
+/**
+ * Schedule a merge policy run for the DA.
+ *
+ * Runs are queued on a single CPU, so at most one runs at a time for each DA.
+ */
+static void castle_da_merge_policy_kick(struct castle_double_array *da)
+{
+    if (!(da->creation_opts & CASTLE_DA_OPTS_MERGE_POLICY_MASK))
+        return;
+
+    /* Reference for the work, dropped if it was already queued. */
+    castle_da_get(da);
+    if (!queue_work_on(request_cpus.cpus[0], castle_da_wqs[0], &da->policy_work))
+        castle_da_put(da);
+}
+
+/**
+ * Kick the merge policy for DA, for castle_da_hash_iterate().
+ */
+static int castle_da_merge_policy_start(struct castle_double_array *da, void *unused)
+{
+    castle_da_merge_policy_kick(da);
+
+    return 0;
+}
+
+/**
+ * Take over a merge above level 1 of the DA, for castle_merges_hash_iterate().
+ *
+ * E.g. a merge deserialised on FS start, or left behind by a control program.
+ */
+static int castle_da_merge_policy_adopt(struct castle_da_merge *merge, void *da_p)
+{
+    struct castle_double_array *da = da_p;
+
+    if ((merge->da != da) || (merge->level < MIN_DA_SERDES_LEVEL))
+        return 0;
+
+    da->policy_merge_id = merge->id;
+
+    return 1;
+}
+
+/**
+ * Keep the DA's policy merge going, if there is one.
+ *
+ * Issues a work unit if the merge thread is idle, e.g. because a control program
+ * stopped driving it.
+ *
+ * @return 1    Policy merge still in progress
+ * @return 0    No merge in progress, the policy may start one
+ */
+static int castle_da_merge_policy_resume(struct castle_double_array *da)
+{
+    struct castle_merge_thread *merge_thread;
+    struct castle_da_merge *merge;
+    c_work_id_t work_id;
+
+    /* Merges are deallocated in transaction lock, which also protects policy_merge_id. */
+    CASTLE_TRANSACTION_BEGIN;
+    if (MERGE_ID_INVAL(da->policy_merge_id))
+        castle_merges_hash_iterate(castle_da_merge_policy_adopt, da);
+    if (MERGE_ID_INVAL(da->policy_merge_id))
+    {
+        CASTLE_TRANSACTION_END;
+
+        return 0;
+    }
+
+    merge = castle_merges_hash_get(da->policy_merge_id);
+    if (!merge)
+    {
+        da->policy_merge_id = INVAL_MERGE_ID;
+        CASTLE_TRANSACTION_END;
+
+        return 0;
+    }
+
+    if (!THREAD_ID_INVAL(merge->thread_id))
+    {
+        merge_thread = castle_merge_threads_hash_get(merge->thread_id);
+        if (merge_thread && !merge_thread->cur_work_size)
+            castle_merge_do_work(merge->id, castle_da_merge_policy_work_bytes(), &work_id);
+    }
+    CASTLE_TRANSACTION_END;
+
+    return 1;
+}
+
+/**
+ * Mark merge policy arrays whose key range overlaps no other array's.
+ *
+ * Key ranges that aren't cached yet are worked out for CTs not being merged.  Arrays
+ * with unknown ranges are assumed to overlap everything.
+ */
+static void castle_da_merge_policy_disjoint_set(struct castle_component_tree **cts,
+                                                struct castle_merge_policy_array *arrays,
+                                                uint32_t nr_arrays)
+{
+    struct castle_btree_type *btree;
+    c_ext_mask_id_t *masks;
+    void *keys[2];
+    uint32_t i, j;
+
+    masks = castle_alloc(nr_arrays * sizeof(c_ext_mask_id_t));
+
+    /* Merges (which shrink their input trees) only start in transaction lock.  Pin the
+       tree extents of CTs not being merged, so the leaves can be read without it. */
+    CASTLE_TRANSACTION_BEGIN;
+    for (i = 0; masks && (i < nr_arrays); i++)
+    {
+        masks[i] = INVAL_MASK_ID;
+        if (!cts[i]->merge && !CT_KEY_RANGE_KNOWN(cts[i]))
+            masks[i] = castle_extent_get(cts[i]->tree_ext_free.ext_id);
+    }
+    CASTLE_TRANSACTION_END;
+
+    for (i = 0; masks && (i < nr_arrays); i++)
+    {
+        if (MASK_ID_INVAL(masks[i]))
+            continue;
+
+        if (castle_ct_key_range_read(cts[i], keys) == 0)
+        {
+            CASTLE_TRANSACTION_BEGIN;
+            castle_ct_key_range_set(cts[i], keys);
+            CASTLE_TRANSACTION_END;
+        }
+        castle_extent_put(masks[i]);
+    }
+    castle_check_free(masks);
+
+    for (i = 0; i < nr_arrays; i++)
+    {
+        arrays[i].disjoint = 0;
+        if (!CT_KEY_RANGE_KNOWN(cts[i]))
+            continue;
+
+        btree = castle_btree_type_get(cts[i]->btree_type);
+        for (j = 0; j < nr_arrays; j++)
+            if (j != i && castle_ct_key_range_overlaps(cts[j], btree,
+                                                       cts[i]->min_key, cts[i]->max_key))
+                break;
+        arrays[i].disjoint = (j == nr_arrays);
+    }
+}
+
+/**
+ * Run the merge policy for a DA and start the merge it picks.
+ *
+ * - Snapshot arrays above level 1 (newest first) with their sizes and whether they
+ *   can be merged
+ * - Work out which arrays are key-disjoint from the rest, those are left alone
+ * - Ask castle_merge_policy_select() for a contiguous run of arrays
+ * - Start the merge and issue its first work unit (or just log it, in dry run mode)
+ */
+static void castle_da_merge_policy_work(struct work_struct *work)
+{
+    struct castle_double_array *da = container_of(work, struct castle_double_array, policy_work);
+    struct castle_merge_policy_array *arrays = NULL;
+    struct castle_component_tree **cts = NULL;
+    struct castle_merge_policy_cfg cfg;
+    c_array_id_t *array_ids = NULL;
+    c_merge_cfg_t merge_cfg;
+    c_merge_id_t merge_id;
+    c_work_id_t work_id;
+    uint32_t nr_arrays, nr_cts = 0, first, nr, i;
+    struct list_head *l;
+    int ret;
+
+    if (exit_cond || castle_ctrl_prog_present())
+        goto out;
+
+    if (castle_da_merge_policy_resume(da))
+        goto out;
+
+    castle_merge_policy_cfg_get(da->creation_opts, &cfg);
+
+    read_lock(&da->lock);
+    nr_arrays = 0;
+    list_for_each(l, &da->levels[2].trees)
+        nr_arrays++;
+    read_unlock(&da->lock);
+    if (nr_arrays < 2)
+        goto out;
+
+    arrays = castle_alloc(nr_arrays * sizeof(struct castle_merge_policy_array));
+    cts    = castle_alloc(nr_arrays * sizeof(struct castle_component_tree *));
+    if (!arrays || !cts)
+        goto out;
+
+    i = 0;
+    read_lock(&da->lock);
+    list_for_each(l, &da->levels[2].trees)
+    {
+        struct castle_component_tree *ct = list_entry(l, struct castle_component_tree, da_list);
+
+        if (i == nr_arrays)
+            break;
+
+        arrays[i].id   = ct->seq;
+        arrays[i].size = atomic64_read(&ct->nr_bytes);
+        arrays[i].busy = (ct->merge != NULL)
+                            || test_bit(CASTLE_CT_BACKUP_BARRIER_BIT, &ct->flags)
+                            || atomic_read(&ct->write_ref_count)
+                            || !atomic64_read(&ct->item_count);
+        castle_ct_get(ct, READ /*rw*/);
+        cts[i++] = ct;
+    }
+    read_unlock(&da->lock);
+    nr_cts = nr_arrays = i;
+
+    castle_da_merge_policy_disjoint_set(cts, arrays, nr_arrays);
+
+    if (!castle_merge_policy_select(&cfg, arrays, nr_arrays, &first, &nr))
+        goto out;
+
+    castle_printk(LOG_INFO, "Merge policy for DA=%d picked %u arrays from 0x%llx "
+                            "(%u arrays above level 1)%s\n",
+                            da->id, nr, arrays[first].id, nr_arrays,
+                            castle_merge_policy_dry_run ? ", dry run" : "");
+    if (castle_merge_policy_dry_run)
+        goto out;
+
+    array_ids = castle_alloc(nr * sizeof(c_array_id_t));
+    if (!array_ids)
+        goto out;
+    for (i = 0; i < nr; i++)
+        array_ids[i] = arrays[first + i].id;
+
+    memset(&merge_cfg, 0, sizeof(c_merge_cfg_t));
+    merge_cfg.vertree      = da->id;
+    merge_cfg.nr_arrays    = nr;
+    merge_cfg.arrays       = array_ids;
+    merge_cfg.nr_data_exts = MERGE_ALL_DATA_EXTS;
+    merge_cfg.data_exts    = NULL;
+    if (da->creation_opts & CASTLE_DA_OPTS_VALUE_LOG)
+    {
+        /* Only garbage collect data extents with little live data left. */
+        ret = castle_da_merge_drain_exts_get(da, &cts[first], nr, &merge_cfg.data_exts);
+        if (ret < 0)
+            goto out;
+        merge_cfg.nr_data_exts = ret;
+    }
+
+    CASTLE_TRANSACTION_BEGIN;
+    ret = castle_merge_start(&merge_cfg, &merge_id, -1);
+    if (!ret)
+    {
+        da->policy_merge_id = merge_id;
+        ret = castle_merge_do_work(merge_id, castle_da_merge_policy_work_bytes(), &work_id);
+        BUG_ON(ret);
+    }
+    CASTLE_TRANSACTION_END;
+
+    if (ret)
+    {
+        castle_printk(LOG_WARN, "Merge policy for DA=%d failed to start merge, err=%d\n",
+                                da->id, ret);
+        /* Failed before the merge took the data extents list over. */
+        castle_check_free(merge_cfg.data_exts);
+    }
+
+out:
+    for (i = 0; i < nr_cts; i++)
+        castle_ct_put(cts[i], READ /*rw*/);
+    castle_check_free(cts);
+    castle_check_free(array_ids);
+    castle_check_free(arrays);
+
+    /* Drop the reference taken by castle_da_merge_policy_kick(). */
+    castle_da_put(da);
+}
+
 int castle_da_vertree_tdp_set(c_da_t da_id, uint64_t seconds)
 {
     struct castle_double_array *da = castle_da_hash_get(da_id);
@@ -5,7 +5,9 @@
 #include "castle_timestamps.h"
 #include "castle_public.h"
 
-#define NR_CASTLE_DA_WQS 1
+#define NR_CASTLE_DA_WQS 3
+#define CASTLE_DA_MO_COPY_WQ 1     /**< castle_da_wqs[] index for async medium object copies. */
+#define CASTLE_DA_SORT_WQ    2     /**< castle_da_wqs[] index for parallel modlist iter sorts. */
 
 #define FOR_EACH_MERGE_TREE(_i, _merge) for((_i)=0; (_i)<(_merge)->nr_trees; (_i)++)
 
@@ -90,6 +92,12 @@ struct castle_da_merge {
     uint32_t                      skipped_count;        /**< Count of entries from deleted
                                                              versions.                          */
 
+    /* Medium object copy stage, @see castle_da_medium_obj_copy(). */
+    spinlock_t                    mo_copies_lock;       /**< Protects mo_copies_inflight.       */
+    int                           mo_copies_inflight;   /**< Copies queued, but not completed.  */
+    wait_queue_head_t             mo_copies_wq;         /**< Woken as copies complete.          */
+    int                           mo_copy_cpu_idx;      /**< request_cpus index for next copy.  */
+
     /* ----- extent shrink pipeline ----- */
     /* iterators */
     c_ext_pos_t                      *latest_mo_cep;
@@ -199,6 +207,11 @@ void castle_da_rq_iter_init    (c_da_rq_iter_t *iter,
                                 uint8_t flags,
                                 castle_da_rq_iter_init_cb_t init_cb,
                                 void *private);
+int  castle_da_rq_iter_split_keys_get(c_da_t da_id,
+                                      void *start_key,
+                                      void *end_key,
+                                      int nr_ranges,
+                                      void **split_keys);
 extern struct castle_iterator_type castle_da_rq_iter;
 
 int  castle_double_array_key_cpu_index(c_vl_bkey_t *key);
@@ -235,13 +248,21 @@ void castle_double_arrays_writeback     (void);
 void castle_double_arrays_pre_writeback (void);
 void castle_double_array_merges_fini    (void);
 
-int  castle_ct_large_obj_add    (c_ext_id_t              ext_id,
+int  castle_ct_large_obj_add    (c_ext_pos_t             cep,
                                  uint64_t                length,
                                  struct list_head       *head,
                                  struct mutex           *mutex);
-int  castle_ct_large_obj_remove (c_ext_id_t              ext_id,
+int  castle_ct_large_obj_remove (c_ext_pos_t             cep,
                                  struct list_head       *head,
                                  struct mutex           *mutex);
+int  castle_large_obj_alloc     (struct castle_double_array *da,
+                                 uint64_t                length,
+                                 c_ext_pos_t            *cep);
+int  castle_large_obj_link      (c_ext_pos_t             cep,
+                                 uint64_t                length);
+void castle_large_obj_unlink    (c_ext_pos_t             cep,
+                                 uint64_t                length);
+void castle_large_obj_pools_post_checkpoint(void);
 
 uint32_t castle_da_count(void);
 void castle_da_threads_priority_set(int nice_value);
@@ -18,6 +18,7 @@
 #include "castle_events.h"
 #include "castle_freespace.h"
 #include "castle_mstore.h"
+#include "castle_io_sched.h"
 
 /* Extent manager - Every disk reserves few chunks in the beginning of the disk to
  * store meta data. Meta data for freespace management (for each disk) would be
@@ -165,6 +166,9 @@ static inline c_ext_pos_t castle_extent_map_cep_get(c_ext_pos_t     map_start,
 
 static c_ext_mask_id_t castle_extent_get_ptr(c_ext_id_t ext_id, c_ext_t **ext);
 
+static void castle_extent_map_cache_invalidate(c_ext_t *ext);
+static void castle_extent_map_cache_free(c_ext_t *ext);
+
 #define CASTLE_EXTENT_MASK_HASH_SIZE 100
 
 static struct list_head *castle_extent_mask_hash = NULL;
@@ -1303,6 +1307,10 @@ static c_ext_t * castle_ext_alloc(c_ext_id_t ext_id)
     ext->use_shadow_map     = 0;
     ext->shadow_map         = NULL;
     spin_lock_init(&ext->shadow_map_lock);
+    seqlock_init(&ext->map_cache_lock);
+    ext->map_cache_gen      = 0;
+    ext->map_cache_valid    = NULL;
+    ext->map_cache          = NULL;
 
     INIT_LIST_HEAD(&ext->mask_list);
     INIT_LIST_HEAD(&ext->schks_list);
@@ -1489,6 +1497,7 @@ static int castle_extent_hash_remove(c_ext_t *ext, void *unused)
         kmem_cache_free(castle_partial_schks_cache, schk);
     }
 
+    castle_extent_map_cache_free(ext);
     castle_free(mask);
     castle_free(ext);
 
@@ -3028,6 +3037,8 @@ out:
         write_unlock_c2b(map_c2b);
         put_c2b(map_c2b);
     }
+    /* Chunks may have been (re)mapped beyond a previously shrunk end. */
+    castle_extent_map_cache_invalidate(ext);
     if(rda_state)
         rda_spec->extent_fini(rda_state);
     if(ext_state)
@@ -3489,6 +3500,7 @@ static void castle_extent_resource_release(void *data)
     castle_cache_dirtytree_demote(ext->dirtytree);
     castle_extent_dirtytree_put(ext->dirtytree);
 
+    castle_extent_map_cache_free(ext);
     castle_free(ext);
 
     debug("Completed deleting ext: %lld\n", ext_id);
@@ -3659,6 +3671,114 @@ static void __castle_extent_map_get(c_ext_t *ext, c_chk_t chk_idx, c_disk_chk_t
     }
 }
 
+/**
+ * Extent map cache.
+ *
+ * Decoded chunk maps for (small) extents are kept in a per-extent array, so that I/O
+ * submission doesn't need to go through the meta extent c2b for every chunk it maps.
+ * Lookups are lock-free (seqlock readers).  Anyone changing the on-disk maps of chunks
+ * within the extent's global mask must call castle_extent_map_cache_invalidate() after
+ * the map c2bs have been updated.  Writes redirected via the shadow map during remap are
+ * handled on top of the cached on-disk map, @see castle_extent_map_get().
+ */
+static int castle_extent_map_cache_chunks = 8192;
+module_param(castle_extent_map_cache_chunks, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_extent_map_cache_chunks, "Largest extent (in chunks) to cache chunk maps for (0 = off)");
+
+/**
+ * Look up the map for a logical chunk in the extent's map cache.
+ *
+ * @param gen   [out] Cache generation the lookup was made in, for castle_extent_map_cache_add()
+ *
+ * @return 1    Map found, copied into chk_map
+ * @return 0    Map not cached
+ */
+static int castle_extent_map_cache_get(c_ext_t *ext,
+                                       c_chk_t chk_idx,
+                                       c_disk_chk_t *chk_map,
+                                       uint32_t *gen)
+{
+    unsigned long seq;
+    int hit;
+
+    do {
+        seq  = read_seqbegin(&ext->map_cache_lock);
+        *gen = ext->map_cache_gen;
+        hit  = ext->map_cache && test_bit(chk_idx, ext->map_cache_valid);
+        if (hit)
+            memcpy(chk_map,
+                   &ext->map_cache[chk_idx * ext->k_factor],
+                   ext->k_factor * sizeof(c_disk_chk_t));
+    } while (read_seqretry(&ext->map_cache_lock, seq));
+
+    return hit;
+}
+
+/**
+ * Add the map of a logical chunk, read from the meta extent, to the extent's map cache.
+ *
+ * Allocates the cache on first use.  The map isn't cached if the cache was invalidated
+ * since the (missed) lookup, as it may have been read before the change.
+ */
+static void castle_extent_map_cache_add(c_ext_t *ext,
+                                        c_chk_t chk_idx,
+                                        c_disk_chk_t *chk_map,
+                                        uint32_t gen)
+{
+    unsigned long *valid = NULL;
+    c_disk_chk_t *maps = NULL;
+
+    if (ext->size > castle_extent_map_cache_chunks)
+        return;
+
+    if (!ext->map_cache)
+    {
+        valid = castle_zalloc(BITS_TO_LONGS(ext->size) * sizeof(unsigned long));
+        maps  = castle_alloc(ext->size * ext->k_factor * sizeof(c_disk_chk_t));
+        if (!valid || !maps)
+            goto out;
+    }
+
+    write_seqlock(&ext->map_cache_lock);
+    if (!ext->map_cache && maps)
+    {
+        ext->map_cache_valid = valid;
+        ext->map_cache       = maps;
+        valid = NULL;
+        maps  = NULL;
+    }
+    if (ext->map_cache && (ext->map_cache_gen == gen))
+    {
+        memcpy(&ext->map_cache[chk_idx * ext->k_factor],
+               chk_map,
+               ext->k_factor * sizeof(c_disk_chk_t));
+        __set_bit(chk_idx, ext->map_cache_valid);
+    }
+    write_sequnlock(&ext->map_cache_lock);
+
+out:
+    castle_check_free(valid);
+    castle_check_free(maps);
+}
+
+/**
+ * Drop all cached maps for the extent.
+ */
+static void castle_extent_map_cache_invalidate(c_ext_t *ext)
+{
+    write_seqlock(&ext->map_cache_lock);
+    ext->map_cache_gen++;
+    if (ext->map_cache)
+        memset(ext->map_cache_valid, 0, BITS_TO_LONGS(ext->size) * sizeof(unsigned long));
+    write_sequnlock(&ext->map_cache_lock);
+}
+
+static void castle_extent_map_cache_free(c_ext_t *ext)
+{
+    castle_check_free(ext->map_cache_valid);
+    castle_check_free(ext->map_cache);
+}
+
 /**
  * Get the mapping of disk chunk layout for a given logical chunk in extent.
  *
@@ -3672,6 +3792,7 @@ uint32_t castle_extent_map_get(c_ext_id_t     ext_id,
     c_ext_t *ext = castle_extents_hash_get(ext_id);
     int i, j;
     uint32_t idx = ext->k_factor;
+    uint32_t gen;
 
     if(ext == NULL)
         return 0;
@@ -3688,7 +3809,14 @@ uint32_t castle_extent_map_get(c_ext_id_t     ext_id,
     if ((offset < ext->global_mask.start) || (offset >= ext->global_mask.end))
         return 0;
 
-    __castle_extent_map_get(ext, offset, chk_map);
+    if (SUPER_EXTENT(ext->ext_id) || (ext->ext_id == MICRO_EXT_ID))
+        /* Maps are in memory already. */
+        __castle_extent_map_get(ext, offset, chk_map);
+    else if (!castle_extent_map_cache_get(ext, offset, chk_map, &gen))
+    {
+        __castle_extent_map_get(ext, offset, chk_map);
+        castle_extent_map_cache_add(ext, offset, chk_map, gen);
+    }
 
     /*
      * This extent may be being remapped, in which case writes may also need to be directed via its
@@ -4582,6 +4710,47 @@ static struct process_state {
     live_slave_t    *live_slaves[MAX_NR_SLAVES];
 } process_state;
 
+/* Max rebuild chunk I/Os in flight onto a single remap target slave (0 = unlimited). */
+int castle_rebuild_slave_concurrency = 16;
+
+/*
+ * Check if a potential remap target slave already has its share of rebuild I/O in flight.
+ *
+ * @param idx       Index into process_state.live_slaves.
+ */
+static int rebuild_slave_busy(int idx)
+{
+    struct castle_slave *cs;
+
+    if (castle_rebuild_slave_concurrency <= 0)
+        return 0;
+
+    cs = castle_slave_find_by_uuid(process_state.live_slaves[idx]->uuid);
+    BUG_ON(!cs);
+
+    return atomic_read(&cs->rebuild_io_in_flight) >= castle_rebuild_slave_concurrency;
+}
+
+/*
+ * Check if any potential remap target slave can take more rebuild I/O.
+ */
+static int rebuild_target_available(void)
+{
+    int idx, found = 0;
+
+    for (idx=0; idx<process_state.nr_live_slaves; idx++)
+    {
+        if (process_state.live_slaves[idx] == NULL)
+            continue;
+        found = 1;
+        if (!rebuild_slave_busy(idx))
+            return 1;
+    }
+
+    /* No remap targets at all, leave it to chunk processing to deal with. */
+    return !found;
+}
+
 /* This structure is used to maintain information about each individual remap chunk I/O. */
 typedef struct process_work_item {
     int                 rw;             /* Read, Write, Remap, Cleanup. */
@@ -4613,6 +4782,8 @@ typedef struct process_work_item {
 #define                     MIN_WORK_ITEMS 16
 #define                     MAX_CACHE_USAGE 15 /* Max percentage of cache work items can use. */
 static int castle_nr_work_items = MAX_WORK_ITEMS;
+static int castle_rebuild_window = MAX_WORK_ITEMS; /* Work items that may currently be in
+                                                      flight, adapted to foreground latency. */
 
 static process_work_item_t  process_work_items[MAX_WORK_ITEMS];
 
@@ -4623,6 +4794,38 @@ wait_queue_head_t           process_io_waitq;
 
 atomic_t                    wi_in_flight = ATOMIC(0); /* Keeps track of work itesm in-flight */
 
+/*
+ * Account a work item's chunk I/O against its remap target slaves.
+ *
+ * @param remap_chunks  The chunk(s) being remapped
+ * @param remap_idx     The number of chunk(s) being remapped
+ */
+static void rebuild_slaves_io_get(c_disk_chk_t *remap_chunks, int remap_idx)
+{
+    struct castle_slave *cs;
+    int i;
+
+    for (i=0; i<remap_idx; i++)
+    {
+        cs = castle_slave_find_by_uuid(remap_chunks[i].slave_id);
+        BUG_ON(!cs);
+        atomic_inc(&cs->rebuild_io_in_flight);
+    }
+}
+
+static void rebuild_slaves_io_put(c_disk_chk_t *remap_chunks, int remap_idx)
+{
+    struct castle_slave *cs;
+    int i;
+
+    for (i=0; i<remap_idx; i++)
+    {
+        cs = castle_slave_find_by_uuid(remap_chunks[i].slave_id);
+        BUG_ON(!cs);
+        atomic_dec(&cs->rebuild_io_in_flight);
+    }
+}
+
 /*
  * Populate the list of 'live' slaves. This is the list that can currently be used as a
  * source of replacement slaves for remapping.
@@ -4862,6 +5065,7 @@ static int castle_extent_slave_get_random(c_ext_t *ext,
 {
     int         idx, nr_slaves_to_use;
     int         slaves_to_use[MAX_NR_SLAVES];
+    int         skip_busy = 1;
     uint16_t    r;
 
     /* For each slave in process_state.live_slaves (the list of potential remap slaves). */
@@ -4872,6 +5076,10 @@ retry:
         if (slave_not_usable(ext, chunkno, idx, want_ssd))
             continue;
 
+        /* Spread the rebuild writes, prefer slaves below their concurrency limit. */
+        if (skip_busy && rebuild_slave_busy(idx))
+            continue;
+
         /*
          * This slave is not already used in this logical chunk - add it to set of potential
          * target slaves for remapping this chunk.
@@ -4881,11 +5089,18 @@ retry:
 
     if (!nr_slaves_to_use)
     {
+        if (skip_busy)
+        {
+            /* All candidates are busy, go with one of them anyway. */
+            skip_busy = 0;
+            goto retry;
+        }
         if (want_ssd)
         {
             /* We want an SSD, but we could not find one - retry for a non-SSD. */
             debug("Wanted to remap to SSD, but failed to find one. Retrying from non-SSD\n");
             want_ssd = 0;
+            skip_busy = 1;
             goto retry;
         }
         /* We've run out of potential slaves to choose from (caller has exhausted them). */
@@ -4938,7 +5153,7 @@ static int castle_extent_slave_get_by_freespace(c_ext_t *ext,
     potential_slaves = avg_freespace = max_freespace = 0;
     for (idx=0; idx<process_state.nr_live_slaves; idx++)
     {
-        if (slave_not_usable(ext, chunkno, idx, want_ssd))
+        if (slave_not_usable(ext, chunkno, idx, want_ssd) || rebuild_slave_busy(idx))
             continue;
 
         potential_slaves++;
@@ -5509,6 +5724,7 @@ void process_io_do_work(struct work_struct *work)
              */
             castle_cache_block_destroy(wi->c2b);
 
+            rebuild_slaves_io_put(wi->remap_chunks, wi->remap_idx);
             castle_free(wi->remap_chunks);
 
             spin_lock_irqsave(&io_list_lock, flags);
@@ -5640,6 +5856,7 @@ int submit_async_remap_io(c_ext_t *ext, int chunkno, c_disk_chk_t *remap_chunks,
     set_c2b_remap(c2b);
 
     atomic_inc(&wi_in_flight);
+    rebuild_slaves_io_get(remap_chunks, remap_idx);
 
     c2b->end_io = castle_extent_process_async_end;
     init_io_work_item(wi, c2b, ext, remap_chunks, remap_idx, chunkno);
@@ -5668,6 +5885,7 @@ int submit_async_remap_io(c_ext_t *ext, int chunkno, c_disk_chk_t *remap_chunks,
             spin_lock_irq(&io_list_lock);
             list_add(&wi->free_list, &io_free_list);
             spin_unlock_irq(&io_list_lock);
+            rebuild_slaves_io_put(remap_chunks, remap_idx);
             atomic_dec(&wi_in_flight);
             return ret;
         }
@@ -5822,6 +6040,9 @@ static void writeback_rebuild_chunk(writeback_info_t *writeback_info)
             map_page_idx++;
     }
 
+    /* Readers must pick up the remapped chunks from now on. */
+    castle_extent_map_cache_invalidate(ext);
+
     /* Make sure the updated map is flushed out. */
     castle_cache_extent_flush(META_EXT_ID, 0, 0, 0);
 
@@ -6031,6 +6252,7 @@ int work_io_check(void)
             write_unlock_c2b(wi->c2b);
             //BUG_ON(castle_cache_block_destroy(wi->c2b) && LOGICAL_EXTENT(wi->ext->ext_id));
             put_c2b(wi->c2b);
+            rebuild_slaves_io_put(wi->remap_chunks, wi->remap_idx);
             castle_free(wi->remap_chunks);
 
             list_add_tail(&wi->free_list, &io_free_list);
@@ -6041,7 +6263,7 @@ int work_io_check(void)
     }
     spin_unlock_irq(&io_list_lock);
 
-    if (atomic_read(&wi_in_flight) < castle_nr_work_items)
+    if ((atomic_read(&wi_in_flight) < castle_rebuild_window) && rebuild_target_available())
         return 1;
 
     return 0;
@@ -6056,6 +6278,109 @@ unsigned long delta_time;
 #define RATELIMIT_MAX 10000 /* 10Gb/s max */
 int castle_extents_process_ratelimit = RATELIMIT_DEFAULT;
 
+/* Foreground read latency (95th percentile, ms) above which rebuild backs off (0 = off). */
+int castle_rebuild_user_latency_ms = 32;
+#define REBUILD_WINDOW_ADJUST_PERIOD    (HZ/10)
+static unsigned long castle_rebuild_window_adjusted;
+
+/*
+ * Adapt the number of rebuild chunk I/Os in flight to foreground I/O latency: halve it
+ * whenever user reads on any slave got slower than castle_rebuild_user_latency_ms since the
+ * last adjustment, grow it gradually otherwise.
+ */
+static void castle_extents_process_window_adjust(void)
+{
+    struct list_head    *lh;
+    struct castle_slave *cs;
+    uint32_t            lat_ms, max_lat_ms = 0;
+
+    if (time_before(jiffies, castle_rebuild_window_adjusted + REBUILD_WINDOW_ADJUST_PERIOD))
+        return;
+    castle_rebuild_window_adjusted = jiffies;
+
+    rcu_read_lock();
+    list_for_each_rcu(lh, &castle_slaves.slaves)
+    {
+        cs = list_entry(lh, struct castle_slave, list);
+        if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+            continue;
+        lat_ms = castle_io_sched_latency_pct_mark(&cs->io_sched, CASTLE_IO_CLASS_USER, 95);
+        max_lat_ms = max(max_lat_ms, lat_ms);
+    }
+    rcu_read_unlock();
+
+    if ((castle_rebuild_user_latency_ms > 0) && (max_lat_ms > castle_rebuild_user_latency_ms))
+        castle_rebuild_window = max(castle_rebuild_window / 2, 1);
+    else
+        castle_rebuild_window = min(castle_rebuild_window + max(castle_nr_work_items / 16, 1),
+                                    castle_nr_work_items);
+    debug("Rebuild window %d, user read latency %ums\n", castle_rebuild_window, max_lat_ms);
+}
+
+#define REBUILD_PRIO_LEVELS     4   /* Extents with 0, 1, 2 and 3+ live copies. */
+#define REBUILD_PRIO_SAMPLES    8   /* Chunks sampled per extent to count its live copies. */
+
+/*
+ * Estimate the number of live copies left of an extent's data, i.e. the minimum number of
+ * in-service, non-evacuating slaves holding a sample of its chunks.
+ */
+static int castle_extent_live_copies(c_ext_t *ext)
+{
+    c_disk_chk_t        maps[ext->k_factor];
+    c_chk_cnt_t         start, end, step;
+    c_chk_t             chk;
+    struct castle_slave *cs;
+    int                 i, j, nr_maps, live, min_live = ext->k_factor;
+
+    castle_extent_mask_read(ext->rebuild_mask_id, &start, &end);
+    if (end <= start)
+        return min_live;
+
+    step = max((end - start) / REBUILD_PRIO_SAMPLES, (c_chk_cnt_t)1);
+    for (i=0, chk=start; (i<REBUILD_PRIO_SAMPLES) && (chk<end); i++, chk+=step)
+    {
+        nr_maps = castle_extent_map_get(ext->ext_id, chk, maps, READ, 0);
+        if (!nr_maps)
+            continue;
+
+        for (j=0, live=0; j<nr_maps; j++)
+        {
+            cs = castle_slave_find_by_uuid(maps[j].slave_id);
+            if (cs &&
+                !test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags) &&
+                !test_bit(CASTLE_SLAVE_EVACUATE_BIT, &cs->flags))
+                live++;
+        }
+        min_live = min(min_live, live);
+    }
+
+    return min_live;
+}
+
+/*
+ * Order the extent list so that extents with the fewest live copies are processed first.
+ */
+static void castle_extents_process_prioritise(void)
+{
+    struct list_head    levels[REBUILD_PRIO_LEVELS];
+    struct list_head    *process_entry, *ptmp;
+    c_ext_t             *ext;
+    int                 i;
+
+    for (i=0; i<REBUILD_PRIO_LEVELS; i++)
+        INIT_LIST_HEAD(&levels[i]);
+
+    list_for_each_safe(process_entry, ptmp, &extent_list)
+    {
+        ext = list_entry(process_entry, c_ext_t, process_list);
+        i = min(castle_extent_live_copies(ext), REBUILD_PRIO_LEVELS - 1);
+        list_move_tail(process_entry, &levels[i]);
+    }
+
+    for (i=0; i<REBUILD_PRIO_LEVELS; i++)
+        list_splice_init(&levels[i], extent_list.prev);
+}
+
 /*
  * Disable synchronisation between extent processing and checkpoint thread.
  */
@@ -6128,6 +6453,8 @@ static int castle_extents_process(void *unused)
         /* Initialisation for I/O ratelimiting. */
         batch = BATCHSIZE; /* 10 x 1m I/Os per batch. */
         delta_time = jiffies;
+        castle_rebuild_window = castle_nr_work_items;
+        castle_rebuild_window_adjusted = jiffies;
 
         /*
          * Build the list of extents to process. Extent transaction protected to avoid racing
@@ -6143,6 +6470,9 @@ static int castle_extents_process(void *unused)
             goto finished;
         }
 
+        /* Rebuild the extents at most risk of data loss first. */
+        castle_extents_process_prioritise();
+
         list_for_each_safe(process_entry, ptmp, &extent_list)
         {
             int chunk_index;
@@ -6290,6 +6620,8 @@ retry:
                             }
                         }
 
+                        castle_extents_process_window_adjust();
+
                         if ((rebuild_read_chunks + rebuild_write_chunks) >= batch)
                         {
                             if (castle_extents_process_ratelimit < RATELIMIT_MIN)
@@ -6389,24 +6721,25 @@ skip_extent:
                         writeback_info->ext_finished = COMPLETE;
                 }
 
-                while (atomic_read(&wi_in_flight))
+                /*
+                 * Don't drain this extent's chunk I/O, let it overlap with the next extents'.
+                 * All I/O is drained before maps are written back (on checkpoint presync), and
+                 * before processing finishes. Just check for errors so far.
+                 */
+                io_error = work_io_check();
+                if (io_error < 0)
                 {
-                    io_error = work_io_check();
-                    if (io_error < 0)
-                    {
-                        switch (io_error) {
-                            case -EAGAIN:
-                                /*
-                                 * We found a dead slave during one of the chunk I/Os. This
-                                 * means that extent processing will restart, so there's nothing
-                                 * to do here.
-                                 */
-                                break;
-                            default:
-                                BUG();
-                        }
+                    switch (io_error) {
+                        case -EAGAIN:
+                            /*
+                             * We found a dead slave during one of the chunk I/Os. This
+                             * means that extent processing will restart, so there's nothing
+                             * to do here.
+                             */
+                            break;
+                        default:
+                            BUG();
                     }
-                    msleep(IO_SLEEP_TIME);
                 }
 
                 writeback_info = NULL;
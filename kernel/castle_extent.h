@@ -54,6 +54,10 @@ typedef struct castle_extent {
     c_disk_chk_t        *shadow_map;
     c_ext_mask_range_t  shadow_map_range; /* Range of chunks covered by shadow map. */
     int                 use_shadow_map; /* Extent is currently being remapped           */
+    seqlock_t           map_cache_lock; /**< Protects map cache, readers are lock-free. */
+    uint32_t            map_cache_gen;  /**< Bumped every time the map cache is invalidated. */
+    unsigned long      *map_cache_valid;/**< Logical chunks with a cached map (bitmap).  */
+    c_disk_chk_t       *map_cache;      /**< Cached maps, k_factor per logical chunk.   */
     atomic_t            link_cnt;
     /* This global mask gets updated after freeing resources. Checkpoint has to commit
      * this to mstore. */
@@ -215,6 +215,63 @@ static void castle_freespace_slave_superchunk_freed(struct castle_slave  *cs,
     }
 }
 
+/**
+ * Refills the slave's freespace cache with copies of the ring entries from the consumer
+ * onwards. Entries are copied out of a single block of the ring, so that consecutive
+ * superchunk allocations don't have to get (and possibly read) that block each time.
+ *
+ * The producer never overwrites entries between cons and prod, therefore the copies stay
+ * valid until they are consumed. The on-disk ring is not modified.
+ *
+ * @param cs    Slave to refill the cache for. Freespace lock must be held.
+ *
+ * @return 0:       Success.
+ * @return -EIO:    Failed to read the freespace ring.
+ */
+static int castle_freespace_cache_refill(struct castle_slave *cs)
+{
+    castle_freespace_t  *freespace = &cs->freespace;
+    c_byte_off_t         cons_off;
+    c_ext_pos_t          cep;
+    c2_block_t          *c2b;
+    uint32_t             nr;
+
+    BUG_ON(!mutex_is_locked(&cs->freespace_lock));
+    BUG_ON(cs->freespace_cache_idx < cs->freespace_cache_nr);
+
+    /* Calculate consumer offset within super extent and cep to be used to fetch c2b. */
+    cons_off   = FREESPACE_OFFSET + freespace->cons * sizeof(c_chk_t);
+    cep.ext_id = cs->sup_ext;
+    cep.offset = MASK_BLK_OFFSET(cons_off);
+    c2b = castle_cache_block_get(cep, 1, USER);
+
+    /* Get the uptodate buffer, If failed it should be due to disk failure. */
+    if (castle_cache_block_sync_read(c2b))
+    {
+        put_c2b(c2b);
+        return -EIO;
+    }
+
+    /* Don't go past the end of the block, the end of the ring or the producer. */
+    nr = (C_BLK_SIZE - BLOCK_OFFSET(cons_off)) / sizeof(c_chk_t);
+    nr = min_t(uint32_t, nr, freespace->max_entries - freespace->cons);
+    nr = min_t(uint32_t, nr, freespace->nr_entries);
+    nr = min_t(uint32_t, nr, FREESPACE_CACHE_SCHKS);
+    BUG_ON(nr == 0);
+
+    read_lock_c2b(c2b);
+    memcpy(cs->freespace_cache,
+           ((uint8_t *)c2b_buffer(c2b)) + BLOCK_OFFSET(cons_off),
+           nr * sizeof(c_chk_t));
+    read_unlock_c2b(c2b);
+    put_c2b(c2b);
+
+    cs->freespace_cache_idx = 0;
+    cs->freespace_cache_nr  = nr;
+
+    return 0;
+}
+
 /*
  * Allocate a superchunk from the slave with reservation from reservation pool. It is
  * possible to pass invalid pool id.
@@ -229,10 +286,7 @@ c_chk_seq_t castle_freespace_slave_superchunk_alloc(struct castle_slave *cs,
 {
     castle_freespace_t  *freespace;
     c_chk_seq_t          chk_seq;
-    c_ext_pos_t          cep;
-    c_byte_off_t         cons_off;
-    c2_block_t          *c2b;
-    c_chk_t             *cons_chk;
+    c_chk_t              cons_chk;
     int                  ret;
     int                  reserved_here = 0;
 
@@ -262,17 +316,10 @@ get_super_chunk:
     BUG_ON(freespace->cons == cs->prev_prod);
     BUG_ON(!freespace->free_chk_cnt || !freespace->nr_entries);
 
-    /* Calculate consumer offset within super extent and cep to be used to fetch c2b. */
-    cons_off   = FREESPACE_OFFSET + freespace->cons * sizeof(c_chk_t);
-    cep.ext_id = cs->sup_ext;
-    cep.offset = MASK_BLK_OFFSET(cons_off);
-    c2b = castle_cache_block_get(cep, 1, USER);
-
-    /* Get the uptodate buffer, If failed it should be due to disk failure. */
-    if (castle_cache_block_sync_read(c2b))
+    /* Refill the cache of ring entries, if it has been used up. */
+    if ((cs->freespace_cache_idx >= cs->freespace_cache_nr) && castle_freespace_cache_refill(cs))
     {
         debug("Failed to read superblock from slave %x\n", cs->uuid);
-        put_c2b(c2b);
         freespace_sblk_put(cs);
         /* If we reserved superchunks at the top of this function, we should return them.
            This is unlikely to matter, as the above error will only happen when the
@@ -282,13 +329,13 @@ get_super_chunk:
 
         return INVAL_CHK_SEQ;
     }
-    write_lock_c2b(c2b);
 
-    cons_chk = (c_chk_t *)(((uint8_t *)c2b_buffer(c2b)) + BLOCK_OFFSET(cons_off));
-    BUG_ON((*cons_chk == -1) || (*cons_chk % CHKS_PER_SLOT));
+    /* Cached entry always corresponds to the ring entry at cons. */
+    cons_chk = cs->freespace_cache[cs->freespace_cache_idx++];
+    BUG_ON((cons_chk == -1) || (cons_chk % CHKS_PER_SLOT));
 
     /* Make the superchunk to return (represented as chk_seq. */
-    chk_seq.first_chk        = *cons_chk;
+    chk_seq.first_chk        = cons_chk;
     chk_seq.count            = CHKS_PER_SLOT;
     /* Update bookkeeping information in various structures. */
     freespace->free_chk_cnt -= CHKS_PER_SLOT;
@@ -316,10 +363,6 @@ get_super_chunk:
 
     BUG_ON(freespace->nr_entries < 0 || freespace->free_chk_cnt < 0);
 
-    dirty_c2b(c2b);
-    write_unlock_c2b(c2b);
-    put_c2b(c2b);
-
     BUG_ON((chk_seq.first_chk + chk_seq.count - 1) >= (freespace->disk_size + FREE_SPACE_START));
     freespace_sblk_put(cs);
 
@@ -487,6 +530,9 @@ int castle_freespace_slave_init(struct castle_slave *cs, int fresh)
 
     mutex_init(&cs->freespace_lock);
 
+    cs->freespace_cache_nr  = 0;
+    cs->freespace_cache_idx = 0;
+
     cs->reserved_schks = 0;
     cs->disk_size = freespace->disk_size;
     atomic_set(&cs->free_chk_cnt, freespace->free_chk_cnt);
@@ -0,0 +1,464 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+
+#include "castle_public.h"
+#include "castle_defines.h"
+#include "castle.h"
+#include "castle_utils.h"
+#include "castle_debug.h"
+#include "castle_io_sched.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(_f, _a...)        (castle_printk(LOG_DEBUG, _f, ##_a))
+#else
+#define debug(_f, ...)          ((void)0)
+#endif
+
+static int castle_io_sched_enabled = 1;
+
+module_param(castle_io_sched_enabled, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_io_sched_enabled, "Schedule slave I/O by class (0 = submit straight to the block layer)");
+
+static int castle_io_sched_depth = 16;
+
+module_param(castle_io_sched_depth, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_io_sched_depth, "Max number of bios in flight per slave");
+
+/* Share of the slave bandwidth each class gets when all classes are backlogged. */
+static int castle_io_sched_weights[CASTLE_IO_CLASSES] = {8, 4, 2, 1};
+
+module_param_array(castle_io_sched_weights, int, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_io_sched_weights, "I/O class weights: user,flush,merge,rebuild");
+
+/* Time after which the oldest queued bio of a class is dispatched ahead of fair share. */
+static int castle_io_sched_deadlines[CASTLE_IO_CLASSES] = {20, 200, 500, 1000};
+
+module_param_array(castle_io_sched_deadlines, int, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_io_sched_deadlines, "I/O class deadlines in ms: user,flush,merge,rebuild");
+
+static int castle_io_sched_slow_ms = 100;
+
+module_param(castle_io_sched_slow_ms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_io_sched_slow_ms, "Read delay injected by SLAVE_SLOW_ERR, in ms");
+
+/* Dispatches queued bios for all slaves.  Not shared with other castle work, so that
+   queued I/O doesn't wait behind unrelated work items. */
+static struct workqueue_struct *castle_io_sched_wq = NULL;
+
+/* Samples after which the recent latency histograms are halved. */
+#define CASTLE_IO_SCHED_LAT_DECAY       (1024)
+
+static char *castle_io_class_names[CASTLE_IO_CLASSES] = {
+    [CASTLE_IO_CLASS_USER]    = "user",
+    [CASTLE_IO_CLASS_FLUSH]   = "flush",
+    [CASTLE_IO_CLASS_MERGE]   = "merge",
+    [CASTLE_IO_CLASS_REBUILD] = "rebuild",
+};
+
+/**
+ * Pick the next bio to dispatch and account for it.  Must be called with sched->lock held.
+ *
+ * The oldest bio of a class past its deadline goes first.  Otherwise the class with the
+ * smallest virtual time is chosen, i.e. the one that got least of its share so far.
+ *
+ * @return  NULL if nothing is queued
+ */
+static struct castle_io_sched_req* castle_io_sched_next(struct castle_io_sched *sched,
+                                                        s64 now_ns)
+{
+    struct castle_io_sched_class *cls;
+    struct castle_io_sched_req *req;
+    s64 oldest_ns = 0;
+    int i, next = -1, expired = 0;
+
+    for (i=0; i<CASTLE_IO_CLASSES; i++)
+    {
+        s64 queued_ns;
+
+        cls = &sched->classes[i];
+        if (list_empty(&cls->queue))
+            continue;
+
+        req = list_first_entry(&cls->queue, struct castle_io_sched_req, list);
+        queued_ns = timespec_to_ns(&req->queued);
+        if (now_ns - queued_ns >= (s64)castle_io_sched_deadlines[i] * 1000000LL)
+        {
+            if (!expired || queued_ns < oldest_ns)
+            {
+                next      = i;
+                oldest_ns = queued_ns;
+            }
+            expired = 1;
+            continue;
+        }
+
+        if (!expired && (next < 0 || cls->vtime < sched->classes[next].vtime))
+            next = i;
+    }
+
+    if (next < 0)
+        return NULL;
+
+    cls = &sched->classes[next];
+    req = list_first_entry(&cls->queue, struct castle_io_sched_req, list);
+    list_del(&req->list);
+    cls->queued--;
+    cls->in_flight++;
+    cls->dispatched++;
+    cls->vtime += req->bio->bi_size / max(castle_io_sched_weights[next], 1);
+    sched->vtime = cls->vtime;
+    sched->in_flight++;
+
+    return req;
+}
+
+/**
+ * Move bios that can be dispatched now onto the dispatch list.  Must be called with
+ * sched->lock held.
+ *
+ * @param drain     Dispatch everything that's queued, regardless of the depth limit
+ */
+static void castle_io_sched_collect(struct castle_io_sched *sched,
+                                    struct list_head *dispatch,
+                                    int drain)
+{
+    struct castle_io_sched_req *req;
+    struct timespec now;
+    s64 now_ns;
+
+    getnstimeofday(&now);
+    now_ns = timespec_to_ns(&now);
+    while (drain || sched->in_flight < max(castle_io_sched_depth, 1))
+    {
+        if (!(req = castle_io_sched_next(sched, now_ns)))
+            break;
+        list_add_tail(&req->list, dispatch);
+    }
+}
+
+/**
+ * Whether reads from the slave should be held back to emulate a slow disk.
+ *
+ * @see SLAVE_SLOW_ERR
+ */
+static int castle_io_sched_slow(struct castle_io_sched *sched, struct castle_io_sched_req *req)
+{
+    struct castle_slave *cs = container_of(sched, struct castle_slave, io_sched);
+
+    return INJECT_ERR(SLAVE_SLOW_ERR) &&
+           (cs->uuid == castle_fault_arg) &&
+           (req->rw == READ) &&
+           (req->slow_until == 0);
+}
+
+static void castle_io_sched_slow_timer_fire(unsigned long data)
+{
+    struct castle_io_sched *sched = (struct castle_io_sched *)data;
+
+    queue_work(castle_io_sched_wq, &sched->work);
+}
+
+/**
+ * Hand collected bios off to the block layer.  May sleep, don't hold sched->lock.
+ */
+static void castle_io_sched_dispatch(struct castle_io_sched *sched, struct list_head *dispatch)
+{
+    struct castle_io_sched_req *req;
+    struct list_head *lh, *tmp;
+
+    list_for_each_safe(lh, tmp, dispatch)
+    {
+        struct bio *bio;
+
+        req = list_entry(lh, struct castle_io_sched_req, list);
+        list_del(&req->list);
+        if (unlikely(castle_io_sched_slow(sched, req)))
+        {
+            /* Park the read, it stays accounted as in flight. */
+            req->slow_until = jiffies + msecs_to_jiffies(castle_io_sched_slow_ms) + 1;
+            spin_lock_irq(&sched->lock);
+            list_add_tail(&req->list, &sched->slow);
+            if (!timer_pending(&sched->slow_timer))
+                mod_timer(&sched->slow_timer, req->slow_until);
+            spin_unlock_irq(&sched->lock);
+            continue;
+        }
+        bio = req->bio;
+        debug("Dispatching bio %p, class=%s, rw=%d\n",
+                bio, castle_io_class_names[req->io_class], req->rw);
+
+        /* req may be freed by the completion, don't touch it after submission. */
+        bio_get(bio);
+        submit_bio(req->rw, bio);
+        if (bio_flagged(bio, BIO_EOPNOTSUPP))
+        {
+            castle_printk(LOG_ERROR, "BIO flagged not supported.\n");
+            WARN_ON(1);
+        }
+        bio_put(bio);
+    }
+}
+
+/**
+ * Dispatch bios that queued up behind the depth limit, or were held back by SLAVE_SLOW_ERR.
+ */
+static void castle_io_sched_work(struct work_struct *work)
+{
+    struct castle_io_sched *sched = container_of(work, struct castle_io_sched, work);
+    struct castle_io_sched_req *req;
+    LIST_HEAD(dispatch);
+
+    spin_lock_irq(&sched->lock);
+    while (!list_empty(&sched->slow))
+    {
+        req = list_first_entry(&sched->slow, struct castle_io_sched_req, list);
+        if (time_before(jiffies, req->slow_until))
+        {
+            mod_timer(&sched->slow_timer, req->slow_until);
+            break;
+        }
+        list_move_tail(&req->list, &dispatch);
+    }
+    castle_io_sched_collect(sched, &dispatch, 0 /*drain*/);
+    spin_unlock_irq(&sched->lock);
+
+    castle_io_sched_dispatch(sched, &dispatch);
+}
+
+void castle_io_sched_init(struct castle_io_sched *sched)
+{
+    int i;
+
+    memset(sched, 0, sizeof(struct castle_io_sched));
+    spin_lock_init(&sched->lock);
+    for (i=0; i<CASTLE_IO_CLASSES; i++)
+        INIT_LIST_HEAD(&sched->classes[i].queue);
+    CASTLE_INIT_WORK(&sched->work, castle_io_sched_work);
+    INIT_LIST_HEAD(&sched->slow);
+    setup_timer(&sched->slow_timer, castle_io_sched_slow_timer_fire, (unsigned long)sched);
+}
+
+/**
+ * Stop the scheduler.  All I/O must have completed.
+ */
+void castle_io_sched_fini(struct castle_io_sched *sched)
+{
+    int i;
+
+    del_timer_sync(&sched->slow_timer);
+    BUG_ON(sched->in_flight);
+    BUG_ON(!list_empty(&sched->slow));
+    for (i=0; i<CASTLE_IO_CLASSES; i++)
+        BUG_ON(!list_empty(&sched->classes[i].queue) || sched->classes[i].queued);
+    /* Let a dispatch work queued by the last completions finish before sched goes away. */
+    flush_workqueue(castle_io_sched_wq);
+}
+
+/**
+ * Queue a bio for submission to the slave, dispatching whatever the scheduler allows.
+ *
+ * Barrier bios (and all bios, if the scheduler is disabled) flush the queues out first,
+ * so that they are not reordered ahead of earlier I/O.
+ *
+ * @param req       Caller allocated, must stay valid until castle_io_sched_end()
+ */
+void castle_io_sched_submit(struct castle_io_sched *sched,
+                            struct castle_io_sched_req *req,
+                            struct bio *bio,
+                            int rw,
+                            c_io_class_t io_class)
+{
+    struct castle_io_sched_class *cls;
+    LIST_HEAD(dispatch);
+
+    BUG_ON(io_class >= CASTLE_IO_CLASSES);
+    req->bio      = bio;
+    req->rw       = rw;
+    req->io_class = io_class;
+    req->slow_until = 0;
+    getnstimeofday(&req->queued);
+
+    cls = &sched->classes[io_class];
+    spin_lock_irq(&sched->lock);
+    if (!castle_io_sched_enabled || (rw & (1 << BIO_RW_BARRIER)))
+    {
+        castle_io_sched_collect(sched, &dispatch, 1 /*drain*/);
+        cls->in_flight++;
+        cls->dispatched++;
+        sched->in_flight++;
+        list_add_tail(&req->list, &dispatch);
+    }
+    else
+    {
+        /* Don't let a class that was idle claim back the share it didn't use. */
+        if (list_empty(&cls->queue))
+            cls->vtime = max(cls->vtime, sched->vtime);
+        list_add_tail(&req->list, &cls->queue);
+        cls->queued++;
+        castle_io_sched_collect(sched, &dispatch, 0 /*drain*/);
+    }
+    spin_unlock_irq(&sched->lock);
+
+    castle_io_sched_dispatch(sched, &dispatch);
+}
+
+/**
+ * Account for a completed bio.  Called from bio end_io (interrupt context).
+ */
+void castle_io_sched_end(struct castle_io_sched *sched, struct castle_io_sched_req *req)
+{
+    struct castle_io_sched_class *cls = &sched->classes[req->io_class];
+    struct timespec now;
+    unsigned long flags;
+    uint64_t lat_us;
+    int bucket, pending = 0, i;
+
+    getnstimeofday(&now);
+    lat_us = (timespec_to_ns(&now) - timespec_to_ns(&req->queued)) / 1000LL;
+    bucket = min((int)fls64(lat_us / 1000), CASTLE_IO_SCHED_LAT_BUCKETS - 1);
+
+    spin_lock_irqsave(&sched->lock, flags);
+    BUG_ON(sched->in_flight == 0 || cls->in_flight == 0);
+    sched->in_flight--;
+    cls->in_flight--;
+    cls->lat_hist[bucket]++;
+    cls->lat_recent[bucket]++;
+    if (++cls->nr_recent >= CASTLE_IO_SCHED_LAT_DECAY)
+    {
+        cls->nr_recent = 0;
+        for (i=0; i<CASTLE_IO_SCHED_LAT_BUCKETS; i++)
+        {
+            cls->lat_recent[i] /= 2;
+            cls->nr_recent += cls->lat_recent[i];
+        }
+    }
+    if (req->rw == READ)
+        /* Weight 1/8 for the new sample. */
+        sched->read_lat_us = sched->read_lat_us - sched->read_lat_us / 8
+                           + (uint32_t)min(lat_us, (uint64_t)UINT_MAX / 8) / 8;
+    for (i=0; i<CASTLE_IO_CLASSES; i++)
+        pending += sched->classes[i].queued;
+    spin_unlock_irqrestore(&sched->lock, flags);
+
+    /* Can't submit bios from here, leave it to the workqueue. */
+    if (pending)
+        queue_work(castle_io_sched_wq, &sched->work);
+}
+
+/**
+ * Estimate a percentile of the recent completion latency of a class.
+ *
+ * @param pct       Percentile, 1-100
+ *
+ * @return  Upper bound of the latency histogram bucket the percentile falls in, in ms,
+ *          or 0 if there are no recent samples
+ */
+uint32_t castle_io_sched_latency_pct(struct castle_io_sched *sched, c_io_class_t io_class, int pct)
+{
+    struct castle_io_sched_class *cls = &sched->classes[io_class];
+    unsigned long flags;
+    uint64_t cum = 0;
+    uint32_t lat_ms = 0;
+    int i;
+
+    spin_lock_irqsave(&sched->lock, flags);
+    if (cls->nr_recent)
+        for (i=0; i<CASTLE_IO_SCHED_LAT_BUCKETS; i++)
+        {
+            cum += cls->lat_recent[i];
+            if (cum * 100 >= (uint64_t)pct * cls->nr_recent)
+            {
+                lat_ms = 1 << i;
+                break;
+            }
+        }
+    spin_unlock_irqrestore(&sched->lock, flags);
+
+    return lat_ms;
+}
+
+/**
+ * Estimate a percentile of the completion latency of a class, over the bios completed
+ * since the previous call.
+ *
+ * @return  As for castle_io_sched_latency_pct()
+ */
+uint32_t castle_io_sched_latency_pct_mark(struct castle_io_sched *sched,
+                                          c_io_class_t io_class,
+                                          int pct)
+{
+    struct castle_io_sched_class *cls = &sched->classes[io_class];
+    uint64_t delta[CASTLE_IO_SCHED_LAT_BUCKETS];
+    uint64_t total = 0, cum = 0;
+    uint32_t lat_ms = 0;
+    int i;
+
+    spin_lock_irq(&sched->lock);
+    for (i=0; i<CASTLE_IO_SCHED_LAT_BUCKETS; i++)
+    {
+        delta[i] = cls->lat_hist[i] - cls->lat_mark[i];
+        cls->lat_mark[i] = cls->lat_hist[i];
+        total += delta[i];
+    }
+    spin_unlock_irq(&sched->lock);
+
+    if (total)
+        for (i=0; i<CASTLE_IO_SCHED_LAT_BUCKETS; i++)
+        {
+            cum += delta[i];
+            if (cum * 100 >= (uint64_t)pct * total)
+            {
+                lat_ms = 1 << i;
+                break;
+            }
+        }
+
+    return lat_ms;
+}
+
+/**
+ * Print per-class queue depths and the completion latency histograms (from queueing
+ * to completion, bucket i counts bios that took [2^(i-1), 2^i) ms).
+ */
+ssize_t castle_io_sched_show(struct castle_io_sched *sched, char *buf)
+{
+    struct castle_io_sched_class *cls;
+    ssize_t len = 0;
+    int i, j;
+
+    spin_lock_irq(&sched->lock);
+    for (i=0; i<CASTLE_IO_CLASSES; i++)
+    {
+        cls = &sched->classes[i];
+        len += sprintf(buf + len, "%s: queued=%u in_flight=%u dispatched=%llu latency_ms=",
+                       castle_io_class_names[i], cls->queued, cls->in_flight, cls->dispatched);
+        for (j=0; j<CASTLE_IO_SCHED_LAT_BUCKETS; j++)
+            len += sprintf(buf + len, "%llu%c", cls->lat_hist[j],
+                           (j == CASTLE_IO_SCHED_LAT_BUCKETS - 1) ? '\n' : ',');
+    }
+    spin_unlock_irq(&sched->lock);
+
+    return len;
+}
+
+int castle_io_scheds_init(void)
+{
+    castle_io_sched_wq = create_workqueue("castle_io_sched");
+    if (!castle_io_sched_wq)
+    {
+        castle_printk(LOG_ERROR, "Could not create I/O scheduler workqueue.\n");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void castle_io_scheds_fini(void)
+{
+    if (castle_io_sched_wq)
+        destroy_workqueue(castle_io_sched_wq);
+    castle_io_sched_wq = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef __CASTLE_IO_SCHED_H__
+#define __CASTLE_IO_SCHED_H__
+
+#include "castle.h"
+
+/**
+ * Per-slave I/O scheduler.
+ *
+ * Bios are queued per I/O class and dispatched to the block layer, up to a fixed depth
+ * per slave, by weighted fair sharing between the classes.  A class whose oldest bio
+ * has exceeded its deadline is dispatched first.
+ */
+
+int     castle_io_scheds_init   (void);
+void    castle_io_scheds_fini   (void);
+void    castle_io_sched_init    (struct castle_io_sched *sched);
+void    castle_io_sched_fini    (struct castle_io_sched *sched);
+void    castle_io_sched_submit  (struct castle_io_sched *sched,
+                                 struct castle_io_sched_req *req,
+                                 struct bio *bio,
+                                 int rw,
+                                 c_io_class_t io_class);
+void    castle_io_sched_end     (struct castle_io_sched *sched,
+                                 struct castle_io_sched_req *req);
+uint32_t castle_io_sched_latency_pct
+                                (struct castle_io_sched *sched,
+                                 c_io_class_t io_class,
+                                 int pct);
+uint32_t castle_io_sched_latency_pct_mark
+                                (struct castle_io_sched *sched,
+                                 c_io_class_t io_class,
+                                 int pct);
+ssize_t castle_io_sched_show    (struct castle_io_sched *sched, char *buf);
+
+/**
+ * Expected time for a new read on the slave to complete, in us.
+ */
+static inline uint64_t castle_io_sched_read_cost(struct castle_slave *cs)
+{
+    return (uint64_t)(atomic_read(&cs->io_in_flight) + 1) * max(cs->io_sched.read_lat_us, 1U);
+}
+
+#endif /* __CASTLE_IO_SCHED_H__ */
@@ -498,6 +498,32 @@ int castle_norm_key_compare(const struct castle_norm_key *a, const struct castle
     else return a->length - b->length;
 }
 
+/**
+ * Compute an order-preserving prefix of a normalized key.
+ * @param key       the key whose prefix we need
+ *
+ * The first eight bytes of the key's contents are packed big-endian (padded with zeroes
+ * for shorter keys), so that comparing the prefixes of two keys as integers agrees with
+ * memcmp() on those bytes. The minimum key maps to 0, and the maximum and invalid keys map
+ * to ~0. Keys with different prefixes are therefore ordered by their prefixes, while keys
+ * with equal prefixes still need to be compared with @see castle_norm_key_compare().
+ */
+uint64_t castle_norm_key_prefix(const struct castle_norm_key *key)
+{
+    const unsigned char *data;
+    uint64_t prefix = 0;
+    size_t len, i;
+
+    if (unlikely(NORM_KEY_SPECIAL(key)))
+        return NORM_KEY_MIN(key) ? 0 : ~0ULL;
+
+    len = castle_norm_key_len_get(key, &data);
+    for (i = 0; i < sizeof(prefix); i++)
+        prefix = (prefix << 8) | (i < len ? data[i] : 0);
+
+    return prefix;
+}
+
 /*
  * Functions which query and/or manipulate the dimensions of normalized keys.
  */
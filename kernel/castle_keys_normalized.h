@@ -93,6 +93,7 @@ struct castle_norm_key *castle_norm_key_hypercube_next(const struct castle_norm_
                                                        const struct castle_norm_key *high);
 
 int castle_norm_key_compare(const struct castle_norm_key *a, const struct castle_norm_key *b);
+uint64_t castle_norm_key_prefix(const struct castle_norm_key *key);
 int castle_norm_key_nr_dims(const struct castle_norm_key *key);
 uint32_t castle_norm_key_hash(const struct castle_norm_key *key, c_btree_hash_enum_t type, uint32_t seed);
 void castle_norm_key_print(int level, const struct castle_norm_key *key);
@@ -28,6 +28,7 @@
 #include "castle_freespace.h"
 #include "castle_rebuild.h"
 #include "castle_ctrl_prog.h"
+#include "castle_io_sched.h"
 #include "castle_unit_tests.h"
 
 struct castle               castle;
@@ -67,6 +68,12 @@ MODULE_PARM_DESC(castle_extents_process_ratelimit, "extproc_ratelimit,");
 module_param(castle_rebuild_freespace_threshold, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_rebuild_freespace_threshold, "extproc_freesp_thresh,");
 
+module_param(castle_rebuild_slave_concurrency, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_rebuild_slave_concurrency, "extproc_slave_concurrency,");
+
+module_param(castle_rebuild_user_latency_ms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_rebuild_user_latency_ms, "extproc_user_latency_ms,");
+
 module_param(castle_meta_ext_compact_pct, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_meta_ext_compact_pct, "meta_ext_compact_pct,");
 
@@ -487,6 +494,7 @@ static struct castle_slave *castle_slave_ghost_add(uint32_t uuid)
     set_bit(CASTLE_SLAVE_GHOST_BIT, &slave->flags);
     set_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags);
     castle_freespace_slave_init(slave, 0);
+    castle_io_sched_init(&slave->io_sched);
     INIT_RCU_HEAD(&slave->rcu);
     list_add_rcu(&slave->list, &castle_slaves.slaves);
 
@@ -599,6 +607,8 @@ static int castle_unit_tests(void)
 
     test_seq_id++; if (0 != (err = castle_slim_tree_unit_tests_do() ) ) goto fail;
     test_seq_id++; if (0 != (err = castle_instream_unit_tests_do() ) ) goto fail;
+    test_seq_id++; if (0 != (err = castle_da_merged_iter_unit_tests_do() ) ) goto fail;
+    test_seq_id++; if (0 != (err = castle_merge_policy_unit_tests_do() ) ) goto fail;
 
     BUG_ON(err);
     castle_printk(LOG_INIT, "%s::%d tests passed.\n", __FUNCTION__, test_seq_id);
@@ -1569,6 +1579,8 @@ struct castle_slave* castle_claim(uint32_t new_dev)
     mutex_init(&cs->sblk_lock);
     INIT_RCU_HEAD(&cs->rcu);
     atomic_set(&cs->io_in_flight, 0);
+    atomic_set(&cs->rebuild_io_in_flight, 0);
+    castle_io_sched_init(&cs->io_sched);
 
     dev = new_decode_dev(new_dev);
     bdev = open_by_devnum(dev, FMODE_READ|FMODE_WRITE);
@@ -1743,6 +1755,7 @@ void castle_release(struct castle_slave *cs)
     /* Ghost slaves are only partially initialised, and have no bdev. */
     if (!test_bit(CASTLE_SLAVE_GHOST_BIT, &cs->flags))
         castle_release_device(cs);
+    castle_io_sched_fini(&cs->io_sched);
 
     list_del_rcu(&cs->list);
     synchronize_rcu();
@@ -2466,6 +2479,7 @@ static void castle_wqs_fini(void)
         if(castle_wqs[i])
             destroy_workqueue(castle_wqs[i]);
     }
+    castle_io_scheds_fini();
 }
 
 static int castle_wqs_init(void)
@@ -2487,6 +2501,8 @@ static int castle_wqs_init(void)
         if(!castle_wqs[i])
             goto err_out;
     }
+    if(castle_io_scheds_init())
+        goto err_out;
 
     return 0;
 
@@ -0,0 +1,554 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "castle_public.h"
+#include "castle_defines.h"
+#include "castle.h"
+#include "castle_utils.h"
+#include "castle_merge_policy.h"
+#include "castle_unit_tests.h"
+
+/* Default size ratio between tiers/levels, for DAs created without an explicit fanout. */
+static int castle_merge_policy_fanout = 4;
+
+module_param(castle_merge_policy_fanout, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_fanout, "Default merge policy fanout (2-31)");
+
+static int castle_merge_policy_max_arrays = 16;
+
+module_param(castle_merge_policy_max_arrays, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_max_arrays, "Merge policy read amplification target (arrays above level 1)");
+
+static int castle_merge_policy_max_write_amp = 0;
+
+module_param(castle_merge_policy_max_write_amp, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_max_write_amp, "Merge policy per-merge write amplification limit (0 = unlimited)");
+
+static int castle_merge_policy_max_space_amp = 0;
+
+module_param(castle_merge_policy_max_space_amp, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_max_space_amp, "Merge policy space amplification target in % (0 = off)");
+
+/* Log merge policy decisions without starting the merges. */
+int castle_merge_policy_dry_run = 0;
+
+module_param(castle_merge_policy_dry_run, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_dry_run, "Log merge policy decisions only");
+
+/* Work unit (in MB) for merges started by the merge policy. */
+int castle_merge_policy_work_size = 64;
+
+module_param(castle_merge_policy_work_size, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_policy_work_size, "Merge policy merge work unit (MB)");
+
+/**
+ * Get the merge policy and amplification targets for a DA's creation options.
+ *
+ * Fanout comes from the DA options if set there, castle_merge_policy_fanout otherwise.
+ * Targets come from the module parameters.
+ */
+void castle_merge_policy_cfg_get(c_da_opts_t opts, struct castle_merge_policy_cfg *cfg)
+{
+    int fanout;
+
+    cfg->policy = (opts & CASTLE_DA_OPTS_MERGE_POLICY_MASK) >> CASTLE_DA_OPTS_MERGE_POLICY_SHIFT;
+    BUG_ON(cfg->policy >= CASTLE_MERGE_POLICY_INVAL);
+
+    fanout = (opts & CASTLE_DA_OPTS_MERGE_FANOUT_MASK) >> CASTLE_DA_OPTS_MERGE_FANOUT_SHIFT;
+    if (!fanout)
+        fanout = castle_merge_policy_fanout;
+    cfg->fanout = max(2, min(fanout, 31));
+
+    cfg->max_arrays    = max(2, castle_merge_policy_max_arrays);
+    cfg->max_write_amp = max(0, castle_merge_policy_max_write_amp);
+    cfg->max_space_amp = max(0, castle_merge_policy_max_space_amp);
+}
+
+/**
+ * Is the run of arrays [first, first+nr) mergeable within the write amplification limit.
+ *
+ * Write amplification of a merge is the output size divided by the size of everything
+ * but its largest input, i.e. how much gets rewritten to push the newer data down.
+ *
+ * Runs made of disjoint arrays only are not worth it unless disjoint_ok is set:
+ * lookups already consult at most one of them, and there is nothing to drop.
+ */
+static int castle_merge_policy_run_ok(struct castle_merge_policy_cfg *cfg,
+                                      struct castle_merge_policy_array *arrays,
+                                      uint32_t first,
+                                      uint32_t nr,
+                                      int disjoint_ok)
+{
+    uint64_t total = 0, largest = 0;
+    uint32_t i, nr_disjoint = 0;
+
+    if (nr < 2)
+        return 0;
+
+    for (i = first; i < first + nr; i++)
+    {
+        if (arrays[i].busy)
+            return 0;
+        total += arrays[i].size;
+        largest = max(largest, arrays[i].size);
+        nr_disjoint += !!arrays[i].disjoint;
+    }
+
+    if (nr_disjoint == nr && !disjoint_ok)
+        return 0;
+
+    if (cfg->max_write_amp && total > (uint64_t)cfg->max_write_amp * (total - largest))
+        return 0;
+
+    return 1;
+}
+
+/**
+ * Size-tiered: find the newest run of fanout arrays of similar size (within 2x).
+ */
+static int castle_merge_policy_tiered_select(struct castle_merge_policy_cfg *cfg,
+                                             struct castle_merge_policy_array *arrays,
+                                             uint32_t nr_arrays,
+                                             int disjoint_ok,
+                                             uint32_t *first,
+                                             uint32_t *nr)
+{
+    uint64_t run_min, run_max;
+    uint32_t i, j;
+
+    for (i = 0; i + cfg->fanout <= nr_arrays; i++)
+    {
+        run_min = run_max = arrays[i].size;
+        for (j = i + 1; j < i + cfg->fanout; j++)
+        {
+            run_min = min(run_min, arrays[j].size);
+            run_max = max(run_max, arrays[j].size);
+            if (run_max > 2 * run_min)
+                break;
+        }
+
+        if (j == i + cfg->fanout
+                && castle_merge_policy_run_ok(cfg, arrays, i, cfg->fanout, disjoint_ok))
+        {
+            *first = i;
+            *nr    = cfg->fanout;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Leveled: merge the newest array that isn't at least fanout times smaller than its
+ * older neighbour into that neighbour.
+ */
+static int castle_merge_policy_leveled_select(struct castle_merge_policy_cfg *cfg,
+                                              struct castle_merge_policy_array *arrays,
+                                              uint32_t nr_arrays,
+                                              uint32_t *first,
+                                              uint32_t *nr)
+{
+    uint32_t i;
+
+    for (i = 0; i + 1 < nr_arrays; i++)
+    {
+        if (arrays[i].size * cfg->fanout <= arrays[i+1].size)
+            continue;
+
+        if (castle_merge_policy_run_ok(cfg, arrays, i, 2, 0 /*disjoint_ok*/))
+        {
+            *first = i;
+            *nr    = 2;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Hybrid (lazy leveling): tiered for all but the oldest array.  Once the newer arrays
+ * add up to 1/fanout of the oldest, merge everything into it.
+ */
+static int castle_merge_policy_hybrid_select(struct castle_merge_policy_cfg *cfg,
+                                             struct castle_merge_policy_array *arrays,
+                                             uint32_t nr_arrays,
+                                             uint32_t *first,
+                                             uint32_t *nr)
+{
+    uint64_t newer = 0;
+    uint32_t i;
+
+    if (nr_arrays < 2)
+        return 0;
+
+    if (castle_merge_policy_tiered_select(cfg, arrays, nr_arrays - 1, 0 /*disjoint_ok*/,
+                                          first, nr))
+        return 1;
+
+    for (i = 0; i + 1 < nr_arrays; i++)
+        newer += arrays[i].size;
+
+    if (newer * cfg->fanout >= arrays[nr_arrays-1].size
+            && castle_merge_policy_run_ok(cfg, arrays, 0, nr_arrays, 0 /*disjoint_ok*/))
+    {
+        *first = 0;
+        *nr    = nr_arrays;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Merge the cheapest window of excess+1 arrays.  Ignores the write amplification limit.
+ *
+ * @param overlapping   Only consider windows without disjoint arrays
+ */
+static int castle_merge_policy_window_select(struct castle_merge_policy_array *arrays,
+                                             uint32_t nr_arrays,
+                                             uint32_t excess,
+                                             int overlapping,
+                                             uint32_t *first,
+                                             uint32_t *nr)
+{
+    uint64_t size, best_size = 0;
+    uint32_t i, j, window, found = 0;
+
+    window = max(excess + 1, 2U);
+    for (i = 0; i + window <= nr_arrays; i++)
+    {
+        for (j = i, size = 0; j < i + window; j++)
+        {
+            if (arrays[j].busy || (overlapping && arrays[j].disjoint))
+                break;
+            size += arrays[j].size;
+        }
+
+        if (j < i + window || (found && size >= best_size))
+            continue;
+
+        found     = 1;
+        best_size = size;
+        *first    = i;
+        *nr       = window;
+    }
+
+    return found;
+}
+
+/**
+ * Read amplification backstop: merge the cheapest window of arrays that brings the
+ * number of arrays a lookup consults back to max_arrays.
+ *
+ * A key falls within at most one disjoint array, so disjoint arrays add one to the
+ * count between them.  To bound per-array overheads they are still size-tiered, with
+ * fanout squared to keep rewrites down, and capped at fanout times max_arrays.
+ */
+static int castle_merge_policy_read_amp_select(struct castle_merge_policy_cfg *cfg,
+                                               struct castle_merge_policy_array *arrays,
+                                               uint32_t nr_arrays,
+                                               uint32_t *first,
+                                               uint32_t *nr)
+{
+    uint32_t i, nr_disjoint = 0, nr_lookup;
+
+    for (i = 0; i < nr_arrays; i++)
+        nr_disjoint += !!arrays[i].disjoint;
+    nr_lookup = nr_arrays - nr_disjoint + (nr_disjoint ? 1 : 0);
+
+    if (nr_lookup > cfg->max_arrays)
+    {
+        if (castle_merge_policy_window_select(arrays, nr_arrays, nr_lookup - cfg->max_arrays,
+                                              1 /*overlapping*/, first, nr))
+            return 1;
+        if (castle_merge_policy_window_select(arrays, nr_arrays, nr_lookup - cfg->max_arrays,
+                                              0 /*overlapping*/, first, nr))
+            return 1;
+    }
+
+    if (nr_disjoint)
+    {
+        struct castle_merge_policy_cfg disjoint_cfg = *cfg;
+
+        disjoint_cfg.fanout = cfg->fanout * cfg->fanout;
+        if (castle_merge_policy_tiered_select(&disjoint_cfg, arrays, nr_arrays, 1 /*disjoint_ok*/,
+                                              first, nr))
+            return 1;
+    }
+
+    if (nr_arrays > cfg->max_arrays * cfg->fanout)
+        return castle_merge_policy_window_select(arrays, nr_arrays,
+                                                 nr_arrays - cfg->max_arrays * cfg->fanout,
+                                                 0 /*overlapping*/, first, nr);
+
+    return 0;
+}
+
+/**
+ * Pick the next merge for a DA.
+ *
+ * @param cfg       Policy and amplification targets
+ * @param arrays    Arrays above level 1, newest first
+ * @param nr_arrays Number of arrays
+ * @param first     [out] Index of the first (newest) array to merge
+ * @param nr        [out] Number of contiguous arrays to merge
+ *
+ * - If newer arrays exceed max_space_amp % of the oldest, merge everything
+ * - Otherwise ask the policy, which leaves disjoint arrays alone
+ * - If the policy picks nothing and lookups consult more than max_arrays arrays, merge
+ *   the cheapest window that brings the count back down
+ *
+ * Decisions depend on the inputs only, @see castle_merge_policy_simulate().
+ *
+ * @return 1 if a merge was picked, 0 otherwise
+ */
+int castle_merge_policy_select(struct castle_merge_policy_cfg *cfg,
+                               struct castle_merge_policy_array *arrays,
+                               uint32_t nr_arrays,
+                               uint32_t *first,
+                               uint32_t *nr)
+{
+    uint64_t newer = 0;
+    uint32_t i;
+    int ret = 0;
+
+    if (cfg->policy == CASTLE_MERGE_POLICY_NONE || nr_arrays < 2)
+        return 0;
+
+    if (cfg->max_space_amp)
+    {
+        /* Disjoint arrays can't hold overwritten data. */
+        for (i = 0; i + 1 < nr_arrays; i++)
+            if (!arrays[i].disjoint)
+                newer += arrays[i].size;
+
+        if (newer * 100 > (uint64_t)cfg->max_space_amp * arrays[nr_arrays-1].size)
+        {
+            for (i = 0; i < nr_arrays && !arrays[i].busy; i++);
+            if (i == nr_arrays)
+            {
+                *first = 0;
+                *nr    = nr_arrays;
+                return 1;
+            }
+        }
+    }
+
+    switch (cfg->policy)
+    {
+        case CASTLE_MERGE_POLICY_TIERED:
+            ret = castle_merge_policy_tiered_select(cfg, arrays, nr_arrays, 0 /*disjoint_ok*/,
+                                                    first, nr);
+            break;
+        case CASTLE_MERGE_POLICY_LEVELED:
+            ret = castle_merge_policy_leveled_select(cfg, arrays, nr_arrays, first, nr);
+            break;
+        case CASTLE_MERGE_POLICY_HYBRID:
+            ret = castle_merge_policy_hybrid_select(cfg, arrays, nr_arrays, first, nr);
+            break;
+        default:
+            BUG();
+    }
+
+    if (!ret)
+        ret = castle_merge_policy_read_amp_select(cfg, arrays, nr_arrays, first, nr);
+
+    return ret;
+}
+
+#define MERGE_POLICY_SIM_MAX_ARRAYS     (256)
+#define MERGE_POLICY_SIM_FLUSH_SIZE     (1024)
+
+/**
+ * Deterministically simulate a merge policy.
+ *
+ * Starting from no arrays, a fixed size array arrives nr_flushes times (as if from a
+ * level 1 merge).  After each arrival merges picked by castle_merge_policy_select() are
+ * applied instantly, until it picks none.  dup_pct percent of the newer data in a merge
+ * is assumed to overwrite older data and is dropped.
+ *
+ * Arrays cover the whole key space, unless append is set: then each arrival holds keys
+ * above all previous ones (e.g. time series), and arrays are disjoint until merged with
+ * an overlapping one.
+ *
+ * @return 0        Simulation completed, stats filled in
+ * @return -ENOMEM  Failed to allocate simulation state
+ * @return -E2BIG   Policy let the number of arrays grow without bound
+ */
+int castle_merge_policy_simulate(struct castle_merge_policy_cfg *cfg,
+                                 uint32_t nr_flushes,
+                                 uint32_t dup_pct,
+                                 int append,
+                                 struct castle_merge_policy_sim_stats *stats)
+{
+    struct castle_merge_policy_array *arrays;
+    uint64_t written = 0, ingested = 0, total, largest, newer;
+    uint32_t nr_arrays = 0, flush, first, nr, i, j;
+    uint32_t (*ranges)[2];
+
+    arrays = castle_zalloc(MERGE_POLICY_SIM_MAX_ARRAYS * sizeof(struct castle_merge_policy_array));
+    ranges = castle_alloc(MERGE_POLICY_SIM_MAX_ARRAYS * sizeof(*ranges));
+    if (!arrays || !ranges)
+    {
+        castle_check_free(arrays);
+        castle_check_free(ranges);
+        return -ENOMEM;
+    }
+
+    memset(stats, 0, sizeof(struct castle_merge_policy_sim_stats));
+    for (flush = 0; flush < nr_flushes; flush++)
+    {
+        if (nr_arrays == MERGE_POLICY_SIM_MAX_ARRAYS)
+        {
+            castle_free(ranges);
+            castle_free(arrays);
+            return -E2BIG;
+        }
+
+        memmove(&arrays[1], &arrays[0], nr_arrays * sizeof(struct castle_merge_policy_array));
+        memmove(&ranges[1], &ranges[0], nr_arrays * sizeof(*ranges));
+        arrays[0].id   = flush;
+        arrays[0].size = MERGE_POLICY_SIM_FLUSH_SIZE;
+        ranges[0][0]   = append ? flush : 0;
+        ranges[0][1]   = append ? flush : nr_flushes;
+        nr_arrays++;
+        ingested += MERGE_POLICY_SIM_FLUSH_SIZE;
+        written  += MERGE_POLICY_SIM_FLUSH_SIZE;
+
+        do {
+            for (i = 0; i < nr_arrays; i++)
+            {
+                for (j = 0; j < nr_arrays; j++)
+                    if (j != i && ranges[j][0] <= ranges[i][1] && ranges[i][0] <= ranges[j][1])
+                        break;
+                arrays[i].disjoint = (j == nr_arrays);
+            }
+
+            if (!castle_merge_policy_select(cfg, arrays, nr_arrays, &first, &nr))
+                break;
+
+            BUG_ON(nr < 2 || first + nr > nr_arrays);
+
+            for (i = first, total = largest = 0; i < first + nr; i++)
+            {
+                total  += arrays[i].size;
+                largest = max(largest, arrays[i].size);
+                ranges[first][0] = min(ranges[first][0], ranges[i][0]);
+                ranges[first][1] = max(ranges[first][1], ranges[i][1]);
+            }
+            /* Only overlapping arrays can overwrite each other. */
+            if (!append)
+                total = largest + (total - largest) * (100 - dup_pct) / 100;
+            written += total;
+            stats->nr_merges++;
+
+            arrays[first].size = total;
+            memmove(&arrays[first+1], &arrays[first+nr],
+                    (nr_arrays - first - nr) * sizeof(struct castle_merge_policy_array));
+            memmove(&ranges[first+1], &ranges[first+nr],
+                    (nr_arrays - first - nr) * sizeof(*ranges));
+            nr_arrays -= nr - 1;
+        } while (1);
+
+        stats->max_arrays = max(stats->max_arrays, nr_arrays);
+        for (i = 0, newer = 0; i + 1 < nr_arrays; i++)
+            if (!arrays[i].disjoint)
+                newer += arrays[i].size;
+        stats->space_amp = max(stats->space_amp,
+                               (uint32_t)(newer * 100 / arrays[nr_arrays-1].size));
+    }
+
+    stats->write_amp = ingested ? written * 100 / ingested : 0;
+    castle_free(ranges);
+    castle_free(arrays);
+
+    return 0;
+}
+
+static char *castle_merge_policy_names[CASTLE_MERGE_POLICY_INVAL] =
+    {"none", "tiered", "leveled", "hybrid"};
+
+/**
+ * Simulate each merge policy and check it meets its read amplification target.
+ *
+ * Also checks the expected trade-off: tiered writes less than leveled, leveled keeps
+ * fewer arrays than tiered.  Results are logged for comparing policies and fanouts.
+ * With append-only keys, every policy should write less than with random keys.
+ */
+int castle_merge_policy_unit_tests_do(void)
+{
+    struct castle_merge_policy_sim_stats stats[CASTLE_MERGE_POLICY_INVAL];
+    uint32_t random_write_amp[CASTLE_MERGE_POLICY_INVAL];
+    struct castle_merge_policy_cfg cfg;
+    c_merge_policy_t policy;
+    uint32_t dup_pct;
+    int err;
+
+    for (dup_pct = 0; dup_pct <= 50; dup_pct += 50)
+    {
+        for (policy = CASTLE_MERGE_POLICY_TIERED; policy < CASTLE_MERGE_POLICY_INVAL; policy++)
+        {
+            cfg.policy        = policy;
+            cfg.fanout        = 4;
+            cfg.max_arrays    = 16;
+            cfg.max_write_amp = 0;
+            cfg.max_space_amp = 0;
+
+            if ((err = castle_merge_policy_simulate(&cfg, 4096, dup_pct, 0, &stats[policy])))
+                return err;
+
+            castle_printk(LOG_INIT, "Merge policy %s (fanout=%u, dup=%u%%): merges=%llu "
+                    "write_amp=%u.%02u max_arrays=%u space_amp=%u%%\n",
+                    castle_merge_policy_names[policy], cfg.fanout, dup_pct,
+                    stats[policy].nr_merges,
+                    stats[policy].write_amp / 100, stats[policy].write_amp % 100,
+                    stats[policy].max_arrays, stats[policy].space_amp);
+
+            if (stats[policy].max_arrays > cfg.max_arrays)
+                return -EINVAL;
+            if (dup_pct == 0)
+                random_write_amp[policy] = stats[policy].write_amp;
+        }
+
+        if (stats[CASTLE_MERGE_POLICY_TIERED].write_amp
+                > stats[CASTLE_MERGE_POLICY_LEVELED].write_amp)
+            return -EINVAL;
+        if (stats[CASTLE_MERGE_POLICY_LEVELED].max_arrays
+                > stats[CASTLE_MERGE_POLICY_TIERED].max_arrays)
+            return -EINVAL;
+    }
+
+    /* Append-only keys. */
+    for (policy = CASTLE_MERGE_POLICY_TIERED; policy < CASTLE_MERGE_POLICY_INVAL; policy++)
+    {
+        struct castle_merge_policy_sim_stats append_stats;
+
+        cfg.policy = policy;
+        if ((err = castle_merge_policy_simulate(&cfg, 4096, 0, 1, &append_stats)))
+            return err;
+
+        castle_printk(LOG_INIT, "Merge policy %s (fanout=%u, append): merges=%llu "
+                "write_amp=%u.%02u max_arrays=%u\n",
+                castle_merge_policy_names[policy], cfg.fanout,
+                append_stats.nr_merges,
+                append_stats.write_amp / 100, append_stats.write_amp % 100,
+                append_stats.max_arrays);
+
+        if (append_stats.max_arrays > cfg.max_arrays * cfg.fanout)
+            return -EINVAL;
+        if (append_stats.write_amp >= random_write_amp[policy])
+            return -EINVAL;
+    }
+
+    /* Space amplification target forces full merges. */
+    cfg.policy        = CASTLE_MERGE_POLICY_TIERED;
+    cfg.max_space_amp = 100;
+    if ((err = castle_merge_policy_simulate(&cfg, 4096, 0, 0, &stats[0])))
+        return err;
+    if (stats[0].space_amp > cfg.max_space_amp)
+        return -EINVAL;
+
+    return 0;
+}
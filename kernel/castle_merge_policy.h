@@ -0,0 +1,68 @@
+#ifndef __CASTLE_MERGE_POLICY_H__
+#define __CASTLE_MERGE_POLICY_H__
+
+#include "castle_public.h"
+
+/**
+ * In-kernel merge policies for arrays above level 1.
+ *
+ * Selected per DA at creation time through c_da_opts_t, @see CASTLE_DA_OPTS_MERGE_POLICY_MASK.
+ */
+typedef enum {
+    CASTLE_MERGE_POLICY_NONE = 0,       /**< Merges are left to the control program.           */
+    CASTLE_MERGE_POLICY_TIERED,         /**< Merge runs of fanout similarly sized arrays.      */
+    CASTLE_MERGE_POLICY_LEVELED,        /**< Keep each array fanout times its newer neighbour. */
+    CASTLE_MERGE_POLICY_HYBRID,         /**< Tiered, except the oldest array which is leveled. */
+    CASTLE_MERGE_POLICY_INVAL,
+} c_merge_policy_t;
+
+/**
+ * Array state the policy works on.  Arrays are passed newest first, as on da->levels[2].
+ */
+struct castle_merge_policy_array {
+    c_array_id_t        id;
+    uint64_t            size;           /**< Array size (any unit, consistent across arrays).  */
+    int                 busy;           /**< Array can't be merged right now.                  */
+    int                 disjoint;       /**< Key range of the array is known and overlaps no
+                                             other array's.                                    */
+};
+
+/**
+ * Policy and amplification targets for a DA.
+ */
+struct castle_merge_policy_cfg {
+    c_merge_policy_t    policy;
+    uint32_t            fanout;         /**< Size ratio between tiers/levels.                  */
+    uint32_t            max_arrays;     /**< Read amplification target: arrays per lookup.     */
+    uint32_t            max_write_amp;  /**< Max bytes written per byte of newer data in a
+                                             single merge (0 = unlimited).                     */
+    uint32_t            max_space_amp;  /**< Max size of newer arrays as a percentage of the
+                                             oldest, before merging everything (0 = off).      */
+};
+
+/**
+ * Outcome of a deterministic policy simulation.
+ */
+struct castle_merge_policy_sim_stats {
+    uint64_t            nr_merges;
+    uint32_t            write_amp;      /**< Bytes written per byte ingested, x100.            */
+    uint32_t            max_arrays;     /**< Peak number of arrays after merging.              */
+    uint32_t            space_amp;      /**< Peak newer arrays size as % of the oldest.        */
+};
+
+extern int castle_merge_policy_dry_run;
+extern int castle_merge_policy_work_size;
+
+void castle_merge_policy_cfg_get     (c_da_opts_t opts, struct castle_merge_policy_cfg *cfg);
+int  castle_merge_policy_select      (struct castle_merge_policy_cfg *cfg,
+                                      struct castle_merge_policy_array *arrays,
+                                      uint32_t nr_arrays,
+                                      uint32_t *first,
+                                      uint32_t *nr);
+int  castle_merge_policy_simulate    (struct castle_merge_policy_cfg *cfg,
+                                      uint32_t nr_flushes,
+                                      uint32_t dup_pct,
+                                      int append,
+                                      struct castle_merge_policy_sim_stats *stats);
+
+#endif /* __CASTLE_MERGE_POLICY_H__ */
@@ -26,6 +26,10 @@
 
 static const uint32_t OBJ_TOMBSTONE = ((uint32_t)-1);
 
+static int castle_object_pull_window = 8;
+module_param(castle_object_pull_window, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_object_pull_window, "Chunks of an object value to keep read ahead of big-get clients (0 = off)");
+
 /**********************************************************************************************/
 /* Helper functions */
 
@@ -236,11 +240,13 @@ static void castle_objects_rq_iter_init(castle_object_iterator_t *iter,
     castle_printk(LOG_DEBUG, "============================================================\n");
 #endif
 
+    /* The DA iterator only walks the btree range, keys are still checked against
+     * the whole hypercube in castle_objects_rq_iter_prep_next(). */
     castle_da_rq_iter_init(&iter->da_rq_iter,
                            iter->version,
                            iter->da_id,
-                           iter->start_key,
-                           iter->end_key,
+                           iter->range_start ? iter->range_start : iter->start_key,
+                           iter->range_end   ? iter->range_end   : iter->end_key,
                            iter->seq_id,
                            iter->flags,
                            _castle_objects_rq_iter_init, /*init_cb*/
@@ -254,17 +260,31 @@ static void castle_objects_rq_iter_init(castle_object_iterator_t *iter,
 /**********************************************************************************************/
 
 #define OBJ_IO_MAX_BUFFER_SIZE      (10)    /* In C_BLK_SIZE blocks */
+#define OBJ_LO_IO_MAX_BUFFER_SIZE   (BLKS_PER_CHK)  /* Large objects are written a chunk at a
+                                                       time, they start chunk aligned.      */
+
+/**
+ * Size of the buffers object data is written through, in C_BLK_SIZE blocks.
+ */
+static inline int castle_object_write_buffer_blocks(struct castle_object_replace *replace)
+{
+    if (CVT_LARGE_OBJECT(replace->cvt))
+        return OBJ_LO_IO_MAX_BUFFER_SIZE;
+
+    return OBJ_IO_MAX_BUFFER_SIZE;
+}
 
 static c_ext_pos_t  castle_object_write_next_cep(c_ext_pos_t  old_cep,
-                                                 uint32_t data_length)
+                                                 uint32_t data_length,
+                                                 int max_blocks)
 {
     uint32_t data_c2b_length;
     c_ext_pos_t new_data_cep;
     int nr_blocks;
 
     /* Work out how large buffer to allocate */
-    data_c2b_length = data_length > OBJ_IO_MAX_BUFFER_SIZE * C_BLK_SIZE ?
-                                    OBJ_IO_MAX_BUFFER_SIZE * C_BLK_SIZE :
+    data_c2b_length = data_length > max_blocks * C_BLK_SIZE ?
+                                    max_blocks * C_BLK_SIZE :
                                     data_length;
     nr_blocks = (data_c2b_length - 1) / C_BLK_SIZE + 1;
     debug("Allocating new buffer of size %d blocks, for data_length=%d\n",
@@ -276,15 +296,16 @@ static c_ext_pos_t  castle_object_write_next_cep(c_ext_pos_t  old_cep,
 }
 
 static c2_block_t* castle_object_write_buffer_alloc(c_ext_pos_t new_data_cep,
-                                                    uint64_t data_length)
+                                                    uint64_t data_length,
+                                                    int max_blocks)
 {
     uint64_t data_c2b_length;
     c2_block_t *new_data_c2b;
     int nr_blocks;
 
     /* Work out how large the buffer is */
-    data_c2b_length = data_length > OBJ_IO_MAX_BUFFER_SIZE * C_BLK_SIZE ?
-                                    OBJ_IO_MAX_BUFFER_SIZE * C_BLK_SIZE :
+    data_c2b_length = data_length > max_blocks * C_BLK_SIZE ?
+                                    max_blocks * C_BLK_SIZE :
                                     data_length;
     nr_blocks = (data_c2b_length - 1) / C_BLK_SIZE + 1;
     new_data_c2b = castle_cache_block_get(new_data_cep, nr_blocks, MERGE_OUT);
@@ -300,6 +321,26 @@ static c2_block_t* castle_object_write_buffer_alloc(c_ext_pos_t new_data_cep,
     return new_data_c2b;
 }
 
+/**
+ * Release a filled, write locked, object data buffer.
+ *
+ * Large object data is unlikely to be read back soon.  Rather than leaving it dirty for the
+ * flush thread, it is written out straight away and demoted, to be reclaimed first.
+ */
+static void castle_object_write_buffer_release(struct castle_object_replace *replace,
+                                               c2_block_t *data_c2b)
+{
+    dirty_c2b(data_c2b);
+
+    if (CVT_LARGE_OBJECT(replace->cvt))
+        castle_cache_block_writeback(data_c2b);
+    else
+    {
+        write_unlock_c2b(data_c2b);
+        put_c2b(data_c2b);
+    }
+}
+
 static void castle_object_replace_data_copy(struct castle_object_replace *replace,
                                             void *buffer, uint32_t buffer_length, int not_last)
 {
@@ -356,7 +397,7 @@ static int castle_object_data_write(struct castle_object_replace *replace)
             last_copy = 1;
             copy_length = data_length;
         }
-        if (copy_length < 0 || copy_length > (OBJ_IO_MAX_BUFFER_SIZE * C_BLK_SIZE))
+        if (copy_length < 0 || copy_length > data_c2b_length)
         {
             castle_printk(LOG_ERROR, "Unexpected copy_length %d\n", copy_length);
             BUG();
@@ -382,20 +423,20 @@ static int castle_object_data_write(struct castle_object_replace *replace)
             c2_block_t *new_data_c2b;
             c_ext_pos_t new_data_cep;
             debug("Run out of buffer space, allocating a new one.\n");
-            new_data_cep = castle_object_write_next_cep(data_c2b->cep, data_c2b_length);
+            new_data_cep = castle_object_write_next_cep(data_c2b->cep, data_c2b_length,
+                                                        castle_object_write_buffer_blocks(replace));
             if (EXT_POS_COMP(new_data_cep, data_c2b->cep) <= 0)
             {
                 castle_printk(LOG_ERROR, "Unexpected change in CEP while copy"cep_fmt_str
                         cep_fmt_str_nl, cep2str(data_c2b->cep), cep2str(new_data_cep));
                 BUG();
             }
-            new_data_c2b = castle_object_write_buffer_alloc(new_data_cep, data_length);
+            new_data_c2b = castle_object_write_buffer_alloc(new_data_cep, data_length,
+                                                castle_object_write_buffer_blocks(replace));
             data_c2b_length = new_data_c2b->nr_pages * C_BLK_SIZE;
             data_c2b_offset = 0;
             /* Release the (old) buffer */
-            dirty_c2b(data_c2b);
-            write_unlock_c2b(data_c2b);
-            put_c2b(data_c2b);
+            castle_object_write_buffer_release(replace, data_c2b);
             c2b_locked = 0;
             /* Swap the new buffer in, if one was initialised. */
             data_c2b = new_data_c2b;
@@ -406,8 +447,14 @@ static int castle_object_data_write(struct castle_object_replace *replace)
     debug("Exiting data_write with data_c2b_offset=%d, data_length=%d, data_c2b=%p\n",
             data_c2b_offset, data_length, data_c2b);
 
-    /* Release the locks on c2b. */
-    if (c2b_locked)
+    /* Release the locks on c2b.  Release the last buffer altogether, once all data is in. */
+    if (data_length == 0)
+    {
+        BUG_ON(!c2b_locked);
+        castle_object_write_buffer_release(replace, data_c2b);
+        data_c2b = NULL;
+    }
+    else if (c2b_locked)
     {
         dirty_c2b(data_c2b);
         write_unlock_c2b(data_c2b);
@@ -432,10 +479,10 @@ static void castle_object_replace_large_object_free(struct castle_component_tree
 
     BUG_ON(!CVT_LARGE_OBJECT(cvt));
     /* Update the large object chunk count on the tree */
-    chk_cnt = castle_extent_size_get(cvt.cep.ext_id);
+    chk_cnt = (cvt.length - 1) / C_CHK_SIZE + 1;
     atomic64_sub(chk_cnt, &ct->large_ext_chk_cnt);
     debug("Freeing Large Object of size - %u\n", chk_cnt);
-    castle_ct_large_obj_remove(cvt.cep.ext_id,
+    castle_ct_large_obj_remove(cvt.cep,
                                &ct->large_objs,
                                &ct->lo_mutex);
 }
@@ -482,7 +529,7 @@ static void castle_object_replace_complete(struct castle_bio_vec *c_bvec,
        Since there was an error, the object hasn't been threaded onto large object list yet.
        There is no need to remove it from there, or to change any accounting. */
     if (err && CVT_LARGE_OBJECT(replace->cvt))
-        castle_extent_free(replace->cvt.cep.ext_id);
+        castle_large_obj_unlink(replace->cvt.cep, replace->cvt.length);
 
     /* Release kmalloced memory for inline objects. */
     CVT_INLINE_FREE(replace->cvt);
@@ -547,12 +594,9 @@ int castle_object_replace_continue(struct castle_object_replace *replace)
     copy_end = castle_object_data_write(replace);
     if(copy_end)
     {
-        c2_block_t *data_c2b = replace->data_c2b;
-        uint32_t data_length = replace->data_length;
-
-        BUG_ON(data_length != 0);
-        put_c2b(data_c2b);
-        replace->data_c2b = NULL;
+        /* Data buffer already released by castle_object_data_write(). */
+        BUG_ON(replace->data_length != 0);
+        BUG_ON(replace->data_c2b);
 
         /* Finished writing the data out, insert the key into the btree. */
         castle_object_replace_key_insert(replace);
@@ -600,7 +644,8 @@ static void castle_object_replace_on_disk_start(struct castle_object_replace *re
     BUG_ON(replace->value_len != cvt.length);
 
     /* Init the c2b for data writeout. */
-    c2b = castle_object_write_buffer_alloc(cvt.cep, cvt.length);
+    c2b = castle_object_write_buffer_alloc(cvt.cep, cvt.length,
+                                           castle_object_write_buffer_blocks(replace));
     replace->data_c2b = c2b;
     replace->data_c2b_offset = 0;
     replace->data_length = cvt.length;
@@ -609,13 +654,10 @@ static void castle_object_replace_on_disk_start(struct castle_object_replace *re
     {
         int complete_write;
 
+        /* Releases the data c2b if all the data was available. */
         complete_write = castle_object_data_write(replace);
         BUG_ON(complete_write && (replace->data_length != 0));
-        if(complete_write)
-        {
-            put_c2b(replace->data_c2b);
-            replace->data_c2b = NULL;
-        }
+        BUG_ON(complete_write && replace->data_c2b);
     }
 }
 
@@ -666,7 +708,7 @@ static int castle_object_replace_cvt_get(c_bvec_t    *c_bvec,
     /* Bookkeeping for large objects (about to be inserted into the tree). */
     if(CVT_LARGE_OBJECT(*new_cvt))
     {
-        if (castle_ct_large_obj_add(new_cvt->cep.ext_id,
+        if (castle_ct_large_obj_add(new_cvt->cep,
                                     replace->value_len,
                                     &c_bvec->tree->large_objs,
                                     &c_bvec->tree->lo_mutex))
@@ -745,7 +787,7 @@ static int castle_object_replace_space_reserve(struct castle_object_replace *rep
 {
     c_bvec_t *c_bvec = replace->c_bvec;
     int tombstone = c_bvec_data_del(c_bvec);
-    uint64_t value_len, nr_blocks, nr_chunks;
+    uint64_t value_len, nr_blocks;
     c_ext_pos_t cep;
 
     replace->cvt = INVAL_VAL_TUP;
@@ -808,7 +850,6 @@ static int castle_object_replace_space_reserve(struct castle_object_replace *rep
 
     /* Out of line objects. */
     nr_blocks = (value_len - 1) / C_BLK_SIZE + 1;
-    nr_chunks = (value_len - 1) / C_CHK_SIZE + 1;
     /* Medium objects. */
     if(value_len <= MEDIUM_OBJECT_LIMIT)
     {
@@ -825,14 +866,7 @@ static int castle_object_replace_space_reserve(struct castle_object_replace *rep
     }
 
     /* Large objects. */
-    memset(&cep, 0, sizeof(c_ext_pos_t));
-    cep.ext_id = castle_extent_alloc(castle_get_rda_lvl(),
-                                     c_bvec->tree->da->id,
-                                     EXT_T_LARGE_OBJECT,
-                                     nr_chunks, 0,  /* Not in transaction. */
-                                     NULL, NULL);
-
-    if(EXT_ID_INVAL(cep.ext_id))
+    if (castle_large_obj_alloc(c_bvec->tree->da, value_len, &cep))
     {
         castle_printk(LOG_WARN, "Failed to allocate space for Large Object.\n");
         return -ENOSPC;
@@ -1045,6 +1079,16 @@ int castle_object_batch_in_stream(struct  castle_attachment *attachment,
 
 void castle_object_slice_get_end_io(void *obj_iter, int err);
 
+static void castle_object_iter_keys_dealloc(castle_object_iterator_t *iterator)
+{
+    if (iterator->range_end)
+        iterator->btree->key_dealloc(iterator->range_end);
+    if (iterator->range_start)
+        iterator->btree->key_dealloc(iterator->range_start);
+    iterator->btree->key_dealloc(iterator->end_key);
+    iterator->btree->key_dealloc(iterator->start_key);
+}
+
 /**
  * Asynchronous callback handler for castle_objects_rq_iter_init().
  *
@@ -1061,8 +1105,7 @@ void _castle_object_iter_init(castle_object_iterator_t *iterator)
 
     if (err)
     {
-        iterator->btree->key_dealloc(iterator->end_key);
-        iterator->btree->key_dealloc(iterator->start_key);
+        castle_object_iter_keys_dealloc(iterator);
         castle_free(iterator);
     }
     else
@@ -1077,6 +1120,8 @@ void _castle_object_iter_init(castle_object_iterator_t *iterator)
 /**
  * Initialise a range query.
  *
+ * @param   range_start Only walk keys after this one, NULL to walk from start_key
+ * @param   range_end   Only walk keys up to this one, NULL to walk to end_key
  * @param   seq_id      Unique ID for tracing purposes
  * @param   start_cb    Callback in the event we go asynchronous
  * @param   private     Caller-provided data passed to start_cb()
@@ -1091,12 +1136,19 @@ void _castle_object_iter_init(castle_object_iterator_t *iterator)
  * @return -EINVAL  Invalid start and/or end key
  * @return -ENOMEM  Failed to allocate memory for initialisation
  *
+ * The range keys bound the part of the btree walked, in btree key order.  Keys
+ * returned are still those within the start_key/end_key hypercube, so a range
+ * query can be split into several iterators over disjoint btree ranges without
+ * changing the results, @see castle_object_iter_split().
+ *
  * @also castle_objects_rq_iter_init()
  * @also _castle_object_iter_init()
  */
 int castle_object_iter_init(struct castle_attachment *attachment,
                              c_vl_bkey_t *start_key,
                              c_vl_bkey_t *end_key,
+                             c_vl_bkey_t *range_start,
+                             c_vl_bkey_t *range_end,
                              castle_object_iterator_t **iter,
                              int seq_id,
                              uint8_t flags,
@@ -1142,6 +1194,43 @@ int castle_object_iter_init(struct castle_attachment *attachment,
     if (!iterator->end_key)
         goto err1;
 
+    /* Walk from the key after range_start, unless start_key is already past it. */
+    if (range_start)
+    {
+        void *key = iterator->btree->key_pack(range_start, NULL, NULL);
+
+        if (!key)
+            goto err2;
+        iterator->range_start = iterator->btree->key_next(key, NULL, NULL);
+        iterator->btree->key_dealloc(key);
+        if (!iterator->range_start)
+            goto err2;
+        if (iterator->btree->key_compare(iterator->range_start, iterator->start_key) <= 0)
+        {
+            iterator->btree->key_dealloc(iterator->range_start);
+            iterator->range_start = NULL;
+        }
+    }
+    if (range_end)
+    {
+        iterator->range_end = iterator->btree->key_pack(range_end, NULL, NULL);
+        if (!iterator->range_end)
+            goto err2;
+        if (iterator->btree->key_compare(iterator->range_end, iterator->end_key) >= 0)
+        {
+            iterator->btree->key_dealloc(iterator->range_end);
+            iterator->range_end = NULL;
+        }
+    }
+    if (iterator->btree->key_compare(iterator->range_start ? iterator->range_start
+                                                           : iterator->start_key,
+                                     iterator->range_end ? iterator->range_end
+                                                         : iterator->end_key) > 0)
+    {
+        ret = -EINVAL;
+        goto err2;
+    }
+
     /* Initialise the rest of the iterator */
     iterator->seq_id        = seq_id;
     iterator->flags         = flags;
@@ -1157,11 +1246,88 @@ int castle_object_iter_init(struct castle_attachment *attachment,
 
     return 0;
 
+err2: if (iterator->range_end)
+          iterator->btree->key_dealloc(iterator->range_end);
+      if (iterator->range_start)
+          iterator->btree->key_dealloc(iterator->range_start);
+      iterator->btree->key_dealloc(iterator->end_key);
 err1: iterator->btree->key_dealloc(iterator->start_key);
 err0: castle_free(iterator);
     return ret;
 }
 
+/**
+ * Split a range query into sub-ranges that can be iterated in parallel.
+ *
+ * @param   nr_ranges   Maximum number of sub-ranges
+ * @param   split_keys  Array of (nr_ranges - 1) entries to return split keys in
+ *
+ * Sub-range i is then iterated with castle_object_iter_init(), passing the same
+ * start_key and end_key, range_start = split_keys[i-1] (NULL for the first) and
+ * range_end = split_keys[i] (NULL for the last).  The results of the iterators,
+ * taken in order, are those of a single iterator over the whole range.
+ *
+ * May sleep.  Caller frees the split keys with castle_free().
+ *
+ * @return  Number of split keys, 0 if the range wasn't split
+ * @return -EINVAL  Invalid start and/or end key
+ * @return -ENOMEM  Failed to allocate memory
+ *
+ * @also castle_da_rq_iter_split_keys_get()
+ */
+int castle_object_iter_split(struct castle_attachment *attachment,
+                             c_vl_bkey_t *start_key,
+                             c_vl_bkey_t *end_key,
+                             int nr_ranges,
+                             c_vl_bkey_t **split_keys)
+{
+    struct castle_btree_type *btree = castle_double_array_btree_type_get(attachment);
+    void *packed_start, *packed_end;
+    void **keys;
+    int i, nr_split, err;
+
+    if (start_key->nr_dims != end_key->nr_dims)
+        return -EINVAL;
+    if (nr_ranges < 2)
+        return 0;
+
+    nr_split = -ENOMEM;
+    keys = castle_alloc((nr_ranges - 1) * sizeof(void *));
+    if (!keys)
+        goto err0;
+    packed_start = btree->key_pack(start_key, NULL, NULL);
+    if (!packed_start)
+        goto err1;
+    packed_end = btree->key_pack(end_key, NULL, NULL);
+    if (!packed_end)
+        goto err2;
+
+    nr_split = castle_da_rq_iter_split_keys_get(castle_version_da_id_get(attachment->version),
+                                                packed_start,
+                                                packed_end,
+                                                nr_ranges,
+                                                keys);
+    for (i = 0, err = 0; i < nr_split; i++)
+    {
+        split_keys[i] = btree->key_unpack(keys[i], NULL, NULL);
+        if (!split_keys[i])
+            err = -ENOMEM;
+        btree->key_dealloc(keys[i]);
+    }
+    if (err)
+    {
+        for (i = 0; i < nr_split; i++)
+            castle_check_free(split_keys[i]);
+        nr_split = err;
+    }
+
+    btree->key_dealloc(packed_end);
+err2: btree->key_dealloc(packed_start);
+err1: castle_free(keys);
+err0:
+    return nr_split;
+}
+
 int castle_object_iter_next(castle_object_iterator_t *iterator,
                             castle_object_iter_next_available_t callback,
                             void *data)
@@ -1218,8 +1384,7 @@ int castle_object_iter_finish(castle_object_iterator_t *iterator)
 {
     castle_objects_rq_iter_cancel(iterator);
     debug_rq("Freeing iterators & buffers.\n");
-    iterator->btree->key_dealloc(iterator->end_key);
-    iterator->btree->key_dealloc(iterator->start_key);
+    castle_object_iter_keys_dealloc(iterator);
     castle_free(iterator);
 
     return 0;
@@ -1254,7 +1419,7 @@ static void castle_object_value_acquire(c_val_tup_t *cvt)
      * reference, which would require us to store the reference ID (extent mask ID). */
     /* Note: Might need to revisit this code with unknown Big-object implementation. */
     else if (CVT_LARGE_OBJECT(*cvt))
-        BUG_ON(castle_extent_link(cvt->cep.ext_id));
+        BUG_ON(castle_large_obj_link(cvt->cep, cvt->length));
 }
 
 static void castle_object_value_release(c_val_tup_t *cvt)
@@ -1265,7 +1430,7 @@ static void castle_object_value_release(c_val_tup_t *cvt)
     }
 
     else if (CVT_LARGE_OBJECT(*cvt))
-        castle_extent_unlink(cvt->cep.ext_id);
+        castle_large_obj_unlink(cvt->cep, cvt->length);
 }
 
 void castle_object_get_continue(struct castle_bio_vec *c_bvec,
@@ -1431,6 +1596,47 @@ void castle_object_get_continue(struct castle_bio_vec *c_bvec,
     /* completes in __castle_object_get_complete(). */
 }
 
+/**
+ * Finish a medium object get read directly into the requester's pages.
+ *
+ * Falls back to a cached read if the direct read failed.
+ *
+ * @also castle_object_get_direct_io_end()
+ */
+static void castle_object_get_direct_complete(c_bvec_t *c_bvec)
+{
+    struct castle_object_get *get = c_bvec->c_bio->get;
+    c_val_tup_t cvt = get->cvt;
+
+    if (c_bvec->c_bio->err)
+    {
+        debug("Direct read failed with err=%d, retrying via the cache.\n", c_bvec->c_bio->err);
+        c_bvec->c_bio->err = 0;
+        castle_object_get_continue(c_bvec, get, cvt.cep, cvt.length);
+        return;
+    }
+
+    atomic64_add(cvt.length, &c_bvec->cts_proxy->da->read_data_bytes);
+    castle_object_bvec_proxy_key_dealloc(c_bvec);
+    castle_da_cts_proxy_put(c_bvec->cts_proxy);
+    castle_object_value_release(&cvt);
+    castle_utils_bio_free(c_bvec->c_bio);
+    get->direct_done(get, cvt.length);
+}
+DEFINE_WQ_TRACE_FN(castle_object_get_direct_complete, c_bvec_t);
+
+/**
+ * End of I/O for castle_cache_direct_read(), possibly in interrupt context.
+ */
+static void castle_object_get_direct_io_end(void *private, int err)
+{
+    c_bvec_t *c_bvec = private;
+
+    c_bvec->c_bio->err = err;
+    CASTLE_INIT_WORK_AND_TRACE(&c_bvec->work, castle_object_get_direct_complete, c_bvec);
+    queue_work(castle_wq, &c_bvec->work);
+}
+
 /**
  * Get callback handler.
  *
@@ -1447,6 +1653,7 @@ void castle_object_get_complete(struct castle_bio_vec *c_bvec,
 {
     struct castle_object_get *get = c_bvec->c_bio->get;
     c_bio_t *c_bio = c_bvec->c_bio;
+    struct page **pages;
 
     debug("Returned from btree walk with value of type 0x%x and length 0x%llu and timestamp %llu\n",
           cvt.type, (uint64_t)cvt.length, cvt.user_timestamp);
@@ -1525,7 +1732,14 @@ void castle_object_get_complete(struct castle_bio_vec *c_bvec,
         get->data_length     = cvt.length;
         get->first           = 1; /* first */
 
-        castle_object_get_continue(c_bvec, get, cvt.cep, cvt.length);
+        /* Read straight into the requester's pages if it supplied some. */
+        if (!get->direct_pages || !(pages = get->direct_pages(get, cvt.length)) ||
+            castle_cache_direct_read(cvt.cep,
+                                     pages,
+                                     (cvt.length - 1) / PAGE_SIZE + 1,
+                                     castle_object_get_direct_io_end,
+                                     c_bvec))
+            castle_object_get_continue(c_bvec, get, cvt.cep, cvt.length);
 
         FAULT(GET_FAULT);
     }
@@ -1662,6 +1876,28 @@ void castle_object_chunk_pull_io_end(c2_block_t *c2b, int did_io)
         __castle_object_chunk_pull_complete(&pull->work);
 }
 
+/**
+ * Keep up to castle_object_pull_window chunks of the value being pulled in flight, ahead
+ * of the chunk the client is reading now.
+ *
+ * Uses a static prefetch window, resized on every pull so that it never reads past the
+ * end of the value (which may share its extent with other values).
+ */
+static void castle_object_pull_readahead(struct castle_object_pull *pull, c_ext_pos_t cep)
+{
+    c_byte_off_t value_end;
+    int chunks;
+
+    if (castle_object_pull_window <= 0)
+        return;
+
+    /* Prefetch windows start at the chunk cep is in, count it in. */
+    value_end = pull->cvt.cep.offset + pull->cvt.length - 1;
+    chunks = min_t(c_chk_cnt_t, CHUNK(value_end) - CHUNK(cep.offset), castle_object_pull_window);
+    if (chunks > 0)
+        castle_cache_advise(cep, C2_ADV_PREFETCH | C2_ADV_STATIC, USER, chunks + 1);
+}
+
 /**
  * Copy buf_len's worth of pull->cvt into userland buf.
  *
@@ -1706,7 +1942,7 @@ void castle_object_chunk_pull(struct castle_object_pull *pull, void *buf, size_t
     pull->curr_c2b = castle_cache_block_get(cep,
                                             (pull->to_copy - 1) / PAGE_SIZE + 1,
                                             USER);
-    castle_cache_advise(pull->curr_c2b->cep, C2_ADV_PREFETCH, USER, 0);
+    castle_object_pull_readahead(pull, cep);
     BUG_ON(castle_cache_block_read(pull->curr_c2b,
                                    castle_object_chunk_pull_io_end,
                                    pull));
@@ -19,11 +19,18 @@ int          castle_object_get               (struct castle_object_get *get,
 int          castle_object_iter_init         (struct castle_attachment *attachment,
                                               c_vl_bkey_t *start_key,
                                               c_vl_bkey_t *end_key,
+                                              c_vl_bkey_t *range_start,
+                                              c_vl_bkey_t *range_end,
                                               castle_object_iterator_t **iter,
                                               int seq_id,
                                               uint8_t flags,
                                               castle_object_iter_start_cb_t start_cb,
                                               void *private);
+int          castle_object_iter_split        (struct castle_attachment *attachment,
+                                              c_vl_bkey_t *start_key,
+                                              c_vl_bkey_t *end_key,
+                                              int nr_ranges,
+                                              c_vl_bkey_t **split_keys);
 int          castle_object_iter_next         (castle_object_iterator_t *iterator,
                                               castle_object_iter_next_available_t callback,
                                               void *data);
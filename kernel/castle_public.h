@@ -14,7 +14,7 @@
 extern "C" {
 #endif
 
-#define CASTLE_PROTOCOL_VERSION 39 /* last updated by BM */
+#define CASTLE_PROTOCOL_VERSION 41 /* last updated by BM */
 
 #ifdef SWIG
 #define PACKED               //override gcc intrinsics for SWIG
@@ -64,6 +64,7 @@ typedef enum {
     SLAVE_OOS_ERR,      /*13 */
     REBUILD_FAULT1,     /*14 Fault between extent remaps*/
     REBUILD_FAULT2,     /*15 Fault in mid extent remap*/
+    SLAVE_SLOW_ERR,     /*16 Delay reads from slave (arg: uuid)*/
 } c_fault_t;
 
 typedef enum {
@@ -217,7 +218,20 @@ typedef uint64_t c_da_opts_t;       /**< Options bitmask for DA options that mus
 enum {
     CASTLE_DA_OPTS_NONE                  = (0),             /**< No options (all defaults). */
     CASTLE_DA_OPTS_NO_USER_TIMESTAMPING  = (1 << 0),        /**< Disable user timestamping. */
+    CASTLE_DA_OPTS_MERGE_POLICY_TIERED   = (1 << 1),        /**< In-kernel size-tiered merges. */
+    CASTLE_DA_OPTS_MERGE_POLICY_LEVELED  = (2 << 1),        /**< In-kernel leveled merges.     */
+    CASTLE_DA_OPTS_MERGE_POLICY_HYBRID   = (3 << 1),        /**< In-kernel hybrid merges.      */
+    CASTLE_DA_OPTS_VALUE_LOG             = (1 << 8),        /**< Keep medium objects in place
+                                                                 across in-kernel merges.       */
 };
+/* In-kernel merge policy, used for merges above level 1 when no control program is present. */
+#define CASTLE_DA_OPTS_MERGE_POLICY_SHIFT   (1)
+#define CASTLE_DA_OPTS_MERGE_POLICY_MASK    ((c_da_opts_t)0x3 << CASTLE_DA_OPTS_MERGE_POLICY_SHIFT)
+/* Merge policy fanout (2-31), 0 selects the castle_merge_policy_fanout default. */
+#define CASTLE_DA_OPTS_MERGE_FANOUT_SHIFT   (3)
+#define CASTLE_DA_OPTS_MERGE_FANOUT_MASK    ((c_da_opts_t)0x1f << CASTLE_DA_OPTS_MERGE_FANOUT_SHIFT)
+#define CASTLE_DA_OPTS_MERGE_FANOUT(_f)     (((c_da_opts_t)(_f) << CASTLE_DA_OPTS_MERGE_FANOUT_SHIFT) \
+                                                & CASTLE_DA_OPTS_MERGE_FANOUT_MASK)
 
 /* Golden Nugget - Types */
 typedef uint64_t c_array_id_t;
@@ -763,14 +777,56 @@ typedef struct castle_var_length_btree_key {
  * on the ring that are not ongoing stateful ops.  Furthermore, the total ring
  * capacity must not exactly match CASTLE_STATEFUL_OPS or no requests may be
  * queued.
+ *
+ * A connection has a single ring by default.  CASTLE_IOCTL_RINGS_SET, issued
+ * before the rings are mapped, switches it to up to CASTLE_RINGS_MAX rings.  The
+ * first mmap() must then be of exactly nr_rings * CASTLE_RING_SIZE bytes, with
+ * ring i at offset i * CASTLE_RING_SIZE.  Each ring is consumed by its own kernel
+ * thread, bound to a separate CPU, and is poked with CASTLE_IOCTL_POKE_RING_N.
+ * Responses are queued on the ring the request came from.  Stateful op tokens
+ * are valid across all rings of the connection.
+ *
+ * Rings follow the usual req_event/rsp_event notification protocol: clients only
+ * need to poke a ring when RING_PUSH_REQUESTS_AND_CHECK_NOTIFY() says so (the
+ * consumer doesn't move req_event while it busy-polls), and must use
+ * RING_FINAL_CHECK_FOR_RESPONSES() before sleeping in poll(), as the kernel may
+ * skip wakeups rsp_event didn't ask for.
  */
 #define CASTLE_RING_PAGES   (32)                                /**< Must be a power of 2.  */
 #define CASTLE_RING_SIZE    (CASTLE_RING_PAGES << PAGE_SHIFT)
 #define CASTLE_STATEFUL_OPS 512                                 /**< Must be < total slots. */
+#define CASTLE_RINGS_MAX    (32)                                /**< Rings per connection.  */
 
 
-#define CASTLE_IOCTL_POKE_RING 2
+#define CASTLE_IOCTL_POKE_RING 2                                /**< Poke all rings.        */
 #define CASTLE_IOCTL_WAIT 3
+#define CASTLE_IOCTL_RINGS_SET 4                                /**< arg: number of rings.  */
+#define CASTLE_IOCTL_POKE_RING_N 5                              /**< arg: ring index.       */
+#define CASTLE_IOCTL_BUFFERS_REGISTER 6     /**< arg: castle_buffers_register_t pointer.    */
+
+/**
+ * Registered ("fixed") buffers.
+ *
+ * CASTLE_IOCTL_BUFFERS_REGISTER installs a table of already mmap()ed shared buffers,
+ * once per connection.  Requests may then address buffer i at offset off with
+ * CASTLE_FIXED_BUFFER(i, off) instead of a user pointer, in any pointer field, which
+ * the kernel resolves without searching the connection's buffers.  Registered buffers
+ * stay allocated until the connection is closed, even if munmap()ed.  Pointers
+ * returned by the kernel (e.g. in iterator replies) are always plain user pointers.
+ * The encoding needs 64-bit pointers.
+ */
+#define CASTLE_FIXED_BUFFERS_MAX            (1024)
+#define CASTLE_FIXED_BUFFER_BIT             (1ULL << 63)
+#define CASTLE_FIXED_BUFFER(_idx, _off)                                                     \
+    ((void *)(unsigned long)(CASTLE_FIXED_BUFFER_BIT | ((uint64_t)(_idx) << 32) | (uint32_t)(_off)))
+#define CASTLE_FIXED_BUFFER_IDX(_addr)                                                      \
+    ((uint32_t)(((uint64_t)(unsigned long)(_addr) & ~CASTLE_FIXED_BUFFER_BIT) >> 32))
+#define CASTLE_FIXED_BUFFER_OFFSET(_addr)   ((uint32_t)(unsigned long)(_addr))
+
+typedef struct castle_buffers_register {
+    uint32_t              nr_buffers;
+    void                **buffers;          /**< Start of each buffer, table index order.   */
+} castle_buffers_register_t;
 
 #define CASTLE_RING_REPLACE 1
 #define CASTLE_RING_BIG_PUT 2
@@ -791,6 +847,27 @@ typedef struct castle_var_length_btree_key {
 #define CASTLE_RING_STREAM_IN_START 16
 #define CASTLE_RING_STREAM_IN_NEXT 17
 #define CASTLE_RING_STREAM_IN_FINISH 18
+/* Batched point ops, see castle_request_multi_get_t */
+#define CASTLE_RING_MULTI_GET 19
+#define CASTLE_RING_MULTI_REPLACE 20
+
+#define CASTLE_RING_MULTI_MAX_KEYS (1024)                       /**< Keys per multi op.     */
+/* Streaming range queries, see castle_request_iter_stream_start_t */
+#define CASTLE_RING_ITER_STREAM_START 21
+
+#define CASTLE_ITER_STREAM_MAX_BUFFERS (64)                     /**< Buffers per stream.    */
+/* Parallel range queries, see castle_request_iter_split_t */
+#define CASTLE_RING_ITER_SPLIT 22
+#define CASTLE_RING_ITER_RANGE_START 23
+
+#define CASTLE_ITER_SPLIT_MAX_RANGES (64)                       /**< Sub-ranges per split.  */
+/* Filtered range queries, see castle_request_iter_filter_start_t */
+#define CASTLE_RING_ITER_FILTER_START 24
+
+#define CASTLE_ITER_FILTER_MAX_DIMS (16)                        /**< Dimension predicates.  */
+#define CASTLE_ITER_FILTER_MAX_SIZE (4096)                      /**< Bytes per filter.      */
+/* In-kernel aggregation, see castle_request_aggregate_t */
+#define CASTLE_RING_AGGREGATE 25
 
 typedef uint32_t castle_interface_token_t;
 
@@ -846,6 +923,44 @@ typedef struct castle_request_get {
     uint32_t             value_len;
 } castle_request_get_t;
 
+/**
+ * Batched gets and replaces.
+ *
+ * keys_ptr points at nr_keys c_vl_bkey_t keys, packed back to back in a shared
+ * buffer, each starting on an 8 byte boundary.  Keys are looked up / inserted
+ * independently of each other (there is no atomicity), in key order per T0.
+ *
+ * MULTI_GET returns nr_keys struct castle_iter_val at the start of buffer_ptr,
+ * in the same order as the keys, followed by the values themselves:
+ *   CASTLE_VALUE_TYPE_INVALID          - key not found (or deleted)
+ *   CASTLE_VALUE_TYPE_INLINE{_COUNTER} - val points at the value in buffer_ptr
+ *   CASTLE_VALUE_TYPE_OUT_OF_LINE      - value (of length) didn't fit in the
+ *                                        buffer, fetch it with GET or BIG_GET
+ * The response length is the number of buffer bytes used.
+ *
+ * MULTI_REPLACE takes nr_keys struct castle_iter_val at the start of values_ptr,
+ * one per key, of CASTLE_VALUE_TYPE_INLINE (val pointing at length bytes within
+ * values_ptr) or CASTLE_VALUE_TYPE_TOMBSTONE (remove).  The response err is the
+ * first error hit, and its length the number of keys successfully written.
+ */
+typedef struct castle_request_multi_get {
+    c_collection_id_t    collection_id;
+    uint32_t             nr_keys;
+    void                *keys_ptr;          /**< nr_keys packed keys.                       */
+    uint32_t             keys_len;          /**< Size of keys_ptr buffer.                   */
+    void                *buffer_ptr;        /**< Resulting values.                          */
+    uint32_t             buffer_len;        /**< Size of buffer_ptr buffer.                 */
+} castle_request_multi_get_t;
+
+typedef struct castle_request_multi_replace {
+    c_collection_id_t    collection_id;
+    uint32_t             nr_keys;
+    void                *keys_ptr;          /**< nr_keys packed keys.                       */
+    uint32_t             keys_len;          /**< Size of keys_ptr buffer.                   */
+    void                *values_ptr;        /**< Values for the keys.                       */
+    uint32_t             values_len;        /**< Size of values_ptr buffer.                 */
+} castle_request_multi_replace_t;
+
 typedef struct castle_request_iter_start {
     c_collection_id_t    collection_id;
     uint32_t             start_key_len;
@@ -856,6 +971,129 @@ typedef struct castle_request_iter_start {
     uint32_t             buffer_len;        /**< Size of buffer_ptr buffer.                 */
 } castle_request_iter_start_t;
 
+/**
+ * Start a streaming range query.
+ *
+ * As CASTLE_RING_ITER_START, except that buffer_ptr is split into nr_buffers equally
+ * sized buffers, each at least a page, which the kernel keeps filling ahead of the
+ * client, in order, with the usual castle_key_value_list results.  The reply to this
+ * request and to each subsequent CASTLE_RING_ITER_NEXT (whose buffer fields are ignored)
+ * is for the next buffer in turn: the i-th reply (counting this one as 0) describes buffer
+ * i % nr_buffers.  Sending ITER_NEXT hands the buffer from the previous reply back to the
+ * kernel, so only one ITER_NEXT should be outstanding at a time.  Once all buffers are
+ * full the kernel stops until one is handed back.  The stream ends as a normal iterator
+ * does, with a NULL next pointer in the last buffer's list, or with ITER_FINISH.
+ */
+typedef struct castle_request_iter_stream_start {
+    castle_request_iter_start_t start;      /**< As for CASTLE_RING_ITER_START.             */
+    uint32_t             nr_buffers;        /**< Up to CASTLE_ITER_STREAM_MAX_BUFFERS.      */
+} castle_request_iter_stream_start_t;
+
+/**
+ * Split a range query into sub-ranges that can be iterated concurrently.
+ *
+ * Fills buffer_ptr with a castle_key_value_list of up to nr_ranges - 1 split keys (with
+ * NULL values), in ascending order; the reply length is the number of keys.  Sub-range i
+ * is then iterated with CASTLE_RING_ITER_RANGE_START, passing the original start and end
+ * keys, range_start = split key i - 1 and range_end = split key i (NULL at either end).
+ * Each iterator starts on the next request CPU, so the sub-ranges are scanned in
+ * parallel.  Consuming the iterators' results in sub-range order gives the same ordered
+ * results as a single iterator over the whole range; consuming them as they arrive
+ * gives the results unordered, but sooner.
+ */
+typedef struct castle_request_iter_split {
+    castle_request_iter_start_t start;      /**< buffer_ptr receives the split keys.        */
+    uint32_t             nr_ranges;         /**< Up to CASTLE_ITER_SPLIT_MAX_RANGES.        */
+} castle_request_iter_split_t;
+
+/**
+ * Start an iterator over a sub-range of a range query, @see castle_request_iter_split_t.
+ *
+ * As CASTLE_RING_ITER_START, but only returns keys sorting after range_start and up to
+ * and including range_end.
+ */
+typedef struct castle_request_iter_range_start {
+    castle_request_iter_start_t start;      /**< As for CASTLE_RING_ITER_START.             */
+    c_vl_bkey_t         *range_start_ptr;   /**< NULL to start at the start key.            */
+    uint32_t             range_start_len;
+    c_vl_bkey_t         *range_end_ptr;     /**< NULL to end at the end key.                */
+    uint32_t             range_end_len;
+} castle_request_iter_range_start_t;
+
+/**
+ * Key dimension predicate, @see castle_iter_filter_t.
+ *
+ * Bounds are byte strings at offsets into the filter, compared as key dimensions are.
+ * A zero length bound is unbounded; min == max tests for equality.
+ */
+typedef struct castle_iter_filter_dim {
+    uint32_t             dim;               /**< Key dimension to test.                     */
+    uint32_t             min_off;           /**< Inclusive lower bound.                     */
+    uint32_t             min_len;
+    uint32_t             max_off;           /**< Inclusive upper bound.                     */
+    uint32_t             max_len;
+} castle_iter_filter_dim_t;
+
+/**
+ * Predicate evaluated by the kernel on each key-value pair a range query returns.
+ *
+ * Only pairs satisfying all of the dimension predicates, the value prefix and the
+ * timestamp window are returned; then at most max_values of the pairs sharing the same
+ * first prefix_dims key dimensions.  Out-of-line values never match a value prefix.
+ * The whole filter, including bound and prefix data, is at most
+ * CASTLE_ITER_FILTER_MAX_SIZE bytes.
+ */
+typedef struct castle_iter_filter {
+    uint32_t                 nr_dims;       /**< Up to CASTLE_ITER_FILTER_MAX_DIMS.         */
+    uint32_t                 value_prefix_off;
+    uint32_t                 value_prefix_len;  /**< 0 for no value prefix.                 */
+    uint32_t                 prefix_dims;   /**< Dimensions grouping pairs for max_values.  */
+    uint32_t                 max_values;    /**< 0 for no limit.                            */
+    castle_user_timestamp_t  ts_min;        /**< Inclusive, 0 for no lower limit.           */
+    castle_user_timestamp_t  ts_max;        /**< Inclusive, ULLONG_MAX for no upper limit.  */
+    castle_iter_filter_dim_t dims[0];
+} castle_iter_filter_t;
+
+/**
+ * Start a filtered range query.
+ *
+ * As CASTLE_RING_ITER_START, except that only key-value pairs matching the filter are
+ * returned.
+ */
+typedef struct castle_request_iter_filter_start {
+    castle_request_iter_start_t start;      /**< As for CASTLE_RING_ITER_START.             */
+    castle_iter_filter_t *filter_ptr;
+    uint32_t             filter_len;
+} castle_request_iter_filter_start_t;
+
+/**
+ * Aggregate of a group of key-value pairs, @see castle_request_aggregate_t.
+ */
+typedef struct castle_aggregate {
+    uint64_t             nr_keys;           /**< Key-value pairs in the group.              */
+    uint64_t             nr_counters;       /**< Of which counters, aggregated below.       */
+    int64_t              sum;
+    int64_t              min;
+    int64_t              max;
+} castle_aggregate_t;
+
+/**
+ * Aggregate a range query in the kernel.
+ *
+ * As CASTLE_RING_ITER_START, and continued with CASTLE_RING_ITER_NEXT/ITER_FINISH on the
+ * returned token, except that each castle_key_value_list entry describes a group of
+ * consecutive pairs sharing their first group_dims key dimensions.  The entry's key is the
+ * first key in the group, and its value an inline castle_aggregate_t.  With group_dims of
+ * 0 the whole range is a single group.  Tombstones are not counted; if filter_ptr is set
+ * only pairs matching the filter are.
+ */
+typedef struct castle_request_aggregate {
+    castle_request_iter_start_t start;      /**< As for CASTLE_RING_ITER_START.             */
+    uint32_t             group_dims;
+    castle_iter_filter_t *filter_ptr;       /**< Optional, NULL for no filter.              */
+    uint32_t             filter_len;
+} castle_request_aggregate_t;
+
 typedef struct castle_request_stream_in_start {
     c_collection_id_t    collection_id;
     uint64_t             entries_count;
@@ -928,6 +1166,9 @@ typedef struct castle_request {
         castle_request_remove_t             remove;
         castle_request_get_t                get;
 
+        castle_request_multi_get_t          multi_get;
+        castle_request_multi_replace_t      multi_replace;
+
         castle_request_counter_replace_t    counter_replace;
 
         castle_request_big_get_t            big_get;
@@ -936,6 +1177,11 @@ typedef struct castle_request {
         castle_request_put_chunk_t          put_chunk;
 
         castle_request_iter_start_t         iter_start;
+        castle_request_iter_stream_start_t  iter_stream_start;
+        castle_request_iter_split_t         iter_split;
+        castle_request_iter_range_start_t   iter_range_start;
+        castle_request_iter_filter_start_t  iter_filter_start;
+        castle_request_aggregate_t          aggregate;
         castle_request_iter_next_t          iter_next;
         castle_request_iter_finish_t        iter_finish;
 
@@ -26,6 +26,8 @@ typedef struct c_def_rda_state {
     uint32_t                             nr_slaves;
     struct castle_slave                 *permuted_slaves[MAX_NR_SLAVES];
     uint8_t                              permut_idx;
+    uint32_t                             run_chunks;    /**< Chunks per run on the same slaves. */
+    uint32_t                             run_idx;       /**< Chunks allocated in current run.   */
 } c_def_rda_state_t;
 
 typedef struct c_ssd_rda_state {
@@ -81,8 +83,35 @@ static c_rda_spec_t castle_rda_1, castle_rda_2;
  *             need an extra seek to skip (23, 2). We avoid this by keeping seperate super chunks
  *             for each copy.
  *      c. Write the map to meta extent.
+ *
+ * Run-length allocation: extents that are written and read sequentially (merge outputs,
+ * medium and large objects) stay on the same slaves for castle_rda_run_chunks consecutive
+ * logical chunks before moving on in the permutation.  The chunks of a run come from the
+ * same superchunk(s), and are therefore physically adjacent on each disk, which lets the
+ * I/O path coalesce them, @see _submit_c2b_rda().
  */
 
+static unsigned int castle_rda_run_chunks = CHKS_PER_SLOT;
+module_param(castle_rda_run_chunks, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_rda_run_chunks, "Consecutive chunks of sequential extents placed on the same slaves (1 = off)");
+
+/**
+ * Whether extents of given type are accessed sequentially, and so benefit from
+ * run-length allocation.
+ */
+static int castle_rda_ext_type_sequential(c_ext_type_t ext_type)
+{
+    switch (ext_type)
+    {
+        case EXT_T_LEAF_NODES:
+        case EXT_T_MEDIUM_OBJECTS:
+        case EXT_T_LARGE_OBJECT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 /**
  * (Re)permute the array of castle_slave pointers, used to construct the extent. Uses Fisher-Yates
  * shuffle.
@@ -283,6 +312,10 @@ void* castle_def_rda_extent_init(c_ext_t *ext,
     state->nr_slaves  = 0;
     memset(&state->permuted_slaves, 0, sizeof(struct castle_slave *) * MAX_NR_SLAVES);
     state->permut_idx = 0;
+    state->run_chunks = 1;
+    if (castle_rda_ext_type_sequential(ext->ext_type) && (castle_rda_run_chunks > 1))
+        state->run_chunks = castle_rda_run_chunks;
+    state->run_idx    = 0;
 
     /* Initialise the slaves array. */
     rcu_read_lock();
@@ -404,8 +437,12 @@ int castle_def_rda_next_slave_get(struct castle_slave **cs,
     for (i=0; i<rda_spec->k_factor; i++)
         cs[i] = state->permuted_slaves[(state->permut_idx + i) % state->nr_slaves];
 
-    /* Advance the permutation index. */
-    state->permut_idx++;
+    /* Advance the permutation index, once the current run is complete. */
+    if (++state->run_idx >= state->run_chunks)
+    {
+        state->run_idx = 0;
+        state->permut_idx++;
+    }
 
     /* Remember what chunk we've just dealt with. */
     state->prev_chk = chk_num;
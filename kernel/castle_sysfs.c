@@ -14,6 +14,7 @@
 #include "castle_utils.h"
 #include "castle_btree.h"
 #include "castle_ctrl_prog.h"
+#include "castle_io_sched.h"
 
 static int castle_devel = 0;            /* Whether to show devel syfs directory.    */
 static int castle_devel_enabled = 0;    /* Required for safe shutdown.              */
@@ -265,6 +266,12 @@ static ssize_t da_io_stats_show(struct kobject *kobj,
     sprintf(buf + strlen(buf), "UT ct max uts false +ves: %lu\n",
             atomic64_read(&da->stats.user_timestamps.ct_max_uts_false_positives));
 
+    /* Merge write amplification due to medium objects, @see CASTLE_DA_OPTS_VALUE_LOG. */
+    sprintf(buf + strlen(buf), "VL merge mo bytes copied: %lu\n",
+            atomic64_read(&da->stats.value_log.mo_copied_bytes));
+    sprintf(buf + strlen(buf), "VL merge mo bytes linked: %lu\n",
+            atomic64_read(&da->stats.value_log.mo_linked_bytes));
+
     //sprintf(buf + strlen(buf), "Current write rate: %llu\n", da->cur_write_rate);
 
     return strlen(buf);
@@ -515,6 +522,15 @@ static ssize_t slave_free_blocked_show(struct kobject *kobj,
         return sprintf(buf, "0\n");
 }
 
+static ssize_t slave_io_sched_show(struct kobject *kobj,
+                                   struct attribute *attr,
+                                   char *buf)
+{
+    struct castle_slave *slave = container_of(kobj, struct castle_slave, kobj);
+
+    return castle_io_sched_show(&slave->io_sched, buf);
+}
+
 /* Display the fs version (checkpoint number). */
 extern uint32_t castle_filesystem_fs_version;
 static ssize_t filesystem_version_show(struct kobject *kobj,
@@ -1332,6 +1348,9 @@ __ATTR(free_available, S_IRUGO|S_IWUSR, slave_free_available_show, NULL);
 static struct castle_sysfs_entry slave_free_blocked =
 __ATTR(free_blocked, S_IRUGO|S_IWUSR, slave_free_blocked_show, NULL);
 
+static struct castle_sysfs_entry slave_io_sched =
+__ATTR(io_sched, S_IRUGO|S_IWUSR, slave_io_sched_show, NULL);
+
 static struct attribute *castle_slave_attrs[] = {
     &slave_uuid.attr,
     &slave_size.attr,
@@ -1340,6 +1359,7 @@ static struct attribute *castle_slave_attrs[] = {
     &slave_rebuild_state.attr,
     &slave_free_available.attr,
     &slave_free_blocked.attr,
+    &slave_io_sched.attr,
     NULL,
 };
 
@@ -11,8 +11,9 @@ struct castle_back_conn;
 /** Kernel has removed items from the ring. */
 DEFINE_TRACE(CASTLE_BACK_WORK_DO,
         TPPROTO(struct castle_back_conn *conn,  /**< castle_back_conn processed                 */
+                int ring,               /**< Index of the ring within the connection            */
                 int items),             /**< Number of items removed from ring                  */
-        TPARGS(conn, items));
+        TPARGS(conn, ring, items));
 
 /** Request completed. */
 DEFINE_TRACE(CASTLE_REQUEST_END,
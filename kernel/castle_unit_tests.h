@@ -3,5 +3,7 @@
 
 int castle_slim_tree_unit_tests_do(void);
 int castle_instream_unit_tests_do(void);
+int castle_da_merged_iter_unit_tests_do(void);
+int castle_merge_policy_unit_tests_do(void);
 
 #endif